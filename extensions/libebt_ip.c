@@ -496,16 +496,16 @@ static void brip_print(const void *ip, const struct xt_entry_match *match,
 		printf("0x%02X ", info->tos);
 	}
 	if (info->bitmask & EBT_IP_PROTO) {
-		struct protoent *pe;
+		const char *pname;
 
 		printf("--ip-proto ");
 		if (info->invflags & EBT_IP_PROTO)
 			printf("! ");
-		pe = getprotobynumber(info->protocol);
-		if (pe == NULL) {
+		pname = xtables_protocol_name(info->protocol);
+		if (pname == NULL) {
 			printf("%d ", info->protocol);
 		} else {
-			printf("%s ", pe->p_name);
+			printf("%s ", pname);
 		}
 	}
 	if (info->bitmask & EBT_IP_SPORT) {
@@ -683,7 +683,7 @@ static int brip_xlate(struct xt_xlate *xl,
 		xt_xlate_add(xl, "0x%02x ", info->tos & 0x3f); /* remove ECN bits */
 	}
 	if (info->bitmask & EBT_IP_PROTO) {
-		struct protoent *pe;
+		const char *pe;
 
 		if (info->bitmask & (EBT_IP_SPORT|EBT_IP_DPORT|EBT_IP_ICMP) &&
 		    (info->invflags & EBT_IP_PROTO) == 0) {
@@ -693,11 +693,11 @@ static int brip_xlate(struct xt_xlate *xl,
 			xt_xlate_add(xl, "ip protocol ");
 			if (info->invflags & EBT_IP_PROTO)
 				xt_xlate_add(xl, "!= ");
-			pe = getprotobynumber(info->protocol);
+			pe = xtables_protocol_name(info->protocol);
 			if (pe == NULL)
 				xt_xlate_add(xl, "%d ", info->protocol);
 			else
-				xt_xlate_add(xl, "%s ", pe->p_name);
+				xt_xlate_add(xl, "%s ", pe);
 		}
 	}
 
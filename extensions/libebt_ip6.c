@@ -419,16 +419,16 @@ static void brip6_print(const void *ip, const struct xt_entry_match *match,
 		printf("0x%02X ", ipinfo->tclass);
 	}
 	if (ipinfo->bitmask & EBT_IP6_PROTO) {
-		struct protoent *pe;
+		const char *pname;
 
 		printf("--ip6-proto ");
 		if (ipinfo->invflags & EBT_IP6_PROTO)
 			printf("! ");
-		pe = getprotobynumber(ipinfo->protocol);
-		if (pe == NULL) {
+		pname = xtables_protocol_name(ipinfo->protocol);
+		if (pname == NULL) {
 			printf("%d ", ipinfo->protocol);
 		} else {
-			printf("%s ", pe->p_name);
+			printf("%s ", pname);
 		}
 	}
 	if (ipinfo->bitmask & EBT_IP6_SPORT) {
@@ -558,7 +558,7 @@ static int brip6_xlate(struct xt_xlate *xl,
 	}
 
 	if (info->bitmask & EBT_IP6_PROTO) {
-		struct protoent *pe;
+		const char *pe;
 
 		if (info->bitmask & (EBT_IP6_SPORT|EBT_IP6_DPORT|EBT_IP6_ICMP6) &&
 		    (info->invflags & EBT_IP6_PROTO) == 0) {
@@ -570,11 +570,11 @@ static int brip6_xlate(struct xt_xlate *xl,
 			xt_xlate_add(xl, "meta l4proto ");
 			if (info->invflags & EBT_IP6_PROTO)
 				xt_xlate_add(xl, "!= ");
-			pe = getprotobynumber(info->protocol);
+			pe = xtables_protocol_name(info->protocol);
 			if (pe == NULL)
 				xt_xlate_add(xl, "%d ", info->protocol);
 			else
-				xt_xlate_add(xl, "%s ", pe->p_name);
+				xt_xlate_add(xl, "%s ", pe);
 		}
 	}
 
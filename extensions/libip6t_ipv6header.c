@@ -67,9 +67,9 @@ proto_to_name(uint8_t proto, int nolookup)
         unsigned int i;
 
         if (proto && !nolookup) {
-		const struct protoent *pent = getprotobynumber(proto);
-                if (pent)
-                        return pent->p_name;
+		const char *pname = xtables_protocol_name(proto);
+                if (pname)
+                        return pname;
         }
 
         for (i = 0; i < ARRAY_SIZE(chain_protos); ++i)
@@ -83,10 +83,10 @@ static uint16_t
 name_to_proto(const char *s)
 {
         unsigned int proto=0;
-	const struct protoent *pent;
+	int pnum;
 
-        if ((pent = getprotobyname(s)))
-        	proto = pent->p_proto;
+        if ((pnum = xtables_protocol_number(s)) >= 0)
+        	proto = pnum;
         else {
         	unsigned int i;
         	for (i = 0; i < ARRAY_SIZE(chain_protos); ++i)
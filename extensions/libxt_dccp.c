@@ -133,12 +133,7 @@ static void dccp_parse(struct xt_option_call *cb)
 static const char *
 port_to_service(int port)
 {
-	const struct servent *service;
-
-	if ((service = getservbyport(htons(port), "dccp")))
-		return service->s_name;
-
-	return NULL;
+	return xtables_service_name(port, "dccp");
 }
 
 static void
@@ -256,12 +256,7 @@ static void multiport_check(struct xt_fcheck_call *cb)
 static const char *
 port_to_service(int port, uint8_t proto)
 {
-	const struct servent *service;
-
-	if ((service = getservbyport(htons(port), proto_to_name(proto))))
-		return service->s_name;
-
-	return NULL;
+	return xtables_service_name(port, proto_to_name(proto));
 }
 
 static void
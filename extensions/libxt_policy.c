@@ -244,13 +244,13 @@ static void print_mode(const char *prefix, uint8_t mode, int numeric)
 
 static void print_proto(const char *prefix, uint8_t proto, int numeric)
 {
-	const struct protoent *p = NULL;
+	const char *p = NULL;
 
 	printf(" %sproto ", prefix);
 	if (!numeric)
-		p = getprotobynumber(proto);
+		p = xtables_protocol_name(proto);
 	if (p != NULL)
-		printf("%s", p->p_name);
+		printf("%s", p);
 	else
 		printf("%u", proto);
 }
@@ -297,12 +297,7 @@ sctp_parse(int c, char **argv, int invert, unsigned int *flags,
 static const char *
 port_to_service(int port)
 {
-	const struct servent *service;
-
-	if ((service = getservbyport(htons(port), "sctp")))
-		return service->s_name;
-
-	return NULL;
+	return xtables_service_name(port, "sctp");
 }
 
 static void
@@ -206,12 +206,7 @@ tcp_parse(int c, char **argv, int invert, unsigned int *flags,
 static const char *
 port_to_service(int port)
 {
-	const struct servent *service;
-
-	if ((service = getservbyport(htons(port), "tcp")))
-		return service->s_name;
-
-	return NULL;
+	return xtables_service_name(port, "tcp");
 }
 
 static void
@@ -63,12 +63,7 @@ static void udp_parse(struct xt_option_call *cb)
 static const char *
 port_to_service(int port)
 {
-	const struct servent *service;
-
-	if ((service = getservbyport(htons(port), "udp")))
-		return service->s_name;
-
-	return NULL;
+	return xtables_service_name(port, "udp");
 }
 
 static void
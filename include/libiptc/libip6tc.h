@@ -145,9 +145,41 @@ int ip6tc_set_counter(const xt_chainlabel chain,
 		      struct xt_counters *counters,
 		      struct xtc_handle *handle);
 
+/* Differential update: declare `chain' part of the new ruleset, creating
+   it if needed. */
+int ip6tc_diff_chain(const xt_chainlabel chain, struct xtc_handle *handle);
+
+/* Make `e' the next rule of `chain', keeping an equal old rule (subject
+   to matchmask) and its counters instead of inserting a new one. */
+int ip6tc_diff_entry(const xt_chainlabel chain,
+		     const struct ip6t_entry *e,
+		     unsigned char *matchmask,
+		     struct xtc_handle *handle);
+
+/* Delete the old rules and chains no ip6tc_diff_chain() or
+   ip6tc_diff_entry() call kept. */
+int ip6tc_diff_end(struct xtc_handle *handle);
+
 /* Makes the actual changes. */
 int ip6tc_commit(struct xtc_handle *handle);
 
+/* Compile the table into a blob for ip6tc_replace_snapshot().  Returns
+   NULL on error. */
+void *ip6tc_snapshot(struct xtc_handle *handle, int counters, size_t *len);
+
+/* Replace the table named in a snapshot blob, checking each extension
+   revision with compatible() first if given. */
+int ip6tc_replace_snapshot(const void *blob, size_t len, int counters,
+			   int (*compatible)(const char *, uint8_t, int));
+
+/* Build a handle from a blob of ip6tc_snapshot(), without the kernel.
+   The handle can't be committed.  Returns NULL on error. */
+struct xtc_handle *ip6tc_init_snapshot(const void *blob, size_t len);
+
+/* Have @hook called around the steps of ip6tc_init() and ip6tc_commit(),
+   or no more if NULL. */
+void ip6tc_set_phase_hook(xtc_phase_hook hook);
+
 /* Get raw socket. */
 int ip6tc_get_raw_socket(void);
 
@@ -1,10 +1,26 @@
 #ifndef _LIBXTC_SHARED_H
 #define _LIBXTC_SHARED_H 1
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef char xt_chainlabel[32];
 struct xtc_handle;
 struct xt_counters;
 
+/* Steps of init() and commit(), reported to the hook set with
+ * iptc_set_phase_hook() at their start (end == 0) and end (end == 1). */
+enum xtc_phase {
+	XTC_PHASE_INIT,		/* all of init() */
+	XTC_PHASE_GET_ENTRIES,	/* SO_GET_ENTRIES */
+	XTC_PHASE_PARSE,	/* blob to chains and rules */
+	XTC_PHASE_COMMIT,	/* all of commit() */
+	XTC_PHASE_COMPILE,	/* chains and rules to blob */
+	XTC_PHASE_REPLACE,	/* SO_SET_REPLACE */
+	XTC_PHASE_COUNTERS,	/* SO_SET_ADD_COUNTERS */
+};
+typedef void (*xtc_phase_hook)(enum xtc_phase phase, int end);
+
 struct xtc_ops {
 	int (*commit)(struct xtc_handle *);
 	struct xtc_handle *(*init)(const char *);
@@ -20,6 +36,13 @@ struct xtc_ops {
 	int (*set_policy)(const xt_chainlabel, const xt_chainlabel,
 			  struct xt_counters *, struct xtc_handle *);
 	const char *(*strerror)(int);
+	/* new members go last, iptc_ops and ip6tc_ops are exported */
+	void *(*snapshot)(struct xtc_handle *, int, size_t *);
+	int (*replace_snapshot)(const void *, size_t, int,
+				int (*)(const char *, uint8_t, int));
+	int (*diff_chain)(const xt_chainlabel, struct xtc_handle *);
+	int (*diff_end)(struct xtc_handle *);
+	struct xtc_handle *(*init_snapshot)(const void *, size_t);
 };
 
 #endif /* _LIBXTC_SHARED_H */
@@ -0,0 +1,79 @@
+#ifndef _XTABLES_NFT_H
+#define _XTABLES_NFT_H
+/*
+ * Library which changes iptables rules through nf_tables, for programs
+ * that would otherwise run iptables-nft once per change.
+ *
+ * A handle keeps the rule set cache between calls and collects changes
+ * until xtnft_commit(), which sends them to the kernel as one transaction.
+ * The first change after a commit refreshes the cache if someone else
+ * changed the rule set in the meantime.
+ *
+ * Rules and commands are given as iptables arguments. Errors are reported
+ * through the return value and xtnft_strerror(); the library never exits.
+ * It is not thread safe: use it from one thread at a time.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct xtnft_handle;
+struct xtnft_rule;
+
+/* Open a handle for NFPROTO_IPV4 or NFPROTO_IPV6.  Returns NULL on error. */
+struct xtnft_handle *xtnft_open(int family);
+
+/* Drop uncommitted changes and free the handle. */
+void xtnft_close(struct xtnft_handle *h);
+
+/* Fetch the rule set again if it changed since the last fetch. */
+int xtnft_refresh(struct xtnft_handle *h);
+
+/*
+ * Parse a rule specification such as { "-s", "10.0.0.1", "-j", "ACCEPT" }
+ * for @chain in @table.  Returns NULL if it is not a valid rule.
+ */
+struct xtnft_rule *xtnft_rule_parse(struct xtnft_handle *h,
+				    const char *table, const char *chain,
+				    int argc, const char *const argv[]);
+
+/* Free a rule returned by xtnft_rule_parse(). */
+void xtnft_rule_free(struct xtnft_rule *r);
+
+/* These functions return TRUE for OK or 0 and leave a message for
+   xtnft_strerror(). */
+
+/* Append a rule to its chain. */
+int xtnft_rule_append(struct xtnft_handle *h, const struct xtnft_rule *r);
+
+/* Insert a rule at position @rulenum, counting from 1. */
+int xtnft_rule_insert(struct xtnft_handle *h, const struct xtnft_rule *r,
+		      unsigned int rulenum);
+
+/* Delete the first rule matching @r. */
+int xtnft_rule_delete(struct xtnft_handle *h, const struct xtnft_rule *r);
+
+/* Does a rule matching @r exist? */
+int xtnft_rule_check(struct xtnft_handle *h, const struct xtnft_rule *r);
+
+/*
+ * Run any iptables command line, such as { "-N", "FOO" }, without the
+ * program name.  Listings are printed to stdout.
+ */
+int xtnft_command(struct xtnft_handle *h, int argc, const char *const argv[]);
+
+/* Send all changes made since the last commit to the kernel. */
+int xtnft_commit(struct xtnft_handle *h);
+
+/* Drop all changes made since the last commit. */
+int xtnft_abort(struct xtnft_handle *h);
+
+/* Describe why the last failing call failed. */
+const char *xtnft_strerror(const struct xtnft_handle *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _XTABLES_NFT_H */
@@ -12,6 +12,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <netinet/in.h>
 #include <net/if.h>
 #include <linux/types.h>
@@ -488,6 +489,10 @@ extern bool xtables_strtoul(const char *, char **, uintmax_t *,
 extern bool xtables_strtoui(const char *, char **, unsigned int *,
 	unsigned int, unsigned int);
 extern int xtables_service_to_port(const char *name, const char *proto);
+extern int xtables_service_port(const char *name, const char *proto);
+extern const char *xtables_service_name(unsigned int port, const char *proto);
+extern int xtables_protocol_number(const char *name);
+extern const char *xtables_protocol_name(unsigned int proto);
 extern uint16_t xtables_parse_port(const char *port, const char *proto);
 extern void
 xtables_parse_interface(const char *arg, char *vianame, unsigned char *mask);
@@ -521,6 +526,9 @@ extern void xtables_ip6parse_any(const char *, struct in6_addr **,
 extern void xtables_ip6parse_multiple(const char *, struct in6_addr **,
 	struct in6_addr **, unsigned int *);
 
+extern int xtables_resolve_host(int, const char *, void **, unsigned int *);
+extern void xtables_resolve_prefetch(int, const char *const *, unsigned int);
+
 /* Absolute file name for network data base files.  */
 #define XT_PATH_ETHERTYPES     "/etc/ethertypes"
 
@@ -560,6 +568,15 @@ extern void xtables_print_mac(const unsigned char *macaddress);
 extern void xtables_print_mac_and_mask(const unsigned char *mac,
 				       const unsigned char *mask);
 
+#define XTABLES_OUTPUT_BUFSIZ	(1 << 20)
+
+extern void xtables_output_init(FILE *fp);
+extern char *xtables_fmt_u64(char *buf, uint64_t num);
+extern char *xtables_fmt_ipaddr(char *buf, const struct in_addr *addr);
+extern char *xtables_fmt_ipmask(char *buf, const struct in_addr *mask);
+extern char *xtables_fmt_ip6addr(char *buf, const struct in6_addr *addr);
+extern char *xtables_fmt_ip6mask(char *buf, const struct in6_addr *mask);
+
 extern void xtables_parse_val_mask(struct xt_option_call *cb,
 				   unsigned int *val, unsigned int *mask,
 				   const struct xtables_lmap *lmap);
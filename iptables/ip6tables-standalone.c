@@ -36,6 +36,7 @@
 #include <errno.h>
 #include <ip6tables.h>
 #include "ip6tables-multi.h"
+#include "xshared.h"
 
 int
 ip6tables_main(int argc, char *argv[])
@@ -58,7 +59,10 @@ ip6tables_main(int argc, char *argv[])
 	init_extensions6();
 #endif
 
+	xtables_output_init(stdout);
+	xs_profile_begin(XS_PROF_PARSE);
 	ret = do_command6(argc, argv, &table, &handle, false);
+	xs_profile_end(XS_PROF_PARSE);
 	if (ret) {
 		ret = ip6tc_commit(handle);
 		ip6tc_free(handle);
@@ -106,6 +106,7 @@ static struct option original_opts[] = {
 	{.name = "verbose",       .has_arg = 0, .val = 'v'},
 	{.name = "wait",          .has_arg = 2, .val = 'w'},
 	{.name = "wait-interval", .has_arg = 2, .val = 'W'},
+	{.name = "profile",       .has_arg = 2, .val = 'Q'},
 	{.name = "exact",         .has_arg = 0, .val = 'x'},
 	{.name = "version",       .has_arg = 0, .val = 'V'},
 	{.name = "help",          .has_arg = 2, .val = 'h'},
@@ -266,6 +267,7 @@ exit_printhelp(const struct xtables_rule_match *matches)
 "  --wait-interval -W [usecs]	wait time to try to acquire xtables lock\n"
 "				interval to wait for xtables lock\n"
 "				default is 1 second\n"
+"  --profile[=file]		report time and memory per phase\n"
 "  --line-numbers		print line numbers when listing\n"
 "  --exact	-x		expand numbers (display exact values)\n"
 /*"[!] --fragment	-f		match second or further fragments only\n"*/
@@ -788,6 +790,36 @@ check_entry(const xt_chainlabel chain, struct ip6t_entry *fw,
 	return ret;
 }
 
+static int
+diff_entry(const xt_chainlabel chain, struct ip6t_entry *fw,
+	   unsigned int nsaddrs, const struct in6_addr saddrs[],
+	   const struct in6_addr smasks[], unsigned int ndaddrs,
+	   const struct in6_addr daddrs[], const struct in6_addr dmasks[],
+	   int verbose, struct xtc_handle *handle,
+	   struct xtables_rule_match *matches,
+	   const struct xtables_target *target)
+{
+	unsigned int i, j;
+	int ret = 1;
+	unsigned char *mask;
+
+	mask = make_delete_mask(matches, target);
+	for (i = 0; i < nsaddrs; i++) {
+		fw->ipv6.src = saddrs[i];
+		fw->ipv6.smsk = smasks[i];
+		for (j = 0; j < ndaddrs; j++) {
+			fw->ipv6.dst = daddrs[j];
+			fw->ipv6.dmsk = dmasks[j];
+			if (verbose)
+				print_firewall_line(fw, handle);
+			ret &= ip6tc_diff_entry(chain, fw, mask, handle);
+		}
+	}
+
+	free(mask);
+	return ret;
+}
+
 int
 for_each_chain6(int (*fn)(const xt_chainlabel, int, struct xtc_handle *),
 	       int verbose, int builtinstoo, struct xtc_handle *handle)
@@ -921,25 +953,33 @@ static void
 print_iface(char letter, const char *iface, const unsigned char *mask,
 	    int invert)
 {
+	char buf[IFNAMSIZ + 8], *p = buf;
 	unsigned int i;
 
 	if (mask[0] == 0)
 		return;
 
-	printf("%s -%c ", invert ? " !" : "", letter);
+	if (invert)
+		p = stpcpy(p, " !");
+	*p++ = ' ';
+	*p++ = '-';
+	*p++ = letter;
+	*p++ = ' ';
 
 	for (i = 0; i < IFNAMSIZ; i++) {
 		if (mask[i] != 0) {
 			if (iface[i] != '\0')
-				printf("%c", iface[i]);
+				*p++ = iface[i];
 		} else {
 			/* we can access iface[i-1] here, because
 			 * a few lines above we make sure that mask[0] != 0 */
 			if (iface[i-1] != '\0')
-				printf("+");
+				*p++ = '+';
 			break;
 		}
 	}
+	*p = '\0';
+	fputs(buf, stdout);
 }
 
 /* The ip6tables looks up the /etc/protocols. */
@@ -949,10 +989,11 @@ static void print_proto(uint16_t proto, int invert)
 		unsigned int i;
 		const char *invertstr = invert ? " !" : "";
 
-		const struct protoent *pent = getprotobynumber(proto);
-		if (pent) {
-			printf("%s -p %s",
-			       invertstr, pent->p_name);
+		const char *pname = xtables_protocol_name(proto);
+		if (pname) {
+			fputs(invertstr, stdout);
+			fputs(" -p ", stdout);
+			fputs(pname, stdout);
 			return;
 		}
 
@@ -980,7 +1021,8 @@ static int print_match_save(const struct xt_entry_match *e,
 						       match, revision);
 		if (!mt2)
 			mt2 = match;
-		printf(" -m %s", mt2->alias ? mt2->alias(e) : name);
+		fputs(" -m ", stdout);
+		fputs(mt2->alias ? mt2->alias(e) : name, stdout);
 
 		/* some matches don't provide a save function */
 		if (mt && mt->save)
@@ -1002,21 +1044,25 @@ static int print_match_save(const struct xt_entry_match *e,
 static void print_ip(const char *prefix, const struct in6_addr *ip,
 		     const struct in6_addr *mask, int invert)
 {
-	char buf[51];
+	char buf[128], *p = buf;
 	int l = xtables_ip6mask_to_cidr(mask);
 
 	if (l == 0 && !invert)
 		return;
 
-	printf("%s %s %s",
-		invert ? " !" : "",
-		prefix,
-		inet_ntop(AF_INET6, ip, buf, sizeof buf));
+	if (invert)
+		p = stpcpy(p, " !");
+	*p++ = ' ';
+	p = stpcpy(p, prefix);
+	*p++ = ' ';
+	p = xtables_fmt_ip6addr(p, ip);
+	*p++ = '/';
 
 	if (l == -1)
-		printf("/%s", inet_ntop(AF_INET6, mask, buf, sizeof buf));
+		xtables_fmt_ip6addr(p, mask);
 	else
-		printf("/%d", l);
+		xtables_fmt_u64(p, l);
+	fputs(buf, stdout);
 }
 
 /* We want this to be readable, so only print out necessary fields.
@@ -1030,10 +1076,12 @@ void print_rule6(const struct ip6t_entry *e,
 
 	/* print counters for iptables-save */
 	if (counters > 0)
-		printf("[%llu:%llu] ", (unsigned long long)e->counters.pcnt, (unsigned long long)e->counters.bcnt);
+		print_counter_pair("[", e->counters.pcnt, ':',
+				   e->counters.bcnt, "] ");
 
 	/* print chain name */
-	printf("-A %s", chain);
+	fputs("-A ", stdout);
+	fputs(chain, stdout);
 
 	/* Print IP part. */
 	print_ip("-s", &(e->ipv6.src), &(e->ipv6.smsk),
@@ -1070,7 +1118,8 @@ void print_rule6(const struct ip6t_entry *e,
 
 	/* print counters for iptables -R */
 	if (counters < 0)
-		printf(" -c %llu %llu", (unsigned long long)e->counters.pcnt, (unsigned long long)e->counters.bcnt);
+		print_counter_pair(" -c ", e->counters.pcnt, ' ',
+				   e->counters.bcnt, "");
 
 	/* Print target name and targinfo part */
 	target_name = ip6tc_get_target(e, h);
@@ -1091,7 +1140,8 @@ void print_rule6(const struct ip6t_entry *e,
 							target, revision);
 		if (!tg2)
 			tg2 = target;
-		printf(" -j %s", tg2->alias ? tg2->alias(t) : target_name);
+		fputs(" -j ", stdout);
+		fputs(tg2->alias ? tg2->alias(t) : target_name, stdout);
 
 		if (tg && tg->save)
 			tg->save(&e->ipv6, t);
@@ -1225,7 +1275,6 @@ int do_command6(int argc, char *argv[], char **table,
 	const char *pcnt = NULL, *bcnt = NULL;
 	int ret = 1;
 	struct xtables_match *m;
-	struct xtables_rule_match *matchp;
 	struct xtables_target *t;
 	unsigned long long cnt;
 
@@ -1495,6 +1544,15 @@ int do_command6(int argc, char *argv[], char **table,
 			wait_interval_set = true;
 			break;
 
+		case 'Q':
+			if (restore) {
+				xtables_error(PARAMETER_PROBLEM,
+					      "You cannot use `--profile' from "
+					      "iptables-restore");
+			}
+			/* taken by xs_profile_init() already */
+			break;
+
 		case 'm':
 			command_match(&cs);
 			break;
@@ -1609,10 +1667,7 @@ int do_command6(int argc, char *argv[], char **table,
 			"\nThe \"nat\" table is not intended for filtering, "
 		        "the use of DROP is therefore inhibited.\n\n");
 
-	for (matchp = cs.matches; matchp; matchp = matchp->next)
-		xtables_option_mfcall(matchp->match);
-	if (cs.target != NULL)
-		xtables_option_tfcall(cs.target);
+	xs_option_fcheck(&cs);
 
 	/* Fix me: must put inverse options checking here --MN */
 
@@ -1653,7 +1708,7 @@ int do_command6(int argc, char *argv[], char **table,
 
 	/* Attempt to acquire the xtables lock */
 	if (!restore)
-		xtables_lock_or_exit(wait, &wait_interval);
+		xtables_lock_or_exit(wait, &wait_interval, *table);
 
 	/* only allocate handle if we weren't called with a handle */
 	if (!*handle)
@@ -1743,11 +1798,18 @@ int do_command6(int argc, char *argv[], char **table,
 
 	switch (command) {
 	case CMD_APPEND:
-		ret = append_entry(chain, e,
-				   nsaddrs, saddrs, smasks,
-				   ndaddrs, daddrs, dmasks,
-				   cs.options&OPT_VERBOSE,
-				   *handle);
+		if (xs_diff_enabled)
+			ret = diff_entry(chain, e,
+					 nsaddrs, saddrs, smasks,
+					 ndaddrs, daddrs, dmasks,
+					 cs.options&OPT_VERBOSE,
+					 *handle, cs.matches, cs.target);
+		else
+			ret = append_entry(chain, e,
+					   nsaddrs, saddrs, smasks,
+					   ndaddrs, daddrs, dmasks,
+					   cs.options&OPT_VERBOSE,
+					   *handle);
 		break;
 	case CMD_DELETE:
 		ret = delete_entry(chain, e,
@@ -0,0 +1,834 @@
+/*
+ * iptables-analyze: find rules in iptables-save output which can never
+ * match, which do not change the outcome, or which can be merged.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xtables.h>
+#include "xshared.h"
+#include "xtables-multi.h"
+
+struct xtables_globals iptables_analyze_globals = {
+	.option_offset = 0,
+	.program_version = PACKAGE_VERSION,
+	.program_name = "iptables-analyze",
+};
+
+/* rules looked at after a rule to prove it redundant */
+#define XA_SCAN_MAX	4096
+/* no answer within XA_SCAN_MAX rules */
+#define XA_UNKNOWN	UINT_MAX
+/* ports one multiport match takes */
+#define XA_MULTIPORT_MAX	15
+
+static const struct option options[] = {
+	{.name = "table",   .has_arg = true,  .val = 't'},
+	{.name = "verbose", .has_arg = false, .val = 'v'},
+	{.name = "reorder", .has_arg = false, .val = 'R'},
+	{.name = "restore", .has_arg = false, .val = 'r'},
+	{.name = "diff",    .has_arg = false, .val = 'd'},
+	{.name = "help",    .has_arg = false, .val = 'h'},
+	{NULL},
+};
+
+static bool verbose;
+
+static enum {
+	XA_ANALYZE,
+	XA_REORDER,
+	XA_RESTORE,
+	XA_DIFF,
+} mode;
+
+enum xa_state {
+	XA_KEEP,
+	XA_SHADOWED,
+	XA_REDUNDANT,
+};
+
+/**
+ * struct xa_index - earlier terminal rules of a chain, by address prefix
+ * @head:	first rule + 1 of each bucket, 0 for an empty bucket
+ * @next:	next rule + 1 in the bucket of each rule
+ * @mask:	number of buckets - 1
+ * @lens:	prefix lengths of source and destination keys in use
+ * @rest:	rules with neither a source nor a destination prefix
+ * @nrest:	entries in @rest
+ *
+ * A rule is found under its source prefix if it has one, else under its
+ * destination prefix. Only a rule whose prefix contains the prefix of a
+ * later rule can cover it, so a lookup tries the prefixes of each length
+ * in use which contain the later rule's.
+ */
+struct xa_index {
+	unsigned int	*head;
+	unsigned int	*next;
+	unsigned int	mask;
+	bool		lens[2][129];
+	unsigned int	*rest;
+	unsigned int	nrest;
+};
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t table] [-v] [-R|-r|-d] [file]\n"
+		"       %s -h\n\n"
+		"Reads iptables-save output and reports rules which can be\n"
+		"removed or merged without changing the outcome.\n\n"
+		"  -R, --reorder	propose a rule order from the counters\n"
+		"  -r, --restore	print the tables in that order\n"
+		"  -d, --diff	print the moves for iptables-restore --noflush\n",
+		name, name);
+}
+
+static const struct xs_prefix *xa_key(const struct xs_rule *r, int *which)
+{
+	if (r->src.family && !r->src.inv) {
+		*which = 0;
+		return &r->src;
+	}
+	if (r->dst.family && !r->dst.inv) {
+		*which = 1;
+		return &r->dst;
+	}
+	return NULL;
+}
+
+static uint32_t xa_hash(int which, unsigned int len, const uint8_t *addr)
+{
+	uint32_t hash = 2166136261u;
+	unsigned int i;
+
+	hash = (hash ^ which) * 16777619u;
+	hash = (hash ^ len) * 16777619u;
+	for (i = 0; i < 16; i++)
+		hash = (hash ^ addr[i]) * 16777619u;
+	return hash;
+}
+
+static void xa_index_init(struct xa_index *idx, unsigned int num)
+{
+	unsigned int size = 16;
+
+	while (size < num)
+		size <<= 1;
+
+	memset(idx, 0, sizeof(*idx));
+	idx->mask = size - 1;
+	idx->head = xtables_calloc(size, sizeof(*idx->head));
+	idx->next = xtables_calloc(num ? num : 1, sizeof(*idx->next));
+	idx->rest = xtables_calloc(num ? num : 1, sizeof(*idx->rest));
+}
+
+static void xa_index_free(struct xa_index *idx)
+{
+	free(idx->head);
+	free(idx->next);
+	free(idx->rest);
+}
+
+static void xa_index_add(struct xa_index *idx, const struct xs_rule *rules,
+			 unsigned int i)
+{
+	const struct xs_prefix *key;
+	uint32_t bucket;
+	int which;
+
+	key = xa_key(&rules[i], &which);
+	if (key == NULL) {
+		idx->rest[idx->nrest++] = i;
+		return;
+	}
+
+	bucket = xa_hash(which, key->len, key->addr) & idx->mask;
+	idx->next[i] = idx->head[bucket];
+	idx->head[bucket] = i + 1;
+	idx->lens[which][key->len] = true;
+}
+
+/* @p shortened to @len bits */
+static void xa_prefix_trim(struct xs_prefix *probe, const struct xs_prefix *p,
+			   unsigned int len)
+{
+	memset(probe->addr, 0, sizeof(probe->addr));
+	memcpy(probe->addr, p->addr, len / 8);
+	if (len % 8)
+		probe->addr[len / 8] = p->addr[len / 8] &
+				       (uint8_t)(0xff << (8 - len % 8));
+	probe->len = len;
+}
+
+static void xa_index_probe(const struct xa_index *idx,
+			   const struct xs_rule *rules, unsigned int b,
+			   int which, const struct xs_prefix *p,
+			   unsigned int *found)
+{
+	struct xs_prefix probe = *p;
+	const struct xs_prefix *key;
+	unsigned int len, i;
+	int key_which = -1;
+
+	for (len = 0; len <= p->len; len++) {
+		if (!idx->lens[which][len])
+			continue;
+
+		xa_prefix_trim(&probe, p, len);
+
+		i = idx->head[xa_hash(which, len, probe.addr) & idx->mask];
+		for (; i; i = idx->next[i - 1]) {
+			key = xa_key(&rules[i - 1], &key_which);
+			if (key_which != which || key->len != len ||
+			    memcmp(key->addr, probe.addr, sizeof(probe.addr)))
+				continue;
+			if (i - 1 < *found &&
+			    xs_rule_covers(&rules[i - 1], &rules[b]))
+				*found = i - 1;
+		}
+	}
+}
+
+/* The earliest terminal rule in @idx which covers rule @b, or @b. */
+static unsigned int xa_index_lookup(const struct xa_index *idx,
+				    const struct xs_rule *rules,
+				    unsigned int b)
+{
+	const struct xs_rule *r = &rules[b];
+	unsigned int found = b, i;
+
+	if (r->src.family && !r->src.inv)
+		xa_index_probe(idx, rules, b, 0, &r->src, &found);
+	if (r->dst.family && !r->dst.inv)
+		xa_index_probe(idx, rules, b, 1, &r->dst, &found);
+
+	for (i = 0; i < idx->nrest && idx->rest[i] < found; i++)
+		if (xs_rule_covers(&rules[idx->rest[i]], r))
+			found = idx->rest[i];
+	return found;
+}
+
+static bool xa_has_src(const struct xs_rule *r)
+{
+	return r->src.family && !r->src.inv;
+}
+
+/*
+ * The first rule after @i that rule @i can meet, @n if there is none, or
+ * XA_UNKNOWN if XA_SCAN_MAX rules did not tell. @idx holds the later rules
+ * with a source prefix, @other gives the next rule from each position on
+ * without one.
+ */
+static unsigned int xa_next_met(const struct xa_index *idx,
+				const unsigned int *other,
+				const enum xa_state *state,
+				const struct xs_rule *rules, unsigned int i,
+				unsigned int n)
+{
+	const struct xs_rule *r = &rules[i];
+	unsigned int best = n, steps = 0, len, e, j;
+	struct xs_prefix probe;
+
+	/* a later rule with a longer prefix may lie inside ours */
+	len = xa_has_src(r) ? r->src.len + 1 : 0;
+	for (; len <= 128; len++)
+		if (idx->lens[0][len])
+			break;
+
+	if (len <= 128) {
+		for (j = i + 1; j < n; j++) {
+			if (j > i + XA_SCAN_MAX)
+				return XA_UNKNOWN;
+			if (state[j] != XA_SHADOWED &&
+			    !xs_rule_disjoint(r, &rules[j]))
+				return j;
+		}
+		return n;
+	}
+
+	for (j = other[i + 1]; j < n; j = other[j + 1]) {
+		if (++steps > XA_SCAN_MAX)
+			return XA_UNKNOWN;
+		if (state[j] != XA_SHADOWED && !xs_rule_disjoint(r, &rules[j])) {
+			best = j;
+			break;
+		}
+	}
+
+	/* bucket chains are in rule order, the index was filled backwards */
+	probe = r->src;
+	for (len = 0; len <= r->src.len; len++) {
+		if (!idx->lens[0][len])
+			continue;
+
+		xa_prefix_trim(&probe, &r->src, len);
+		e = idx->head[xa_hash(0, len, probe.addr) & idx->mask];
+		for (; e && e - 1 < best; e = idx->next[e - 1]) {
+			j = e - 1;
+			if (++steps > XA_SCAN_MAX)
+				return XA_UNKNOWN;
+			if (rules[j].src.len != len ||
+			    memcmp(rules[j].src.addr, probe.addr,
+				   sizeof(probe.addr)) ||
+			    xs_rule_disjoint(r, &rules[j]))
+				continue;
+			best = j;
+			break;
+		}
+	}
+	return best;
+}
+
+static bool xa_same_verdict(const struct xs_rule *a, const struct xs_rule *b)
+{
+	return !(xs_rule_diff(a, b) & XS_RULE_VERDICT);
+}
+
+/* Would the packets of @r get its verdict at the end of chain @c too? */
+static bool xa_end_verdict(const struct xs_rule_chain *c,
+			   const struct xs_rule *r)
+{
+	if (r->jump_goto)
+		return false;
+	if (strcmp(r->verdict, "RETURN") == 0)
+		return true;
+	return c->policy && strcmp(r->verdict, c->policy) == 0;
+}
+
+static void xa_print_rule(const struct xs_rule_chain *c,
+			  const struct xs_rule *r)
+{
+	if (verbose)
+		printf("\t-A %s %s\n", c->name, r->text);
+}
+
+static const char *xa_field_name(unsigned int field)
+{
+	switch (field) {
+	case XS_RULE_SRC:
+		return "source address";
+	case XS_RULE_DST:
+		return "destination address";
+	case XS_RULE_SPORT:
+		return "source port";
+	case XS_RULE_DPORT:
+		return "destination port";
+	}
+	return NULL;
+}
+
+/* Can rules differing only in @field be merged into one match? */
+static bool xa_mergeable(const struct xs_rule *r, unsigned int field)
+{
+	switch (field) {
+	case XS_RULE_SRC:
+		return !r->src.inv && r->src.family;
+	case XS_RULE_DST:
+		return !r->dst.inv && r->dst.family;
+	case XS_RULE_SPORT:
+		return !r->sport.inv && r->sport.set;
+	case XS_RULE_DPORT:
+		return !r->dport.inv && r->dport.set;
+	}
+	return false;
+}
+
+static unsigned int xa_chain(const struct xs_rule_table *t,
+			     const struct xs_rule_chain *c)
+{
+	unsigned int shadowed = 0, redundant = 0, merged = 0;
+	const struct xs_rule *rules = c->rules;
+	unsigned int i, j, k, last, n = c->num, *by, *other;
+	enum xa_state *state;
+	struct xa_index idx;
+	unsigned int field;
+
+	state = xtables_calloc(n ? n : 1, sizeof(*state));
+	by = xtables_calloc(n ? n : 1, sizeof(*by));
+	other = xtables_calloc(n + 1, sizeof(*other));
+
+	/* rules an earlier terminal rule leaves nothing to match */
+	xa_index_init(&idx, n);
+	for (i = 0; i < n; i++) {
+		j = xa_index_lookup(&idx, rules, i);
+		if (j < i) {
+			state[i] = XA_SHADOWED;
+			shadowed++;
+			printf("%s %s rule %u: shadowed by rule %u\n",
+			       t->name, c->name, i + 1, j + 1);
+			xa_print_rule(c, &rules[j]);
+			xa_print_rule(c, &rules[i]);
+		} else if (xs_rule_terminal(&rules[i])) {
+			xa_index_add(&idx, rules, i);
+		}
+	}
+	xa_index_free(&idx);
+
+	/*
+	 * Terminal rules whose packets would get the same verdict further
+	 * down: the first later rule they can meet is a covering rule with
+	 * that verdict, or there is none and the end of the chain gives it.
+	 * Going backwards, the later rules are in an index by source prefix.
+	 */
+	xa_index_init(&idx, n);
+	other[n] = n;
+	for (i = n; i-- > 0; ) {
+		other[i] = xa_has_src(&rules[i]) ? other[i + 1] : i;
+		by[i] = XA_UNKNOWN;
+		if (state[i] != XA_KEEP)
+			continue;
+
+		j = XA_UNKNOWN;
+		if (xs_rule_terminal(&rules[i]))
+			j = xa_next_met(&idx, other, state, rules, i, n);
+		if (j < n && xs_rule_terminal(&rules[j]) &&
+		    xa_same_verdict(&rules[i], &rules[j]) &&
+		    xs_rule_covers(&rules[j], &rules[i]))
+			by[i] = j;
+		else if (j == n && xa_end_verdict(c, &rules[i]))
+			by[i] = j;
+
+		if (xa_has_src(&rules[i]))
+			xa_index_add(&idx, rules, i);
+	}
+	xa_index_free(&idx);
+
+	for (i = 0; i < n; i++) {
+		if (by[i] == XA_UNKNOWN)
+			continue;
+		if (by[i] < n)
+			printf("%s %s rule %u: redundant, rule %u gives the same verdict\n",
+			       t->name, c->name, i + 1, by[i] + 1);
+		else
+			printf("%s %s rule %u: redundant, the %s gives the same verdict\n",
+			       t->name, c->name, i + 1,
+			       c->policy ? "policy" : "end of the chain");
+		state[i] = XA_REDUNDANT;
+		redundant++;
+		xa_print_rule(c, &rules[i]);
+	}
+
+	/* runs of rules which differ in one field a set could hold */
+	for (i = 0; i < n; i = j) {
+		j = i + 1;
+		if (state[i] != XA_KEEP)
+			continue;
+
+		while (j < n && state[j] != XA_KEEP)
+			j++;
+		if (j == n)
+			break;
+
+		field = xs_rule_diff(&rules[i], &rules[j]);
+		if (!xa_field_name(field) || !xa_mergeable(&rules[i], field) ||
+		    !xa_mergeable(&rules[j], field))
+			continue;
+
+		k = 2;
+		for (last = j++; j < n; j++) {
+			if (state[j] != XA_KEEP)
+				continue;
+			if (xs_rule_diff(&rules[i], &rules[j]) != field ||
+			    !xa_mergeable(&rules[j], field))
+				break;
+			last = j;
+			k++;
+		}
+
+		if (field == XS_RULE_SPORT || field == XS_RULE_DPORT)
+			k -= (k + XA_MULTIPORT_MAX - 1) / XA_MULTIPORT_MAX;
+		else
+			k--;
+		if (k == 0)
+			continue;
+
+		printf("%s %s rules %u-%u: differ only in %s, %u fewer merged with %s\n",
+		       t->name, c->name, i + 1, last + 1, xa_field_name(field), k,
+		       field & (XS_RULE_SPORT | XS_RULE_DPORT) ?
+		       "multiport" : "an ipset");
+		merged += k;
+		if (verbose)
+			for (k = i; k <= last; k++)
+				if (state[k] == XA_KEEP)
+					xa_print_rule(c, &rules[k]);
+	}
+
+	if (shadowed + redundant + merged)
+		printf("%s %s: %u of %u rules can go (%u shadowed, %u redundant, %u by merging)\n",
+		       t->name, c->name, shadowed + redundant + merged, n,
+		       shadowed, redundant, merged);
+
+	free(state);
+	free(by);
+	free(other);
+	return shadowed + redundant + merged;
+}
+
+/* Can @a and @b trade places without changing what happens to a packet? */
+static bool xa_commute(const struct xs_rule *a, const struct xs_rule *b)
+{
+	if (xs_rule_disjoint(a, b))
+		return true;
+	return xs_rule_terminal(a) && xs_rule_terminal(b) &&
+	       xa_same_verdict(a, b);
+}
+
+/* Packets that stop at @r, the ones it hands on cost nothing here. */
+static uint64_t xa_weight(const struct xs_rule *r)
+{
+	return xs_rule_terminal(r) ? r->pcnt : 0;
+}
+
+/*
+ * Rule evaluations for the packets of chain @c with its rules in @order:
+ * a packet stopping at the rule in position p was matched against p rules,
+ * one reaching the end against all of them.
+ */
+static double xa_evaluations(const struct xs_rule_chain *c,
+			     const unsigned int *order, uint64_t end)
+{
+	double evals = (double)end * c->num;
+	unsigned int p;
+
+	for (p = 0; p < c->num; p++)
+		evals += (double)xa_weight(&c->rules[order[p]]) * (p + 1);
+	return evals;
+}
+
+/* Packets entering user chain @c: those of the rules jumping to it. */
+static uint64_t xa_chain_calls(const struct xs_rule_table *t,
+			       const struct xs_rule_chain *c)
+{
+	size_t len = strlen(c->name);
+	const struct xs_rule *r;
+	uint64_t calls = 0;
+	unsigned int i, j;
+
+	for (i = 0; i < t->num; i++) {
+		for (j = 0; j < t->chains[i].num; j++) {
+			r = &t->chains[i].rules[j];
+			if (strncmp(r->verdict, c->name, len) == 0 &&
+			    (r->verdict[len] == '\0' || r->verdict[len] == ' '))
+				calls += r->pcnt;
+		}
+	}
+	return calls;
+}
+
+/**
+ * struct xa_reorder - proposed order of a chain
+ * @order:	rule indices in their new order
+ * @from:	position a rule is taken from in each move, counting from 1
+ * @to:		position it is inserted at
+ * @moved:	number of moves
+ * @packets:	packets which entered the chain
+ * @before:	rule evaluations in the current order
+ * @after:	rule evaluations in the new order
+ */
+struct xa_reorder {
+	unsigned int	*order;
+	unsigned int	*from;
+	unsigned int	*to;
+	unsigned int	moved;
+	uint64_t	packets;
+	double		before;
+	double		after;
+};
+
+/* Turn @ro->order into moves of one rule each, done one after the other. */
+static void xa_reorder_moves(struct xa_reorder *ro, unsigned int n)
+{
+	unsigned int p, q, *cur;
+
+	ro->from = xtables_calloc(n ? n : 1, sizeof(*ro->from));
+	ro->to = xtables_calloc(n ? n : 1, sizeof(*ro->to));
+	cur = xtables_calloc(n ? n : 1, sizeof(*cur));
+	for (p = 0; p < n; p++)
+		cur[p] = p;
+
+	ro->moved = 0;
+	for (p = 0; p < n; p++) {
+		if (cur[p] == ro->order[p])
+			continue;
+		for (q = p + 1; cur[q] != ro->order[p]; q++)
+			;
+		ro->from[ro->moved] = q + 1;
+		ro->to[ro->moved++] = p + 1;
+		memmove(&cur[p + 1], &cur[p], (q - p) * sizeof(*cur));
+		cur[p] = ro->order[p];
+	}
+	free(cur);
+}
+
+/*
+ * Move each rule up past rules which stop fewer packets, as long as it
+ * commutes with each of them. Rules which commute with neither neighbour
+ * keep their relative order, so the chain treats every packet as before.
+ */
+static void xa_reorder_chain(const struct xs_rule_table *t,
+			     const struct xs_rule_chain *c,
+			     struct xa_reorder *ro)
+{
+	const struct xs_rule *rules = c->rules;
+	uint64_t stopped = 0, end, w;
+	unsigned int n = c->num, p, q, j;
+
+	ro->order = xtables_calloc(n ? n : 1, sizeof(*ro->order));
+	for (p = 0; p < n; p++) {
+		ro->order[p] = p;
+		stopped += xa_weight(&rules[p]);
+	}
+
+	if (c->policy) {
+		end = c->pcnt;
+	} else {
+		end = xa_chain_calls(t, c);
+		end = end > stopped ? end - stopped : 0;
+	}
+	ro->packets = stopped + end;
+	ro->before = xa_evaluations(c, ro->order, end);
+
+	for (p = 1; p < n; p++) {
+		j = ro->order[p];
+		w = xa_weight(&rules[j]);
+		if (w == 0)
+			continue;
+
+		for (q = p; q > 0 && p - q < XA_SCAN_MAX; q--) {
+			const struct xs_rule *k = &rules[ro->order[q - 1]];
+
+			if (xa_weight(k) >= w || !xa_commute(k, &rules[j]))
+				break;
+		}
+		memmove(&ro->order[q + 1], &ro->order[q],
+			(p - q) * sizeof(*ro->order));
+		ro->order[q] = j;
+	}
+
+	ro->after = xa_evaluations(c, ro->order, end);
+	xa_reorder_moves(ro, n);
+}
+
+static void xa_reorder_report(const struct xs_rule_table *t,
+			      const struct xs_rule_chain *c,
+			      const struct xa_reorder *ro, const char *prefix)
+{
+	unsigned int m;
+
+	if (ro->packets == 0) {
+		if (verbose)
+			printf("%s%s %s: no packets counted\n", prefix,
+			       t->name, c->name);
+		return;
+	}
+
+	printf("%s%s %s: %.2f rule evaluations per packet", prefix, t->name,
+	       c->name, ro->before / ro->packets);
+	if (ro->moved == 0) {
+		printf(", no reordering helps\n");
+		return;
+	}
+	printf(", %.2f with %u rule%s moved (%.0f%% fewer)\n",
+	       ro->after / ro->packets, ro->moved, ro->moved == 1 ? "" : "s",
+	       100 * (ro->before - ro->after) / ro->before);
+
+	if (!verbose)
+		return;
+	for (m = 0; m < ro->moved; m++)
+		printf("%s\trule %u to %u: -A %s %s\n", prefix,
+		       ro->from[m], ro->to[m], c->name,
+		       c->rules[ro->order[ro->to[m] - 1]].text);
+}
+
+static void xa_print_counted(const struct xs_rule_chain *c,
+			     const struct xs_rule *r, const char *cmd,
+			     unsigned int pos)
+{
+	printf("[%" PRIu64 ":%" PRIu64 "] %s %s ", r->pcnt, r->bcnt, cmd,
+	       c->name);
+	if (pos)
+		printf("%u ", pos);
+	printf("%s\n", r->text);
+}
+
+/* The table in its new order, for iptables-restore --diff. */
+static void xa_print_restore(const struct xs_rule_table *t,
+			     struct xa_reorder *ro)
+{
+	const struct xs_rule_chain *c;
+	unsigned int i, p;
+
+	printf("*%s\n", t->name);
+	for (i = 0; i < t->num; i++)
+		xa_reorder_report(t, &t->chains[i], &ro[i], "# ");
+	for (i = 0; i < t->num; i++) {
+		c = &t->chains[i];
+		printf(":%s %s [%" PRIu64 ":%" PRIu64 "]\n", c->name,
+		       c->policy ? c->policy : "-", c->pcnt, c->bcnt);
+	}
+	for (i = 0; i < t->num; i++) {
+		c = &t->chains[i];
+		for (p = 0; p < c->num; p++)
+			xa_print_counted(c, &c->rules[ro[i].order[p]], "-A", 0);
+	}
+	printf("COMMIT\n");
+}
+
+/*
+ * The moves alone, as deletions and insertions by position for
+ * iptables-restore --noflush. Each rule keeps its counters.
+ */
+static void xa_print_moves(const struct xs_rule_table *t,
+			   struct xa_reorder *ro)
+{
+	const struct xs_rule_chain *c;
+	bool header = false;
+	unsigned int i, m;
+
+	for (i = 0; i < t->num; i++) {
+		c = &t->chains[i];
+		if (ro[i].moved == 0)
+			continue;
+		if (!header) {
+			printf("*%s\n", t->name);
+			header = true;
+		}
+		xa_reorder_report(t, c, &ro[i], "# ");
+
+		for (m = 0; m < ro[i].moved; m++) {
+			printf("-D %s %u\n", c->name, ro[i].from[m]);
+			xa_print_counted(c,
+				&c->rules[ro[i].order[ro[i].to[m] - 1]],
+				"-I", ro[i].to[m]);
+		}
+	}
+	if (header)
+		printf("COMMIT\n");
+}
+
+static void xa_reorder_table(const struct xs_rule_table *t, double *before,
+			     double *after, uint64_t *packets)
+{
+	struct xa_reorder *ro;
+	unsigned int i;
+
+	ro = xtables_calloc(t->num ? t->num : 1, sizeof(*ro));
+	for (i = 0; i < t->num; i++) {
+		xa_reorder_chain(t, &t->chains[i], &ro[i]);
+		*before += ro[i].before;
+		*after += ro[i].after;
+		*packets += ro[i].packets;
+	}
+
+	switch (mode) {
+	case XA_REORDER:
+		for (i = 0; i < t->num; i++)
+			xa_reorder_report(t, &t->chains[i], &ro[i], "");
+		break;
+	case XA_RESTORE:
+		xa_print_restore(t, ro);
+		break;
+	case XA_DIFF:
+		xa_print_moves(t, ro);
+		break;
+	default:
+		break;
+	}
+
+	for (i = 0; i < t->num; i++) {
+		free(ro[i].order);
+		free(ro[i].from);
+		free(ro[i].to);
+	}
+	free(ro);
+}
+
+int iptables_analyze_main(int argc, char *argv[])
+{
+	unsigned int i, j, rules = 0, saved = 0;
+	double before = 0, after = 0;
+	uint64_t packets = 0;
+	struct xs_ruleset rs = {};
+	const char *table = NULL;
+	FILE *in = stdin;
+	int c;
+
+	xtables_set_params(&iptables_analyze_globals);
+
+	while ((c = getopt_long(argc, argv, "t:vRrdh", options, NULL)) != -1) {
+		switch (c) {
+		case 't':
+			table = optarg;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'R':
+			mode = XA_REORDER;
+			break;
+		case 'r':
+			mode = XA_RESTORE;
+			break;
+		case 'd':
+			mode = XA_DIFF;
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			exit(0);
+		default:
+			print_usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (optind == argc - 1) {
+		in = fopen(argv[optind], "re");
+		if (!in) {
+			fprintf(stderr, "Can't open %s: %s\n", argv[optind],
+				strerror(errno));
+			exit(1);
+		}
+	} else if (optind < argc) {
+		fprintf(stderr, "Unknown arguments found on commandline\n");
+		exit(1);
+	}
+
+	xs_ruleset_read(&rs, in);
+	if (in != stdin)
+		fclose(in);
+
+	for (i = 0; i < rs.num; i++) {
+		const struct xs_rule_table *t = &rs.tables[i];
+
+		if (table && strcmp(t->name, table))
+			continue;
+		if (mode != XA_ANALYZE) {
+			xa_reorder_table(t, &before, &after, &packets);
+			continue;
+		}
+		for (j = 0; j < t->num; j++) {
+			rules += t->chains[j].num;
+			saved += xa_chain(t, &t->chains[j]);
+		}
+	}
+
+	if (mode == XA_ANALYZE)
+		printf("total: %u of %u rules can go\n", saved, rules);
+	else if (mode == XA_REORDER && packets)
+		printf("total: %.0f rule evaluations, %.0f reordered\n",
+		       before, after);
+
+	xs_ruleset_free(&rs);
+	return 0;
+}
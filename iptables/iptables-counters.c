@@ -0,0 +1,301 @@
+/*
+ * Counter export of the legacy backend, see xshared-counters.c.
+ *
+ * The rules are walked in the blob SO_GET_ENTRIES returns, as the kernel
+ * lays it out: the counters need neither libiptc's parse of the blob into
+ * chains and rules nor any extension.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include "config.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netfilter/xt_comment.h>
+#include "iptables.h"
+#include "ip6tables.h"
+#include "iptables-multi.h"
+#include "ip6tables-multi.h"
+#include "xshared.h"
+
+/**
+ * struct xtc_layout - where an entry of a family keeps what is needed
+ * @level:		socket option level
+ * @so_get_info:	IPT_SO_GET_INFO or IP6T_SO_GET_INFO
+ * @so_get_entries:	IPT_SO_GET_ENTRIES or IP6T_SO_GET_ENTRIES
+ * @entrytable:		offset of the entries in the SO_GET_ENTRIES request
+ * @target_offset:	offset of target_offset in an entry
+ * @next_offset:	offset of next_offset in an entry
+ * @counters:		offset of the counters in an entry
+ * @elems:		offset of the first match in an entry
+ *
+ * Struct ipt_getinfo and ip6t_getinfo are the same, as are the fields of
+ * the entries after the addresses.
+ */
+struct xtc_layout {
+	int	level;
+	int	so_get_info;
+	int	so_get_entries;
+	size_t	entrytable;
+	size_t	target_offset;
+	size_t	next_offset;
+	size_t	counters;
+	size_t	elems;
+};
+
+#ifdef ENABLE_IPV4
+static const struct xtc_layout ipt_layout = {
+	.level		= IPPROTO_IP,
+	.so_get_info	= IPT_SO_GET_INFO,
+	.so_get_entries	= IPT_SO_GET_ENTRIES,
+	.entrytable	= offsetof(struct ipt_get_entries, entrytable),
+	.target_offset	= offsetof(struct ipt_entry, target_offset),
+	.next_offset	= offsetof(struct ipt_entry, next_offset),
+	.counters	= offsetof(struct ipt_entry, counters),
+	.elems		= offsetof(struct ipt_entry, elems),
+};
+#endif
+
+#ifdef ENABLE_IPV6
+static const struct xtc_layout ip6t_layout = {
+	.level		= IPPROTO_IPV6,
+	.so_get_info	= IP6T_SO_GET_INFO,
+	.so_get_entries	= IP6T_SO_GET_ENTRIES,
+	.entrytable	= offsetof(struct ip6t_get_entries, entrytable),
+	.target_offset	= offsetof(struct ip6t_entry, target_offset),
+	.next_offset	= offsetof(struct ip6t_entry, next_offset),
+	.counters	= offsetof(struct ip6t_entry, counters),
+	.elems		= offsetof(struct ip6t_entry, elems),
+};
+#endif
+
+static const char *const xtc_hooknames[NF_INET_NUMHOOKS] = {
+	[NF_INET_PRE_ROUTING]	= "PREROUTING",
+	[NF_INET_LOCAL_IN]	= "INPUT",
+	[NF_INET_FORWARD]	= "FORWARD",
+	[NF_INET_LOCAL_OUT]	= "OUTPUT",
+	[NF_INET_POST_ROUTING]	= "POSTROUTING",
+};
+
+static uint16_t xtc_u16(const char *e, size_t off)
+{
+	uint16_t val;
+
+	memcpy(&val, e + off, sizeof(val));
+	return val;
+}
+
+static const struct xt_entry_target *
+xtc_target(const struct xtc_layout *l, const char *e)
+{
+	return (const void *)(e + xtc_u16(e, l->target_offset));
+}
+
+static bool xtc_is_error(const struct xt_entry_target *t)
+{
+	return !strcmp(t->u.user.name, XT_ERROR_TARGET);
+}
+
+/* Comment of the comment match of an entry, empty if it has none. */
+static bool xtc_comment(const struct xtc_layout *l, const char *e,
+			char comment[XT_MAX_COMMENT_LEN])
+{
+	const struct xt_comment_info *info;
+	const struct xt_entry_match *m;
+	size_t off, end = xtc_u16(e, l->target_offset);
+
+	for (off = l->elems; off + sizeof(*m) <= end; off += m->u.match_size) {
+		m = (const void *)(e + off);
+		if (m->u.match_size < sizeof(*m))
+			break;
+		if (strcmp(m->u.user.name, "comment") ||
+		    m->u.match_size < sizeof(*m) + sizeof(*info))
+			continue;
+
+		info = (const void *)m->data;
+		memcpy(comment, info->comment, XT_MAX_COMMENT_LEN);
+		comment[XT_MAX_COMMENT_LEN - 1] = '\0';
+		return true;
+	}
+	return false;
+}
+
+/*
+ * A base chain starts at its hook entry and ends with its policy at the
+ * underflow of the hook.  A user chain starts with an ERROR target naming
+ * it and ends with a RETURN before the next ERROR target; the last entry
+ * of the table is an ERROR target named "ERROR".
+ */
+static void xtc_walk(struct xs_counters *cs, const struct xtc_layout *l,
+		     const struct ipt_getinfo *info, const char *table,
+		     const char *base, size_t size)
+{
+	const struct xt_entry_target *t;
+	struct xs_counter_chain *c = NULL;
+	char comment[XT_MAX_COMMENT_LEN];
+	const struct xt_counters *ctr;
+	size_t off, next;
+	const char *e;
+	unsigned int h;
+
+	for (off = 0; off + l->elems <= size; off = next) {
+		e = base + off;
+		next = off + xtc_u16(e, l->next_offset);
+		if (next <= off || next > size)
+			break;
+		t = xtc_target(l, e);
+		ctr = (const void *)(e + l->counters);
+
+		if (xtc_is_error(t)) {
+			if (!strcmp((const char *)t->data, XT_ERROR_TARGET))
+				break;
+			c = xs_counters_chain(cs, table, (const char *)t->data);
+			continue;
+		}
+
+		for (h = 0; h < NF_INET_NUMHOOKS; h++) {
+			if (!(info->valid_hooks & (1 << h)))
+				continue;
+			if (off == info->hook_entry[h])
+				c = xs_counters_chain(cs, table,
+						      xtc_hooknames[h]);
+			if (off == info->underflow[h])
+				break;
+		}
+		if (h < NF_INET_NUMHOOKS) {
+			if (!c)
+				continue;
+			c->policy = true;
+			c->pcnt = ctr->pcnt;
+			c->bcnt = ctr->bcnt;
+			c = NULL;
+			continue;
+		}
+
+		/* the RETURN at the end of a user chain */
+		if (!c ||
+		    (next < size && xtc_is_error(xtc_target(l, base + next))))
+			continue;
+
+		xs_counters_add(cs, c, 0, ctr->pcnt, ctr->bcnt,
+				xtc_comment(l, e, comment) ? comment : NULL);
+	}
+}
+
+static int xtc_fetch_table(struct xs_counters *cs, const struct xtc_layout *l,
+			   int sockfd, const char *table)
+{
+	struct ipt_get_entries *entries = NULL;
+	struct ipt_getinfo info;
+	socklen_t len;
+	int ret = -1;
+
+	do {
+		memset(&info, 0, sizeof(info));
+		strncpy(info.name, table, sizeof(info.name) - 1);
+		len = sizeof(info);
+		if (getsockopt(sockfd, l->level, l->so_get_info,
+			       &info, &len) < 0)
+			break;
+
+		/* the table changed in between when the size is off */
+		len = l->entrytable + info.size;
+		entries = xtables_realloc(entries, len);
+		memset(entries, 0, l->entrytable);
+		strcpy(entries->name, info.name);
+		entries->size = info.size;
+		ret = getsockopt(sockfd, l->level, l->so_get_entries,
+				 entries, &len);
+		if (ret == 0)
+			xtc_walk(cs, l, &info, table,
+				 (const char *)entries + l->entrytable,
+				 info.size);
+	} while (ret < 0 && errno == EAGAIN);
+
+	free(entries);
+	return ret;
+}
+
+static int xtc_fetch(struct xs_counters *cs, const char *table, void *data)
+{
+	char tablename[XT_TABLE_MAXNAMELEN + 1];
+	const struct xtc_layout *l = data;
+	FILE *procfile;
+	int sockfd;
+
+	sockfd = socket(afinfo->family, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+	if (sockfd < 0)
+		return -1;
+
+	if (table) {
+		if (xtc_fetch_table(cs, l, sockfd, table) < 0)
+			xtables_error(OTHER_PROBLEM,
+				      "Cannot fetch counters of table `%s': %s\n",
+				      table, strerror(errno));
+		close(sockfd);
+		return 0;
+	}
+
+	procfile = fopen(afinfo->proc_exists, "re");
+	if (!procfile) {
+		close(sockfd);
+		return errno == ENOENT ? 0 : -1;
+	}
+
+	while (fgets(tablename, sizeof(tablename), procfile)) {
+		if (tablename[strlen(tablename) - 1] != '\n')
+			xtables_error(OTHER_PROBLEM,
+				   "Badly formed tablename `%s'\n",
+				   tablename);
+		tablename[strlen(tablename) - 1] = '\0';
+
+		/* a table unloaded since it was listed has no counters */
+		if (xtc_fetch_table(cs, l, sockfd, tablename) < 0 &&
+		    errno != ENOENT)
+			xtables_error(OTHER_PROBLEM,
+				      "Cannot fetch counters of table `%s': %s\n",
+				      tablename, strerror(errno));
+	}
+
+	fclose(procfile);
+	close(sockfd);
+	return 0;
+}
+
+#ifdef ENABLE_IPV4
+int iptables_counters_main(int argc, char *argv[])
+{
+	iptables_globals.program_name = "iptables-counters";
+	if (xtables_init_all(&iptables_globals, NFPROTO_IPV4) < 0) {
+		fprintf(stderr, "%s/%s Failed to initialize xtables\n",
+				iptables_globals.program_name,
+				iptables_globals.program_version);
+		exit(1);
+	}
+
+	return xs_counters_main(argc, argv, NFPROTO_IPV4, "legacy",
+				xtc_fetch, (void *)&ipt_layout);
+}
+#endif /* ENABLE_IPV4 */
+
+#ifdef ENABLE_IPV6
+int ip6tables_counters_main(int argc, char *argv[])
+{
+	ip6tables_globals.program_name = "ip6tables-counters";
+	if (xtables_init_all(&ip6tables_globals, NFPROTO_IPV6) < 0) {
+		fprintf(stderr, "%s/%s Failed to initialize xtables\n",
+				ip6tables_globals.program_name,
+				ip6tables_globals.program_version);
+		exit(1);
+	}
+
+	return xs_counters_main(argc, argv, NFPROTO_IPV6, "legacy",
+				xtc_fetch, (void *)&ip6t_layout);
+}
+#endif /* ENABLE_IPV6 */
@@ -4,5 +4,7 @@
 extern int iptables_main(int, char **);
 extern int iptables_save_main(int, char **);
 extern int iptables_restore_main(int, char **);
+extern int iptables_counters_main(int, char **);
+extern int ip46tables_dual_restore_main(int, char **);
 
 #endif /* _IPTABLES_MULTI_H */
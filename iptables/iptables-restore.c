@@ -21,6 +21,8 @@
 #include "ip6tables-multi.h"
 
 static int counters, verbose, noflush, wait;
+static int check_batch, append_missing;
+static bool dual_stack;
 
 static struct timeval wait_interval = {
 	.tv_sec	= 1,
@@ -28,7 +30,11 @@ static struct timeval wait_interval = {
 
 /* Keeping track of external matches and targets.  */
 static const struct option options[] = {
+	{.name = "append-missing", .has_arg = 0, .val = 'A'},
+	{.name = "binary",        .has_arg = 0, .val = 'b'},
 	{.name = "counters",      .has_arg = 0, .val = 'c'},
+	{.name = "check-batch",   .has_arg = 0, .val = 'C'},
+	{.name = "diff",          .has_arg = 0, .val = 'd'},
 	{.name = "verbose",       .has_arg = 0, .val = 'v'},
 	{.name = "version",       .has_arg = 0, .val = 'V'},
 	{.name = "test",          .has_arg = 0, .val = 't'},
@@ -38,13 +44,21 @@ static const struct option options[] = {
 	{.name = "table",         .has_arg = 1, .val = 'T'},
 	{.name = "wait",          .has_arg = 2, .val = 'w'},
 	{.name = "wait-interval", .has_arg = 2, .val = 'W'},
+	{.name = "parse-cache",   .has_arg = 0, .val = 'P'},
+	{.name = "partition",     .has_arg = 1, .val = 'p'},
+	{.name = "profile",       .has_arg = 2, .val = 'Q'},
 	{NULL},
 };
 
 static void print_usage(const char *name, const char *version)
 {
-	fprintf(stderr, "Usage: %s [-c] [-v] [-V] [-t] [-h] [-n] [-w secs] [-W usecs] [-T table] [-M command]\n"
+	fprintf(stderr, "Usage: %s [-A] [-b] [-c] [-C] [-d] [-v] [-V] [-t] [-h] [-n] [-w secs] [-W usecs] [-T table] [-M command] [-P]\n"
+			"	   [-p N[,src|dst|dport...]]\n"
+			"	   [ --append-missing ]\n"
+			"	   [ --binary ]\n"
 			"	   [ --counters ]\n"
+			"	   [ --check-batch ]\n"
+			"	   [ --diff ]\n"
 			"	   [ --verbose ]\n"
 			"	   [ --version]\n"
 			"	   [ --test ]\n"
@@ -53,7 +67,10 @@ static void print_usage(const char *name, const char *version)
 			"	   [ --wait=<seconds>\n"
 			"	   [ --wait-interval=<usecs>\n"
 			"	   [ --table=<TABLE> ]\n"
-			"	   [ --modprobe=<command> ]\n", name);
+			"	   [ --modprobe=<command> ]\n"
+			"	   [ --parse-cache ]\n"
+			"	   [ --partition=N[,src|dst|dport...] ]\n"
+			"	   [ --profile[=<file>] ]\n", name);
 }
 
 struct iptables_restore_cb {
@@ -69,6 +86,103 @@ struct iptables_restore_cb {
 			  struct xtc_handle **handle, bool restore);
 };
 
+extern struct iptables_restore_cb ipt_restore_cb, ip6t_restore_cb;
+
+/* A table of dual-stack input, parsed but not committed yet */
+struct restore_pending {
+	struct iptables_restore_cb	*cb;
+	struct xtc_handle		*handle;
+	char				table[XT_TABLE_MAXNAMELEN + 1];
+};
+
+static struct restore_pending pending[2 * XT_LOCK_TABLES_MAX];
+static int npending;
+
+/*
+ * Section lines "@ipv4" and "@ipv6" of dual-stack input switch the family
+ * of the tables following them.
+ */
+static struct iptables_restore_cb *restore_family(const char *tag)
+{
+#if defined ENABLE_IPV4 && defined ENABLE_IPV6
+	if (tag && strcmp(tag, "ipv4") == 0) {
+		xtables_set_nfproto(NFPROTO_IPV4);
+		xtables_set_params(&iptables_globals);
+		return &ipt_restore_cb;
+	}
+	if (tag && strcmp(tag, "ipv6") == 0) {
+		xtables_set_nfproto(NFPROTO_IPV6);
+		xtables_set_params(&ip6tables_globals);
+		return &ip6t_restore_cb;
+	}
+#endif
+	return NULL;
+}
+
+/*
+ * Commit the tables of dual-stack input collected so far, back to back.
+ * Returns false if a commit failed, the tables after it are dropped then.
+ */
+static bool restore_commit_pending(void)
+{
+	bool ok = true;
+	int i;
+
+	for (i = 0; i < npending; i++) {
+		struct restore_pending *p = &pending[i];
+
+		if (ok && !p->cb->ops->commit(p->handle)) {
+			fprintf(stderr, "%s: can't commit table `%s': %s\n",
+				xt_params->program_name, p->table,
+				p->cb->ops->strerror(errno));
+			ok = false;
+		}
+		p->cb->ops->free(p->handle);
+	}
+	npending = 0;
+	return ok;
+}
+
+/*
+ * Commits of dual-stack tables wait until the whole input parsed, so a
+ * table must not come twice: its second part would have to see the first
+ * one committed. Returns true if @table of @cb was seen before.
+ */
+static bool restore_table_repeated(struct iptables_restore_cb *cb,
+				   const char *table)
+{
+	static struct {
+		struct iptables_restore_cb	*cb;
+		char				table[XT_TABLE_MAXNAMELEN + 1];
+	} seen[ARRAY_SIZE(pending)];
+	static int nseen;
+	int i;
+
+	for (i = 0; i < nseen; i++)
+		if (seen[i].cb == cb && strcmp(seen[i].table, table) == 0)
+			return true;
+
+	if (nseen == (int)ARRAY_SIZE(seen))
+		xtables_error(PARAMETER_PROBLEM,
+			      "%s: line %u too many tables\n",
+			      xt_params->program_name, line);
+
+	seen[nseen].cb = cb;
+	snprintf(seen[nseen].table, sizeof(seen[nseen].table), "%s", table);
+	nseen++;
+	return false;
+}
+
+static void restore_defer_commit(struct iptables_restore_cb *cb,
+				 struct xtc_handle *handle, const char *table)
+{
+	struct restore_pending *p = &pending[npending++];
+
+	p->cb = cb;
+	p->handle = handle;
+	snprintf(p->table, sizeof(p->table), "%s", table);
+}
+
 static struct xtc_handle *
 create_handle(struct iptables_restore_cb *cb, const char *tablename)
 {
@@ -90,28 +204,224 @@ create_handle(struct iptables_restore_cb *cb, const char *tablename)
 	return handle;
 }
 
+/*
+ * In --diff mode, leave a policy already in place alone and carry its
+ * counters over if only the verdict changes, unless --counters gave new
+ * ones.  Returns whether the policy still needs to be set.
+ */
+static bool diff_policy(struct iptables_restore_cb *cb, const char *chain,
+			const char *policy, struct xt_counters *count,
+			struct xtc_handle *handle)
+{
+	struct xt_counters old;
+	const char *cur;
+
+	if (counters)
+		return true;
+
+	cur = cb->ops->get_policy(chain, &old, handle);
+	if (!cur)
+		return true;
+	if (strcmp(cur, policy) == 0)
+		return false;
+
+	*count = old;
+	return true;
+}
+
+/*
+ * Collect the distinct tables named in the input, so all their locks can be
+ * taken at once. Returns -1 if the input can not be rewound or names too
+ * many tables.
+ */
+static int restore_scan_tables(FILE *in, const char *tablename,
+			       char tables[][XT_TABLE_MAXNAMELEN + 1])
+{
+	struct xs_reader rd;
+	char *buffer, *table;
+	int i, num = 0;
+	long pos;
+
+	pos = ftell(in);
+	if (pos < 0)
+		return -1;
+
+	/* the parser's reader, so that long lines are not split up */
+	xs_reader_open(&rd, in);
+	while (num >= 0 && (buffer = xs_reader_getline(&rd))) {
+		if (buffer[0] != '*')
+			continue;
+		table = strtok(buffer + 1, " \t\n");
+		if (!table || (tablename && strcmp(tablename, table) != 0))
+			continue;
+
+		for (i = 0; i < num; i++)
+			if (strncmp(tables[i], table, XT_TABLE_MAXNAMELEN) == 0)
+				break;
+		if (i < num)
+			continue;
+
+		if (num == XT_LOCK_TABLES_MAX) {
+			num = -1;
+			break;
+		}
+		strncpy(tables[num], table, XT_TABLE_MAXNAMELEN);
+		tables[num][XT_TABLE_MAXNAMELEN] = '\0';
+		num++;
+	}
+	xs_reader_close(&rd);
+
+	if (fseek(in, pos, SEEK_SET) < 0) {
+		fprintf(stderr, "Can't rewind input: %s\n", strerror(errno));
+		exit(1);
+	}
+	return num;
+}
+
+/* Each revision used in a snapshot is asked about once only. */
+static int snapshot_compatible(const char *name, uint8_t revision, int opt)
+{
+	static struct {
+		char	name[XT_EXTENSION_MAXNAMELEN];
+		uint8_t	revision;
+		int	opt;
+		int	ret;
+	} seen[64];
+	static unsigned int num;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < num; i++)
+		if (seen[i].revision == revision && seen[i].opt == opt &&
+		    strcmp(seen[i].name, name) == 0)
+			return seen[i].ret;
+
+	ret = xtables_compatible_revision(name, revision, opt);
+	if (num < ARRAY_SIZE(seen)) {
+		strcpy(seen[num].name, name);
+		seen[num].revision = revision;
+		seen[num].opt = opt;
+		seen[num++].ret = ret;
+	}
+	return ret;
+}
+
+/*
+ * Hand the tables of a snapshot to the kernel as they are. Returns false
+ * if any of them does not fit this kernel, the caller restores the text
+ * form then.
+ */
+static bool restore_snapshot(struct iptables_restore_cb *cb,
+			     struct xs_snapshot *snap, const char *tablename)
+{
+	const char *locknames[XT_LOCK_TABLES_MAX];
+	size_t start = snap->pos, len;
+	const char *table;
+	const void *blob;
+	int lock, ntables = 0;
+	bool ok = true;
+
+	while (xs_snapshot_next(snap, &table, &len)) {
+		if (tablename && strcmp(tablename, table) != 0)
+			continue;
+		if (ntables == XT_LOCK_TABLES_MAX)
+			return false;
+		locknames[ntables++] = table;
+	}
+	snap->pos = start;
+	if (ntables == 0)
+		return false;
+
+	lock = xtables_lock_tables_or_exit(wait, &wait_interval,
+					   locknames, ntables);
+
+	while (ok && (blob = xs_snapshot_next(snap, &table, &len))) {
+		if (tablename && strcmp(tablename, table) != 0)
+			continue;
+
+		ok = cb->ops->replace_snapshot(blob, len, counters,
+					       snapshot_compatible);
+		if (!ok && errno == ENOENT) {
+			/* try to insmod the module if the table is missing */
+			xtables_load_ko(xtables_modprobe_program, false);
+			ok = cb->ops->replace_snapshot(blob, len, counters,
+						       snapshot_compatible);
+		}
+		if (!ok && verbose)
+			fprintf(stderr, "%s: table `%s' not restored from "
+				"snapshot: %s\n", xt_params->program_name,
+				table, cb->ops->strerror(errno));
+	}
+
+	xtables_unlock(lock);
+	return ok;
+}
+
+/*
+ * Answer a rule line of --check-batch input with "present" or "absent",
+ * and append the rule if it is absent and --append-missing was given.
+ * Returns 2 if the rule was appended, or 0 on failure.
+ */
+static int check_batch_rule(struct iptables_restore_cb *cb,
+			    struct xs_argv *args, struct xs_argv *check,
+			    struct xtc_handle **handle)
+{
+	int ret;
+
+	xs_argv_check_batch(args, check, line);
+	ret = cb->do_command(check->argc, check->argv, &check->argv[2],
+			     handle, true);
+	if (!ret && errno != ENOENT)
+		return 0;
+
+	printf("%u %s\n", line, ret ? "present" : "absent");
+	if (ret || !append_missing)
+		return 1;
+
+	return cb->do_command(args->argc, args->argv, &args->argv[2],
+			      handle, true) ? 2 : 0;
+}
+
 static int
 ip46tables_restore_main(struct iptables_restore_cb *cb, int argc, char *argv[])
 {
 	struct xtc_handle *handle = NULL;
-	char buffer[10240];
+	struct xs_snapshot snap = {};
+	struct xs_partition partition = {};
+	struct xs_reader rd;
+	struct xs_argv args = {}, check = {};
+	bool binary = false, appended = false;
+	char *buffer;
 	int c, lock;
 	char curtable[XT_TABLE_MAXNAMELEN + 1] = {};
 	FILE *in;
 	int in_table = 0, testing = 0;
 	const char *tablename = NULL;
+	char tables[XT_LOCK_TABLES_MAX][XT_TABLE_MAXNAMELEN + 1];
+	const char *locknames[XT_LOCK_TABLES_MAX];
+	int i, ntables;
+	bool lock_all = false;
 
 	line = 0;
 	lock = XT_LOCK_NOT_ACQUIRED;
 
-	while ((c = getopt_long(argc, argv, "bcvVthnwWM:T:", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "AbcCdvVthnwWM:T:Pp:", options, NULL)) != -1) {
 		switch (c) {
+			case 'A':
+				append_missing = 1;
+				/* fall through */
+			case 'C':
+				check_batch = 1;
+				break;
 			case 'b':
-				fprintf(stderr, "-b/--binary option is not implemented\n");
+				binary = true;
 				break;
 			case 'c':
 				counters = 1;
 				break;
+			case 'd':
+				xs_diff_enabled = true;
+				break;
 			case 'v':
 				verbose = 1;
 				break;
@@ -142,6 +452,15 @@ ip46tables_restore_main(struct iptables_restore_cb *cb, int argc, char *argv[])
 			case 'T':
 				tablename = optarg;
 				break;
+			case 'P':
+				xs_memo_enabled = true;
+				break;
+			case 'p':
+				xs_partition_parse(&partition, optarg);
+				break;
+			case 'Q':
+				/* taken by xs_profile_init() already */
+				break;
 			default:
 				fprintf(stderr,
 					"Try `%s -h' for more information.\n",
@@ -169,8 +488,85 @@ ip46tables_restore_main(struct iptables_restore_cb *cb, int argc, char *argv[])
 		exit(1);
 	}
 
+	if (xs_diff_enabled && noflush) {
+		fprintf(stderr, "Options --diff and --noflush are exclusive\n");
+		exit(1);
+	}
+
+	if (check_batch) {
+		if (xs_diff_enabled) {
+			fprintf(stderr, "Options --diff and --check-batch are "
+				"exclusive\n");
+			exit(1);
+		}
+		noflush = 1;
+	}
+
+	if (binary && dual_stack) {
+		fprintf(stderr, "%s: snapshots hold one family only\n",
+			xt_params->program_name);
+		exit(1);
+	}
+
+	if (partition.leaf) {
+		if (binary || noflush || dual_stack) {
+			fprintf(stderr, "%s: --partition wants a full ruleset "
+				"of one family in text form\n",
+				xt_params->program_name);
+			exit(1);
+		}
+		in = xs_partition_input(in, &partition);
+	}
+
+	if (binary) {
+		if (xs_snapshot_read(&snap, in, afinfo->family, "legacy") < 0) {
+			fprintf(stderr, "%s: input is not a snapshot\n",
+				xt_params->program_name);
+			exit(1);
+		}
+		fclose(in);
+
+		if (!testing && !noflush && !xs_diff_enabled) {
+			if (restore_snapshot(cb, &snap, tablename)) {
+				xs_snapshot_free(&snap);
+				return 0;
+			}
+			if (verbose)
+				fprintf(stderr, "%s: restoring text form of "
+					"snapshot\n", xt_params->program_name);
+		}
+
+		in = xs_snapshot_text(&snap);
+		if (!in) {
+			fprintf(stderr, "Can't read snapshot: %s\n",
+				strerror(errno));
+			exit(1);
+		}
+	}
+
+	if (!dual_stack)
+		xs_restore_prefetch_hosts(in, afinfo->family);
+
+	/* Take all table locks up front if the input can be scanned twice,
+	 * otherwise lock each table while restoring it. Table locks are per
+	 * family, dual-stack input takes the lock of all tables instead.
+	 */
+	ntables = restore_scan_tables(in, tablename, tables);
+	if (dual_stack) {
+		lock = xtables_lock_tables_or_exit(wait, &wait_interval,
+						   NULL, 0);
+		lock_all = true;
+	} else if (ntables > 0) {
+		for (i = 0; i < ntables; i++)
+			locknames[i] = tables[i];
+		lock = xtables_lock_tables_or_exit(wait, &wait_interval,
+						   locknames, ntables);
+		lock_all = true;
+	}
+
 	/* Grab standard input. */
-	while (fgets(buffer, sizeof(buffer), in)) {
+	xs_reader_open(&rd, in);
+	while ((buffer = xs_reader_getline(&rd))) {
 		int ret = 0;
 
 		line++;
@@ -181,7 +577,19 @@ ip46tables_restore_main(struct iptables_restore_cb *cb, int argc, char *argv[])
 				fputs(buffer, stdout);
 			continue;
 		} else if ((strcmp(buffer, "COMMIT\n") == 0) && (in_table)) {
-			if (!testing) {
+			xs_profile_end(XS_PROF_PARSE);
+			if (xs_diff_enabled && !cb->ops->diff_end(handle))
+				xtables_error(OTHER_PROBLEM,
+					"Can't update table `%s': %s\n",
+					curtable, cb->ops->strerror(errno));
+
+			if (!testing && (!check_batch || appended) &&
+			    dual_stack) {
+				DEBUGP("Deferring commit\n");
+				restore_defer_commit(cb, handle, curtable);
+				handle = NULL;
+				ret = 1;
+			} else if (!testing && (!check_batch || appended)) {
 				DEBUGP("Calling commit\n");
 				ret = cb->ops->commit(handle);
 				cb->ops->free(handle);
@@ -192,16 +600,28 @@ ip46tables_restore_main(struct iptables_restore_cb *cb, int argc, char *argv[])
 			}
 
 			/* Done with the current table, release the lock. */
-			if (lock >= 0) {
+			if (lock >= 0 && !lock_all) {
 				xtables_unlock(lock);
 				lock = XT_LOCK_NOT_ACQUIRED;
 			}
 
 			in_table = 0;
-		} else if ((buffer[0] == '*') && (!in_table)) {
-			/* Acquire a lock before we create a new table handle */
-			lock = xtables_lock_or_exit(wait, &wait_interval);
+		} else if (buffer[0] == '@' && !in_table && dual_stack) {
+			struct iptables_restore_cb *next;
 
+			next = restore_family(strtok(buffer + 1, " \t\n"));
+			if (!next)
+				xtables_error(PARAMETER_PROBLEM,
+					"%s: line %u unknown family\n",
+					xt_params->program_name, line);
+
+			if (handle) {
+				cb->ops->free(handle);
+				handle = NULL;
+			}
+			cb = next;
+			ret = 1;
+		} else if ((buffer[0] == '*') && (!in_table)) {
 			/* New table */
 			char *table;
 
@@ -216,18 +636,25 @@ ip46tables_restore_main(struct iptables_restore_cb *cb, int argc, char *argv[])
 			strncpy(curtable, table, XT_TABLE_MAXNAMELEN);
 			curtable[XT_TABLE_MAXNAMELEN] = '\0';
 
-			if (tablename && strcmp(tablename, table) != 0) {
-				if (lock >= 0) {
-					xtables_unlock(lock);
-					lock = XT_LOCK_NOT_ACQUIRED;
-				}
+			if (tablename && strcmp(tablename, table) != 0)
 				continue;
-			}
+
+			/* Acquire a lock before we create a new table handle */
+			if (!lock_all)
+				lock = xtables_lock_or_exit(wait, &wait_interval,
+							    table);
+
 			if (handle)
 				cb->ops->free(handle);
+			handle = NULL;
+
+			if (dual_stack && restore_table_repeated(cb, table))
+				xtables_error(PARAMETER_PROBLEM,
+					"%s: line %u table `%s' repeated\n",
+					xt_params->program_name, line, table);
 
 			handle = create_handle(cb, table);
-			if (noflush == 0) {
+			if (noflush == 0 && !xs_diff_enabled) {
 				DEBUGP("Cleaning all chains of table '%s'\n",
 					table);
 				cb->for_each_chain(cb->flush_entries, verbose, 1,
@@ -241,6 +668,27 @@ ip46tables_restore_main(struct iptables_restore_cb *cb, int argc, char *argv[])
 
 			ret = 1;
 			in_table = 1;
+			appended = false;
+			xs_profile_begin(XS_PROF_PARSE);
+
+		} else if (buffer[0] == ':' && in_table && check_batch) {
+			/* Only create chains that rules to append need. */
+			char *chain = strtok(buffer+1, " \t\n");
+
+			if (!chain)
+				xtables_error(PARAMETER_PROBLEM,
+					   "%s: line %u chain name invalid\n",
+					   xt_params->program_name, line);
+
+			if (append_missing && !cb->ops->is_chain(chain, handle)) {
+				if (!cb->ops->create_chain(chain, handle))
+					xtables_error(PARAMETER_PROBLEM,
+						   "error creating chain "
+						   "'%s':%s\n", chain,
+						   strerror(errno));
+				appended = true;
+			}
+			ret = 1;
 
 		} else if ((buffer[0] == ':') && (in_table)) {
 			/* New chain. */
@@ -261,7 +709,14 @@ ip46tables_restore_main(struct iptables_restore_cb *cb, int argc, char *argv[])
 					   "(%u chars max)",
 					   chain, XT_EXTENSION_MAXNAMELEN - 1);
 
-			if (cb->ops->builtin(chain, handle) <= 0) {
+			if (xs_diff_enabled) {
+				DEBUGP("Keeping chain '%s'\n", chain);
+				if (!cb->ops->diff_chain(chain, handle))
+					xtables_error(PARAMETER_PROBLEM,
+						   "error creating chain "
+						   "'%s':%s\n", chain,
+						   strerror(errno));
+			} else if (cb->ops->builtin(chain, handle) <= 0) {
 				if (noflush && cb->ops->is_chain(chain, handle)) {
 					DEBUGP("Flushing existing user defined chain '%s'\n", chain);
 					if (!cb->ops->flush_entries(chain, handle))
@@ -304,8 +759,11 @@ ip46tables_restore_main(struct iptables_restore_cb *cb, int argc, char *argv[])
 				DEBUGP("Setting policy of chain %s to %s\n",
 					chain, policy);
 
-				if (!cb->ops->set_policy(chain, policy, &count,
-						     handle))
+				if ((!xs_diff_enabled ||
+				     diff_policy(cb, chain, policy, &count,
+						 handle)) &&
+				    !cb->ops->set_policy(chain, policy, &count,
+							 handle))
 					xtables_error(OTHER_PROBLEM,
 						"Can't set policy `%s'"
 						" on `%s' line %u: %s\n",
@@ -349,28 +807,36 @@ ip46tables_restore_main(struct iptables_restore_cb *cb, int argc, char *argv[])
 				parsestart = buffer;
 			}
 
-			add_argv(argv[0], 0);
-			add_argv("-t", 0);
-			add_argv(curtable, 0);
+			xs_argv_add(&args, argv[0]);
+			xs_argv_add(&args, "-t");
+			xs_argv_add(&args, curtable);
 
 			if (counters && pcnt && bcnt) {
-				add_argv("--set-counters", 0);
-				add_argv((char *) pcnt, 0);
-				add_argv((char *) bcnt, 0);
+				xs_argv_add(&args, "--set-counters");
+				xs_argv_add(&args, pcnt);
+				xs_argv_add(&args, bcnt);
 			}
 
-			add_param_to_argv(parsestart, line);
+			xs_argv_split(&args, parsestart, line);
 
 			DEBUGP("calling do_command(%u, argv, &%s, handle):\n",
-				newargc, curtable);
+				args.argc, curtable);
 
-			for (a = 0; a < newargc; a++)
-				DEBUGP("argv[%u]: %s\n", a, newargv[a]);
+			for (a = 0; a < args.argc; a++)
+				DEBUGP("argv[%u]: %s\n", a, args.argv[a]);
 
-			ret = cb->do_command(newargc, newargv,
-					 &newargv[2], &handle, true);
+			if (check_batch) {
+				ret = check_batch_rule(cb, &args, &check,
+						       &handle);
+				if (ret == 2)
+					appended = true;
+				xs_argv_reset(&check);
+			} else {
+				ret = cb->do_command(args.argc, args.argv,
+						 &args.argv[2], &handle, true);
+			}
 
-			free_argv();
+			xs_argv_reset(&args);
 			fflush(stdout);
 		}
 		if (tablename && strcmp(tablename, curtable) != 0)
@@ -387,7 +853,17 @@ ip46tables_restore_main(struct iptables_restore_cb *cb, int argc, char *argv[])
 		exit(1);
 	}
 
+	if (dual_stack && !restore_commit_pending())
+		exit(1);
+
+	if (lock_all)
+		xtables_unlock(lock);
+
+	xs_argv_free(&args);
+	xs_argv_free(&check);
+	xs_reader_close(&rd);
 	fclose(in);
+	xs_snapshot_free(&snap);
 	return 0;
 }
 
@@ -453,3 +929,30 @@ ip6tables_restore_main(int argc, char *argv[])
 	return ip46tables_restore_main(&ip6t_restore_cb, argc, argv);
 }
 #endif
+
+#if defined ENABLE_IPV4 && defined ENABLE_IPV6
+int
+ip46tables_dual_restore_main(int argc, char *argv[])
+{
+	int c;
+
+	iptables_globals.program_name = "ip46tables-restore";
+	ip6tables_globals.program_name = "ip46tables-restore";
+	c = xtables_init_all(&ip6tables_globals, NFPROTO_IPV6);
+	if (c < 0) {
+		fprintf(stderr, "%s/%s Failed to initialize xtables\n",
+				iptables_globals.program_name,
+				iptables_globals.program_version);
+		exit(1);
+	}
+#if defined(ALL_INCLUSIVE) || defined(NO_SHARED_LIBS)
+	init_extensions();
+	init_extensions4();
+	init_extensions6();
+#endif
+
+	/* input without a section line is IPv4 */
+	dual_stack = true;
+	return ip46tables_restore_main(restore_family("ipv4"), argc, argv);
+}
+#endif
@@ -24,14 +24,17 @@
 #include "xshared.h"
 
 static int show_counters;
+static struct xs_snapshot *snapshot;
 
 static const struct option options[] = {
+	{.name = "binary",   .has_arg = false, .val = 'b'},
 	{.name = "counters", .has_arg = false, .val = 'c'},
 	{.name = "dump",     .has_arg = false, .val = 'd'},
 	{.name = "table",    .has_arg = true,  .val = 't'},
 	{.name = "modprobe", .has_arg = true,  .val = 'M'},
 	{.name = "file",     .has_arg = true,  .val = 'f'},
 	{.name = "version",  .has_arg = false, .val = 'V'},
+	{.name = "profile",  .has_arg = 2,     .val = 'Q'},
 	{NULL},
 };
 
@@ -100,16 +103,17 @@ static int do_output(struct iptables_save_cb *cb, const char *tablename)
 	     chain;
 	     chain = cb->ops->next_chain(h)) {
 
-		printf(":%s ", chain);
+		fputc(':', stdout);
+		fputs(chain, stdout);
 		if (cb->ops->builtin(chain, h)) {
 			struct xt_counters count;
 
-			printf("%s ", cb->ops->get_policy(chain, &count, h));
-			printf("[%llu:%llu]\n",
-			       (unsigned long long)count.pcnt,
-			       (unsigned long long)count.bcnt);
+			fputc(' ', stdout);
+			fputs(cb->ops->get_policy(chain, &count, h), stdout);
+			print_counter_pair(" [", count.pcnt, ':',
+					   count.bcnt, "]\n");
 		} else {
-			printf("- [0:0]\n");
+			fputs(" - [0:0]\n", stdout);
 		}
 	}
 
@@ -122,6 +126,19 @@ static int do_output(struct iptables_save_cb *cb, const char *tablename)
 	now = time(NULL);
 	printf("COMMIT\n");
 	printf("# Completed on %s", ctime(&now));
+
+	if (snapshot) {
+		void *blob;
+		size_t len;
+
+		blob = cb->ops->snapshot(h, show_counters, &len);
+		if (!blob)
+			xtables_error(OTHER_PROBLEM, "Cannot snapshot table "
+				      "`%s': %s\n", tablename,
+				      cb->ops->strerror(errno));
+		xs_snapshot_add(snapshot, tablename, blob, len);
+		free(blob);
+	}
 	cb->ops->free(h);
 
 	return 1;
@@ -135,13 +152,15 @@ static int
 do_iptables_save(struct iptables_save_cb *cb, int argc, char *argv[])
 {
 	const char *tablename = NULL;
+	struct xs_snapshot snap;
+	bool binary = false;
 	FILE *file = NULL;
 	int ret, c;
 
 	while ((c = getopt_long(argc, argv, "bcdt:M:f:V", options, NULL)) != -1) {
 		switch (c) {
 		case 'b':
-			fprintf(stderr, "-b/--binary option is not implemented\n");
+			binary = true;
 			break;
 		case 'c':
 			show_counters = 1;
@@ -172,6 +191,9 @@ do_iptables_save(struct iptables_save_cb *cb, int argc, char *argv[])
 		case 'd':
 			do_output(cb, tablename);
 			exit(0);
+		case 'Q':
+			/* taken by xs_profile_init() already */
+			break;
 		case 'V':
 			printf("%s v%s (legacy)\n",
 			       xt_params->program_name,
@@ -190,7 +212,22 @@ do_iptables_save(struct iptables_save_cb *cb, int argc, char *argv[])
 		exit(1);
 	}
 
-	return !do_output(cb, tablename);
+	xtables_output_init(stdout);
+	if (!binary)
+		return !do_output(cb, tablename);
+
+	/* The text goes along, restore falls back to it on other systems */
+	if (xs_snapshot_capture(&snap) < 0)
+		xtables_error(OTHER_PROBLEM, "Cannot capture output: %s\n",
+			      strerror(errno));
+	snap.counters = show_counters;
+	snapshot = &snap;
+	ret = do_output(cb, tablename);
+	snapshot = NULL;
+	if (xs_snapshot_write(&snap, afinfo->family, "legacy") < 0)
+		xtables_error(OTHER_PROBLEM, "Cannot write snapshot: %s\n",
+			      strerror(errno));
+	return !ret;
 }
 
 #ifdef ENABLE_IPV4
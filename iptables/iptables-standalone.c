@@ -37,6 +37,7 @@
 #include <string.h>
 #include <iptables.h>
 #include "iptables-multi.h"
+#include "xshared.h"
 
 int
 iptables_main(int argc, char *argv[])
@@ -58,7 +59,10 @@ iptables_main(int argc, char *argv[])
 	init_extensions4();
 #endif
 
+	xtables_output_init(stdout);
+	xs_profile_begin(XS_PROF_PARSE);
 	ret = do_command4(argc, argv, &table, &handle, false);
+	xs_profile_end(XS_PROF_PARSE);
 	if (ret) {
 		ret = iptc_commit(handle);
 		iptc_free(handle);
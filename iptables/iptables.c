@@ -103,6 +103,7 @@ static struct option original_opts[] = {
 	{.name = "verbose",       .has_arg = 0, .val = 'v'},
 	{.name = "wait",          .has_arg = 2, .val = 'w'},
 	{.name = "wait-interval", .has_arg = 2, .val = 'W'},
+	{.name = "profile",       .has_arg = 2, .val = 'Q'},
 	{.name = "exact",         .has_arg = 0, .val = 'x'},
 	{.name = "fragments",     .has_arg = 0, .val = 'f'},
 	{.name = "version",       .has_arg = 0, .val = 'V'},
@@ -259,6 +260,7 @@ exit_printhelp(const struct xtables_rule_match *matches)
 "  --wait	-w [seconds]	maximum wait to acquire xtables lock before give up\n"
 "  --wait-interval -W [usecs]	wait time to try to acquire xtables lock\n"
 "				default is 1 second\n"
+"  --profile[=file]		report time and memory per phase\n"
 "  --line-numbers		print line numbers when listing\n"
 "  --exact	-x		expand numbers (display exact values)\n"
 "[!] --fragment	-f		match second or further fragments only\n"
@@ -773,6 +775,36 @@ check_entry(const xt_chainlabel chain, struct ipt_entry *fw,
 	return ret;
 }
 
+static int
+diff_entry(const xt_chainlabel chain, struct ipt_entry *fw,
+	   unsigned int nsaddrs, const struct in_addr saddrs[],
+	   const struct in_addr smasks[], unsigned int ndaddrs,
+	   const struct in_addr daddrs[], const struct in_addr dmasks[],
+	   int verbose, struct xtc_handle *handle,
+	   struct xtables_rule_match *matches,
+	   const struct xtables_target *target)
+{
+	unsigned int i, j;
+	int ret = 1;
+	unsigned char *mask;
+
+	mask = make_delete_mask(matches, target);
+	for (i = 0; i < nsaddrs; i++) {
+		fw->ip.src.s_addr = saddrs[i].s_addr;
+		fw->ip.smsk.s_addr = smasks[i].s_addr;
+		for (j = 0; j < ndaddrs; j++) {
+			fw->ip.dst.s_addr = daddrs[j].s_addr;
+			fw->ip.dmsk.s_addr = dmasks[j].s_addr;
+			if (verbose)
+				print_firewall_line(fw, handle);
+			ret &= iptc_diff_entry(chain, fw, mask, handle);
+		}
+	}
+
+	free(mask);
+	return ret;
+}
+
 int
 for_each_chain4(int (*fn)(const xt_chainlabel, int, struct xtc_handle *),
 	       int verbose, int builtinstoo, struct xtc_handle *handle)
@@ -907,9 +939,11 @@ static void print_proto(uint16_t proto, int invert)
 		unsigned int i;
 		const char *invertstr = invert ? " !" : "";
 
-		const struct protoent *pent = getprotobynumber(proto);
-		if (pent) {
-			printf("%s -p %s", invertstr, pent->p_name);
+		const char *pname = xtables_protocol_name(proto);
+		if (pname) {
+			fputs(invertstr, stdout);
+			fputs(" -p ", stdout);
+			fputs(pname, stdout);
 			return;
 		}
 
@@ -924,38 +958,38 @@ static void print_proto(uint16_t proto, int invert)
 	}
 }
 
-#define IP_PARTS_NATIVE(n)			\
-(unsigned int)((n)>>24)&0xFF,			\
-(unsigned int)((n)>>16)&0xFF,			\
-(unsigned int)((n)>>8)&0xFF,			\
-(unsigned int)((n)&0xFF)
-
-#define IP_PARTS(n) IP_PARTS_NATIVE(ntohl(n))
-
 /* This assumes that mask is contiguous, and byte-bounded. */
 static void
 print_iface(char letter, const char *iface, const unsigned char *mask,
 	    int invert)
 {
+	char buf[IFNAMSIZ + 8], *p = buf;
 	unsigned int i;
 
 	if (mask[0] == 0)
 		return;
 
-	printf("%s -%c ", invert ? " !" : "", letter);
+	if (invert)
+		p = stpcpy(p, " !");
+	*p++ = ' ';
+	*p++ = '-';
+	*p++ = letter;
+	*p++ = ' ';
 
 	for (i = 0; i < IFNAMSIZ; i++) {
 		if (mask[i] != 0) {
 			if (iface[i] != '\0')
-				printf("%c", iface[i]);
+				*p++ = iface[i];
 		} else {
 			/* we can access iface[i-1] here, because
 			 * a few lines above we make sure that mask[0] != 0 */
 			if (iface[i-1] != '\0')
-				printf("+");
+				*p++ = '+';
 			break;
 		}
 	}
+	*p = '\0';
+	fputs(buf, stdout);
 }
 
 static int print_match_save(const struct xt_entry_match *e,
@@ -971,7 +1005,8 @@ static int print_match_save(const struct xt_entry_match *e,
 						       match, revision);
 		if (!mt2)
 			mt2 = match;
-		printf(" -m %s", mt2->alias ? mt2->alias(e) : name);
+		fputs(" -m ", stdout);
+		fputs(mt2->alias ? mt2->alias(e) : name, stdout);
 
 		/* some matches don't provide a save function */
 		if (mt && mt->save)
@@ -993,30 +1028,27 @@ static int print_match_save(const struct xt_entry_match *e,
 static void print_ip(const char *prefix, uint32_t ip,
 		     uint32_t mask, int invert)
 {
-	uint32_t bits, hmask = ntohl(mask);
-	int i;
+	const struct in_addr addr = { .s_addr = ip }, msk = { .s_addr = mask };
+	char buf[64], *p = buf;
+	int cidr;
 
 	if (!mask && !ip && !invert)
 		return;
 
-	printf("%s %s %u.%u.%u.%u",
-		invert ? " !" : "",
-		prefix,
-		IP_PARTS(ip));
-
-	if (mask == 0xFFFFFFFFU) {
-		printf("/32");
-		return;
-	}
-
-	i    = 32;
-	bits = 0xFFFFFFFEU;
-	while (--i >= 0 && hmask != bits)
-		bits <<= 1;
-	if (i >= 0)
-		printf("/%u", i);
+	if (invert)
+		p = stpcpy(p, " !");
+	*p++ = ' ';
+	p = stpcpy(p, prefix);
+	*p++ = ' ';
+	p = xtables_fmt_ipaddr(p, &addr);
+	*p++ = '/';
+
+	cidr = xtables_ipmask_to_cidr(&msk);
+	if (cidr >= 0)
+		xtables_fmt_u64(p, cidr);
 	else
-		printf("/%u.%u.%u.%u", IP_PARTS(mask));
+		xtables_fmt_ipaddr(p, &msk);
+	fputs(buf, stdout);
 }
 
 /* We want this to be readable, so only print out necessary fields.
@@ -1030,10 +1062,12 @@ void print_rule4(const struct ipt_entry *e,
 
 	/* print counters for iptables-save */
 	if (counters > 0)
-		printf("[%llu:%llu] ", (unsigned long long)e->counters.pcnt, (unsigned long long)e->counters.bcnt);
+		print_counter_pair("[", e->counters.pcnt, ':',
+				   e->counters.bcnt, "] ");
 
 	/* print chain name */
-	printf("-A %s", chain);
+	fputs("-A ", stdout);
+	fputs(chain, stdout);
 
 	/* Print IP part. */
 	print_ip("-s", e->ip.src.s_addr,e->ip.smsk.s_addr,
@@ -1060,7 +1094,8 @@ void print_rule4(const struct ipt_entry *e,
 
 	/* print counters for iptables -R */
 	if (counters < 0)
-		printf(" -c %llu %llu", (unsigned long long)e->counters.pcnt, (unsigned long long)e->counters.bcnt);
+		print_counter_pair(" -c ", e->counters.pcnt, ' ',
+				   e->counters.bcnt, "");
 
 	/* Print target name and targinfo part */
 	target_name = iptc_get_target(e, h);
@@ -1081,7 +1116,8 @@ void print_rule4(const struct ipt_entry *e,
 							target, revision);
 		if (!tg2)
 			tg2 = target;
-		printf(" -j %s", tg2->alias ? tg2->alias(t) : target_name);
+		fputs(" -j ", stdout);
+		fputs(tg2->alias ? tg2->alias(t) : target_name, stdout);
 
 		if (tg && tg->save)
 			tg->save(&e->ip, t);
@@ -1214,7 +1250,6 @@ int do_command4(int argc, char *argv[], char **table,
 	const char *pcnt = NULL, *bcnt = NULL;
 	int ret = 1;
 	struct xtables_match *m;
-	struct xtables_rule_match *matchp;
 	struct xtables_target *t;
 	unsigned long long cnt;
 
@@ -1481,6 +1516,15 @@ int do_command4(int argc, char *argv[], char **table,
 			wait_interval_set = true;
 			break;
 
+		case 'Q':
+			if (restore) {
+				xtables_error(PARAMETER_PROBLEM,
+					      "You cannot use `--profile' from "
+					      "iptables-restore");
+			}
+			/* taken by xs_profile_init() already */
+			break;
+
 		case 'm':
 			command_match(&cs);
 			break;
@@ -1591,10 +1635,7 @@ int do_command4(int argc, char *argv[], char **table,
 			"\nThe \"nat\" table is not intended for filtering, "
 		        "the use of DROP is therefore inhibited.\n\n");
 
-	for (matchp = cs.matches; matchp; matchp = matchp->next)
-		xtables_option_mfcall(matchp->match);
-	if (cs.target != NULL)
-		xtables_option_tfcall(cs.target);
+	xs_option_fcheck(&cs);
 
 	/* Fix me: must put inverse options checking here --MN */
 
@@ -1635,7 +1676,7 @@ int do_command4(int argc, char *argv[], char **table,
 
 	/* Attempt to acquire the xtables lock */
 	if (!restore)
-		xtables_lock_or_exit(wait, &wait_interval);
+		xtables_lock_or_exit(wait, &wait_interval, *table);
 
 	/* only allocate handle if we weren't called with a handle */
 	if (!*handle)
@@ -1727,11 +1768,18 @@ int do_command4(int argc, char *argv[], char **table,
 
 	switch (command) {
 	case CMD_APPEND:
-		ret = append_entry(chain, e,
-				   nsaddrs, saddrs, smasks,
-				   ndaddrs, daddrs, dmasks,
-				   cs.options&OPT_VERBOSE,
-				   *handle);
+		if (xs_diff_enabled)
+			ret = diff_entry(chain, e,
+					 nsaddrs, saddrs, smasks,
+					 ndaddrs, daddrs, dmasks,
+					 cs.options&OPT_VERBOSE,
+					 *handle, cs.matches, cs.target);
+		else
+			ret = append_entry(chain, e,
+					   nsaddrs, saddrs, smasks,
+					   ndaddrs, daddrs, dmasks,
+					   cs.options&OPT_VERBOSE,
+					   *handle);
 		break;
 	case CMD_DELETE:
 		ret = delete_entry(chain, e,
@@ -0,0 +1,332 @@
+/*
+ * libxtables-nft: change iptables rules through nf_tables from within a
+ * program, see xtables-nft.h.
+ *
+ * Calls run the same parser and nft_handle code as iptables-nft. Where
+ * that code would print an error and exit, the library returns to the
+ * calling function instead, keeping the message for xtnft_strerror().
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include "config.h"
+#include <errno.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iptables.h>
+#include <xtables-nft.h>
+#include "nft.h"
+
+struct xtnft_handle {
+	struct nft_handle	nft;
+	char			errmsg[256];
+};
+
+struct xtnft_rule {
+	char			*table;
+	char			*chain;
+	int			argc;
+	size_t			len;
+	char			*buf;	/* NUL separated arguments */
+};
+
+enum xtnft_op {
+	XTNFT_PARSE,
+	XTNFT_RUN,
+	XTNFT_REFRESH,
+	XTNFT_COMMIT,
+	XTNFT_ABORT,
+};
+
+static bool xtnft_ready;
+static struct xtnft_handle *xtnft_cur;
+static sigjmp_buf xtnft_jmp;
+
+/* Keep the message and return from xtnft_call() instead of exiting. */
+static void __attribute__((noreturn, format(printf, 2, 3)))
+xtnft_exit_error(enum xtables_exittype status, const char *msg, ...)
+{
+	char *errmsg = xtnft_cur->errmsg;
+	size_t len;
+	va_list args;
+
+	va_start(args, msg);
+	vsnprintf(errmsg, sizeof(xtnft_cur->errmsg), msg, args);
+	va_end(args);
+
+	len = strlen(errmsg);
+	while (len && errmsg[len - 1] == '\n')
+		errmsg[--len] = '\0';
+
+	xtables_free_opts(1);
+	siglongjmp(xtnft_jmp, status + 1);
+}
+
+/* Usage errors print to stderr and exit without an xtables_error(). */
+static void xtnft_exit(int status)
+{
+	if (status && !xtnft_cur->errmsg[0])
+		snprintf(xtnft_cur->errmsg, sizeof(xtnft_cur->errmsg),
+			 "Invalid arguments");
+	siglongjmp(xtnft_jmp, status + 1);
+}
+
+static int xtnft_call(struct xtnft_handle *h, enum xtnft_op op,
+		      int argc, char *argv[])
+{
+	char *table = "filter";
+	int ret;
+
+	xtnft_cur = h;
+	h->errmsg[0] = '\0';
+	xtables_set_nfproto(h->nft.family);
+	xt_params->program_name = h->nft.family == NFPROTO_IPV6 ?
+				  "ip6tables" : "iptables";
+
+	ret = sigsetjmp(xtnft_jmp, 1);
+	if (ret) {
+		/* the command did not get to free what it parsed */
+		do_commandx_abort();
+		return ret == 1;
+	}
+
+	/* don't throw away the changes of a transaction being built */
+	if (op <= XTNFT_REFRESH && h->nft.obj_list_num == 0)
+		nft_cache_refresh(&h->nft);
+
+	switch (op) {
+	case XTNFT_PARSE:
+		ret = do_parsex(&h->nft, argc, argv, &table);
+		break;
+	case XTNFT_RUN:
+		ret = do_commandx(&h->nft, argc, argv, &table, false);
+		break;
+	case XTNFT_REFRESH:
+		ret = 1;
+		break;
+	case XTNFT_COMMIT:
+		ret = h->nft.obj_list_num ? nft_commit(&h->nft) : 1;
+		break;
+	case XTNFT_ABORT:
+		ret = h->nft.obj_list_num ? nft_abort(&h->nft) : 1;
+		break;
+	}
+
+	if (!ret && !h->errmsg[0])
+		snprintf(h->errmsg, sizeof(h->errmsg), "%s",
+			 nft_strerror(errno));
+	return ret;
+}
+
+static int xtnft_nomem(struct xtnft_handle *h)
+{
+	snprintf(h->errmsg, sizeof(h->errmsg), "%s", strerror(ENOMEM));
+	return 0;
+}
+
+struct xtnft_handle *xtnft_open(int family)
+{
+	struct xtnft_handle *h;
+
+	if (family != NFPROTO_IPV4 && family != NFPROTO_IPV6) {
+		errno = EAFNOSUPPORT;
+		return NULL;
+	}
+
+	if (!xtnft_ready) {
+		xtables_globals.program_name = "iptables";
+		if (xtables_init_all(&xtables_globals, family) < 0)
+			return NULL;
+		xtables_globals.exit_err = xtnft_exit_error;
+		xtables_exit_hook = xtnft_exit;
+		xtnft_ready = true;
+	}
+
+	h = calloc(1, sizeof(*h));
+	if (h == NULL)
+		return NULL;
+
+	h->nft.family = family;
+	if (nft_init(&h->nft, xtables_ipv4) < 0) {
+		free(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+void xtnft_close(struct xtnft_handle *h)
+{
+	if (h == NULL)
+		return;
+
+	xtnft_call(h, XTNFT_ABORT, 0, NULL);
+	nft_fini(&h->nft);
+	free(h);
+}
+
+int xtnft_refresh(struct xtnft_handle *h)
+{
+	return xtnft_call(h, XTNFT_REFRESH, 0, NULL);
+}
+
+/*
+ * Run @cmd [@num] on the chain of @r. The arguments are copied for every
+ * call, as the parser writes into them.
+ */
+static int xtnft_rule_call(struct xtnft_handle *h, const struct xtnft_rule *r,
+			   enum xtnft_op op, char *cmd, unsigned int rulenum)
+{
+	char num[16], *buf, *p, **argv;
+	int argc = 0, i, ret;
+
+	argv = calloc(r->argc + 7, sizeof(*argv));
+	buf = malloc(r->len ? r->len : 1);
+	if (argv == NULL || buf == NULL) {
+		free(argv);
+		free(buf);
+		return xtnft_nomem(h);
+	}
+	memcpy(buf, r->buf, r->len);
+
+	argv[argc++] = "iptables";
+	argv[argc++] = "-t";
+	argv[argc++] = r->table;
+	argv[argc++] = cmd;
+	argv[argc++] = r->chain;
+	if (rulenum) {
+		snprintf(num, sizeof(num), "%u", rulenum);
+		argv[argc++] = num;
+	}
+	for (p = buf, i = 0; i < r->argc; i++, p += strlen(p) + 1)
+		argv[argc++] = p;
+
+	ret = xtnft_call(h, op, argc, argv);
+
+	free(argv);
+	free(buf);
+	return ret;
+}
+
+struct xtnft_rule *xtnft_rule_parse(struct xtnft_handle *h,
+				    const char *table, const char *chain,
+				    int argc, const char *const argv[])
+{
+	struct xtnft_rule *r;
+	char *p;
+	int i;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		xtnft_nomem(h);
+		return NULL;
+	}
+
+	for (i = 0; i < argc; i++)
+		r->len += strlen(argv[i]) + 1;
+
+	r->table = strdup(table);
+	r->chain = strdup(chain);
+	r->buf = malloc(r->len ? r->len : 1);
+	if (r->table == NULL || r->chain == NULL || r->buf == NULL) {
+		xtnft_rule_free(r);
+		xtnft_nomem(h);
+		return NULL;
+	}
+
+	r->argc = argc;
+	for (p = r->buf, i = 0; i < argc; i++)
+		p = stpcpy(p, argv[i]) + 1;
+
+	if (!xtnft_rule_call(h, r, XTNFT_PARSE, "-A", 0)) {
+		xtnft_rule_free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+void xtnft_rule_free(struct xtnft_rule *r)
+{
+	if (r == NULL)
+		return;
+
+	free(r->table);
+	free(r->chain);
+	free(r->buf);
+	free(r);
+}
+
+int xtnft_rule_append(struct xtnft_handle *h, const struct xtnft_rule *r)
+{
+	return xtnft_rule_call(h, r, XTNFT_RUN, "-A", 0);
+}
+
+int xtnft_rule_insert(struct xtnft_handle *h, const struct xtnft_rule *r,
+		      unsigned int rulenum)
+{
+	return xtnft_rule_call(h, r, XTNFT_RUN, "-I", rulenum ? rulenum : 1);
+}
+
+int xtnft_rule_delete(struct xtnft_handle *h, const struct xtnft_rule *r)
+{
+	return xtnft_rule_call(h, r, XTNFT_RUN, "-D", 0);
+}
+
+int xtnft_rule_check(struct xtnft_handle *h, const struct xtnft_rule *r)
+{
+	return xtnft_rule_call(h, r, XTNFT_RUN, "-C", 0);
+}
+
+int xtnft_command(struct xtnft_handle *h, int argc, const char *const argv[])
+{
+	char **args, *buf, *p;
+	size_t len = 1;
+	int i, ret;
+
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+
+	args = calloc(argc + 2, sizeof(*args));
+	buf = malloc(len);
+	if (args == NULL || buf == NULL) {
+		free(args);
+		free(buf);
+		return xtnft_nomem(h);
+	}
+
+	args[0] = "iptables";
+	for (p = buf, i = 0; i < argc; i++) {
+		args[i + 1] = p;
+		p = stpcpy(p, argv[i]) + 1;
+	}
+
+	ret = xtnft_call(h, XTNFT_RUN, argc + 1, args);
+
+	free(args);
+	free(buf);
+	return ret;
+}
+
+int xtnft_commit(struct xtnft_handle *h)
+{
+	return xtnft_call(h, XTNFT_COMMIT, 0, NULL);
+}
+
+int xtnft_abort(struct xtnft_handle *h)
+{
+	return xtnft_call(h, XTNFT_ABORT, 0, NULL);
+}
+
+const char *xtnft_strerror(const struct xtnft_handle *h)
+{
+	return h->errmsg[0] ? h->errmsg : strerror(0);
+}
@@ -132,32 +132,6 @@ static void get_frag(struct nft_xt_ctx *ctx, struct nftnl_expr *e, bool *inv)
 	ctx->flags &= ~NFT_XT_CTX_BITWISE;
 }
 
-static const char *mask_to_str(uint32_t mask)
-{
-	static char mask_str[sizeof("255.255.255.255")];
-	uint32_t bits, hmask = ntohl(mask);
-	struct in_addr mask_addr = {
-		.s_addr = mask,
-	};
-	int i;
-
-	if (mask == 0xFFFFFFFFU) {
-		sprintf(mask_str, "32");
-		return mask_str;
-	}
-
-	i    = 32;
-	bits = 0xFFFFFFFEU;
-	while (--i >= 0 && hmask != bits)
-		bits <<= 1;
-	if (i >= 0)
-		sprintf(mask_str, "%u", i);
-	else
-		sprintf(mask_str, "%s", inet_ntoa(mask_addr));
-
-	return mask_str;
-}
-
 static void nft_ipv4_parse_meta(struct nft_xt_ctx *ctx, struct nftnl_expr *e,
 				void *data)
 {
@@ -294,11 +268,29 @@ static void nft_ipv4_print_rule(struct nftnl_rule *r, unsigned int num,
 static void save_ipv4_addr(char letter, const struct in_addr *addr,
 			   uint32_t mask, int invert)
 {
+	const struct in_addr msk = { .s_addr = mask };
+	char buf[64], *p = buf;
+	int cidr;
+
 	if (!mask && !invert && !addr->s_addr)
 		return;
 
-	printf("%s-%c %s/%s ", invert ? "! " : "", letter, inet_ntoa(*addr),
-	       mask_to_str(mask));
+	if (invert)
+		p = stpcpy(p, "! ");
+	*p++ = '-';
+	*p++ = letter;
+	*p++ = ' ';
+	p = xtables_fmt_ipaddr(p, addr);
+	*p++ = '/';
+
+	cidr = xtables_ipmask_to_cidr(&msk);
+	if (cidr >= 0)
+		p = xtables_fmt_u64(p, cidr);
+	else
+		p = xtables_fmt_ipaddr(p, &msk);
+	*p++ = ' ';
+	*p = '\0';
+	fputs(buf, stdout);
 }
 
 static void nft_ipv4_save_rule(const void *data, unsigned int format)
@@ -396,17 +388,16 @@ static int nft_ipv4_xlate(const void *data, struct xt_xlate *xl)
 	}
 
 	if (cs->fw.ip.proto != 0) {
-		const struct protoent *pent =
-			getprotobynumber(cs->fw.ip.proto);
+		const char *pname = xtables_protocol_name(cs->fw.ip.proto);
 		char protonum[sizeof("65535")];
 		const char *name = protonum;
 
 		snprintf(protonum, sizeof(protonum), "%u",
 			 cs->fw.ip.proto);
 
-		if (!pent || !xlate_find_match(cs, pent->p_name)) {
-			if (pent)
-				name = pent->p_name;
+		if (!pname || !xlate_find_match(cs, pname)) {
+			if (pname)
+				name = pname;
 			xt_xlate_add(xl, "ip protocol %s%s ",
 				   cs->fw.ip.invflags & IPT_INV_PROTO ?
 					"!= " : "", name);
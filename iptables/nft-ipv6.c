@@ -224,20 +224,27 @@ static void save_ipv6_addr(char letter, const struct in6_addr *addr,
 			   const struct in6_addr *mask,
 			   int invert)
 {
-	char addr_str[INET6_ADDRSTRLEN];
+	char buf[128], *p = buf;
 	int l = xtables_ip6mask_to_cidr(mask);
 
 	if (!invert && l == 0)
 		return;
 
-	printf("%s-%c %s",
-		invert ? "! " : "", letter,
-		inet_ntop(AF_INET6, addr, addr_str, sizeof(addr_str)));
+	if (invert)
+		p = stpcpy(p, "! ");
+	*p++ = '-';
+	*p++ = letter;
+	*p++ = ' ';
+	p = xtables_fmt_ip6addr(p, addr);
+	*p++ = '/';
 
 	if (l == -1)
-		printf("/%s ", inet_ntop(AF_INET6, mask, addr_str, sizeof(addr_str)));
+		p = xtables_fmt_ip6addr(p, mask);
 	else
-		printf("/%d ", l);
+		p = xtables_fmt_u64(p, l);
+	*p++ = ' ';
+	*p = '\0';
+	fputs(buf, stdout);
 }
 
 static void nft_ipv6_save_rule(const void *data, unsigned int format)
@@ -355,17 +362,16 @@ static int nft_ipv6_xlate(const void *data, struct xt_xlate *xl)
 		     cs->fw6.ipv6.invflags & IP6T_INV_VIA_OUT);
 
 	if (cs->fw6.ipv6.proto != 0) {
-		const struct protoent *pent =
-			getprotobynumber(cs->fw6.ipv6.proto);
+		const char *pname = xtables_protocol_name(cs->fw6.ipv6.proto);
 		char protonum[sizeof("65535")];
 		const char *name = protonum;
 
 		snprintf(protonum, sizeof(protonum), "%u",
 			 cs->fw6.ipv6.proto);
 
-		if (!pent || !xlate_find_match(cs, pent->p_name)) {
-			if (pent)
-				name = pent->p_name;
+		if (!pname || !xlate_find_match(cs, pname)) {
+			if (pname)
+				name = pname;
 			xt_xlate_add(xl, "meta l4proto %s%s ",
 				   cs->fw6.ipv6.invflags & IP6T_INV_PROTO ?
 					"!= " : "", name);
@@ -0,0 +1,1238 @@
+/*
+ * In-memory stand-in for nf_tables, a transport of struct nft_handle.
+ *
+ * It holds tables, chains and rules in the process and speaks netlink to
+ * nft.c as the kernel does: GETGEN, GETTABLE, GETCHAIN, GETRULE and
+ * GETRULE_RESET are answered with the same messages, batches are applied
+ * as a whole or not at all, bump the generation id when committed and fail
+ * with ERESTART when begun on a stale one. Only what iptables-nft sends is
+ * understood, and expressions are kept as they come, never evaluated.
+ *
+ * All handles of a process share one ruleset, so a handle sees the
+ * commits of the others as it sees those of other processes with the
+ * kernel. It starts empty and is gone at exit. Select it with
+ * XTABLES_NFT_TRANSPORT=memory to run the nft code path, from restore
+ * parsing to the acknowledgments of the batch, without privileges.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#include <libmnl/libmnl.h>
+#include <libnftnl/common.h>
+#include <libnftnl/table.h>
+#include <libnftnl/chain.h>
+#include <libnftnl/rule.h>
+#include <libnftnl/expr.h>
+
+#include <xtables.h>
+#include "nft.h"
+
+#define MEMNL_CHAIN_HASH	1024		/* buckets per table */
+#define MEMNL_MSG_MAX		(UINT16_MAX + 4096)
+#define MEMNL_DGRAM		8192		/* dump datagrams, as NLMSG_GOODSIZE */
+
+struct memnl_rule {
+	struct list_head	head;
+	struct nftnl_rule	*r;
+	uint32_t		id;	/* NFTA_RULE_ID, in the batch adding it */
+};
+
+struct memnl_chain {
+	struct list_head	head;
+	struct hlist_node	node;
+	struct nftnl_chain	*c;
+	struct list_head	rules;
+	uint32_t		use;	/* rules jumping to it */
+};
+
+struct memnl_table {
+	struct list_head	head;
+	struct nftnl_table	*t;
+	uint32_t		family;
+	struct list_head	chains;
+	struct hlist_head	hash[MEMNL_CHAIN_HASH];
+};
+
+enum memnl_undo_type {
+	MEMNL_TABLE_ADD,
+	MEMNL_TABLE_DEL,
+	MEMNL_CHAIN_ADD,
+	MEMNL_CHAIN_DEL,
+	MEMNL_CHAIN_SET,
+	MEMNL_RULE_ADD,
+	MEMNL_RULE_DEL,
+};
+
+/**
+ * struct memnl_undo - change made by the batch being applied
+ * @head:	in memnl.undo, oldest first
+ * @type:	what was changed
+ * @table:	table changed, or the table of the chain or rule
+ * @chain:	chain changed, or the chain of the rule
+ * @rule:	rule changed
+ * @prev:	entry a deleted object followed in its list
+ * @old:	name, policy and counters of a chain before MEMNL_CHAIN_SET
+ *
+ * Deleted objects are only unlinked; they are freed when the batch is
+ * committed, or linked back at @prev when it is aborted. Undoing the
+ * changes newest first puts every @prev back in place before it is used.
+ */
+struct memnl_undo {
+	struct list_head	head;
+	enum memnl_undo_type	type;
+	struct memnl_table	*table;
+	struct memnl_chain	*chain;
+	struct memnl_rule	*rule;
+	struct list_head	*prev;
+	struct nftnl_chain	*old;
+};
+
+/**
+ * struct memnl_sock - state of a handle: the replies it did not receive
+ * @buf:	datagrams, each a uint32_t length and its messages
+ * @head:	offset of the next datagram to receive
+ * @tail:	end of the queued datagrams
+ * @size:	size of @buf
+ * @dgram:	offset of the length of the datagram being filled, or -1
+ * @portid:	port id of the handle, in the replies
+ *
+ * A dump is queued whole, where the kernel fills a datagram per recv().
+ */
+struct memnl_sock {
+	char		*buf;
+	size_t		head;
+	size_t		tail;
+	size_t		size;
+	ssize_t		dgram;
+	uint32_t	portid;
+};
+
+/* The ruleset of the process. The genid starts at 1, 0 is never checked. */
+static struct {
+	uint32_t		genid;
+	uint64_t		handle;		/* last one of a chain or rule */
+	uint32_t		portid;		/* last one given out */
+	struct list_head	tables;
+	struct list_head	undo;
+} memnl = {
+	.genid	= 1,
+	.tables	= LIST_HEAD_INIT(memnl.tables),
+	.undo	= LIST_HEAD_INIT(memnl.undo),
+};
+
+static uint32_t memnl_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*name)
+		hash = (hash ^ (uint8_t)*name++) * 16777619u;
+	return hash % MEMNL_CHAIN_HASH;
+}
+
+static const char *memnl_chain_name(const struct memnl_chain *c)
+{
+	return nftnl_chain_get_str(c->c, NFTNL_CHAIN_NAME);
+}
+
+static struct memnl_table *memnl_table_find(uint32_t family, const char *name)
+{
+	struct memnl_table *t;
+
+	list_for_each_entry(t, &memnl.tables, head) {
+		if (t->family == family &&
+		    strcmp(nftnl_table_get_str(t->t, NFTNL_TABLE_NAME),
+			   name) == 0)
+			return t;
+	}
+	return NULL;
+}
+
+static struct memnl_chain *memnl_chain_find(struct memnl_table *t,
+					    const char *name)
+{
+	struct memnl_chain *c;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(c, n, &t->hash[memnl_hash(name)], node) {
+		if (strcmp(memnl_chain_name(c), name) == 0)
+			return c;
+	}
+	return NULL;
+}
+
+static struct memnl_chain *memnl_chain_find_handle(struct memnl_table *t,
+						   uint64_t handle)
+{
+	struct memnl_chain *c;
+
+	list_for_each_entry(c, &t->chains, head) {
+		if (nftnl_chain_get_u64(c->c, NFTNL_CHAIN_HANDLE) == handle)
+			return c;
+	}
+	return NULL;
+}
+
+static struct memnl_rule *memnl_rule_find(struct memnl_chain *c,
+					  uint64_t handle)
+{
+	struct memnl_rule *r;
+
+	list_for_each_entry(r, &c->rules, head) {
+		if (nftnl_rule_get_u64(r->r, NFTNL_RULE_HANDLE) == handle)
+			return r;
+	}
+	return NULL;
+}
+
+static struct memnl_rule *memnl_rule_find_id(struct memnl_chain *c,
+					     uint32_t id)
+{
+	struct memnl_rule *r;
+
+	list_for_each_entry(r, &c->rules, head) {
+		if (r->id == id)
+			return r;
+	}
+	return NULL;
+}
+
+static void memnl_rule_free(struct memnl_rule *r)
+{
+	nftnl_rule_free(r->r);
+	free(r);
+}
+
+static void memnl_chain_free(struct memnl_chain *c)
+{
+	struct memnl_rule *r, *tmp;
+
+	list_for_each_entry_safe(r, tmp, &c->rules, head)
+		memnl_rule_free(r);
+	nftnl_chain_free(c->c);
+	free(c);
+}
+
+static void memnl_table_free(struct memnl_table *t)
+{
+	struct memnl_chain *c, *tmp;
+
+	list_for_each_entry_safe(c, tmp, &t->chains, head)
+		memnl_chain_free(c);
+	nftnl_table_free(t->t);
+	free(t);
+}
+
+static struct memnl_undo *memnl_log(enum memnl_undo_type type,
+				    struct memnl_table *t)
+{
+	struct memnl_undo *u = xtables_calloc(1, sizeof(*u));
+
+	u->type = type;
+	u->table = t;
+	list_add_tail(&u->head, &memnl.undo);
+	return u;
+}
+
+/*
+ * Add @delta to the references of the chains @r jumps or goes to. With a
+ * @delta of 0, only check that they exist.
+ */
+static int memnl_rule_jumps(struct memnl_table *t, struct nftnl_rule *r,
+			    int delta)
+{
+	struct nftnl_expr_iter *iter;
+	struct memnl_chain *c;
+	struct nftnl_expr *e;
+	int ret = 0;
+
+	iter = nftnl_expr_iter_create(r);
+	if (iter == NULL)
+		return -ENOMEM;
+
+	while ((e = nftnl_expr_iter_next(iter))) {
+		if (strcmp(nftnl_expr_get_str(e, NFTNL_EXPR_NAME),
+			   "immediate") ||
+		    !nftnl_expr_is_set(e, NFTNL_EXPR_IMM_CHAIN))
+			continue;
+
+		c = memnl_chain_find(t, nftnl_expr_get_str(e,
+							   NFTNL_EXPR_IMM_CHAIN));
+		if (c == NULL)
+			ret = -ENOENT;
+		else
+			c->use += delta;
+	}
+	nftnl_expr_iter_destroy(iter);
+	return ret;
+}
+
+/* Zero the counters of @r, once GETRULE_RESET has reported them. */
+static void memnl_rule_reset(struct nftnl_rule *r)
+{
+	struct nftnl_expr_iter *iter;
+	struct nftnl_expr *e;
+
+	iter = nftnl_expr_iter_create(r);
+	if (iter == NULL)
+		return;
+
+	while ((e = nftnl_expr_iter_next(iter))) {
+		if (strcmp(nftnl_expr_get_str(e, NFTNL_EXPR_NAME), "counter"))
+			continue;
+		nftnl_expr_set_u64(e, NFTNL_EXPR_CTR_PACKETS, 0);
+		nftnl_expr_set_u64(e, NFTNL_EXPR_CTR_BYTES, 0);
+	}
+	nftnl_expr_iter_destroy(iter);
+}
+
+/* Jumps name their chain, which keeps its references through a rename. */
+static void memnl_rename_jumps(struct memnl_table *t, const char *old,
+			       const char *name)
+{
+	struct nftnl_expr_iter *iter;
+	struct memnl_chain *c;
+	struct memnl_rule *r;
+	struct nftnl_expr *e;
+
+	list_for_each_entry(c, &t->chains, head) {
+		list_for_each_entry(r, &c->rules, head) {
+			iter = nftnl_expr_iter_create(r->r);
+			if (iter == NULL)
+				continue;
+
+			while ((e = nftnl_expr_iter_next(iter))) {
+				if (nftnl_expr_is_set(e, NFTNL_EXPR_IMM_CHAIN) &&
+				    strcmp(nftnl_expr_get_str(e,
+						NFTNL_EXPR_IMM_CHAIN), old) == 0)
+					nftnl_expr_set_str(e,
+						NFTNL_EXPR_IMM_CHAIN, name);
+			}
+			nftnl_expr_iter_destroy(iter);
+		}
+	}
+}
+
+/*
+ * Give @c the name, policy and counters of @from. Those @from lacks are
+ * left alone, or removed with @unset, to restore a copy from before.
+ */
+static void memnl_chain_assign(struct memnl_table *t, struct memnl_chain *c,
+			       const struct nftnl_chain *from, bool unset)
+{
+	const char *name = nftnl_chain_get_str(from, NFTNL_CHAIN_NAME);
+
+	if (strcmp(name, memnl_chain_name(c))) {
+		if (c->use)
+			memnl_rename_jumps(t, memnl_chain_name(c), name);
+		hlist_del(&c->node);
+		nftnl_chain_set_str(c->c, NFTNL_CHAIN_NAME, name);
+		hlist_add_head(&c->node, &t->hash[memnl_hash(name)]);
+	}
+
+	if (nftnl_chain_is_set(from, NFTNL_CHAIN_POLICY))
+		nftnl_chain_set_u32(c->c, NFTNL_CHAIN_POLICY,
+				    nftnl_chain_get_u32(from,
+							NFTNL_CHAIN_POLICY));
+	else if (unset)
+		nftnl_chain_unset(c->c, NFTNL_CHAIN_POLICY);
+
+	if (nftnl_chain_is_set(from, NFTNL_CHAIN_PACKETS)) {
+		nftnl_chain_set_u64(c->c, NFTNL_CHAIN_PACKETS,
+				    nftnl_chain_get_u64(from,
+							NFTNL_CHAIN_PACKETS));
+		nftnl_chain_set_u64(c->c, NFTNL_CHAIN_BYTES,
+				    nftnl_chain_get_u64(from,
+							NFTNL_CHAIN_BYTES));
+	} else if (unset) {
+		nftnl_chain_unset(c->c, NFTNL_CHAIN_PACKETS);
+		nftnl_chain_unset(c->c, NFTNL_CHAIN_BYTES);
+	}
+}
+
+static struct nftnl_chain *memnl_chain_copy(const struct nftnl_chain *c)
+{
+	struct nftnl_chain *copy = nftnl_chain_alloc();
+
+	if (copy == NULL)
+		return NULL;
+
+	nftnl_chain_set_str(copy, NFTNL_CHAIN_NAME,
+			    nftnl_chain_get_str(c, NFTNL_CHAIN_NAME));
+	if (nftnl_chain_is_set(c, NFTNL_CHAIN_POLICY))
+		nftnl_chain_set_u32(copy, NFTNL_CHAIN_POLICY,
+				    nftnl_chain_get_u32(c, NFTNL_CHAIN_POLICY));
+	if (nftnl_chain_is_set(c, NFTNL_CHAIN_PACKETS)) {
+		nftnl_chain_set_u64(copy, NFTNL_CHAIN_PACKETS,
+				    nftnl_chain_get_u64(c, NFTNL_CHAIN_PACKETS));
+		nftnl_chain_set_u64(copy, NFTNL_CHAIN_BYTES,
+				    nftnl_chain_get_u64(c, NFTNL_CHAIN_BYTES));
+	}
+	return copy;
+}
+
+static void memnl_rule_del(struct memnl_table *t, struct memnl_chain *c,
+			   struct memnl_rule *r)
+{
+	struct memnl_undo *u = memnl_log(MEMNL_RULE_DEL, t);
+
+	u->chain = c;
+	u->rule = r;
+	u->prev = r->head.prev;
+	list_del(&r->head);
+	memnl_rule_jumps(t, r->r, -1);
+}
+
+static int memnl_newtable(const struct nlmsghdr *nlh)
+{
+	struct nftnl_table *nt;
+	struct memnl_table *t;
+	uint32_t family;
+
+	nt = nftnl_table_alloc();
+	if (nt == NULL)
+		return -ENOMEM;
+
+	if (nftnl_table_nlmsg_parse(nlh, nt) < 0 ||
+	    !nftnl_table_is_set(nt, NFTNL_TABLE_NAME)) {
+		nftnl_table_free(nt);
+		return -EINVAL;
+	}
+
+	family = nftnl_table_get_u32(nt, NFTNL_TABLE_FAMILY);
+	if (memnl_table_find(family,
+			     nftnl_table_get_str(nt, NFTNL_TABLE_NAME))) {
+		nftnl_table_free(nt);
+		return nlh->nlmsg_flags & NLM_F_EXCL ? -EEXIST : 0;
+	}
+
+	t = xtables_calloc(1, sizeof(*t));
+	t->t = nt;
+	t->family = family;
+	INIT_LIST_HEAD(&t->chains);
+	list_add_tail(&t->head, &memnl.tables);
+	memnl_log(MEMNL_TABLE_ADD, t);
+	return 0;
+}
+
+static int memnl_deltable(const struct nlmsghdr *nlh)
+{
+	struct nftnl_table *nt;
+	struct memnl_table *t = NULL;
+	struct memnl_undo *u;
+
+	nt = nftnl_table_alloc();
+	if (nt == NULL)
+		return -ENOMEM;
+
+	if (nftnl_table_nlmsg_parse(nlh, nt) >= 0 &&
+	    nftnl_table_is_set(nt, NFTNL_TABLE_NAME))
+		t = memnl_table_find(nftnl_table_get_u32(nt, NFTNL_TABLE_FAMILY),
+				     nftnl_table_get_str(nt, NFTNL_TABLE_NAME));
+	nftnl_table_free(nt);
+	if (t == NULL)
+		return -ENOENT;
+
+	/* the chains and rules go with it, and come back with it */
+	u = memnl_log(MEMNL_TABLE_DEL, t);
+	u->prev = t->head.prev;
+	list_del(&t->head);
+	return 0;
+}
+
+/* Parse a chain message, and find the table it names. */
+static struct nftnl_chain *memnl_chain_parse(const struct nlmsghdr *nlh,
+					     struct memnl_table **t, int *err)
+{
+	struct nftnl_chain *nc;
+
+	nc = nftnl_chain_alloc();
+	if (nc == NULL) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	if (nftnl_chain_nlmsg_parse(nlh, nc) < 0 ||
+	    !nftnl_chain_is_set(nc, NFTNL_CHAIN_TABLE)) {
+		*err = -EINVAL;
+		goto err;
+	}
+
+	*t = memnl_table_find(nftnl_chain_get_u32(nc, NFTNL_CHAIN_FAMILY),
+			      nftnl_chain_get_str(nc, NFTNL_CHAIN_TABLE));
+	if (*t == NULL) {
+		*err = -ENOENT;
+		goto err;
+	}
+	return nc;
+err:
+	nftnl_chain_free(nc);
+	return NULL;
+}
+
+static int memnl_newchain(const struct nlmsghdr *nlh)
+{
+	struct memnl_chain *c, *other;
+	struct memnl_table *t;
+	struct nftnl_chain *nc;
+	struct memnl_undo *u;
+	const char *name;
+	int err;
+
+	nc = memnl_chain_parse(nlh, &t, &err);
+	if (nc == NULL)
+		return err;
+
+	if (!nftnl_chain_is_set(nc, NFTNL_CHAIN_NAME)) {
+		err = -EINVAL;
+		goto out;
+	}
+	name = nftnl_chain_get_str(nc, NFTNL_CHAIN_NAME);
+
+	/* by handle, the name is a new one */
+	if (nftnl_chain_is_set(nc, NFTNL_CHAIN_HANDLE)) {
+		c = memnl_chain_find_handle(t, nftnl_chain_get_u64(nc,
+							NFTNL_CHAIN_HANDLE));
+		if (c == NULL) {
+			err = -ENOENT;
+			goto out;
+		}
+	} else {
+		c = memnl_chain_find(t, name);
+	}
+
+	if (c == NULL) {
+		c = xtables_calloc(1, sizeof(*c));
+		c->c = nc;
+		INIT_LIST_HEAD(&c->rules);
+		nftnl_chain_set_u64(nc, NFTNL_CHAIN_HANDLE, ++memnl.handle);
+		list_add_tail(&c->head, &t->chains);
+		hlist_add_head(&c->node, &t->hash[memnl_hash(name)]);
+
+		u = memnl_log(MEMNL_CHAIN_ADD, t);
+		u->chain = c;
+		return 0;
+	}
+
+	if (nlh->nlmsg_flags & NLM_F_EXCL) {
+		err = -EEXIST;
+		goto out;
+	}
+
+	other = memnl_chain_find(t, name);
+	if (other && other != c) {
+		err = -EEXIST;
+		goto out;
+	}
+
+	u = memnl_log(MEMNL_CHAIN_SET, t);
+	u->chain = c;
+	u->old = memnl_chain_copy(c->c);
+	memnl_chain_assign(t, c, nc, false);
+	err = 0;
+out:
+	nftnl_chain_free(nc);
+	return err;
+}
+
+static int memnl_delchain(const struct nlmsghdr *nlh)
+{
+	struct memnl_rule *r, *tmp;
+	struct memnl_table *t;
+	struct nftnl_chain *nc;
+	struct memnl_chain *c;
+	struct memnl_undo *u;
+	int err;
+
+	nc = memnl_chain_parse(nlh, &t, &err);
+	if (nc == NULL)
+		return err;
+
+	if (nftnl_chain_is_set(nc, NFTNL_CHAIN_HANDLE))
+		c = memnl_chain_find_handle(t, nftnl_chain_get_u64(nc,
+							NFTNL_CHAIN_HANDLE));
+	else if (nftnl_chain_is_set(nc, NFTNL_CHAIN_NAME))
+		c = memnl_chain_find(t, nftnl_chain_get_str(nc,
+							NFTNL_CHAIN_NAME));
+	else
+		c = NULL;
+	nftnl_chain_free(nc);
+
+	if (c == NULL)
+		return -ENOENT;
+	if (c->use ||
+	    (nlh->nlmsg_flags & NLM_F_NONREC && !list_empty(&c->rules)))
+		return -EBUSY;
+
+	list_for_each_entry_safe(r, tmp, &c->rules, head)
+		memnl_rule_del(t, c, r);
+
+	u = memnl_log(MEMNL_CHAIN_DEL, t);
+	u->chain = c;
+	u->prev = c->head.prev;
+	list_del(&c->head);
+	hlist_del(&c->node);
+	return 0;
+}
+
+/* Parse a rule message, and find the table and the chain it names. */
+static struct nftnl_rule *memnl_rule_parse(const struct nlmsghdr *nlh,
+					   struct memnl_table **t,
+					   struct memnl_chain **c, int *err)
+{
+	struct nftnl_rule *nr;
+
+	nr = nftnl_rule_alloc();
+	if (nr == NULL) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	if (nftnl_rule_nlmsg_parse(nlh, nr) < 0 ||
+	    !nftnl_rule_is_set(nr, NFTNL_RULE_TABLE)) {
+		*err = -EINVAL;
+		goto err;
+	}
+
+	*t = memnl_table_find(nftnl_rule_get_u32(nr, NFTNL_RULE_FAMILY),
+			      nftnl_rule_get_str(nr, NFTNL_RULE_TABLE));
+	if (*t == NULL) {
+		*err = -ENOENT;
+		goto err;
+	}
+
+	*c = NULL;
+	if (nftnl_rule_is_set(nr, NFTNL_RULE_CHAIN)) {
+		*c = memnl_chain_find(*t, nftnl_rule_get_str(nr,
+							NFTNL_RULE_CHAIN));
+		if (*c == NULL) {
+			*err = -ENOENT;
+			goto err;
+		}
+	}
+	return nr;
+err:
+	nftnl_rule_free(nr);
+	return NULL;
+}
+
+static int memnl_newrule(const struct nlmsghdr *nlh)
+{
+	struct memnl_rule *r, *ref = NULL;
+	struct memnl_table *t;
+	struct memnl_chain *c;
+	struct nftnl_rule *nr;
+	struct memnl_undo *u;
+	int err;
+
+	nr = memnl_rule_parse(nlh, &t, &c, &err);
+	if (nr == NULL)
+		return err;
+
+	if (c == NULL) {
+		err = -EINVAL;
+		goto err;
+	}
+
+	if (nlh->nlmsg_flags & NLM_F_REPLACE) {
+		if (!nftnl_rule_is_set(nr, NFTNL_RULE_HANDLE)) {
+			err = -EINVAL;
+			goto err;
+		}
+		ref = memnl_rule_find(c, nftnl_rule_get_u64(nr,
+							NFTNL_RULE_HANDLE));
+	} else if (nftnl_rule_is_set(nr, NFTNL_RULE_POSITION)) {
+		ref = memnl_rule_find(c, nftnl_rule_get_u64(nr,
+							NFTNL_RULE_POSITION));
+	} else if (nftnl_rule_is_set(nr, NFTNL_RULE_POSITION_ID)) {
+		ref = memnl_rule_find_id(c, nftnl_rule_get_u32(nr,
+							NFTNL_RULE_POSITION_ID));
+	}
+	if (ref == NULL && (nlh->nlmsg_flags & NLM_F_REPLACE ||
+			    nftnl_rule_is_set(nr, NFTNL_RULE_POSITION) ||
+			    nftnl_rule_is_set(nr, NFTNL_RULE_POSITION_ID))) {
+		err = -ENOENT;
+		goto err;
+	}
+
+	err = memnl_rule_jumps(t, nr, 0);
+	if (err < 0)
+		goto err;
+
+	r = xtables_calloc(1, sizeof(*r));
+	r->r = nr;
+	if (nftnl_rule_is_set(nr, NFTNL_RULE_ID))
+		r->id = nftnl_rule_get_u32(nr, NFTNL_RULE_ID);
+	nftnl_rule_unset(nr, NFTNL_RULE_ID);
+	nftnl_rule_unset(nr, NFTNL_RULE_POSITION);
+	nftnl_rule_unset(nr, NFTNL_RULE_POSITION_ID);
+	nftnl_rule_set_u64(nr, NFTNL_RULE_HANDLE, ++memnl.handle);
+
+	if (ref == NULL && nlh->nlmsg_flags & NLM_F_APPEND)
+		list_add_tail(&r->head, &c->rules);
+	else if (ref == NULL)
+		list_add(&r->head, &c->rules);
+	else if (nlh->nlmsg_flags & NLM_F_APPEND &&
+		 !(nlh->nlmsg_flags & NLM_F_REPLACE))
+		list_add(&r->head, &ref->head);
+	else
+		list_add_tail(&r->head, &ref->head);
+	memnl_rule_jumps(t, nr, 1);
+
+	u = memnl_log(MEMNL_RULE_ADD, t);
+	u->chain = c;
+	u->rule = r;
+
+	if (nlh->nlmsg_flags & NLM_F_REPLACE)
+		memnl_rule_del(t, c, ref);
+	return 0;
+err:
+	nftnl_rule_free(nr);
+	return err;
+}
+
+static int memnl_delrule(const struct nlmsghdr *nlh)
+{
+	struct memnl_rule *r, *tmp;
+	struct memnl_table *t;
+	struct memnl_chain *c;
+	struct nftnl_rule *nr;
+	uint64_t handle = 0;
+	int err;
+
+	nr = memnl_rule_parse(nlh, &t, &c, &err);
+	if (nr == NULL)
+		return err;
+
+	if (nftnl_rule_is_set(nr, NFTNL_RULE_HANDLE))
+		handle = nftnl_rule_get_u64(nr, NFTNL_RULE_HANDLE);
+	nftnl_rule_free(nr);
+
+	if (handle) {
+		if (c == NULL)
+			return -EINVAL;
+		r = memnl_rule_find(c, handle);
+		if (r == NULL)
+			return -ENOENT;
+		memnl_rule_del(t, c, r);
+		return 0;
+	}
+
+	/* a flush of the chain, or of all chains of the table */
+	if (c) {
+		list_for_each_entry_safe(r, tmp, &c->rules, head)
+			memnl_rule_del(t, c, r);
+		return 0;
+	}
+	list_for_each_entry(c, &t->chains, head) {
+		list_for_each_entry_safe(r, tmp, &c->rules, head)
+			memnl_rule_del(t, c, r);
+	}
+	return 0;
+}
+
+/* Apply a message of a batch, as nf_tables does in its transaction. */
+static int memnl_change(const struct nlmsghdr *nlh)
+{
+	if (NFNL_SUBSYS_ID(nlh->nlmsg_type) != NFNL_SUBSYS_NFTABLES)
+		return -EOPNOTSUPP;
+
+	switch (NFNL_MSG_TYPE(nlh->nlmsg_type)) {
+	case NFT_MSG_NEWTABLE:
+		return memnl_newtable(nlh);
+	case NFT_MSG_DELTABLE:
+		return memnl_deltable(nlh);
+	case NFT_MSG_NEWCHAIN:
+		return memnl_newchain(nlh);
+	case NFT_MSG_DELCHAIN:
+		return memnl_delchain(nlh);
+	case NFT_MSG_NEWRULE:
+		return memnl_newrule(nlh);
+	case NFT_MSG_DELRULE:
+		return memnl_delrule(nlh);
+	}
+	return -EOPNOTSUPP;
+}
+
+/* Undo a change of an aborted batch. */
+static void memnl_undo(struct memnl_undo *u)
+{
+	struct memnl_table *t = u->table;
+	struct memnl_chain *c = u->chain;
+	struct memnl_rule *r = u->rule;
+
+	switch (u->type) {
+	case MEMNL_TABLE_ADD:
+		list_del(&t->head);
+		memnl_table_free(t);
+		break;
+	case MEMNL_TABLE_DEL:
+		list_add(&t->head, u->prev);
+		break;
+	case MEMNL_CHAIN_ADD:
+		list_del(&c->head);
+		hlist_del(&c->node);
+		memnl_chain_free(c);
+		break;
+	case MEMNL_CHAIN_DEL:
+		list_add(&c->head, u->prev);
+		hlist_add_head(&c->node, &t->hash[memnl_hash(memnl_chain_name(c))]);
+		break;
+	case MEMNL_CHAIN_SET:
+		memnl_chain_assign(t, c, u->old, true);
+		nftnl_chain_free(u->old);
+		break;
+	case MEMNL_RULE_ADD:
+		list_del(&r->head);
+		memnl_rule_jumps(t, r->r, -1);
+		memnl_rule_free(r);
+		break;
+	case MEMNL_RULE_DEL:
+		list_add(&r->head, u->prev);
+		memnl_rule_jumps(t, r->r, 1);
+		break;
+	}
+}
+
+static void memnl_abort(void)
+{
+	struct memnl_undo *u;
+
+	while (!list_empty(&memnl.undo)) {
+		u = list_entry(memnl.undo.prev, struct memnl_undo, head);
+		memnl_undo(u);
+		list_del(&u->head);
+		free(u);
+	}
+}
+
+/*
+ * Free what the batch deleted. Going oldest first, an object is freed
+ * after the last change that refers to it.
+ */
+static void memnl_commit(void)
+{
+	struct memnl_undo *u, *tmp;
+
+	list_for_each_entry_safe(u, tmp, &memnl.undo, head) {
+		switch (u->type) {
+		case MEMNL_TABLE_DEL:
+			memnl_table_free(u->table);
+			break;
+		case MEMNL_CHAIN_DEL:
+			memnl_chain_free(u->chain);
+			break;
+		case MEMNL_CHAIN_SET:
+			nftnl_chain_free(u->old);
+			break;
+		case MEMNL_RULE_ADD:
+			u->rule->id = 0;
+			break;
+		case MEMNL_RULE_DEL:
+			memnl_rule_free(u->rule);
+			break;
+		case MEMNL_TABLE_ADD:
+		case MEMNL_CHAIN_ADD:
+			break;
+		}
+		list_del(&u->head);
+		free(u);
+	}
+	memnl.genid++;
+}
+
+/* Room for a reply at the tail of the queue. */
+static struct nlmsghdr *memnl_put(struct memnl_sock *s)
+{
+	size_t need = s->tail + sizeof(uint32_t) + MEMNL_MSG_MAX;
+
+	if (need > s->size) {
+		s->size = need * 2;
+		s->buf = xtables_realloc(s->buf, s->size);
+	}
+	return mnl_nlmsg_put_header(s->buf + s->tail);
+}
+
+/*
+ * Queue the reply built at memnl_put(). The messages of a dump share
+ * datagrams of up to MEMNL_DGRAM bytes, others get one of their own.
+ */
+static void memnl_queue(struct memnl_sock *s, struct nlmsghdr *nlh,
+			bool multi)
+{
+	uint32_t len = MNL_ALIGN(nlh->nlmsg_len), *dlen;
+
+	nlh->nlmsg_pid = s->portid;
+	if (s->dgram < 0 || !multi ||
+	    *(uint32_t *)(s->buf + s->dgram) + len > MEMNL_DGRAM) {
+		memmove(s->buf + s->tail + sizeof(uint32_t), nlh, len);
+		s->dgram = s->tail;
+		*(uint32_t *)(s->buf + s->dgram) = 0;
+		s->tail += sizeof(uint32_t);
+	}
+
+	dlen = (uint32_t *)(s->buf + s->dgram);
+	*dlen += len;
+	s->tail += len;
+	if (!multi)
+		s->dgram = -1;
+}
+
+/* A reply to @req, as nftnl_nlmsg_build_hdr() builds requests. */
+static struct nlmsghdr *memnl_reply(struct memnl_sock *s,
+				    const struct nlmsghdr *req,
+				    uint16_t type, uint8_t family,
+				    uint16_t flags)
+{
+	struct nlmsghdr *nlh = memnl_put(s);
+	struct nfgenmsg *nfg;
+
+	nlh->nlmsg_type = (NFNL_SUBSYS_NFTABLES << 8) | type;
+	nlh->nlmsg_flags = flags;
+	nlh->nlmsg_seq = req->nlmsg_seq;
+
+	nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(*nfg));
+	nfg->nfgen_family = family;
+	nfg->version = NFNETLINK_V0;
+	nfg->res_id = htons(memnl.genid & 0xffff);
+	return nlh;
+}
+
+/* An acknowledgment of @req, or an error if @error is negative. */
+static void memnl_ack(struct memnl_sock *s, const struct nlmsghdr *req,
+		      int error)
+{
+	struct nlmsghdr *nlh = memnl_put(s);
+	struct nlmsgerr *err;
+
+	nlh->nlmsg_type = NLMSG_ERROR;
+	nlh->nlmsg_seq = req->nlmsg_seq;
+	err = mnl_nlmsg_put_extra_header(nlh, sizeof(*err));
+	err->error = error;
+	err->msg = *req;
+	memnl_queue(s, nlh, false);
+}
+
+static void memnl_done(struct memnl_sock *s, const struct nlmsghdr *req)
+{
+	struct nlmsghdr *nlh = memnl_put(s);
+
+	nlh->nlmsg_type = NLMSG_DONE;
+	nlh->nlmsg_flags = NLM_F_MULTI;
+	nlh->nlmsg_seq = req->nlmsg_seq;
+	mnl_nlmsg_put_extra_header(nlh, sizeof(int));
+	memnl_queue(s, nlh, true);
+}
+
+static void memnl_getgen(struct memnl_sock *s, const struct nlmsghdr *req)
+{
+	struct nlmsghdr *nlh;
+
+	nlh = memnl_reply(s, req, NFT_MSG_NEWGEN, AF_UNSPEC, 0);
+	mnl_attr_put_u32(nlh, NFTA_GEN_ID, htonl(memnl.genid));
+	memnl_queue(s, nlh, false);
+}
+
+static void memnl_gettable(struct memnl_sock *s, const struct nlmsghdr *req,
+			   uint8_t family)
+{
+	struct memnl_table *t;
+	struct nlmsghdr *nlh;
+
+	list_for_each_entry(t, &memnl.tables, head) {
+		if (family != NFPROTO_UNSPEC && family != t->family)
+			continue;
+
+		nlh = memnl_reply(s, req, NFT_MSG_NEWTABLE, t->family,
+				  NLM_F_MULTI);
+		nftnl_table_nlmsg_build_payload(nlh, t->t);
+		memnl_queue(s, nlh, true);
+	}
+	memnl_done(s, req);
+}
+
+static void memnl_getchain(struct memnl_sock *s, const struct nlmsghdr *req,
+			   uint8_t family)
+{
+	struct memnl_table *t;
+	struct memnl_chain *c;
+	struct nlmsghdr *nlh;
+
+	list_for_each_entry(t, &memnl.tables, head) {
+		if (family != NFPROTO_UNSPEC && family != t->family)
+			continue;
+
+		list_for_each_entry(c, &t->chains, head) {
+			nftnl_chain_set_u32(c->c, NFTNL_CHAIN_USE, c->use);
+			nlh = memnl_reply(s, req, NFT_MSG_NEWCHAIN, t->family,
+					  NLM_F_MULTI);
+			nftnl_chain_nlmsg_build_payload(nlh, c->c);
+			memnl_queue(s, nlh, true);
+		}
+	}
+	memnl_done(s, req);
+}
+
+static void memnl_rule_reply(struct memnl_sock *s, const struct nlmsghdr *req,
+			     struct memnl_table *t, struct memnl_rule *r,
+			     uint16_t flags, bool reset)
+{
+	struct nlmsghdr *nlh;
+
+	nlh = memnl_reply(s, req, NFT_MSG_NEWRULE, t->family, flags);
+	nftnl_rule_nlmsg_build_payload(nlh, r->r);
+	memnl_queue(s, nlh, flags & NLM_F_MULTI);
+	if (reset)
+		memnl_rule_reset(r->r);
+}
+
+/* The rules of a table and chain if the request names them, or one rule. */
+static int memnl_getrule(struct memnl_sock *s, const struct nlmsghdr *req,
+			 uint8_t family, bool reset)
+{
+	const char *table = NULL, *chain = NULL;
+	struct nftnl_rule *filter;
+	struct memnl_table *t;
+	struct memnl_chain *c;
+	struct memnl_rule *r;
+	uint64_t handle = 0;
+
+	filter = nftnl_rule_alloc();
+	if (filter == NULL)
+		return -ENOMEM;
+	if (nftnl_rule_nlmsg_parse(req, filter) < 0) {
+		nftnl_rule_free(filter);
+		return -EINVAL;
+	}
+	if (nftnl_rule_is_set(filter, NFTNL_RULE_TABLE))
+		table = nftnl_rule_get_str(filter, NFTNL_RULE_TABLE);
+	if (nftnl_rule_is_set(filter, NFTNL_RULE_CHAIN))
+		chain = nftnl_rule_get_str(filter, NFTNL_RULE_CHAIN);
+	if (nftnl_rule_is_set(filter, NFTNL_RULE_HANDLE))
+		handle = nftnl_rule_get_u64(filter, NFTNL_RULE_HANDLE);
+
+	if ((req->nlmsg_flags & NLM_F_DUMP) != NLM_F_DUMP) {
+		r = NULL;
+		t = table ? memnl_table_find(family, table) : NULL;
+		c = t && chain ? memnl_chain_find(t, chain) : NULL;
+		if (c)
+			r = memnl_rule_find(c, handle);
+		nftnl_rule_free(filter);
+		if (r == NULL)
+			return -ENOENT;
+
+		memnl_rule_reply(s, req, t, r, 0, reset);
+		return 0;
+	}
+
+	list_for_each_entry(t, &memnl.tables, head) {
+		if ((family != NFPROTO_UNSPEC && family != t->family) ||
+		    (table && strcmp(table, nftnl_table_get_str(t->t,
+							NFTNL_TABLE_NAME))))
+			continue;
+
+		list_for_each_entry(c, &t->chains, head) {
+			if (chain && strcmp(chain, memnl_chain_name(c)))
+				continue;
+
+			list_for_each_entry(r, &c->rules, head)
+				memnl_rule_reply(s, req, t, r, NLM_F_MULTI,
+						 reset);
+		}
+	}
+	nftnl_rule_free(filter);
+	memnl_done(s, req);
+	return 0;
+}
+
+/* Answer a request outside of a batch. */
+static int memnl_get(struct memnl_sock *s, const struct nlmsghdr *nlh)
+{
+	const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+	bool dump = (nlh->nlmsg_flags & NLM_F_DUMP) == NLM_F_DUMP;
+
+	if (NFNL_SUBSYS_ID(nlh->nlmsg_type) != NFNL_SUBSYS_NFTABLES)
+		return -EOPNOTSUPP;
+
+	switch (NFNL_MSG_TYPE(nlh->nlmsg_type)) {
+	case NFT_MSG_GETGEN:
+		memnl_getgen(s, nlh);
+		return 0;
+	case NFT_MSG_GETTABLE:
+		if (!dump)
+			break;
+		memnl_gettable(s, nlh, nfg->nfgen_family);
+		return 0;
+	case NFT_MSG_GETCHAIN:
+		if (!dump)
+			break;
+		memnl_getchain(s, nlh, nfg->nfgen_family);
+		return 0;
+	case NFT_MSG_GETRULE:
+		return memnl_getrule(s, nlh, nfg->nfgen_family, false);
+	case NFT_MSG_GETRULE_RESET:
+		return memnl_getrule(s, nlh, nfg->nfgen_family, true);
+	}
+	return -EOPNOTSUPP;
+}
+
+/* A batch begun on another generation than the current one is refused. */
+static int memnl_begin(const struct nlmsghdr *nlh)
+{
+	const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+	struct nlattr *attr;
+
+	if (ntohs(nfg->res_id) != NFNL_SUBSYS_NFTABLES)
+		return -EINVAL;
+
+	mnl_attr_for_each(attr, nlh, sizeof(*nfg)) {
+		if (mnl_attr_get_type(attr) == NFTA_GEN_ID &&
+		    mnl_attr_get_u32(attr) &&
+		    ntohl(mnl_attr_get_u32(attr)) != memnl.genid)
+			return -ERESTART;
+	}
+	return 0;
+}
+
+static int memnl_open(struct nft_handle *h)
+{
+	struct memnl_sock *s = calloc(1, sizeof(*s));
+
+	if (s == NULL)
+		return -1;
+
+	s->dgram = -1;
+	s->portid = ++memnl.portid;
+	h->portid = s->portid;
+	h->transport_priv = s;
+	return 0;
+}
+
+static void memnl_close(struct nft_handle *h)
+{
+	struct memnl_sock *s = h->transport_priv;
+
+	free(s->buf);
+	free(s);
+	h->transport_priv = NULL;
+}
+
+/*
+ * Take the requests of a datagram, as nfnetlink_rcv() does: a batch is
+ * committed if it ends and none of its messages failed, each of those gets
+ * an error. Its replies are queued for memnl_recv().
+ */
+static ssize_t memnl_sendmsg(struct nft_handle *h, const struct iovec *iov,
+			     int iovlen)
+{
+	struct memnl_sock *s = h->transport_priv;
+	bool batch = false, failed = false, end = false;
+	const struct nlmsghdr *nlh;
+	ssize_t sent = 0;
+	int i, len, ret;
+
+	for (i = 0; i < iovlen && !end; i++) {
+		nlh = iov[i].iov_base;
+		len = iov[i].iov_len;
+		sent += len;
+
+		for (; mnl_nlmsg_ok(nlh, len) && !end;
+		     nlh = mnl_nlmsg_next(nlh, &len)) {
+			if (nlh->nlmsg_type == NFNL_MSG_BATCH_BEGIN) {
+				ret = memnl_begin(nlh);
+				if (ret < 0) {
+					memnl_ack(s, nlh, ret);
+					return sent;
+				}
+				batch = true;
+				continue;
+			}
+			if (nlh->nlmsg_type == NFNL_MSG_BATCH_END) {
+				end = batch;
+				continue;
+			}
+
+			if (batch)
+				ret = memnl_change(nlh);
+			else
+				ret = memnl_get(s, nlh);
+			s->dgram = -1;
+
+			if (ret < 0) {
+				failed |= batch;
+				memnl_ack(s, nlh, ret);
+			} else if (nlh->nlmsg_flags & NLM_F_ACK &&
+				   (batch || (nlh->nlmsg_flags & NLM_F_DUMP) !=
+					     NLM_F_DUMP)) {
+				memnl_ack(s, nlh, 0);
+			}
+		}
+	}
+
+	if (end && !failed)
+		memnl_commit();
+	else if (batch)
+		memnl_abort();
+
+	return sent;
+}
+
+static ssize_t memnl_recv(struct nft_handle *h, void *buf, size_t len)
+{
+	struct memnl_sock *s = h->transport_priv;
+	uint32_t dlen;
+
+	if (s->head == s->tail) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	memcpy(&dlen, s->buf + s->head, sizeof(dlen));
+	s->head += sizeof(dlen);
+	memcpy(buf, s->buf + s->head, dlen < len ? dlen : len);
+	s->head += dlen;
+	if (s->head == s->tail)
+		s->head = s->tail = 0;
+
+	/* truncated, as mnl_socket_recvfrom() reports MSG_TRUNC */
+	if (dlen > len) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return dlen;
+}
+
+static int memnl_pending(struct nft_handle *h)
+{
+	struct memnl_sock *s = h->transport_priv;
+
+	return s->head != s->tail;
+}
+
+static int memnl_setbuf(struct nft_handle *h, int opt, int size)
+{
+	return 0;
+}
+
+const struct nft_transport nft_transport_memory = {
+	.name		= "memory",
+	.open		= memnl_open,
+	.close		= memnl_close,
+	.sendmsg	= memnl_sendmsg,
+	.recv		= memnl_recv,
+	.pending	= memnl_pending,
+	.setbuf		= memnl_setbuf,
+};
@@ -319,7 +319,9 @@ static void nft_parse_target(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
 
 	size = XT_ALIGN(sizeof(struct xt_entry_target)) + tg_len;
 
-	t = xtables_calloc(1, size);
+	/* only the header needs clearing, the payload is copied over */
+	t = xtables_malloc(size);
+	memset(t, 0, sizeof(*t));
 	memcpy(&t->data, targinfo, tg_len);
 	t->u.target_size = size;
 	t->u.user.revision = nftnl_expr_get_u32(e, NFTNL_EXPR_TG_REV);
@@ -357,7 +359,8 @@ static void nft_parse_match(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
 	if (match == NULL)
 		return;
 
-	m = xtables_calloc(1, sizeof(struct xt_entry_match) + mt_len);
+	m = xtables_malloc(sizeof(struct xt_entry_match) + mt_len);
+	memset(m, 0, sizeof(*m));
 	memcpy(&m->data, mt_info, mt_len);
 	m->u.match_size = mt_len + XT_ALIGN(sizeof(struct xt_entry_match));
 	m->u.user.revision = nftnl_expr_get_u32(e, NFTNL_EXPR_TG_REV);
@@ -372,13 +375,13 @@ static void nft_parse_match(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
 
 void print_proto(uint16_t proto, int invert)
 {
-	const struct protoent *pent = getprotobynumber(proto);
+	const char *pname = xtables_protocol_name(proto);
 
 	if (invert)
 		printf("! ");
 
-	if (pent) {
-		printf("-p %s ", pent->p_name);
+	if (pname) {
+		printf("-p %s ", pname);
 		return;
 	}
 
@@ -493,8 +496,10 @@ static void nft_parse_cmp(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
 	}
 }
 
-static void nft_parse_counter(struct nftnl_expr *e, struct xt_counters *counters)
+static void nft_parse_counter(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
 {
+	struct xt_counters *counters = &ctx->cs->counters;
+
 	counters->pcnt = nftnl_expr_get_u64(e, NFTNL_EXPR_CTR_PACKETS);
 	counters->bcnt = nftnl_expr_get_u64(e, NFTNL_EXPR_CTR_BYTES);
 }
@@ -591,6 +596,59 @@ static void nft_parse_limit(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
 		ops->parse_match(match, ctx->cs);
 }
 
+enum nft_xt_expr_type {
+	NFT_XT_EXPR_COUNTER,
+	NFT_XT_EXPR_PAYLOAD,
+	NFT_XT_EXPR_META,
+	NFT_XT_EXPR_BITWISE,
+	NFT_XT_EXPR_CMP,
+	NFT_XT_EXPR_IMMEDIATE,
+	NFT_XT_EXPR_MATCH,
+	NFT_XT_EXPR_TARGET,
+	NFT_XT_EXPR_LIMIT,
+	__NFT_XT_EXPR_MAX,
+};
+
+static const struct nft_xt_expr_parser {
+	const char	*name;
+	void		(*parse)(struct nft_xt_ctx *ctx, struct nftnl_expr *e);
+} nft_xt_expr_parsers[__NFT_XT_EXPR_MAX] = {
+	[NFT_XT_EXPR_COUNTER]	= { "counter",	 nft_parse_counter },
+	[NFT_XT_EXPR_PAYLOAD]	= { "payload",	 nft_parse_payload },
+	[NFT_XT_EXPR_META]	= { "meta",	 nft_parse_meta },
+	[NFT_XT_EXPR_BITWISE]	= { "bitwise",	 nft_parse_bitwise },
+	[NFT_XT_EXPR_CMP]	= { "cmp",	 nft_parse_cmp },
+	[NFT_XT_EXPR_IMMEDIATE]	= { "immediate", nft_parse_immediate },
+	[NFT_XT_EXPR_MATCH]	= { "match",	 nft_parse_match },
+	[NFT_XT_EXPR_TARGET]	= { "target",	 nft_parse_target },
+	[NFT_XT_EXPR_LIMIT]	= { "limit",	 nft_parse_limit },
+};
+
+/* libnftnl hands out the name string of the expression type, which is the
+ * same pointer for all expressions of a type. Remember it per type, so
+ * only the first expression of each type needs string compares.
+ */
+static const char *nft_xt_expr_names[__NFT_XT_EXPR_MAX];
+
+static const struct nft_xt_expr_parser *nft_xt_expr_lookup(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < __NFT_XT_EXPR_MAX; i++) {
+		if (nft_xt_expr_names[i] == name)
+			return &nft_xt_expr_parsers[i];
+	}
+
+	for (i = 0; i < __NFT_XT_EXPR_MAX; i++) {
+		if (strcmp(nft_xt_expr_parsers[i].name, name) == 0) {
+			nft_xt_expr_names[i] = name;
+			return &nft_xt_expr_parsers[i];
+		}
+	}
+
+	return NULL;
+}
+
 void nft_rule_to_iptables_command_state(const struct nftnl_rule *r,
 					struct iptables_command_state *cs)
 {
@@ -609,27 +667,12 @@ void nft_rule_to_iptables_command_state(const struct nftnl_rule *r,
 	ctx.iter = iter;
 	expr = nftnl_expr_iter_next(iter);
 	while (expr != NULL) {
-		const char *name =
-			nftnl_expr_get_str(expr, NFTNL_EXPR_NAME);
-
-		if (strcmp(name, "counter") == 0)
-			nft_parse_counter(expr, &ctx.cs->counters);
-		else if (strcmp(name, "payload") == 0)
-			nft_parse_payload(&ctx, expr);
-		else if (strcmp(name, "meta") == 0)
-			nft_parse_meta(&ctx, expr);
-		else if (strcmp(name, "bitwise") == 0)
-			nft_parse_bitwise(&ctx, expr);
-		else if (strcmp(name, "cmp") == 0)
-			nft_parse_cmp(&ctx, expr);
-		else if (strcmp(name, "immediate") == 0)
-			nft_parse_immediate(&ctx, expr);
-		else if (strcmp(name, "match") == 0)
-			nft_parse_match(&ctx, expr);
-		else if (strcmp(name, "target") == 0)
-			nft_parse_target(&ctx, expr);
-		else if (strcmp(name, "limit") == 0)
-			nft_parse_limit(&ctx, expr);
+		const struct nft_xt_expr_parser *parser;
+
+		parser = nft_xt_expr_lookup(nftnl_expr_get_str(expr,
+							      NFTNL_EXPR_NAME));
+		if (parser != NULL)
+			parser->parse(&ctx, expr);
 
 		expr = nftnl_expr_iter_next(iter);
 	}
@@ -774,25 +817,32 @@ void print_rule_details(const struct iptables_command_state *cs,
 static void
 print_iface(char letter, const char *iface, const unsigned char *mask, int inv)
 {
+	char buf[IFNAMSIZ + 8], *p = buf;
 	unsigned int i;
 
 	if (mask[0] == 0)
 		return;
 
-	printf("%s-%c ", inv ? "! " : "", letter);
+	if (inv)
+		p = stpcpy(p, "! ");
+	*p++ = '-';
+	*p++ = letter;
+	*p++ = ' ';
 
 	for (i = 0; i < IFNAMSIZ; i++) {
 		if (mask[i] != 0) {
 			if (iface[i] != '\0')
-				printf("%c", iface[i]);
-			} else {
-				if (iface[i-1] != '\0')
-					printf("+");
-				break;
+				*p++ = iface[i];
+		} else {
+			if (iface[i-1] != '\0')
+				*p++ = '+';
+			break;
 		}
 	}
 
-	printf(" ");
+	*p++ = ' ';
+	*p = '\0';
+	fputs(buf, stdout);
 }
 
 void save_rule_details(const struct iptables_command_state *cs,
@@ -812,15 +862,18 @@ void save_rule_details(const struct iptables_command_state *cs,
 	}
 
 	if (proto > 0) {
-		const struct protoent *pent = getprotobynumber(proto);
+		const char *pname = xtables_protocol_name(proto);
 
 		if (invflags & XT_INV_PROTO)
 			printf("! ");
 
-		if (pent)
-			printf("-p %s ", pent->p_name);
-		else
+		if (pname) {
+			fputs("-p ", stdout);
+			fputs(pname, stdout);
+			fputc(' ', stdout);
+		} else {
 			printf("-p %u ", proto);
+		}
 	}
 }
 
@@ -828,8 +881,8 @@ void save_counters(const void *data)
 {
 	const struct iptables_command_state *cs = data;
 
-	printf("[%llu:%llu] ", (unsigned long long)cs->counters.pcnt,
-			       (unsigned long long)cs->counters.bcnt);
+	print_counter_pair("[", cs->counters.pcnt, ':',
+			   cs->counters.bcnt, "] ");
 }
 
 void nft_ipv46_save_chain(const struct nftnl_chain *c, const char *policy)
@@ -838,8 +891,11 @@ void nft_ipv46_save_chain(const struct nftnl_chain *c, const char *policy)
 	uint64_t pkts = nftnl_chain_get_u64(c, NFTNL_CHAIN_PACKETS);
 	uint64_t bytes = nftnl_chain_get_u64(c, NFTNL_CHAIN_BYTES);
 
-	printf(":%s %s [%"PRIu64":%"PRIu64"]\n",
-	       chain, policy ?: "-", pkts, bytes);
+	fputc(':', stdout);
+	fputs(chain, stdout);
+	fputc(' ', stdout);
+	fputs(policy ?: "-", stdout);
+	print_counter_pair(" [", pkts, ':', bytes, "]\n");
 }
 
 void save_matches_and_target(const struct iptables_command_state *cs,
@@ -849,29 +905,29 @@ void save_matches_and_target(const struct iptables_command_state *cs,
 	struct xtables_rule_match *matchp;
 
 	for (matchp = cs->matches; matchp; matchp = matchp->next) {
-		if (matchp->match->alias) {
-			printf("-m %s",
-			       matchp->match->alias(matchp->match->m));
-		} else
-			printf("-m %s", matchp->match->name);
+		fputs("-m ", stdout);
+		if (matchp->match->alias)
+			fputs(matchp->match->alias(matchp->match->m), stdout);
+		else
+			fputs(matchp->match->name, stdout);
 
 		if (matchp->match->save != NULL) {
 			/* cs->fw union makes the trick */
 			matchp->match->save(fw, matchp->match->m);
 		}
-		printf(" ");
+		fputc(' ', stdout);
 	}
 
 	if ((format & (FMT_NOCOUNTS | FMT_C_COUNTS)) == FMT_C_COUNTS)
-		printf("-c %llu %llu ",
-		       (unsigned long long)cs->counters.pcnt,
-		       (unsigned long long)cs->counters.bcnt);
+		print_counter_pair("-c ", cs->counters.pcnt, ' ',
+				   cs->counters.bcnt, " ");
 
 	if (cs->target != NULL) {
-		if (cs->target->alias) {
-			printf("-j %s", cs->target->alias(cs->target->t));
-		} else
-			printf("-j %s", cs->jumpto);
+		fputs("-j ", stdout);
+		if (cs->target->alias)
+			fputs(cs->target->alias(cs->target->t), stdout);
+		else
+			fputs(cs->jumpto, stdout);
 
 		if (cs->target->save != NULL)
 			cs->target->save(fw, cs->target->t);
@@ -879,7 +935,7 @@ void save_matches_and_target(const struct iptables_command_state *cs,
 		printf("-%c %s", goto_flag ? 'g' : 'j', cs->jumpto);
 	}
 
-	printf("\n");
+	fputc('\n', stdout);
 }
 
 void print_matches_and_target(struct iptables_command_state *cs,
@@ -88,7 +88,9 @@ static void mnl_genid_get(struct nft_handle *h, uint32_t *genid)
 	int ret;
 
 	nlh = nftnl_nlmsg_build_hdr(buf, NFT_MSG_GETGEN, 0, 0, h->seq);
+	xs_profile_begin(XS_PROF_CACHE_GENID);
 	ret = mnl_talk(h, nlh, genid_cb, genid);
+	xs_profile_end(XS_PROF_CACHE_GENID);
 	if (ret == 0)
 		return;
 
@@ -96,23 +98,128 @@ static void mnl_genid_get(struct nft_handle *h, uint32_t *genid)
 		      "Could not fetch rule set generation id: %s\n", nft_strerror(errno));
 }
 
+static int nft_netlink_open(struct nft_handle *h)
+{
+	h->nl = mnl_socket_open(NETLINK_NETFILTER);
+	if (h->nl == NULL)
+		return -1;
+
+	if (mnl_socket_bind(h->nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+		mnl_socket_close(h->nl);
+		h->nl = NULL;
+		return -1;
+	}
+
+	h->portid = mnl_socket_get_portid(h->nl);
+	return 0;
+}
+
+static void nft_netlink_close(struct nft_handle *h)
+{
+	mnl_socket_close(h->nl);
+	h->nl = NULL;
+}
+
+static ssize_t nft_netlink_sendmsg(struct nft_handle *h,
+				   const struct iovec *iov, int iovlen)
+{
+	static const struct sockaddr_nl snl = {
+		.nl_family = AF_NETLINK
+	};
+	struct msghdr msg = {
+		.msg_name	= (struct sockaddr *) &snl,
+		.msg_namelen	= sizeof(snl),
+		.msg_iov	= (struct iovec *)iov,
+		.msg_iovlen	= iovlen,
+	};
+
+	return sendmsg(mnl_socket_get_fd(h->nl), &msg, 0);
+}
+
+static ssize_t nft_netlink_recv(struct nft_handle *h, void *buf, size_t len)
+{
+	return mnl_socket_recvfrom(h->nl, buf, len);
+}
+
+static int nft_netlink_pending(struct nft_handle *h)
+{
+	int ret, fd = mnl_socket_get_fd(h->nl);
+	fd_set readfds;
+	struct timeval tv = {
+		.tv_sec		= 0,
+		.tv_usec	= 0
+	};
+
+	FD_ZERO(&readfds);
+	FD_SET(fd, &readfds);
+
+	ret = select(fd+1, &readfds, NULL, NULL, &tv);
+	if (ret <= 0)
+		return ret;
+
+	return FD_ISSET(fd, &readfds);
+}
+
+static int nft_netlink_setbuf(struct nft_handle *h, int opt, int size)
+{
+	return setsockopt(mnl_socket_get_fd(h->nl), SOL_SOCKET, opt,
+			  &size, sizeof(socklen_t));
+}
+
+const struct nft_transport nft_transport_netlink = {
+	.name		= "netlink",
+	.open		= nft_netlink_open,
+	.close		= nft_netlink_close,
+	.sendmsg	= nft_netlink_sendmsg,
+	.recv		= nft_netlink_recv,
+	.pending	= nft_netlink_pending,
+	.setbuf		= nft_netlink_setbuf,
+};
+
+/*
+ * The transport of handles that do not set their own: the kernel, unless
+ * XTABLES_NFT_TRANSPORT names another one. NULL if it names none.
+ */
+const struct nft_transport *nft_transport_default(void)
+{
+	static const struct nft_transport *transports[] = {
+		&nft_transport_netlink,
+		&nft_transport_memory,
+	};
+	const char *name = getenv("XTABLES_NFT_TRANSPORT");
+	unsigned int i;
+
+	if (name == NULL || *name == '\0')
+		return &nft_transport_netlink;
+
+	for (i = 0; i < ARRAY_SIZE(transports); i++) {
+		if (strcmp(name, transports[i]->name) == 0)
+			return transports[i];
+	}
+	return NULL;
+}
+
 int mnl_talk(struct nft_handle *h, struct nlmsghdr *nlh,
 	     int (*cb)(const struct nlmsghdr *nlh, void *data),
 	     void *data)
 {
+	struct iovec iov = {
+		.iov_base	= nlh,
+		.iov_len	= nlh->nlmsg_len,
+	};
 	int ret;
 	char buf[16536];
 
-	if (mnl_socket_sendto(h->nl, nlh, nlh->nlmsg_len) < 0)
+	if (h->transport->sendmsg(h, &iov, 1) < 0)
 		return -1;
 
-	ret = mnl_socket_recvfrom(h->nl, buf, sizeof(buf));
+	ret = h->transport->recv(h, buf, sizeof(buf));
 	while (ret > 0) {
 		ret = mnl_cb_run(buf, ret, h->seq, h->portid, cb, data);
 		if (ret <= 0)
 			break;
 
-		ret = mnl_socket_recvfrom(h->nl, buf, sizeof(buf));
+		ret = h->transport->recv(h, buf, sizeof(buf));
 	}
 	if (ret == -1) {
 		return -1;
@@ -191,16 +298,13 @@ static void mnl_err_list_free(struct mnl_err *err)
 	free(err);
 }
 
-static void mnl_set_sndbuffer(struct nft_handle *h)
+static void mnl_set_sndbuffer(struct nft_handle *h, int newbuffsiz)
 {
-	int newbuffsiz = nftnl_batch_iovec_len(h->batch) * BATCH_PAGE_SIZE;
-
 	if (newbuffsiz <= h->nlsndbuffsiz)
 		return;
 
 	/* Rise sender buffer length to avoid hitting -EMSGSIZE */
-	if (setsockopt(mnl_socket_get_fd(h->nl), SOL_SOCKET, SO_SNDBUFFORCE,
-		       &newbuffsiz, sizeof(socklen_t)) < 0)
+	if (h->transport->setbuf(h, SO_SNDBUFFORCE, newbuffsiz) < 0)
 		return;
 
 	h->nlsndbuffsiz = newbuffsiz;
@@ -214,8 +318,7 @@ static void mnl_set_rcvbuffer(struct nft_handle *h, int numcmds)
 		return;
 
 	/* Rise receiver buffer length to avoid hitting -ENOBUFS */
-	if (setsockopt(mnl_socket_get_fd(h->nl), SOL_SOCKET, SO_RCVBUFFORCE,
-		       &newbuffsiz, sizeof(socklen_t)) < 0)
+	if (h->transport->setbuf(h, SO_RCVBUFFORCE, newbuffsiz) < 0)
 		return;
 
 	h->nlrcvbuffsiz = newbuffsiz;
@@ -223,74 +326,56 @@ static void mnl_set_rcvbuffer(struct nft_handle *h, int numcmds)
 
 static ssize_t mnl_nft_socket_sendmsg(struct nft_handle *h, int numcmds)
 {
-	static const struct sockaddr_nl snl = {
-		.nl_family = AF_NETLINK
-	};
 	uint32_t iov_len = nftnl_batch_iovec_len(h->batch);
 	struct iovec iov[iov_len];
-	struct msghdr msg = {
-		.msg_name	= (struct sockaddr *) &snl,
-		.msg_namelen	= sizeof(snl),
-		.msg_iov	= iov,
-		.msg_iovlen	= iov_len,
-	};
 
-	mnl_set_sndbuffer(h);
+	mnl_set_sndbuffer(h, iov_len * BATCH_PAGE_SIZE);
 	mnl_set_rcvbuffer(h, numcmds);
 	nftnl_batch_iovec(h->batch, iov, iov_len);
 
-	return sendmsg(mnl_socket_get_fd(h->nl), &msg, 0);
+	return h->transport->sendmsg(h, iov, iov_len);
 }
 
-static int mnl_batch_talk(struct nft_handle *h, int numcmds)
+/* Collect the acknowledgments of a batch sent, errors go to h->err_list. */
+static int mnl_batch_acks(struct nft_handle *h)
 {
-	const struct mnl_socket *nl = h->nl;
-	int ret, fd = mnl_socket_get_fd(nl), portid = mnl_socket_get_portid(nl);
 	char rcv_buf[MNL_SOCKET_BUFFER_SIZE];
-	fd_set readfds;
-	struct timeval tv = {
-		.tv_sec		= 0,
-		.tv_usec	= 0
-	};
-	int err = 0;
-
-	ret = mnl_nft_socket_sendmsg(h, numcmds);
-	if (ret == -1)
-		return -1;
-
-	FD_ZERO(&readfds);
-	FD_SET(fd, &readfds);
+	int ret, err = 0;
 
 	/* receive and digest all the acknowledgments from the kernel. */
-	ret = select(fd+1, &readfds, NULL, NULL, &tv);
-	if (ret == -1)
-		return -1;
-
-	while (ret > 0 && FD_ISSET(fd, &readfds)) {
+	while ((ret = h->transport->pending(h)) > 0) {
 		struct nlmsghdr *nlh = (struct nlmsghdr *)rcv_buf;
 
-		ret = mnl_socket_recvfrom(nl, rcv_buf, sizeof(rcv_buf));
+		ret = h->transport->recv(h, rcv_buf, sizeof(rcv_buf));
 		if (ret == -1)
 			return -1;
 
-		ret = mnl_cb_run(rcv_buf, ret, 0, portid, NULL, NULL);
+		ret = mnl_cb_run(rcv_buf, ret, 0, h->portid, NULL, NULL);
 		/* Continue on error, make sure we get all acknowledgments */
 		if (ret == -1) {
 			mnl_err_list_node_add(&h->err_list, errno,
 					      nlh->nlmsg_seq);
 			err = -1;
 		}
-
-		ret = select(fd+1, &readfds, NULL, NULL, &tv);
-		if (ret == -1)
-			return -1;
-
-		FD_ZERO(&readfds);
-		FD_SET(fd, &readfds);
 	}
+	if (ret == -1)
+		return -1;
+
 	return err;
 }
 
+static int mnl_batch_talk(struct nft_handle *h, int numcmds)
+{
+	int ret = -1;
+
+	xs_profile_begin(XS_PROF_TALK);
+	if (mnl_nft_socket_sendmsg(h, numcmds) != -1)
+		ret = mnl_batch_acks(h);
+	xs_profile_end(XS_PROF_TALK);
+
+	return ret;
+}
+
 enum obj_update_type {
 	NFT_COMPAT_TABLE_ADD,
 	NFT_COMPAT_TABLE_FLUSH,
@@ -799,16 +884,11 @@ static bool nft_chain_builtin(struct nftnl_chain *c)
 
 static int nft_restart(struct nft_handle *h)
 {
-	mnl_socket_close(h->nl);
+	h->transport->close(h);
 
-	h->nl = mnl_socket_open(NETLINK_NETFILTER);
-	if (h->nl == NULL)
-		return -1;
-
-	if (mnl_socket_bind(h->nl, 0, MNL_SOCKET_AUTOPID) < 0)
+	if (h->transport->open(h) < 0)
 		return -1;
 
-	h->portid = mnl_socket_get_portid(h->nl);
 	h->nlsndbuffsiz = 0;
 	h->nlrcvbuffsiz = 0;
 
@@ -817,21 +897,22 @@ static int nft_restart(struct nft_handle *h)
 
 int nft_init(struct nft_handle *h, const struct builtin_table *t)
 {
-	h->nl = mnl_socket_open(NETLINK_NETFILTER);
-	if (h->nl == NULL)
+	if (h->transport == NULL)
+		h->transport = nft_transport_default();
+	if (h->transport == NULL) {
+		errno = EINVAL;
 		return -1;
+	}
 
-	if (mnl_socket_bind(h->nl, 0, MNL_SOCKET_AUTOPID) < 0) {
-		mnl_socket_close(h->nl);
+	if (h->transport->open(h) < 0)
 		return -1;
-	}
 
-	h->portid = mnl_socket_get_portid(h->nl);
 	h->tables = t;
 	h->cache = &h->__cache[0];
 
 	INIT_LIST_HEAD(&h->obj_list);
 	INIT_LIST_HEAD(&h->err_list);
+	INIT_LIST_HEAD(&h->diff_list);
 
 	return 0;
 }
@@ -900,7 +981,7 @@ static void flush_chain_cache(struct nft_handle *h, const char *tablename)
 void nft_fini(struct nft_handle *h)
 {
 	flush_chain_cache(h, NULL);
-	mnl_socket_close(h->nl);
+	h->transport->close(h);
 }
 
 static void nft_chain_print_debug(struct nftnl_chain *c, struct nlmsghdr *nlh)
@@ -1264,6 +1345,8 @@ err:
 
 static struct nftnl_chain *
 nft_chain_find(struct nft_handle *h, const char *table, const char *chain);
+static int nft_rule_diff(struct nft_handle *h, const char *chain,
+			 const char *table, void *data, bool verbose);
 
 int
 nft_rule_append(struct nft_handle *h, const char *chain, const char *table,
@@ -1275,6 +1358,9 @@ nft_rule_append(struct nft_handle *h, const char *chain, const char *table,
 
 	nft_xt_builtin_init(h, table);
 
+	if (h->diff && !ref)
+		return nft_rule_diff(h, chain, table, data, verbose);
+
 	nft_fn = nft_rule_append;
 
 	r = nft_rule_new(h, chain, table, data);
@@ -1405,7 +1491,9 @@ static int fetch_table_cache(struct nft_handle *h)
 	nlh = nftnl_rule_nlmsg_build_hdr(buf, NFT_MSG_GETTABLE, h->family,
 					NLM_F_DUMP, h->seq);
 
+	xs_profile_begin(XS_PROF_CACHE_TABLES);
 	ret = mnl_talk(h, nlh, nftnl_table_list_cb, list);
+	xs_profile_end(XS_PROF_CACHE_TABLES);
 	if (ret < 0 && errno == EINTR)
 		assert(nft_restart(h) >= 0);
 
@@ -1436,7 +1524,9 @@ static int fetch_chain_cache(struct nft_handle *h)
 	nlh = nftnl_chain_nlmsg_build_hdr(buf, NFT_MSG_GETCHAIN, h->family,
 					NLM_F_DUMP, h->seq);
 
+	xs_profile_begin(XS_PROF_CACHE_CHAINS);
 	ret = mnl_talk(h, nlh, nftnl_chain_list_cb, h);
+	xs_profile_end(XS_PROF_CACHE_CHAINS);
 	if (ret < 0 && errno == EINTR)
 		assert(nft_restart(h) >= 0);
 
@@ -1596,19 +1686,25 @@ static void __nft_build_cache(struct nft_handle *h)
 {
 	uint32_t genid_start, genid_stop;
 
+	xs_profile_begin(XS_PROF_CACHE);
 retry:
 	mnl_genid_get(h, &genid_start);
 	fetch_chain_cache(h);
+	xs_profile_begin(XS_PROF_CACHE_RULES);
 	fetch_rule_cache(h);
+	xs_profile_end(XS_PROF_CACHE_RULES);
 	h->have_cache = true;
 	mnl_genid_get(h, &genid_stop);
 
 	if (genid_start != genid_stop) {
+		xs_profile_begin(XS_PROF_CACHE_RETRY);
 		flush_chain_cache(h, NULL);
+		xs_profile_end(XS_PROF_CACHE_RETRY);
 		goto retry;
 	}
 
 	h->nft_genid = genid_start;
+	xs_profile_end(XS_PROF_CACHE);
 }
 
 void nft_build_cache(struct nft_handle *h)
@@ -1635,6 +1731,24 @@ static void nft_rebuild_cache(struct nft_handle *h)
 	__nft_build_cache(h);
 }
 
+/**
+ * nft_cache_refresh - bring a kept cache up to date with the kernel
+ * @h:	handle whose cache outlives a single command
+ *
+ * Rebuilds the cache only if the ruleset changed since it was fetched.
+ */
+void nft_cache_refresh(struct nft_handle *h)
+{
+	uint32_t genid;
+
+	if (!h->have_cache)
+		return;
+
+	mnl_genid_get(h, &genid);
+	if (genid != h->nft_genid)
+		nft_rebuild_cache(h);
+}
+
 static void nft_release_cache(struct nft_handle *h)
 {
 	if (h->cache_index)
@@ -2428,132 +2542,439 @@ int nft_rule_replace(struct nft_handle *h, const char *chain,
 	return ret;
 }
 
-static int
-__nft_rule_list(struct nft_handle *h, struct nftnl_chain *c,
-		int rulenum, unsigned int format,
-		void (*cb)(struct nftnl_rule *r, unsigned int num,
-			   unsigned int format))
-{
-	struct nftnl_rule_iter *iter;
-	struct nftnl_rule *r;
-	int rule_ctr = 0;
+/*
+ * Differential restore: the rules found in a chain are indexed by a digest
+ * of their expressions and matched in order against the rules appended to
+ * it, so unchanged rules stay in place with their counters and only the
+ * difference goes into the batch.
+ */
+struct nft_diff_rule {
+	struct nftnl_rule	*r;
+	uint64_t		digest;
+	int			next;	/* next old rule in the same bucket */
+};
 
-	if (rulenum > 0) {
-		r = nftnl_rule_lookup_byindex(c, rulenum - 1);
-		if (!r)
-			/* iptables-legacy returns 0 when listing for
-			 * valid chain but invalid rule number
-			 */
-			return 1;
-		cb(r, rulenum, format);
-		return 1;
-	}
+struct nft_diff_chain {
+	struct list_head	head;
+	struct nftnl_chain	*c;
+	struct nft_diff_rule	*old;
+	int			*hash;	/* first old rule per bucket, or -1 */
+	unsigned int		nold;
+	unsigned int		hsize;
+	unsigned int		pos;	/* first old rule not matched yet */
+};
 
-	iter = nftnl_rule_iter_create(c);
-	if (iter == NULL)
-		return 0;
+static uint64_t nft_diff_fnv(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
 
-	r = nftnl_rule_iter_next(iter);
-	while (r != NULL) {
-		cb(r, ++rule_ctr, format);
-		r = nftnl_rule_iter_next(iter);
+	while (len--) {
+		h ^= *p++;
+		h *= 1099511628211ULL;
 	}
-
-	nftnl_rule_iter_destroy(iter);
-	return 1;
+	return h;
 }
 
-static int nft_rule_count(struct nft_handle *h, struct nftnl_chain *c)
+/* Counters are left out, they differ even between equal rules. */
+static uint64_t nft_rule_digest(struct nftnl_rule *r)
 {
-	struct nftnl_rule_iter *iter;
-	struct nftnl_rule *r;
-	int rule_ctr = 0;
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	uint64_t digest = 14695981039346656037ULL;
+	struct nftnl_expr_iter *iter;
+	struct nlmsghdr *nlh;
+	struct nftnl_expr *e;
+	const void *udata;
+	uint32_t len;
 
-	iter = nftnl_rule_iter_create(c);
+	iter = nftnl_expr_iter_create(r);
 	if (iter == NULL)
-		return 0;
+		return digest;
 
-	r = nftnl_rule_iter_next(iter);
-	while (r != NULL) {
-		rule_ctr++;
-		r = nftnl_rule_iter_next(iter);
+	while ((e = nftnl_expr_iter_next(iter)) != NULL) {
+		if (!strcmp(nftnl_expr_get_str(e, NFTNL_EXPR_NAME), "counter"))
+			continue;
+
+		nlh = mnl_nlmsg_put_header(buf);
+		nftnl_expr_build_payload(nlh, e);
+		digest = nft_diff_fnv(digest, mnl_nlmsg_get_payload(nlh),
+				      mnl_nlmsg_get_payload_len(nlh));
 	}
+	nftnl_expr_iter_destroy(iter);
 
-	nftnl_rule_iter_destroy(iter);
-	return rule_ctr;
+	udata = nftnl_rule_get_data(r, NFTNL_RULE_USERDATA, &len);
+	if (udata)
+		digest = nft_diff_fnv(digest, udata, len);
+
+	return digest;
 }
 
-static void __nft_print_header(struct nft_handle *h,
-			       const struct nft_family_ops *ops,
-			       struct nftnl_chain *c, unsigned int format)
+static void nft_diff_free(struct nft_diff_chain *d)
 {
-	const char *chain_name = nftnl_chain_get_str(c, NFTNL_CHAIN_NAME);
-	bool basechain = !!nftnl_chain_get(c, NFTNL_CHAIN_HOOKNUM);
-	uint32_t refs = nftnl_chain_get_u32(c, NFTNL_CHAIN_USE);
-	uint32_t entries = nft_rule_count(h, c);
-	struct xt_counters ctrs = {
-		.pcnt = nftnl_chain_get_u64(c, NFTNL_CHAIN_PACKETS),
-		.bcnt = nftnl_chain_get_u64(c, NFTNL_CHAIN_BYTES),
-	};
-	const char *pname = NULL;
+	list_del(&d->head);
+	free(d->old);
+	free(d->hash);
+	free(d);
+}
 
-	if (nftnl_chain_is_set(c, NFTNL_CHAIN_POLICY))
-		pname = policy_name[nftnl_chain_get_u32(c, NFTNL_CHAIN_POLICY)];
+/* Most recently used first, appends come chain by chain. */
+static struct nft_diff_chain *
+nft_diff_lookup(struct nft_handle *h, struct nftnl_chain *c)
+{
+	struct nft_diff_chain *d;
 
-	ops->print_header(format, chain_name, pname,
-			&ctrs, basechain, refs - entries, entries);
+	list_for_each_entry(d, &h->diff_list, head) {
+		if (d->c != c)
+			continue;
+		list_move(&d->head, &h->diff_list);
+		return d;
+	}
+	return NULL;
 }
 
-int nft_rule_list(struct nft_handle *h, const char *chain, const char *table,
-		  int rulenum, unsigned int format)
+/* Declare @chain part of the new ruleset, creating it if needed. */
+int nft_diff_chain(struct nft_handle *h, const char *table, const char *chain)
 {
-	const struct nft_family_ops *ops;
-	struct nftnl_chain_list *list;
-	struct nftnl_chain_list_iter *iter;
+	struct nftnl_rule_iter *iter;
+	struct nft_diff_chain *d;
+	struct nftnl_rule *r;
 	struct nftnl_chain *c;
-	bool found = false;
+	unsigned int i, size = 0;
+	int b;
 
-	nft_xt_builtin_init(h, table);
+	nft_fn = nft_diff_chain;
 
-	ops = nft_family_ops_lookup(h->family);
+	nft_xt_builtin_init(h, table);
 
-	if (!nft_is_table_compatible(h, table)) {
-		xtables_error(OTHER_PROBLEM, "table `%s' is incompatible, use 'nft' tool.\n", table);
-		return 0;
+	c = nft_chain_find(h, table, chain);
+	if (!c) {
+		if (nft_chain_restore(h, chain, table) < 0)
+			return -1;
+		c = nft_chain_find(h, table, chain);
 	}
+	if (!c || nft_diff_lookup(h, c))
+		return c ? 0 : -1;
 
-	list = nft_chain_list_get(h, table);
-	if (!list)
-		return 0;
-
-	if (chain) {
-		c = nftnl_chain_list_lookup_byname(list, chain);
-		if (!c)
-			return 0;
+	d = xtables_calloc(1, sizeof(*d));
+	d->c = c;
 
-		if (!rulenum) {
-			if (ops->print_table_header)
-				ops->print_table_header(table);
-			__nft_print_header(h, ops, c, format);
+	iter = nftnl_rule_iter_create(c);
+	if (iter == NULL) {
+		free(d);
+		return -1;
+	}
+	while ((r = nftnl_rule_iter_next(iter)) != NULL) {
+		if (d->nold == size) {
+			size = size ? size * 2 : 64;
+			d->old = xtables_realloc(d->old,
+						 size * sizeof(*d->old));
 		}
-		__nft_rule_list(h, c, rulenum, format, ops->print_rule);
-		return 1;
+		d->old[d->nold].r = r;
+		d->old[d->nold++].digest = nft_rule_digest(r);
 	}
+	nftnl_rule_iter_destroy(iter);
 
-	iter = nftnl_chain_list_iter_create(list);
-	if (iter == NULL)
-		return 0;
+	d->hsize = d->nold * 2 + 1;
+	d->hash = xtables_malloc(d->hsize * sizeof(*d->hash));
+	for (i = 0; i < d->hsize; i++)
+		d->hash[i] = -1;
 
-	if (ops->print_table_header)
-		ops->print_table_header(table);
+	/* push backwards, so each bucket is in chain order */
+	for (i = d->nold; i-- > 0; ) {
+		b = d->old[i].digest % d->hsize;
+		d->old[i].next = d->hash[b];
+		d->hash[b] = i;
+	}
 
-	c = nftnl_chain_list_iter_next(iter);
-	while (c != NULL) {
-		if (found)
-			printf("\n");
+	list_add(&d->head, &h->diff_list);
+	return 0;
+}
 
-		__nft_print_header(h, ops, c, format);
-		__nft_rule_list(h, c, rulenum, format, ops->print_rule);
+/* Whether @policy still has to be set on @chain.  If the verdict changes,
+ * @counters carries the current ones over.
+ */
+bool nft_diff_policy(struct nft_handle *h, const char *table,
+		     const char *chain, const char *policy,
+		     struct xt_counters *counters)
+{
+	struct nftnl_chain *c;
+	uint32_t pol;
+
+	c = nft_chain_find(h, table, chain);
+	if (!c || !nftnl_chain_is_set(c, NFTNL_CHAIN_POLICY))
+		return true;
+
+	pol = nftnl_chain_get_u32(c, NFTNL_CHAIN_POLICY);
+	if (pol <= NF_ACCEPT && strcmp(policy_name[pol], policy) == 0)
+		return false;
+
+	counters->pcnt = nftnl_chain_get_u64(c, NFTNL_CHAIN_PACKETS);
+	counters->bcnt = nftnl_chain_get_u64(c, NFTNL_CHAIN_BYTES);
+	return true;
+}
+
+/* Position of the first old rule from the cursor on equal to @data. */
+static int nft_diff_find(struct nft_handle *h, struct nft_diff_chain *d,
+			 uint64_t digest, void *data)
+{
+	int *first, i;
+
+	if (d->pos == d->nold)
+		return -1;
+
+	/* rules behind the cursor may be gone, unlink them first */
+	first = &d->hash[digest % d->hsize];
+	while (*first >= 0 && (unsigned int)*first < d->pos)
+		*first = d->old[*first].next;
+
+	for (i = *first; i >= 0; i = d->old[i].next) {
+		if (d->old[i].digest == digest &&
+		    h->ops->rule_find(h->ops, d->old[i].r, data))
+			return i;
+	}
+	return -1;
+}
+
+static int nft_rule_diff(struct nft_handle *h, const char *chain,
+			 const char *table, void *data, bool verbose)
+{
+	struct nft_diff_chain *d;
+	struct nftnl_rule *r, *ref;
+	struct nftnl_chain *c;
+	int i;
+
+	nft_fn = nft_rule_append;
+
+	c = nft_chain_find(h, table, chain);
+	if (!c) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	d = nft_diff_lookup(h, c);
+	if (!d) {
+		if (nft_diff_chain(h, table, chain) < 0)
+			return 0;
+		d = nft_diff_lookup(h, c);
+	}
+
+	r = nft_rule_new(h, chain, table, data);
+	if (r == NULL)
+		return 0;
+
+	i = nft_diff_find(h, d, nft_rule_digest(r), data);
+	if (i >= 0) {
+		while (d->pos < (unsigned int)i)
+			__nft_rule_del(h, d->old[d->pos++].r);
+		d->pos++;
+		nftnl_rule_free(r);
+		return 1;
+	}
+
+	ref = d->pos < d->nold ? d->old[d->pos].r : NULL;
+	if (ref)
+		nftnl_rule_set_u64(r, NFTNL_RULE_POSITION,
+				   nftnl_rule_get_u64(ref, NFTNL_RULE_HANDLE));
+
+	if (batch_rule_add(h, ref ? NFT_COMPAT_RULE_INSERT :
+				    NFT_COMPAT_RULE_APPEND, r) == NULL) {
+		nftnl_rule_free(r);
+		return 0;
+	}
+
+	if (verbose)
+		h->ops->print_rule(r, 0, FMT_PRINT_RULE);
+
+	if (ref)
+		nftnl_chain_rule_insert_at(r, ref);
+	else
+		nftnl_chain_rule_add_tail(r, c);
+
+	return 1;
+}
+
+/* Finish a differential restore of @table: delete the old rules nothing
+ * matched, flush the built-in chains that were not declared and delete
+ * such user-defined chains once no rule jumps to them any more.
+ */
+int nft_diff_end(struct nft_handle *h, const char *table)
+{
+	struct nftnl_chain_list_iter *iter;
+	struct nft_diff_chain *d, *tmp;
+	struct nftnl_chain_list *list;
+	struct nftnl_chain *c;
+	const char *name;
+	int ret = 1;
+
+	nft_fn = nft_diff_end;
+
+	list = nft_chain_list_get(h, table);
+	if (list == NULL)
+		return 0;
+
+	iter = nftnl_chain_list_iter_create(list);
+	if (iter == NULL)
+		return 0;
+
+	while ((c = nftnl_chain_list_iter_next(iter)) != NULL) {
+		d = nft_diff_lookup(h, c);
+		if (d) {
+			while (d->pos < d->nold)
+				__nft_rule_del(h, d->old[d->pos++].r);
+			continue;
+		}
+
+		name = nftnl_chain_get_str(c, NFTNL_CHAIN_NAME);
+		__nft_rule_flush(h, table, name, false, false);
+		flush_rule_cache(c);
+	}
+	nftnl_chain_list_iter_destroy(iter);
+
+	iter = nftnl_chain_list_iter_create(list);
+	if (iter == NULL)
+		return 0;
+
+	while ((c = nftnl_chain_list_iter_next(iter)) != NULL) {
+		if (nft_chain_builtin(c) || nft_diff_lookup(h, c))
+			continue;
+
+		name = nftnl_chain_get_str(c, NFTNL_CHAIN_NAME);
+		if (!nft_chain_user_del(h, name, table, false))
+			ret = 0;
+	}
+	nftnl_chain_list_iter_destroy(iter);
+
+	list_for_each_entry_safe(d, tmp, &h->diff_list, head)
+		nft_diff_free(d);
+
+	return ret;
+}
+
+static int
+__nft_rule_list(struct nft_handle *h, struct nftnl_chain *c,
+		int rulenum, unsigned int format,
+		void (*cb)(struct nftnl_rule *r, unsigned int num,
+			   unsigned int format))
+{
+	struct nftnl_rule_iter *iter;
+	struct nftnl_rule *r;
+	int rule_ctr = 0;
+
+	if (rulenum > 0) {
+		r = nftnl_rule_lookup_byindex(c, rulenum - 1);
+		if (!r)
+			/* iptables-legacy returns 0 when listing for
+			 * valid chain but invalid rule number
+			 */
+			return 1;
+		cb(r, rulenum, format);
+		return 1;
+	}
+
+	iter = nftnl_rule_iter_create(c);
+	if (iter == NULL)
+		return 0;
+
+	r = nftnl_rule_iter_next(iter);
+	while (r != NULL) {
+		cb(r, ++rule_ctr, format);
+		r = nftnl_rule_iter_next(iter);
+	}
+
+	nftnl_rule_iter_destroy(iter);
+	return 1;
+}
+
+static int nft_rule_count(struct nft_handle *h, struct nftnl_chain *c)
+{
+	struct nftnl_rule_iter *iter;
+	struct nftnl_rule *r;
+	int rule_ctr = 0;
+
+	iter = nftnl_rule_iter_create(c);
+	if (iter == NULL)
+		return 0;
+
+	r = nftnl_rule_iter_next(iter);
+	while (r != NULL) {
+		rule_ctr++;
+		r = nftnl_rule_iter_next(iter);
+	}
+
+	nftnl_rule_iter_destroy(iter);
+	return rule_ctr;
+}
+
+static void __nft_print_header(struct nft_handle *h,
+			       const struct nft_family_ops *ops,
+			       struct nftnl_chain *c, unsigned int format)
+{
+	const char *chain_name = nftnl_chain_get_str(c, NFTNL_CHAIN_NAME);
+	bool basechain = !!nftnl_chain_get(c, NFTNL_CHAIN_HOOKNUM);
+	uint32_t refs = nftnl_chain_get_u32(c, NFTNL_CHAIN_USE);
+	uint32_t entries = nft_rule_count(h, c);
+	struct xt_counters ctrs = {
+		.pcnt = nftnl_chain_get_u64(c, NFTNL_CHAIN_PACKETS),
+		.bcnt = nftnl_chain_get_u64(c, NFTNL_CHAIN_BYTES),
+	};
+	const char *pname = NULL;
+
+	if (nftnl_chain_is_set(c, NFTNL_CHAIN_POLICY))
+		pname = policy_name[nftnl_chain_get_u32(c, NFTNL_CHAIN_POLICY)];
+
+	ops->print_header(format, chain_name, pname,
+			&ctrs, basechain, refs - entries, entries);
+}
+
+int nft_rule_list(struct nft_handle *h, const char *chain, const char *table,
+		  int rulenum, unsigned int format)
+{
+	const struct nft_family_ops *ops;
+	struct nftnl_chain_list *list;
+	struct nftnl_chain_list_iter *iter;
+	struct nftnl_chain *c;
+	bool found = false;
+
+	nft_xt_builtin_init(h, table);
+
+	ops = nft_family_ops_lookup(h->family);
+
+	if (!nft_is_table_compatible(h, table)) {
+		xtables_error(OTHER_PROBLEM, "table `%s' is incompatible, use 'nft' tool.\n", table);
+		return 0;
+	}
+
+	list = nft_chain_list_get(h, table);
+	if (!list)
+		return 0;
+
+	if (chain) {
+		c = nftnl_chain_list_lookup_byname(list, chain);
+		if (!c)
+			return 0;
+
+		if (!rulenum) {
+			if (ops->print_table_header)
+				ops->print_table_header(table);
+			__nft_print_header(h, ops, c, format);
+		}
+		__nft_rule_list(h, c, rulenum, format, ops->print_rule);
+		return 1;
+	}
+
+	iter = nftnl_chain_list_iter_create(list);
+	if (iter == NULL)
+		return 0;
+
+	if (ops->print_table_header)
+		ops->print_table_header(table);
+
+	c = nftnl_chain_list_iter_next(iter);
+	while (c != NULL) {
+		if (found)
+			printf("\n");
+
+		__nft_print_header(h, ops, c, format);
+		__nft_rule_list(h, c, rulenum, format, ops->print_rule);
 
 		found = true;
 		c = nftnl_chain_list_iter_next(iter);
@@ -2642,22 +3063,190 @@ int nft_rule_list_save(struct nft_handle *h, const char *chain,
 		c = nftnl_chain_list_lookup_byname(list, chain);
 		if (!c)
 			return 0;
-
-		return __nft_rule_list(h, c, rulenum, format, list_save);
+
+		return __nft_rule_list(h, c, rulenum, format, list_save);
+	}
+
+	/* Now dump out rules in this table */
+	iter = nftnl_chain_list_iter_create(list);
+	if (iter == NULL)
+		return 0;
+
+	c = nftnl_chain_list_iter_next(iter);
+	while (c != NULL) {
+		ret = __nft_rule_list(h, c, rulenum, format, list_save);
+		c = nftnl_chain_list_iter_next(iter);
+	}
+	nftnl_chain_list_iter_destroy(iter);
+	return ret;
+}
+
+struct rule_reset_data {
+	struct nftnl_rule	**rules;
+	unsigned int		num, size;
+};
+
+static int nft_rule_reset_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct rule_reset_data *d = data;
+	struct nftnl_rule *r;
+
+	r = nftnl_rule_alloc();
+	if (r == NULL)
+		return MNL_CB_ERROR;
+
+	if (nftnl_rule_nlmsg_parse(nlh, r) < 0) {
+		nftnl_rule_free(r);
+		return MNL_CB_ERROR;
+	}
+
+	if (d->num == d->size) {
+		d->size = d->size ? d->size * 2 : 64;
+		d->rules = xtables_realloc(d->rules,
+					   d->size * sizeof(*d->rules));
+	}
+	d->rules[d->num++] = r;
+	return MNL_CB_OK;
+}
+
+/* Put the rules read through NFT_MSG_GETRULE_RESET in place of the cached
+ * ones: the rule at @rulenum of @chain, all rules of @chain or all of the
+ * table.
+ */
+static void nft_rule_reset_update(struct nft_handle *h,
+				  struct nftnl_chain_list *list,
+				  struct nftnl_chain *c, int rulenum,
+				  struct rule_reset_data *d)
+{
+	struct nftnl_chain_list_iter *iter;
+	struct nftnl_chain *cur;
+	struct nftnl_rule *old;
+	unsigned int i;
+
+	if (rulenum >= 0) {
+		old = nftnl_rule_lookup_byindex(c, rulenum);
+		nftnl_chain_rule_insert_at(d->rules[0], old);
+		nftnl_chain_rule_del(old);
+		nftnl_rule_free(old);
+		return;
+	}
+
+	if (c) {
+		flush_rule_cache(c);
+	} else {
+		iter = nftnl_chain_list_iter_create(list);
+		while ((cur = nftnl_chain_list_iter_next(iter)))
+			flush_rule_cache(cur);
+		nftnl_chain_list_iter_destroy(iter);
+	}
+
+	for (i = 0; i < d->num; i++) {
+		cur = c;
+		if (!cur)
+			cur = nftnl_chain_list_lookup_byname(list,
+					nftnl_rule_get_str(d->rules[i],
+							   NFTNL_RULE_CHAIN));
+		if (cur)
+			nftnl_chain_rule_add_tail(d->rules[i], cur);
+		else
+			nftnl_rule_free(d->rules[i]);
+	}
+
+	if (h->family != NFPROTO_BRIDGE)
+		return;
+
+	if (c) {
+		nft_bridge_chain_postprocess(h, c);
+	} else {
+		iter = nftnl_chain_list_iter_create(list);
+		while ((cur = nftnl_chain_list_iter_next(iter)))
+			nft_bridge_chain_postprocess(h, cur);
+		nftnl_chain_list_iter_destroy(iter);
+	}
+}
+
+/**
+ * nft_rule_counters_reset - read and zero rule counters in one go
+ * @h:		handle
+ * @chain:	chain to reset, all chains of @table if NULL
+ * @table:	table
+ * @rulenum:	position of the only rule to reset, or -1
+ *
+ * Fetches the rules again through NFT_MSG_GETRULE_RESET, which has the
+ * kernel zero their counters while dumping them. The cache then holds the
+ * values counted up to that moment, for listing them, and the following
+ * nft_chain_zero_counters() or nft_rule_zero_counters() only deals with
+ * the base chain counters. Returns 0 if the kernel lacks the message or
+ * changes to the ruleset are pending, the zeroing functions replace the
+ * rules with zero counters then.
+ */
+int nft_rule_counters_reset(struct nft_handle *h, const char *chain,
+			    const char *table, int rulenum)
+{
+	struct rule_reset_data d = {};
+	struct nftnl_chain_list *list;
+	struct nftnl_chain *c = NULL;
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nftnl_rule *r, *old;
+	struct nlmsghdr *nlh;
+	unsigned int i;
+	int ret;
+
+	if (h->obj_list_num)
+		return 0;
+
+	list = nft_chain_list_get(h, table);
+	if (list == NULL)
+		return 0;
+
+	if (chain) {
+		c = nftnl_chain_list_lookup_byname(list, chain);
+		if (!c)
+			return 0;
 	}
 
-	/* Now dump out rules in this table */
-	iter = nftnl_chain_list_iter_create(list);
-	if (iter == NULL)
+	r = nftnl_rule_alloc();
+	if (r == NULL)
 		return 0;
 
-	c = nftnl_chain_list_iter_next(iter);
-	while (c != NULL) {
-		ret = __nft_rule_list(h, c, rulenum, format, list_save);
-		c = nftnl_chain_list_iter_next(iter);
+	nftnl_rule_set_str(r, NFTNL_RULE_TABLE, table);
+	if (chain)
+		nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, chain);
+
+	if (rulenum >= 0) {
+		old = NULL;
+		if (c)
+			old = nftnl_rule_lookup_byindex(c, rulenum);
+		if (old == NULL) {
+			nftnl_rule_free(r);
+			return 0;
+		}
+		nftnl_rule_set_u64(r, NFTNL_RULE_HANDLE,
+				   nftnl_rule_get_u64(old, NFTNL_RULE_HANDLE));
+		nlh = nftnl_rule_nlmsg_build_hdr(buf, NFT_MSG_GETRULE_RESET,
+						 h->family, NLM_F_ACK,
+						 h->seq);
+	} else {
+		nlh = nftnl_rule_nlmsg_build_hdr(buf, NFT_MSG_GETRULE_RESET,
+						 h->family, NLM_F_DUMP,
+						 h->seq);
 	}
-	nftnl_chain_list_iter_destroy(iter);
-	return ret;
+	nftnl_rule_nlmsg_build_payload(nlh, r);
+	nftnl_rule_free(r);
+
+	ret = mnl_talk(h, nlh, nft_rule_reset_cb, &d);
+	if (ret < 0 || (rulenum >= 0 && d.num != 1)) {
+		for (i = 0; i < d.num; i++)
+			nftnl_rule_free(d.rules[i]);
+		free(d.rules);
+		return 0;
+	}
+
+	nft_rule_reset_update(h, list, c, rulenum, &d);
+	free(d.rules);
+
+	h->counters_reset = true;
+	return 1;
 }
 
 int nft_rule_zero_counters(struct nft_handle *h, const char *chain,
@@ -2681,6 +3270,12 @@ int nft_rule_zero_counters(struct nft_handle *h, const char *chain,
 		goto error;
 	}
 
+	if (h->counters_reset ||
+	    nft_rule_counters_reset(h, chain, table, rulenum)) {
+		h->counters_reset = false;
+		return 1;
+	}
+
 	nft_rule_to_iptables_command_state(r, &cs);
 
 	cs.counters.pcnt = cs.counters.bcnt = 0;
@@ -2757,6 +3352,22 @@ static void batch_obj_del(struct nft_handle *h, struct obj_update *o)
 	free(o);
 }
 
+/**
+ * nft_discard - drop the changes queued for the next commit
+ * @h:	handle the changes were made on
+ *
+ * Nothing is sent to the kernel. The cache holds the changes as well, so
+ * it is dropped with them and fetched again when needed.
+ */
+void nft_discard(struct nft_handle *h)
+{
+	struct obj_update *n, *tmp;
+
+	list_for_each_entry_safe(n, tmp, &h->obj_list, head)
+		batch_obj_del(h, n);
+	flush_chain_cache(h, NULL);
+}
+
 static void nft_refresh_transaction(struct nft_handle *h)
 {
 	const char *tablename, *chainname;
@@ -2822,23 +3433,16 @@ static void nft_refresh_transaction(struct nft_handle *h)
 	}
 }
 
-static int nft_action(struct nft_handle *h, int action)
+/*
+ * Put the changes of @h into @batch, numbered from @seq on. Returns the next
+ * sequence number.
+ */
+static uint32_t nft_batch_add_objs(struct nft_handle *h,
+				   struct nftnl_batch *batch, uint32_t seq)
 {
-	struct obj_update *n, *tmp;
-	struct mnl_err *err, *ne;
-	unsigned int buflen, i, len;
-	bool show_errors = true;
-	char errmsg[1024];
-	uint32_t seq;
-	int ret = 0;
-
-retry:
-	seq = 1;
-	h->batch = mnl_batch_init();
-
-	mnl_batch_begin(h->batch, h->nft_genid, seq++);
-	h->nft_genid++;
+	struct obj_update *n;
 
+	h->batch = batch;
 	list_for_each_entry(n, &h->obj_list, head) {
 
 		if (n->skip)
@@ -2912,6 +3516,62 @@ retry:
 		mnl_nft_batch_continue(h->batch);
 	}
 
+	return seq;
+}
+
+/*
+ * A transaction spanning the handles of two families needs both caches to
+ * be of the same generation, the batch is checked against one only.
+ */
+static void nft_action_refresh(struct nft_handle *h, struct nft_handle *peer)
+{
+	do {
+		nft_rebuild_cache(h);
+		nft_refresh_transaction(h);
+		if (peer) {
+			nft_rebuild_cache(peer);
+			nft_refresh_transaction(peer);
+		}
+	} while (peer && peer->nft_genid != h->nft_genid);
+}
+
+static int nft_action(struct nft_handle *h, int action)
+{
+	struct nft_handle *peer = h->peer, *owner;
+	struct obj_update *n, *tmp;
+	struct mnl_err *err, *ne;
+	unsigned int buflen, i, len;
+	bool show_errors = true;
+	char errmsg[1024];
+	uint32_t seq;
+	int ret = 0;
+
+	/* the changes of a peer handle go into the same transaction */
+	if (peer && list_empty(&peer->obj_list)) {
+		peer = NULL;
+	} else if (peer && list_empty(&h->obj_list)) {
+		h = peer;
+		peer = NULL;
+	}
+	xs_profile_begin(XS_PROF_COMMIT);
+	if (peer && peer->nft_genid != h->nft_genid)
+		nft_action_refresh(h, peer);
+
+retry:
+	xs_profile_begin(XS_PROF_BATCH);
+	seq = 1;
+	h->batch = mnl_batch_init();
+
+	mnl_batch_begin(h->batch, h->nft_genid, seq++);
+	h->nft_genid++;
+
+	seq = nft_batch_add_objs(h, h->batch, seq);
+	if (peer) {
+		seq = nft_batch_add_objs(peer, h->batch, seq);
+		peer->batch = NULL;
+		peer->nft_genid = h->nft_genid;
+	}
+
 	switch (action) {
 	case NFT_COMPAT_COMMIT:
 		mnl_batch_end(h->batch, seq++);
@@ -2919,46 +3579,52 @@ retry:
 	case NFT_COMPAT_ABORT:
 		break;
 	}
+	xs_profile_end(XS_PROF_BATCH);
 
 	errno = 0;
 	ret = mnl_batch_talk(h, seq);
 	if (ret && errno == ERESTART) {
-		nft_rebuild_cache(h);
-
-		nft_refresh_transaction(h);
+		xs_profile_begin(XS_PROF_REPLAY);
+		nft_action_refresh(h, peer);
 
 		i=0;
 		list_for_each_entry_safe(err, ne, &h->err_list, head)
 			mnl_err_list_free(err);
 
 		mnl_batch_reset(h->batch);
+		xs_profile_end(XS_PROF_REPLAY);
 		goto retry;
 	}
 
 	i = 0;
 	buflen = sizeof(errmsg);
 
-	list_for_each_entry_safe(n, tmp, &h->obj_list, head) {
-		list_for_each_entry_safe(err, ne, &h->err_list, head) {
-			if (err->seqnum > n->seq)
-				break;
-
-			if (err->seqnum == n->seq && show_errors) {
-				if (n->error.lineno == 0)
-					show_errors = false;
-				len = mnl_append_error(h, n, err, errmsg + i, buflen);
-				if (len > 0 && len <= buflen) {
-					buflen -= len;
-					i += len;
+	for (owner = h; owner; owner = owner == h ? peer : NULL) {
+		list_for_each_entry_safe(n, tmp, &owner->obj_list, head) {
+			list_for_each_entry_safe(err, ne, &h->err_list, head) {
+				if (err->seqnum > n->seq)
+					break;
+
+				if (err->seqnum == n->seq && show_errors) {
+					if (n->error.lineno == 0)
+						show_errors = false;
+					len = mnl_append_error(owner, n, err,
+							       errmsg + i,
+							       buflen);
+					if (len > 0 && len <= buflen) {
+						buflen -= len;
+						i += len;
+					}
 				}
+				mnl_err_list_free(err);
 			}
-			mnl_err_list_free(err);
+			batch_obj_del(owner, n);
 		}
-		batch_obj_del(h, n);
+		nft_release_cache(owner);
 	}
 
-	nft_release_cache(h);
 	mnl_batch_reset(h->batch);
+	xs_profile_end(XS_PROF_COMMIT);
 
 	if (i)
 		xtables_error(RESOURCE_PROBLEM, "%s", errmsg);
@@ -3079,6 +3745,163 @@ int nft_abort(struct nft_handle *h)
 	return nft_action(h, NFT_COMPAT_ABORT);
 }
 
+/* Copy the pages of a batch into one buffer. */
+static void *mnl_batch_flatten(struct nftnl_batch *batch, size_t *len)
+{
+	uint32_t i, iov_len = nftnl_batch_iovec_len(batch);
+	struct iovec iov[iov_len];
+	char *buf;
+
+	nftnl_batch_iovec(batch, iov, iov_len);
+	for (*len = 0, i = 0; i < iov_len; i++)
+		*len += iov[i].iov_len;
+
+	buf = xtables_malloc(*len);
+	for (*len = 0, i = 0; i < iov_len; i++) {
+		memcpy(buf + *len, iov[i].iov_base, iov[i].iov_len);
+		*len += iov[i].iov_len;
+	}
+	return buf;
+}
+
+/*
+ * Serialize a table from the cache as one transaction which replaces it,
+ * see nft_snapshot_replay(). The table is added before it is deleted, so
+ * the batch applies whether the table exists at that point or not. The
+ * generation id is left out on purpose, the batch is not tied to the
+ * ruleset it was taken from.
+ */
+void *nft_snapshot_table(struct nft_handle *h, const char *table,
+			 bool counters, size_t *len)
+{
+	struct nftnl_chain_list_iter *iter;
+	struct nftnl_chain_list *list;
+	struct nftnl_expr_iter *ei;
+	struct nftnl_rule_iter *ri;
+	struct nftnl_table *t;
+	struct nftnl_chain *c;
+	struct nftnl_rule *r;
+	struct nftnl_expr *e;
+	uint32_t seq = 1;
+	char *buf = NULL;
+
+	list = nft_chain_list_get(h, table);
+	if (!list)
+		return NULL;
+
+	t = nftnl_table_alloc();
+	if (!t)
+		return NULL;
+	nftnl_table_set_str(t, NFTNL_TABLE_NAME, table);
+
+	h->batch = mnl_batch_init();
+	nftnl_batch_begin(nftnl_batch_buffer(h->batch), seq++);
+	mnl_nft_batch_continue(h->batch);
+
+	nft_compat_table_batch_add(h, NFT_MSG_NEWTABLE, NLM_F_CREATE, seq++, t);
+	mnl_nft_batch_continue(h->batch);
+	nft_compat_table_batch_add(h, NFT_MSG_DELTABLE, 0, seq++, t);
+	mnl_nft_batch_continue(h->batch);
+	nft_compat_table_batch_add(h, NFT_MSG_NEWTABLE, NLM_F_CREATE, seq++, t);
+	mnl_nft_batch_continue(h->batch);
+
+	/* All chains first, rules may jump to any of them. */
+	iter = nftnl_chain_list_iter_create(list);
+	if (!iter)
+		goto out;
+
+	c = nftnl_chain_list_iter_next(iter);
+	while (c != NULL) {
+		nftnl_chain_unset(c, NFTNL_CHAIN_HANDLE);
+		if (!counters && nftnl_chain_is_set(c, NFTNL_CHAIN_HOOKNUM)) {
+			nftnl_chain_set_u64(c, NFTNL_CHAIN_PACKETS, 0);
+			nftnl_chain_set_u64(c, NFTNL_CHAIN_BYTES, 0);
+		}
+		nft_compat_chain_batch_add(h, NFT_MSG_NEWCHAIN, NLM_F_CREATE,
+					   seq++, c);
+		mnl_nft_batch_continue(h->batch);
+		c = nftnl_chain_list_iter_next(iter);
+	}
+	nftnl_chain_list_iter_destroy(iter);
+
+	iter = nftnl_chain_list_iter_create(list);
+	if (!iter)
+		goto out;
+
+	c = nftnl_chain_list_iter_next(iter);
+	while (c != NULL) {
+		ri = nftnl_rule_iter_create(c);
+		if (!ri)
+			break;
+
+		r = nftnl_rule_iter_next(ri);
+		while (r != NULL) {
+			nftnl_rule_unset(r, NFTNL_RULE_HANDLE);
+			nftnl_rule_unset(r, NFTNL_RULE_POSITION);
+
+			ei = counters ? NULL : nftnl_expr_iter_create(r);
+			e = ei ? nftnl_expr_iter_next(ei) : NULL;
+			while (e != NULL) {
+				const char *en = nftnl_expr_get_str(e, NFTNL_EXPR_NAME);
+
+				if (strcmp(en, "counter") == 0) {
+					nftnl_expr_set_u64(e, NFTNL_EXPR_CTR_PACKETS, 0);
+					nftnl_expr_set_u64(e, NFTNL_EXPR_CTR_BYTES, 0);
+				}
+				e = nftnl_expr_iter_next(ei);
+			}
+			if (ei)
+				nftnl_expr_iter_destroy(ei);
+
+			nft_compat_rule_batch_add(h, NFT_MSG_NEWRULE,
+						  NLM_F_CREATE | NLM_F_APPEND,
+						  seq++, r);
+			mnl_nft_batch_continue(h->batch);
+			r = nftnl_rule_iter_next(ri);
+		}
+		nftnl_rule_iter_destroy(ri);
+		c = nftnl_chain_list_iter_next(iter);
+	}
+	nftnl_chain_list_iter_destroy(iter);
+
+	if (c == NULL) {
+		mnl_batch_end(h->batch, seq++);
+		buf = mnl_batch_flatten(h->batch, len);
+	}
+out:
+	mnl_batch_reset(h->batch);
+	h->batch = NULL;
+	nftnl_table_free(t);
+	return buf;
+}
+
+/*
+ * Send a batch from nft_snapshot_table() as it is. The kernel applies it
+ * as a whole or not at all.
+ */
+int nft_snapshot_replay(struct nft_handle *h, const void *buf, size_t len)
+{
+	struct iovec iov = {
+		.iov_base	= (void *)buf,
+		.iov_len	= len,
+	};
+	struct mnl_err *err, *ne;
+	int ret;
+
+	mnl_set_sndbuffer(h, len);
+	if (h->transport->sendmsg(h, &iov, 1) == -1)
+		return -1;
+
+	ret = mnl_batch_acks(h);
+	list_for_each_entry_safe(err, ne, &h->err_list, head) {
+		if (ret == 0)
+			ret = -1;
+		errno = err->err;
+		mnl_err_list_free(err);
+	}
+	return ret;
+}
+
 int nft_abort_policy_rule(struct nft_handle *h, const char *table)
 {
 	struct obj_update *n, *tmp;
@@ -3127,6 +3950,10 @@ int nft_compatible_revision(const char *name, uint8_t rev, int opt)
 		return 1;
 	}
 
+	/* the stand-in has them all, as a kernel with every module */
+	if (nft_transport_default() != &nft_transport_netlink)
+		return 1;
+
 	nlh = mnl_nlmsg_put_header(buf);
 	nlh->nlmsg_type = (NFNL_SUBSYS_NFT_COMPAT << 8) | NFNL_MSG_COMPAT_GET;
 	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
@@ -3220,6 +4047,7 @@ const char *nft_strerror(int err)
 struct chain_zero_data {
 	struct nft_handle	*handle;
 	bool			verbose;
+	bool			rules_reset;
 };
 
 static int __nft_chain_zero_counters(struct nftnl_chain *c, void *data)
@@ -3242,6 +4070,9 @@ static int __nft_chain_zero_counters(struct nftnl_chain *c, void *data)
 			return -1;
 	}
 
+	if (d->rules_reset)
+		return 0;
+
 	iter = nftnl_rule_iter_create(c);
 	if (iter == NULL)
 		return -1;
@@ -3313,7 +4144,13 @@ int nft_chain_zero_counters(struct nft_handle *h, const char *chain,
 			errno = ENOENT;
 			return 0;
 		}
+	}
+
+	d.rules_reset = h->counters_reset ||
+			nft_rule_counters_reset(h, chain, table, -1);
+	h->counters_reset = false;
 
+	if (chain) {
 		ret = __nft_chain_zero_counters(c, &d);
 		goto err;
 	}
@@ -3324,6 +4161,148 @@ err:
 	return ret == 0 ? 1 : 0;
 }
 
+struct nft_counters_data {
+	struct nft_handle	*h;
+	const char		*table;
+	struct xs_counters	*cs;
+};
+
+static bool nft_counters_table(struct nft_counters_data *d, const char *table)
+{
+	if (d->table && strcmp(d->table, table))
+		return false;
+
+	return nft_table_builtin_find(d->h, table) != NULL;
+}
+
+static int nft_counters_chain_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct nft_counters_data *d = data;
+	struct xs_counter_chain *c;
+	struct nftnl_chain *nc;
+	const char *table;
+
+	nc = nftnl_chain_alloc();
+	if (nc == NULL)
+		return MNL_CB_OK;
+
+	if (nftnl_chain_nlmsg_parse(nlh, nc) < 0)
+		goto out;
+
+	table = nftnl_chain_get_str(nc, NFTNL_CHAIN_TABLE);
+	if (!nft_counters_table(d, table))
+		goto out;
+
+	c = xs_counters_chain(d->cs, table,
+			      nftnl_chain_get_str(nc, NFTNL_CHAIN_NAME));
+	if (nftnl_chain_is_set(nc, NFTNL_CHAIN_HOOKNUM)) {
+		c->policy = true;
+		c->pcnt = nftnl_chain_get_u64(nc, NFTNL_CHAIN_PACKETS);
+		c->bcnt = nftnl_chain_get_u64(nc, NFTNL_CHAIN_BYTES);
+	}
+out:
+	nftnl_chain_free(nc);
+	return MNL_CB_OK;
+}
+
+static int nft_counters_rule_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct nft_counters_data *d = data;
+	struct xs_counter_chain *c;
+	struct nftnl_expr_iter *iter;
+	const char *comment = NULL;
+	uint64_t pcnt = 0, bcnt = 0;
+	struct nftnl_expr *expr;
+	struct nftnl_rule *r;
+	const char *table;
+	const void *udata;
+	uint32_t len;
+
+	r = nftnl_rule_alloc();
+	if (r == NULL)
+		return MNL_CB_OK;
+
+	if (nftnl_rule_nlmsg_parse(nlh, r) < 0)
+		goto out;
+
+	table = nftnl_rule_get_str(r, NFTNL_RULE_TABLE);
+	if (!nft_counters_table(d, table))
+		goto out;
+
+	/* the counter is all that is needed of the expressions */
+	iter = nftnl_expr_iter_create(r);
+	while (iter && (expr = nftnl_expr_iter_next(iter))) {
+		if (strcmp(nftnl_expr_get_str(expr, NFTNL_EXPR_NAME),
+			   "counter"))
+			continue;
+		pcnt = nftnl_expr_get_u64(expr, NFTNL_EXPR_CTR_PACKETS);
+		bcnt = nftnl_expr_get_u64(expr, NFTNL_EXPR_CTR_BYTES);
+		break;
+	}
+	if (iter)
+		nftnl_expr_iter_destroy(iter);
+
+	if (nftnl_rule_is_set(r, NFTNL_RULE_USERDATA)) {
+		udata = nftnl_rule_get_data(r, NFTNL_RULE_USERDATA, &len);
+		comment = get_comment(udata, len);
+	}
+
+	c = xs_counters_chain(d->cs, table,
+			      nftnl_rule_get_str(r, NFTNL_RULE_CHAIN));
+	xs_counters_add(d->cs, c, nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE),
+			pcnt, bcnt, comment);
+out:
+	nftnl_rule_free(r);
+	return MNL_CB_OK;
+}
+
+/**
+ * nft_counters_fetch - counters of the rules and base chains
+ * @h:		handle of the family
+ * @table:	table to fetch, NULL for all tables of iptables
+ * @cs:		counter set to fill
+ *
+ * One chain and one rule dump of the family, again if the ruleset changed
+ * in between; the rules are not turned into iptables commands and no
+ * cache is built.
+ */
+int nft_counters_fetch(struct nft_handle *h, const char *table,
+		       struct xs_counters *cs)
+{
+	struct nft_counters_data d = {
+		.h	= h,
+		.table	= table,
+		.cs	= cs,
+	};
+	uint32_t genid_start, genid_stop;
+	int family = cs->family;
+	char buf[16536];
+	struct nlmsghdr *nlh;
+	int ret;
+
+retry:
+	mnl_genid_get(h, &genid_start);
+
+	nlh = nftnl_chain_nlmsg_build_hdr(buf, NFT_MSG_GETCHAIN, h->family,
+					  NLM_F_DUMP, h->seq);
+	ret = mnl_talk(h, nlh, nft_counters_chain_cb, &d);
+	if (ret == 0) {
+		nlh = nftnl_rule_nlmsg_build_hdr(buf, NFT_MSG_GETRULE,
+						 h->family, NLM_F_DUMP, h->seq);
+		ret = mnl_talk(h, nlh, nft_counters_rule_cb, &d);
+	}
+	if (ret < 0 && errno != EINTR)
+		return -1;
+
+	mnl_genid_get(h, &genid_stop);
+	if (ret < 0 || genid_start != genid_stop) {
+		xs_counters_free(cs);
+		xs_counters_init(cs, family);
+		goto retry;
+	}
+	return 0;
+}
+
 uint32_t nft_invflags2cmp(uint32_t invflags, uint32_t flag)
 {
 	if (invflags & flag)
@@ -4,6 +4,7 @@
 #include "xshared.h"
 #include "nft-shared.h"
 #include <libiptc/linux_list.h>
+#include <sys/uio.h>
 
 enum nft_table_type {
 	NFT_TABLE_FILTER	= 0,
@@ -35,8 +36,12 @@ struct nft_cache {
 	} table[NFT_TABLE_MAX];
 };
 
+struct nft_transport;
+
 struct nft_handle {
 	int			family;
+	const struct nft_transport *transport;
+	void			*transport_priv;	/* state of the stand-in */
 	struct mnl_socket	*nl;
 	int			nlsndbuffsiz;
 	int			nlrcvbuffsiz;
@@ -56,6 +61,10 @@ struct nft_handle {
 	bool			have_cache;
 	bool			restore;
 	bool			noflush;
+	bool			diff;
+	bool			counters_reset;	/* by nft_rule_counters_reset() */
+	struct list_head	diff_list;	/* chains kept by --diff */
+	struct nft_handle	*peer;		/* other family, same commit */
 	int8_t			config_done;
 
 	/* meta data, for error reporting */
@@ -64,6 +73,34 @@ struct nft_handle {
 	} error;
 };
 
+/**
+ * struct nft_transport - how a handle talks to nf_tables
+ * @name:	its name in XTABLES_NFT_TRANSPORT
+ * @open:	connect @h and set h->portid
+ * @close:	disconnect @h
+ * @sendmsg:	send a request or a batch, as a single datagram
+ * @recv:	receive one datagram of replies
+ * @pending:	whether replies are waiting, without blocking
+ * @setbuf:	raise the socket buffer @opt (SO_SNDBUFFORCE, SO_RCVBUFFORCE)
+ *
+ * The netlink transport talks to the kernel, the memory one to the
+ * stand-in of nft-memnl.c; nft.c is the same for both.
+ */
+struct nft_transport {
+	const char	*name;
+	int		(*open)(struct nft_handle *h);
+	void		(*close)(struct nft_handle *h);
+	ssize_t		(*sendmsg)(struct nft_handle *h,
+				   const struct iovec *iov, int iovlen);
+	ssize_t		(*recv)(struct nft_handle *h, void *buf, size_t len);
+	int		(*pending)(struct nft_handle *h);
+	int		(*setbuf)(struct nft_handle *h, int opt, int size);
+};
+
+extern const struct nft_transport nft_transport_netlink;
+extern const struct nft_transport nft_transport_memory;
+const struct nft_transport *nft_transport_default(void);
+
 extern const struct builtin_table xtables_ipv4[NFT_TABLE_MAX];
 extern const struct builtin_table xtables_arp[NFT_TABLE_MAX];
 extern const struct builtin_table xtables_bridge[NFT_TABLE_MAX];
@@ -74,6 +111,7 @@ int mnl_talk(struct nft_handle *h, struct nlmsghdr *nlh,
 int nft_init(struct nft_handle *h, const struct builtin_table *t);
 void nft_fini(struct nft_handle *h);
 void nft_build_cache(struct nft_handle *h);
+void nft_cache_refresh(struct nft_handle *h);
 
 /*
  * Operations with tables.
@@ -100,6 +138,9 @@ int nft_chain_save(struct nft_handle *h, struct nftnl_chain_list *list);
 int nft_chain_user_add(struct nft_handle *h, const char *chain, const char *table);
 int nft_chain_user_del(struct nft_handle *h, const char *chain, const char *table, bool verbose);
 int nft_chain_restore(struct nft_handle *h, const char *chain, const char *table);
+int nft_diff_chain(struct nft_handle *h, const char *table, const char *chain);
+bool nft_diff_policy(struct nft_handle *h, const char *table, const char *chain, const char *policy, struct xt_counters *counters);
+int nft_diff_end(struct nft_handle *h, const char *table);
 int nft_chain_user_rename(struct nft_handle *h, const char *chain, const char *table, const char *newname);
 int nft_chain_zero_counters(struct nft_handle *h, const char *chain, const char *table, bool verbose);
 const struct builtin_chain *nft_chain_builtin_find(const struct builtin_table *t, const char *chain);
@@ -121,6 +162,8 @@ int nft_rule_list_save(struct nft_handle *h, const char *chain, const char *tabl
 int nft_rule_save(struct nft_handle *h, const char *table, unsigned int format);
 int nft_rule_flush(struct nft_handle *h, const char *chain, const char *table, bool verbose);
 int nft_rule_zero_counters(struct nft_handle *h, const char *chain, const char *table, int rulenum);
+int nft_rule_counters_reset(struct nft_handle *h, const char *chain, const char *table, int rulenum);
+int nft_counters_fetch(struct nft_handle *h, const char *table, struct xs_counters *cs);
 
 /*
  * Operations used in userspace tools
@@ -148,6 +191,10 @@ uint32_t nft_invflags2cmp(uint32_t invflags, uint32_t flag);
  */
 int nft_commit(struct nft_handle *h);
 int nft_abort(struct nft_handle *h);
+void nft_discard(struct nft_handle *h);
+void *nft_snapshot_table(struct nft_handle *h, const char *table,
+			 bool counters, size_t *len);
+int nft_snapshot_replay(struct nft_handle *h, const void *buf, size_t len);
 int nft_abort_policy_rule(struct nft_handle *h, const char *table);
 
 /*
@@ -161,7 +208,10 @@ int nft_compatible_revision(const char *name, uint8_t rev, int opt);
 const char *nft_strerror(int err);
 
 /* For xtables.c */
+extern void (*xtables_exit_hook)(int status);
 int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table, bool restore);
+int do_parsex(struct nft_handle *h, int argc, char *argv[], char **table);
+void do_commandx_abort(void);
 /* For xtables-arptables.c */
 int nft_init_arp(struct nft_handle *h, const char *pname);
 int do_commandarp(struct nft_handle *h, int argc, char *argv[], char **table, bool restore);
@@ -0,0 +1,139 @@
+#!/bin/sh
+#
+# Print a synthetic ruleset in the format of iptables-save. The same
+# arguments give the same ruleset, so benchmark runs can be compared.
+#
+# INPUT jumps to each user-defined chain in turn, the rules are spread
+# over the user-defined chains round robin. Each rule uses an extension
+# picked at random, weighted by the mix.
+
+usage() {
+	cat >&2 <<EOF
+Usage: $0 [-c chains] [-r rules] [-m mix] [-s seed] [-6]
+
+  -c chains  user-defined chains, 10 by default
+  -r rules   rules in them, 1000 by default
+  -m mix     extensions and their weights, by default
+             $MIX
+  -s seed    seed of the random numbers, 1 by default
+  -6         print an IPv6 ruleset
+EOF
+	exit 1
+}
+
+CHAINS=10
+RULES=1000
+MIX=none=4,tcp=4,udp=2,multiport=2,iprange=1,conntrack=2,comment=1,limit=1,mark=1,log=1
+SEED=1
+FAMILY=4
+
+while getopts "c:r:m:s:6h" opt; do
+	case $opt in
+	c) CHAINS=$OPTARG ;;
+	r) RULES=$OPTARG ;;
+	m) MIX=$OPTARG ;;
+	s) SEED=$OPTARG ;;
+	6) FAMILY=6 ;;
+	*) usage ;;
+	esac
+done
+
+exec awk -v chains="$CHAINS" -v rules="$RULES" -v mix="$MIX" \
+	 -v seed="$SEED" -v family="$FAMILY" '
+# Park-Miller, exact in the doubles of any awk
+function rnd(n) {
+	state = (state * 16807) % 2147483647
+	return state % n
+}
+
+function addr() {
+	if (family == 6)
+		return sprintf("2001:db8:%x::%x", rnd(65536), rnd(65536) + 1)
+	return sprintf("10.%d.%d.%d", rnd(256), rnd(256), rnd(254) + 1)
+}
+
+function net() {
+	if (family == 6)
+		return sprintf("2001:db8:%x::/%d", rnd(65536), 48 + 16 * rnd(2))
+	if (rnd(2))
+		return sprintf("10.%d.%d.0/24", rnd(256), rnd(256))
+	return addr() "/32"
+}
+
+function verdict(    n) {
+	n = rnd(8)
+	if (n < 3)
+		return "ACCEPT"
+	if (n < 6)
+		return "DROP"
+	if (n < 7)
+		return "RETURN"
+	return "REJECT"
+}
+
+function rule(i,    ext, n, v) {
+	n = rnd(total)
+	for (ext = 1; n >= weight[ext]; ext++)
+		n -= weight[ext]
+	ext = name[ext]
+	v = verdict()
+
+	if (ext == "none")
+		return "-s " net() " -j " v
+	if (ext == "tcp" || ext == "udp")
+		return "-p " ext " -m " ext " --dport " rnd(65535) + 1 " -j " v
+	if (ext == "multiport")
+		return "-p tcp -m multiport --dports " rnd(1024) + 1 "," \
+		       rnd(1024) + 1025 "," rnd(1024) + 2049 " -j " v
+	if (ext == "iprange") {
+		if (family == 6)
+			return "-m iprange --src-range 2001:db8::1-2001:db8::" \
+			       sprintf("%x", rnd(65535) + 2) " -j " v
+		return "-m iprange --src-range 10.0.0.1-10.0.0." \
+		       rnd(253) + 2 " -j " v
+	}
+	if (ext == "conntrack")
+		return "-m conntrack --ctstate " \
+		       (rnd(2) ? "NEW" : "RELATED,ESTABLISHED") " -j " v
+	if (ext == "comment")
+		return "-s " addr() " -m comment --comment \"rule " i "\" -j " v
+	if (ext == "limit")
+		return "-m limit --limit " rnd(100) + 1 "/sec -j " v
+	if (ext == "mark")
+		return sprintf("-m mark --mark 0x%x -j %s", rnd(65536), v)
+	if (ext == "log")
+		return "-s " net() " -j LOG --log-prefix \"rule " i " \""
+	print "gen-ruleset: unknown extension " ext > "/dev/stderr"
+	exit 1
+}
+
+BEGIN {
+	state = seed % 2147483646 + 1
+	nmix = split(mix, parts, ",")
+	for (i = 1; i <= nmix; i++) {
+		split(parts[i], kv, "=")
+		name[i] = kv[1]
+		weight[i] = kv[2] == "" ? 1 : kv[2] + 0
+		total += weight[i]
+	}
+	if (total <= 0) {
+		print "gen-ruleset: empty mix" > "/dev/stderr"
+		exit 1
+	}
+
+	print "*filter"
+	print ":INPUT ACCEPT [0:0]"
+	print ":FORWARD ACCEPT [0:0]"
+	print ":OUTPUT ACCEPT [0:0]"
+	for (c = 0; c < chains; c++)
+		printf(":chain%d - [0:0]\n", c)
+	for (c = 0; c < chains; c++)
+		printf("-A INPUT -j chain%d\n", c)
+	for (c = 0; c < chains; c++)
+		for (i = c; i < rules; i += chains)
+			printf("-A chain%d %s\n", c, rule(i))
+	if (!chains)
+		for (i = 0; i < rules; i++)
+			printf("-A INPUT %s\n", rule(i))
+	print "COMMIT"
+}'
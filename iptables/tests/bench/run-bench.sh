@@ -0,0 +1,78 @@
+#!/bin/bash
+#
+# Run xtables-legacy-bench and xtables-nft-bench on generated rulesets of
+# growing size, and print their results, one line of key=value pairs per
+# benchmark. Called by "make bench" from the iptables build directory.
+#
+# Nothing is committed, but the empty tables the legacy restore benchmarks
+# start from come from the kernel: this runs in a new network namespace,
+# so they are the same on every run.
+
+BENCHDIR="$(dirname $0)"
+BUILDDIR="${BUILDDIR:-.}"
+
+# rules:chains of the generated rulesets
+SIZES="100:1 1000:10 10000:100 50000:100"
+RUNS=10
+
+msg_error() {
+	echo "E: $1 ..." >&2
+	exit 1
+}
+
+usage() {
+	cat >&2 <<EOF
+Usage: $0 [-n runs] [-s rules:chains[,...]] [-m mix] [-6] [-o file]
+
+  -n runs    timed runs of each benchmark, $RUNS by default
+  -s sizes   rulesets to generate, by default ${SIZES// /,}
+  -m mix     extension mix of the rulesets, see gen-ruleset.sh
+  -6         generate IPv6 rulesets
+  -o file    append the results to file too
+EOF
+	exit 1
+}
+
+while getopts "n:s:m:6o:h" opt; do
+	case $opt in
+	n) RUNS=$OPTARG ;;
+	s) SIZES=${OPTARG//,/ } ;;
+	m) MIX="-m $OPTARG" ;;
+	6) FAMILY=-6 ;;
+	o) OUT=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+if [ "$(id -u)" != "0" ] ; then
+	msg_error "this requires root!"
+fi
+
+if [ -z "$XT_BENCH_NETNS" ]; then
+	export XT_BENCH_NETNS=1
+	exec unshare -n "$0" "$@"
+fi
+
+export XTABLES_LIBDIR=${XTABLES_LIBDIR:-${BUILDDIR}/../extensions}
+
+BENCHES=
+for b in xtables-legacy-bench xtables-nft-bench; do
+	[ -x "${BUILDDIR}/$b" ] && BENCHES+=" ${BUILDDIR}/$b"
+done
+[ -n "$BENCHES" ] || msg_error "no benchmark programs in $BUILDDIR"
+
+RULESET=$(mktemp)
+trap "rm -f $RULESET" EXIT
+
+for size in $SIZES; do
+	rules=${size%:*}
+	chains=${size#*:}
+	label="r${rules}c${chains}"
+
+	$BENCHDIR/gen-ruleset.sh -r $rules -c $chains $MIX $FAMILY \
+		>$RULESET || exit 1
+	for b in $BENCHES; do
+		$b -n $RUNS -l $label $FAMILY $RULESET || exit 1
+	done
+done | tee ${OUT:+-a "$OUT"}
+exit ${PIPESTATUS[0]}
@@ -0,0 +1,883 @@
+/*
+ * Counter export of iptables-counters: the counters of all rules and chain
+ * policies, keyed by table, chain, position, nf_tables handle and comment,
+ * printed as OpenMetrics or in a compact binary form, optionally as
+ * increments since the previous scrape.
+ *
+ * The backends fill a struct xs_counters straight from what the kernel
+ * hands out, without the caches the other commands build, and everything
+ * else is done here.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <xtables.h>
+#include "xshared.h"
+
+/*
+ * Binary layout: header, then for each chain a chain record, the table and
+ * chain names and one rule record per rule, each followed by the rule's
+ * comment.  Names and comments have no terminating NUL and are padded to
+ * 8 bytes.  Everything is in host byte order, the position of a rule is
+ * its index in the chain plus one.  A state file of --delta is the same,
+ * with the totals.
+ */
+#define XS_COUNTERS_MAGIC	"xtcntr\n"
+#define XS_COUNTERS_VERSION	1
+#define XS_COUNTERS_ALIGN(x)	(((x) + 7) & ~(size_t)7)
+#define XS_COUNTERS_NAMELEN	256
+#define XS_COUNTERS_BLOCK	65536
+
+struct xs_counters_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	family;
+	uint32_t	flags;
+	uint32_t	chains;
+};
+
+/* The counters are increments since the previous scrape. */
+#define XS_COUNTERS_F_DELTA	0x1
+
+struct xs_counters_chain_rec {
+	uint64_t	pcnt;
+	uint64_t	bcnt;
+	uint32_t	rules;
+	uint16_t	table_len;
+	uint16_t	name_len;
+	uint32_t	flags;
+	uint32_t	reserved;
+};
+
+/* A base chain, the counters are those of its policy. */
+#define XS_COUNTERS_F_POLICY	0x1
+
+struct xs_counters_rule_rec {
+	uint64_t	handle;
+	uint64_t	pcnt;
+	uint64_t	bcnt;
+	uint32_t	comment_len;
+	uint32_t	flags;
+};
+
+/* The rule has a comment, possibly an empty one. */
+#define XS_COUNTERS_F_COMMENT	0x1
+
+static uint32_t xs_counters_strdup(struct xs_counters *cs, const char *s,
+				   size_t len)
+{
+	uint32_t off;
+
+	if (cs->pool_size - cs->pool_len < len + 1) {
+		cs->pool_size = (cs->pool_len + len + 1) * 2;
+		cs->pool = xtables_realloc(cs->pool, cs->pool_size);
+	}
+
+	off = cs->pool_len;
+	memcpy(cs->pool + off, s, len);
+	cs->pool[off + len] = '\0';
+	cs->pool_len += len + 1;
+	return off;
+}
+
+/**
+ * xs_counters_init - start an empty counter set
+ * @cs:		counter set
+ * @family:	NFPROTO_IPV4 or NFPROTO_IPV6
+ */
+void xs_counters_init(struct xs_counters *cs, int family)
+{
+	memset(cs, 0, sizeof(*cs));
+	cs->family = family;
+
+	/* offset 0 stands for no string */
+	cs->pool_size = 4096;
+	cs->pool = xtables_malloc(cs->pool_size);
+	cs->pool[0] = '\0';
+	cs->pool_len = 1;
+}
+
+void xs_counters_free(struct xs_counters *cs)
+{
+	unsigned int i;
+
+	for (i = 0; i < cs->num; i++)
+		free(cs->chains[i].rules);
+	free(cs->chains);
+	free(cs->hash);
+	free(cs->pool);
+	memset(cs, 0, sizeof(*cs));
+}
+
+static uint32_t xs_counters_hash(const char *table, const char *chain)
+{
+	uint32_t hash = 2166136261u;
+
+	do {
+		hash = (hash ^ (unsigned char)*table) * 16777619;
+	} while (*table++);
+	do {
+		hash = (hash ^ (unsigned char)*chain) * 16777619;
+	} while (*chain++);
+
+	return hash;
+}
+
+static bool xs_counters_chain_is(const struct xs_counters *cs,
+				 const struct xs_counter_chain *c,
+				 const char *table, const char *chain)
+{
+	return !strcmp(cs->pool + c->name, chain) &&
+	       !strcmp(cs->pool + c->table, table);
+}
+
+static void xs_counters_hash_add(struct xs_counters *cs, unsigned int i)
+{
+	const struct xs_counter_chain *c = &cs->chains[i];
+	unsigned int mask = cs->hash_size - 1;
+	unsigned int slot;
+
+	slot = xs_counters_hash(cs->pool + c->table, cs->pool + c->name);
+	for (slot &= mask; cs->hash[slot]; slot = (slot + 1) & mask)
+		;
+	cs->hash[slot] = i + 1;
+}
+
+static const struct xs_counter_chain *
+xs_counters_find(const struct xs_counters *cs, const char *table,
+		 const char *chain)
+{
+	const struct xs_counter_chain *c;
+	unsigned int mask = cs->hash_size - 1;
+	unsigned int slot;
+
+	if (cs->hash_size == 0)
+		return NULL;
+
+	slot = xs_counters_hash(table, chain) & mask;
+	for (; cs->hash[slot]; slot = (slot + 1) & mask) {
+		c = &cs->chains[cs->hash[slot] - 1];
+		if (xs_counters_chain_is(cs, c, table, chain))
+			return c;
+	}
+	return NULL;
+}
+
+/**
+ * xs_counters_chain - find a chain, or add it after the others
+ * @cs:		counter set
+ * @table:	table name
+ * @chain:	chain name
+ *
+ * The returned chain is valid until the next chain is added.
+ */
+struct xs_counter_chain *xs_counters_chain(struct xs_counters *cs,
+					   const char *table,
+					   const char *chain)
+{
+	struct xs_counter_chain *c;
+	unsigned int i;
+
+	/* the rules of a chain come one after the other */
+	if (cs->cursor < cs->num) {
+		c = &cs->chains[cs->cursor];
+		if (xs_counters_chain_is(cs, c, table, chain))
+			return c;
+	}
+
+	c = (struct xs_counter_chain *)xs_counters_find(cs, table, chain);
+	if (c) {
+		cs->cursor = c - cs->chains;
+		return c;
+	}
+
+	if (cs->num == cs->size) {
+		cs->size = cs->size ? cs->size * 2 : 16;
+		cs->chains = xtables_realloc(cs->chains,
+					     cs->size * sizeof(*cs->chains));
+	}
+
+	c = &cs->chains[cs->num];
+	memset(c, 0, sizeof(*c));
+	c->table = xs_counters_strdup(cs, table, strlen(table));
+	c->name = xs_counters_strdup(cs, chain, strlen(chain));
+	cs->cursor = cs->num++;
+
+	if (2 * cs->num <= cs->hash_size) {
+		xs_counters_hash_add(cs, cs->cursor);
+		return c;
+	}
+
+	cs->hash_size = cs->hash_size ? cs->hash_size * 2 : 64;
+	free(cs->hash);
+	cs->hash = xtables_calloc(cs->hash_size, sizeof(*cs->hash));
+	for (i = 0; i < cs->num; i++)
+		xs_counters_hash_add(cs, i);
+
+	return c;
+}
+
+static void xs_counters_add_len(struct xs_counters *cs,
+				struct xs_counter_chain *c, uint64_t handle,
+				uint64_t pcnt, uint64_t bcnt,
+				const char *comment, size_t len)
+{
+	struct xs_counter *r;
+
+	if (c->num == c->size) {
+		c->size = c->size ? c->size * 2 : 16;
+		c->rules = xtables_realloc(c->rules,
+					   c->size * sizeof(*c->rules));
+	}
+
+	r = &c->rules[c->num++];
+	r->handle = handle;
+	r->pcnt = pcnt;
+	r->bcnt = bcnt;
+	r->comment = comment ? xs_counters_strdup(cs, comment, len) : 0;
+}
+
+/**
+ * xs_counters_add - append a rule to a chain
+ * @cs:		counter set
+ * @c:		chain from xs_counters_chain()
+ * @handle:	nf_tables rule handle, 0 if there is none
+ * @pcnt:	packet counter
+ * @bcnt:	byte counter
+ * @comment:	rule comment, NULL if there is none
+ */
+void xs_counters_add(struct xs_counters *cs, struct xs_counter_chain *c,
+		     uint64_t handle, uint64_t pcnt, uint64_t bcnt,
+		     const char *comment)
+{
+	xs_counters_add_len(cs, c, handle, pcnt, bcnt, comment,
+			    comment ? strlen(comment) : 0);
+}
+
+/*
+ * A rule is the same as in the previous scrape if it has the same handle,
+ * or, without handles, the same comment or none.  Rules that moved are
+ * found by handle or comment in an index of the previous rules; a comment
+ * used by several rules of a chain only finds them at the same position.
+ */
+struct xs_counters_slot {
+	unsigned int	chain;		/* index + 1, 0 for a free slot */
+	unsigned int	rule;
+	bool		ambiguous;
+};
+
+struct xs_counters_index {
+	struct xs_counters_slot	*slots;
+	unsigned int		size;
+};
+
+static bool xs_counter_same(const struct xs_counters *a,
+			    const struct xs_counter *ra,
+			    const struct xs_counters *b,
+			    const struct xs_counter *rb)
+{
+	if (ra->handle || rb->handle)
+		return ra->handle == rb->handle;
+	if (!ra->comment || !rb->comment)
+		return !ra->comment && !rb->comment;
+
+	return !strcmp(a->pool + ra->comment, b->pool + rb->comment);
+}
+
+static unsigned int xs_counter_slot(const struct xs_counters *cs,
+				    const struct xs_counter *r,
+				    unsigned int chain, unsigned int mask)
+{
+	uint64_t key = r->handle;
+	const char *s;
+
+	if (!key) {
+		key = 0xcbf29ce484222325ULL;
+		for (s = cs->pool + r->comment; *s; s++)
+			key = (key ^ (unsigned char)*s) * 0x100000001b3ULL;
+	}
+	key = (key ^ (chain * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+
+	return (key >> 32) & mask;
+}
+
+static void xs_counters_index(struct xs_counters_index *idx,
+			      const struct xs_counters *cs)
+{
+	const struct xs_counter *r, *other;
+	struct xs_counters_slot *s;
+	unsigned int i, j, n = 0;
+	unsigned int mask, slot;
+
+	for (i = 0; i < cs->num; i++)
+		n += cs->chains[i].num;
+	for (idx->size = 16; idx->size < 2 * n; idx->size *= 2)
+		;
+	idx->slots = xtables_calloc(idx->size, sizeof(*idx->slots));
+	mask = idx->size - 1;
+
+	for (i = 0; i < cs->num; i++) {
+		for (j = 0; j < cs->chains[i].num; j++) {
+			r = &cs->chains[i].rules[j];
+			if (!r->handle && !r->comment)
+				continue;
+
+			slot = xs_counter_slot(cs, r, i, mask);
+			for (;; slot = (slot + 1) & mask) {
+				s = &idx->slots[slot];
+				if (!s->chain)
+					break;
+				if (s->chain != i + 1)
+					continue;
+				other = &cs->chains[i].rules[s->rule];
+				if (xs_counter_same(cs, r, cs, other))
+					break;
+			}
+			if (s->chain)
+				s->ambiguous = true;
+			s->chain = i + 1;
+			s->rule = j;
+		}
+	}
+}
+
+static const struct xs_counter *
+xs_counters_index_find(const struct xs_counters_index *idx,
+		       const struct xs_counters *prev, unsigned int chain,
+		       const struct xs_counters *cs, const struct xs_counter *r)
+{
+	const struct xs_counters_slot *s;
+	const struct xs_counter *other;
+	unsigned int mask = idx->size - 1;
+	unsigned int slot;
+
+	slot = xs_counter_slot(cs, r, chain, mask);
+	for (;; slot = (slot + 1) & mask) {
+		s = &idx->slots[slot];
+		if (!s->chain)
+			return NULL;
+		if (s->chain != chain + 1)
+			continue;
+
+		other = &prev->chains[chain].rules[s->rule];
+		if (xs_counter_same(cs, r, prev, other))
+			return s->ambiguous ? NULL : other;
+	}
+}
+
+/* Counters smaller than before were zeroed or belong to a new rule, all
+ * they count is new then.
+ */
+static void xs_counter_sub(uint64_t *pcnt, uint64_t *bcnt,
+			   uint64_t prev_pcnt, uint64_t prev_bcnt)
+{
+	if (*pcnt < prev_pcnt || *bcnt < prev_bcnt)
+		return;
+
+	*pcnt -= prev_pcnt;
+	*bcnt -= prev_bcnt;
+}
+
+/**
+ * xs_counters_delta - turn the counters into increments
+ * @cs:		counters of this scrape
+ * @prev:	counters of the previous scrape, NULL if there was none
+ *
+ * Rules and chains which are not in @prev keep their totals.
+ */
+void xs_counters_delta(struct xs_counters *cs, const struct xs_counters *prev)
+{
+	struct xs_counters_index idx = {};
+	const struct xs_counter_chain *pc;
+	const struct xs_counter *pr;
+	struct xs_counter_chain *c;
+	struct xs_counter *r;
+	unsigned int i, j;
+
+	cs->delta = true;
+	if (!prev)
+		return;
+
+	for (i = 0; i < cs->num; i++) {
+		c = &cs->chains[i];
+		pc = xs_counters_find(prev, cs->pool + c->table,
+				      cs->pool + c->name);
+		if (!pc)
+			continue;
+
+		if (c->policy && pc->policy)
+			xs_counter_sub(&c->pcnt, &c->bcnt, pc->pcnt, pc->bcnt);
+
+		for (j = 0; j < c->num; j++) {
+			r = &c->rules[j];
+			pr = j < pc->num ? &pc->rules[j] : NULL;
+			if (pr && !xs_counter_same(cs, r, prev, pr))
+				pr = NULL;
+
+			if (!pr && (r->handle || r->comment)) {
+				if (!idx.slots)
+					xs_counters_index(&idx, prev);
+				pr = xs_counters_index_find(&idx, prev,
+							    pc - prev->chains,
+							    cs, r);
+			}
+			if (pr)
+				xs_counter_sub(&r->pcnt, &r->bcnt,
+					       pr->pcnt, pr->bcnt);
+		}
+	}
+	free(idx.slots);
+}
+
+static const void *xs_counters_take(const char *buf, size_t len, size_t *pos,
+				    size_t n)
+{
+	const void *p;
+
+	if (len - *pos < n)
+		return NULL;
+
+	p = buf + *pos;
+	*pos += n;
+	return p;
+}
+
+static int xs_counters_parse(struct xs_counters *cs, const char *buf,
+			     size_t len)
+{
+	const struct xs_counters_chain_rec *crec;
+	const struct xs_counters_rule_rec *rrec;
+	const struct xs_counters_hdr *hdr;
+	char table[XS_COUNTERS_NAMELEN];
+	char name[XS_COUNTERS_NAMELEN];
+	const char *t, *n, *comment;
+	struct xs_counter_chain *c;
+	unsigned int i, j;
+	size_t pos = 0;
+
+	hdr = xs_counters_take(buf, len, &pos, sizeof(*hdr));
+	if (!hdr || memcmp(hdr->magic, XS_COUNTERS_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != XS_COUNTERS_VERSION)
+		return -1;
+
+	cs->family = hdr->family;
+	cs->delta = hdr->flags & XS_COUNTERS_F_DELTA;
+
+	for (i = 0; i < hdr->chains; i++) {
+		crec = xs_counters_take(buf, len, &pos, sizeof(*crec));
+		if (!crec || crec->table_len >= sizeof(table) ||
+		    crec->name_len >= sizeof(name))
+			return -1;
+
+		t = xs_counters_take(buf, len, &pos,
+				     XS_COUNTERS_ALIGN(crec->table_len));
+		n = xs_counters_take(buf, len, &pos,
+				     XS_COUNTERS_ALIGN(crec->name_len));
+		if (!t || !n)
+			return -1;
+
+		memcpy(table, t, crec->table_len);
+		table[crec->table_len] = '\0';
+		memcpy(name, n, crec->name_len);
+		name[crec->name_len] = '\0';
+
+		c = xs_counters_chain(cs, table, name);
+		if (cs->num != i + 1)
+			return -1;
+
+		c->policy = crec->flags & XS_COUNTERS_F_POLICY;
+		c->pcnt = crec->pcnt;
+		c->bcnt = crec->bcnt;
+
+		for (j = 0; j < crec->rules; j++) {
+			rrec = xs_counters_take(buf, len, &pos, sizeof(*rrec));
+			if (!rrec)
+				return -1;
+
+			comment = NULL;
+			if (rrec->flags & XS_COUNTERS_F_COMMENT) {
+				comment = xs_counters_take(buf, len, &pos,
+					XS_COUNTERS_ALIGN(rrec->comment_len));
+				if (!comment ||
+				    memchr(comment, '\0', rrec->comment_len))
+					return -1;
+			}
+			xs_counters_add_len(cs, c, rrec->handle, rrec->pcnt,
+					    rrec->bcnt, comment,
+					    rrec->comment_len);
+		}
+	}
+
+	return pos == len ? 0 : -1;
+}
+
+/**
+ * xs_counters_read - read counters in binary form
+ * @cs:		counter set to fill
+ * @in:		input stream
+ *
+ * Returns -1 with errno set if @in does not hold binary counters.
+ */
+int xs_counters_read(struct xs_counters *cs, FILE *in)
+{
+	size_t len = 0, size = 0, n;
+	char *buf = NULL;
+	int ret;
+
+	do {
+		if (size - len < XS_COUNTERS_BLOCK) {
+			size = size * 2 + XS_COUNTERS_BLOCK;
+			buf = xtables_realloc(buf, size);
+		}
+		n = fread(buf + len, 1, size - len, in);
+		len += n;
+	} while (n > 0);
+
+	xs_counters_init(cs, 0);
+	ret = ferror(in) ? -1 : xs_counters_parse(cs, buf, len);
+	free(buf);
+	if (ret < 0) {
+		xs_counters_free(cs);
+		errno = EINVAL;
+	}
+	return ret;
+}
+
+static void xs_counters_put(FILE *out, const char *s, size_t len)
+{
+	static const char pad[8];
+
+	fwrite(s, 1, len, out);
+	fwrite(pad, 1, XS_COUNTERS_ALIGN(len) - len, out);
+}
+
+/**
+ * xs_counters_write - write counters in binary form
+ * @cs:		counter set
+ * @out:	output stream
+ */
+int xs_counters_write(const struct xs_counters *cs, FILE *out)
+{
+	struct xs_counters_hdr hdr = {
+		.magic		= XS_COUNTERS_MAGIC,
+		.version	= XS_COUNTERS_VERSION,
+		.family		= cs->family,
+		.flags		= cs->delta ? XS_COUNTERS_F_DELTA : 0,
+		.chains		= cs->num,
+	};
+	struct xs_counters_chain_rec crec;
+	struct xs_counters_rule_rec rrec;
+	const struct xs_counter_chain *c;
+	const struct xs_counter *r;
+	const char *table, *name;
+	unsigned int i, j;
+
+	fwrite(&hdr, sizeof(hdr), 1, out);
+
+	for (i = 0; i < cs->num; i++) {
+		c = &cs->chains[i];
+		table = cs->pool + c->table;
+		name = cs->pool + c->name;
+
+		memset(&crec, 0, sizeof(crec));
+		crec.pcnt = c->pcnt;
+		crec.bcnt = c->bcnt;
+		crec.rules = c->num;
+		crec.table_len = strlen(table);
+		crec.name_len = strlen(name);
+		crec.flags = c->policy ? XS_COUNTERS_F_POLICY : 0;
+		fwrite(&crec, sizeof(crec), 1, out);
+		xs_counters_put(out, table, crec.table_len);
+		xs_counters_put(out, name, crec.name_len);
+
+		for (j = 0; j < c->num; j++) {
+			r = &c->rules[j];
+
+			memset(&rrec, 0, sizeof(rrec));
+			rrec.handle = r->handle;
+			rrec.pcnt = r->pcnt;
+			rrec.bcnt = r->bcnt;
+			if (r->comment) {
+				rrec.comment_len = strlen(cs->pool + r->comment);
+				rrec.flags = XS_COUNTERS_F_COMMENT;
+			}
+			fwrite(&rrec, sizeof(rrec), 1, out);
+			if (r->comment)
+				xs_counters_put(out, cs->pool + r->comment,
+						rrec.comment_len);
+		}
+	}
+
+	return fflush(out) != 0 || ferror(out) ? -1 : 0;
+}
+
+static void xs_counters_label(FILE *out, const char *name, const char *value)
+{
+	fprintf(out, ",%s=\"", name);
+	for (; *value; value++) {
+		switch (*value) {
+		case '\\':
+			fputs("\\\\", out);
+			break;
+		case '"':
+			fputs("\\\"", out);
+			break;
+		case '\n':
+			fputs("\\n", out);
+			break;
+		default:
+			fputc(*value, out);
+		}
+	}
+	fputc('"', out);
+}
+
+static void xs_counters_sample(FILE *out, const struct xs_counters *cs,
+			       const char *metric,
+			       const struct xs_counter_chain *c,
+			       unsigned int pos, const struct xs_counter *r,
+			       uint64_t value)
+{
+	fprintf(out, "%s{family=\"%s\"", metric,
+		cs->family == NFPROTO_IPV6 ? "ipv6" : "ipv4");
+	xs_counters_label(out, "table", cs->pool + c->table);
+	xs_counters_label(out, "chain", cs->pool + c->name);
+
+	if (!r) {
+		fputs(",rule=\"policy\"", out);
+	} else {
+		fprintf(out, ",rule=\"%u\"", pos);
+		if (r->handle)
+			fprintf(out, ",handle=\"%" PRIu64 "\"", r->handle);
+		if (r->comment)
+			xs_counters_label(out, "comment", cs->pool + r->comment);
+	}
+	fprintf(out, "} %" PRIu64 "\n", value);
+}
+
+/**
+ * xs_counters_print - print counters in the OpenMetrics text format
+ * @cs:		counter set
+ * @out:	output stream
+ *
+ * Totals are counters, increments are gauges with names ending in _delta.
+ * Chain policies have the rule label "policy", rules their position.
+ */
+int xs_counters_print(const struct xs_counters *cs, FILE *out)
+{
+	static const struct {
+		const char	*name;
+		const char	*help;
+	} metrics[] = {
+		{ "iptables_rule_packets",
+		  "Packets matched by a rule or given the policy of a chain" },
+		{ "iptables_rule_bytes",
+		  "Bytes matched by a rule or given the policy of a chain" },
+	};
+	const struct xs_counter_chain *c;
+	const struct xs_counter *r;
+	char metric[64], sample[sizeof(metric) + 8];
+	unsigned int m, i, j;
+	bool bytes;
+
+	for (m = 0; m < ARRAY_SIZE(metrics); m++) {
+		bytes = m == 1;
+		snprintf(metric, sizeof(metric), "%s%s", metrics[m].name,
+			 cs->delta ? "_delta" : "");
+		snprintf(sample, sizeof(sample), "%s%s", metric,
+			 cs->delta ? "" : "_total");
+		fprintf(out, "# TYPE %s %s\n# HELP %s %s%s.\n", metric,
+			cs->delta ? "gauge" : "counter", metric,
+			metrics[m].help,
+			cs->delta ? ", since the previous scrape" : "");
+
+		for (i = 0; i < cs->num; i++) {
+			c = &cs->chains[i];
+			if (c->policy)
+				xs_counters_sample(out, cs, sample, c, 0, NULL,
+						   bytes ? c->bcnt : c->pcnt);
+			for (j = 0; j < c->num; j++) {
+				r = &c->rules[j];
+				xs_counters_sample(out, cs, sample, c, j + 1, r,
+						   bytes ? r->bcnt : r->pcnt);
+			}
+		}
+	}
+	fputs("# EOF\n", out);
+
+	return fflush(out) != 0 || ferror(out) ? -1 : 0;
+}
+
+static const struct option xs_counters_options[] = {
+	{.name = "table",   .has_arg = true,  .val = 't'},
+	{.name = "binary",  .has_arg = false, .val = 'b'},
+	{.name = "delta",   .has_arg = true,  .val = 'd'},
+	{.name = "version", .has_arg = false, .val = 'V'},
+	{.name = "help",    .has_arg = false, .val = 'h'},
+	{.name = "profile", .has_arg = 2,     .val = 'Q'},
+	{NULL},
+};
+
+static void xs_counters_help(void)
+{
+	printf("Usage: %s [-t table] [-b] [-d statefile]\n"
+	       "\n"
+	       "  -t, --table=TABLE     only the counters of TABLE\n"
+	       "  -b, --binary          binary output instead of OpenMetrics\n"
+	       "  -d, --delta=FILE      increments since the scrape saved in FILE,\n"
+	       "                        which then holds this one\n"
+	       "      --profile[=FILE]  time and memory of each phase\n",
+	       xt_params->program_name);
+}
+
+/* Counters of the previous scrape, NULL if there are none to go by. */
+static struct xs_counters *xs_counters_state(struct xs_counters *prev,
+					     const char *file, int family)
+{
+	FILE *in;
+	int ret;
+
+	in = fopen(file, "re");
+	if (!in) {
+		if (errno == ENOENT)
+			return NULL;
+		xtables_error(OTHER_PROBLEM, "Cannot open state file %s: %s\n",
+			      file, strerror(errno));
+	}
+
+	ret = xs_counters_read(prev, in);
+	fclose(in);
+	if (ret == 0 && !prev->delta && prev->family == family)
+		return prev;
+
+	if (ret == 0)
+		xs_counters_free(prev);
+	fprintf(stderr, "%s: ignoring unusable state file %s\n",
+		xt_params->program_name, file);
+	return NULL;
+}
+
+/* The totals go to a new file, which replaces @file once the output is
+ * delivered, so that a failed scrape is counted by the next one.
+ */
+static char *xs_counters_state_write(const struct xs_counters *cs,
+				     const char *file)
+{
+	FILE *out = NULL;
+	char *tmp;
+	int fd;
+
+	tmp = xtables_malloc(strlen(file) + sizeof(".XXXXXX"));
+	sprintf(tmp, "%s.XXXXXX", file);
+
+	fd = mkstemp(tmp);
+	if (fd >= 0)
+		out = fdopen(fd, "w");
+	if (!out || xs_counters_write(cs, out) < 0 || fclose(out) != 0) {
+		if (fd >= 0)
+			unlink(tmp);
+		xtables_error(OTHER_PROBLEM, "Cannot write state file %s: %s\n",
+			      tmp, strerror(errno));
+	}
+	return tmp;
+}
+
+/**
+ * xs_counters_main - export the counters of a family
+ * @argc:	argument count
+ * @argv:	arguments of the command
+ * @family:	NFPROTO_IPV4 or NFPROTO_IPV6
+ * @backend:	name of the backend, for --version
+ * @fetch:	fills the counter set, of one table or of all of them
+ * @data:	passed to @fetch
+ */
+int xs_counters_main(int argc, char *argv[], int family, const char *backend,
+		     xs_counters_fetch fetch, void *data)
+{
+	struct xs_counters cur, prev_buf, *prev = NULL;
+	const char *table = NULL, *state = NULL;
+	bool binary = false;
+	char *tmp = NULL;
+	int c, ret;
+
+	while ((c = getopt_long(argc, argv, "t:bd:Vh", xs_counters_options,
+				NULL)) != -1) {
+		switch (c) {
+		case 't':
+			table = optarg;
+			break;
+		case 'b':
+			binary = true;
+			break;
+		case 'd':
+			state = optarg;
+			break;
+		case 'Q':
+			/* taken by xs_profile_init() already */
+			break;
+		case 'V':
+			printf("%s v%s (%s)\n", xt_params->program_name,
+			       xt_params->program_version, backend);
+			exit(0);
+		case 'h':
+			xs_counters_help();
+			exit(0);
+		default:
+			fprintf(stderr,
+				"Try `%s -h' for more information.\n",
+				xt_params->program_name);
+			exit(1);
+		}
+	}
+
+	if (optind < argc) {
+		fprintf(stderr, "Unknown arguments found on commandline\n");
+		exit(1);
+	}
+
+	if (state)
+		prev = xs_counters_state(&prev_buf, state, family);
+
+	xs_counters_init(&cur, family);
+	if (fetch(&cur, table, data) < 0)
+		xtables_error(OTHER_PROBLEM, "Cannot fetch counters: %s\n",
+			      strerror(errno));
+
+	if (state) {
+		tmp = xs_counters_state_write(&cur, state);
+		xs_counters_delta(&cur, prev);
+	}
+
+	ret = binary ? xs_counters_write(&cur, stdout) :
+		       xs_counters_print(&cur, stdout);
+	if (ret < 0) {
+		if (tmp)
+			unlink(tmp);
+		xtables_error(OTHER_PROBLEM, "Cannot write counters: %s\n",
+			      strerror(errno));
+	}
+
+	if (tmp && rename(tmp, state) < 0) {
+		unlink(tmp);
+		xtables_error(OTHER_PROBLEM, "Cannot replace state file %s: %s\n",
+			      state, strerror(errno));
+	}
+
+	free(tmp);
+	if (prev)
+		xs_counters_free(prev);
+	xs_counters_free(&cur);
+	return 0;
+}
@@ -0,0 +1,701 @@
+/*
+ * Split long runs of address or port rules of a chain into a tree of
+ * sub-chains, for restore input. A packet then walks down the tree by a
+ * few dispatch rules instead of trying every rule of the run.
+ *
+ * Each sub-chain holds, in their original order, exactly the rules of the
+ * run which can match the packets dispatched to it, so the first rule
+ * deciding a packet is the same as before. Runs are cut before RETURN and
+ * -g rules unless they reach the end of the chain, where the tree is
+ * entered with -g and those rules keep their meaning.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <config.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <xtables.h>
+#include "xshared.h"
+
+/* longer chain names are shortened to make room for the suffix */
+#define XP_BASE_MAX	16
+
+static const struct {
+	const char	*name;
+	enum xs_part_key key;
+} xp_keys[] = {
+	{ "src",	XS_PART_SRC },
+	{ "dst",	XS_PART_DST },
+	{ "dport",	XS_PART_DPORT },
+};
+
+static const struct {
+	uint8_t		proto;
+	const char	*name;
+} xp_port_protos[] = {
+	{ IPPROTO_TCP,	"tcp" },
+	{ IPPROTO_UDP,	"udp" },
+	{ IPPROTO_DCCP,	"dccp" },
+	{ IPPROTO_SCTP,	"sctp" },
+};
+
+/**
+ * xs_partition_parse - parse the argument of --partition
+ * @pt:		partition settings to fill
+ * @arg:	"N[,key...]", N being the most rules a sub-chain keeps
+ *
+ * The keys are tried in the order given, src and dst by default.
+ */
+void xs_partition_parse(struct xs_partition *pt, const char *arg)
+{
+	const char *p, *comma;
+	unsigned int i, len;
+	char *end;
+
+	memset(pt, 0, sizeof(*pt));
+	pt->leaf = strtoul(arg, &end, 10);
+	if (end == arg || (*end && *end != ',') || pt->leaf == 0 ||
+	    pt->leaf > 1000000)
+		xtables_error(PARAMETER_PROBLEM,
+			      "--partition wants a rule count, not \"%s\"", arg);
+
+	for (p = end; *p == ','; p = comma) {
+		p++;
+		comma = p + strcspn(p, ",");
+		len = comma - p;
+		for (i = 0; i < ARRAY_SIZE(xp_keys); i++)
+			if (strlen(xp_keys[i].name) == len &&
+			    strncmp(xp_keys[i].name, p, len) == 0)
+				break;
+		if (i == ARRAY_SIZE(xp_keys) || pt->nkeys == XS_PART_KEYS)
+			xtables_error(PARAMETER_PROBLEM,
+				      "--partition key \"%.*s\" unknown",
+				      (int)len, p);
+		pt->keys[pt->nkeys++] = xp_keys[i].key;
+	}
+
+	if (pt->nkeys == 0) {
+		pt->keys[pt->nkeys++] = XS_PART_SRC;
+		pt->keys[pt->nkeys++] = XS_PART_DST;
+	}
+}
+
+/**
+ * struct xp_buf - growing text buffer
+ * @s:		text
+ * @len:	length of @s
+ * @size:	allocated size of @s
+ */
+struct xp_buf {
+	char		*s;
+	size_t		len;
+	size_t		size;
+};
+
+static void __attribute__((format(printf, 2, 3)))
+xp_printf(struct xp_buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(b->s + b->len, b->size - b->len, fmt, ap);
+	va_end(ap);
+	if (b->len + n + 1 > b->size) {
+		b->size = (b->len + n + 1) * 2;
+		b->s = xtables_realloc(b->s, b->size);
+		va_start(ap, fmt);
+		vsnprintf(b->s + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+	}
+	b->len += n;
+}
+
+/**
+ * struct xp_chain - generated sub-chain
+ * @name:	chain name
+ * @rules:	rules in restore format
+ */
+struct xp_chain {
+	char		name[XT_EXTENSION_MAXNAMELEN];
+	struct xp_buf	rules;
+};
+
+/**
+ * struct xp_ctx - state while partitioning one table
+ * @pt:		partition settings
+ * @family:	address family of the ruleset
+ * @table:	table being partitioned
+ * @chain:	chain being partitioned
+ * @base:	prefix of the names of its sub-chains
+ * @next:	number of its next sub-chain
+ * @dispatch:	"-j" or "-g", how its current run is entered
+ * @done:	rules of @chain whose counters went out already
+ * @rules:	rules of the original chains
+ * @gen:	generated chains in the order they were made
+ * @ngen:	entries in @gen
+ * @size:	allocated entries in @gen
+ */
+struct xp_ctx {
+	const struct xs_partition *pt;
+	int			family;
+	struct xs_rule_table	*table;
+	struct xs_rule_chain	*chain;
+	char			base[XP_BASE_MAX + 1];
+	unsigned int		next;
+	const char		*dispatch;
+	bool			*done;
+	struct xp_buf		rules;
+	struct xp_chain		*gen;
+	unsigned int		ngen;
+	unsigned int		size;
+};
+
+/**
+ * struct xp_node - packets a chain of the tree gets
+ * @src:	source addresses, all of them if the length is 0
+ * @dst:	destination addresses
+ * @proto:	protocol of the port range, 0 if none yet
+ * @lo:		first destination port
+ * @hi:		last destination port
+ */
+struct xp_node {
+	struct xs_prefix src;
+	struct xs_prefix dst;
+	uint8_t		proto;
+	uint16_t	lo;
+	uint16_t	hi;
+};
+
+static struct xp_buf *xp_out(struct xp_ctx *ctx, int out)
+{
+	return out < 0 ? &ctx->rules : &ctx->gen[out].rules;
+}
+
+static const char *xp_chain_name(struct xp_ctx *ctx, int out)
+{
+	return out < 0 ? ctx->chain->name : ctx->gen[out].name;
+}
+
+/* Sub-chains of a chain are named "<base>~<n>", n counting up from 1 and
+ * skipping names the table has already.
+ */
+static int xp_chain_new(struct xp_ctx *ctx)
+{
+	struct xp_chain *c;
+
+	if (ctx->ngen == ctx->size) {
+		ctx->size = ctx->size ? ctx->size * 2 : 16;
+		ctx->gen = xtables_realloc(ctx->gen,
+					   ctx->size * sizeof(*ctx->gen));
+	}
+	c = &ctx->gen[ctx->ngen];
+	memset(c, 0, sizeof(*c));
+	do {
+		snprintf(c->name, sizeof(c->name), "%s~%u",
+			 ctx->base, ++ctx->next);
+	} while (xs_rule_chain_find(ctx->table, c->name));
+
+	return ctx->ngen++;
+}
+
+static void xp_base(struct xp_ctx *ctx, const char *name)
+{
+	uint32_t hash = 2166136261u;
+	const char *p;
+
+	if (strlen(name) <= XP_BASE_MAX) {
+		strcpy(ctx->base, name);
+		return;
+	}
+
+	/* FNV-1a folded to 16 bits keeps long names apart */
+	for (p = name; *p; p++)
+		hash = (hash ^ (uint8_t)*p) * 16777619u;
+	snprintf(ctx->base, sizeof(ctx->base), "%.11s~%04x", name,
+		 (hash >> 16 ^ hash) & 0xffff);
+}
+
+static void xp_rule(struct xp_ctx *ctx, int out, unsigned int i)
+{
+	const struct xs_rule *r = &ctx->chain->rules[i];
+	uint64_t pcnt = 0, bcnt = 0;
+
+	/* a rule copied into several sub-chains keeps its counters once */
+	if (!ctx->done[i]) {
+		pcnt = r->pcnt;
+		bcnt = r->bcnt;
+		ctx->done[i] = true;
+	}
+	xp_printf(xp_out(ctx, out), "[%" PRIu64 ":%" PRIu64 "] -A %s %s\n",
+		  pcnt, bcnt, xp_chain_name(ctx, out), r->text);
+}
+
+static bool xp_generated(const char *name)
+{
+	return strchr(name, '~') != NULL;
+}
+
+/* The prefix @key of @r, or NULL if it is not a plain numeric prefix. */
+static const struct xs_prefix *xp_prefix(const struct xp_ctx *ctx,
+					 const struct xs_rule *r,
+					 enum xs_part_key key)
+{
+	const struct xs_prefix *p = key == XS_PART_SRC ? &r->src : &r->dst;
+	const char *opt = key == XS_PART_SRC ? "-s " : "-d ";
+	unsigned int i;
+
+	/* a rule for any address would be copied into every sub-chain */
+	if (p->inv || p->family != ctx->family)
+		return NULL;
+
+	/* an address which is not numeric is kept as a match */
+	for (i = 0; i < r->nmatches; i++)
+		if (strncmp(r->matches[i], opt, 3) == 0 ||
+		    (strncmp(r->matches[i], "! ", 2) == 0 &&
+		     strncmp(r->matches[i] + 2, opt, 3) == 0))
+			return NULL;
+	return p;
+}
+
+static const char *xp_port_proto(uint8_t proto)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(xp_port_protos); i++)
+		if (xp_port_protos[i].proto == proto)
+			return xp_port_protos[i].name;
+	return NULL;
+}
+
+/* Whether @r can go into a tree of @key, @proto for a port tree. */
+static bool xp_usable(const struct xp_ctx *ctx, const struct xs_rule *r,
+		      enum xs_part_key key, uint8_t proto)
+{
+	/* the output of an earlier run stays as it is */
+	if (xp_generated(r->verdict))
+		return false;
+
+	if (key != XS_PART_DPORT)
+		return xp_prefix(ctx, r, key) != NULL;
+
+	return r->proto == proto && !r->proto_inv && xp_port_proto(proto) &&
+	       r->dport.set && !r->dport.inv;
+}
+
+static unsigned int xp_addr_bits(const struct xp_ctx *ctx)
+{
+	return ctx->family == AF_INET6 ? 128 : 32;
+}
+
+static bool xp_bit(const uint8_t *addr, unsigned int bit)
+{
+	return addr[bit / 8] & (0x80 >> (bit % 8));
+}
+
+/* Bits @a and @b have in common, up to @max. */
+static unsigned int xp_common(const uint8_t *a, const uint8_t *b,
+			      unsigned int max)
+{
+	unsigned int bit;
+
+	for (bit = 0; bit < max; bit += 8)
+		if (a[bit / 8] != b[bit / 8])
+			break;
+	while (bit < max && xp_bit(a, bit) == xp_bit(b, bit))
+		bit++;
+	return bit < max ? bit : max;
+}
+
+static void xp_build(struct xp_ctx *ctx, int out, const struct xp_node *node,
+		     const unsigned int *idx, unsigned int n);
+
+static int xp_sub_chain(struct xp_ctx *ctx, const struct xp_node *node,
+			const unsigned int *idx, unsigned int n)
+{
+	int c = xp_chain_new(ctx);
+
+	xp_build(ctx, c, node, idx, n);
+	return c;
+}
+
+
+/* @addr cut to @len bits into @dst */
+static void xp_mask(uint8_t *dst, const uint8_t *addr, unsigned int len)
+{
+	unsigned int i;
+
+	memcpy(dst, addr, 16);
+	for (i = len; i < 128; i++)
+		dst[i / 8] &= ~(0x80 >> (i % 8));
+}
+
+static void xp_dispatch_prefix(struct xp_ctx *ctx, int out, bool inv,
+			       enum xs_part_key key, const uint8_t *addr,
+			       unsigned int len, int target)
+{
+	char str[INET6_ADDRSTRLEN + 8];
+
+	inet_ntop(ctx->family, addr, str, INET6_ADDRSTRLEN);
+	snprintf(str + strlen(str), 8, "/%u", len);
+	xp_printf(xp_out(ctx, out), "[0:0] -A %s %s%s %s %s %s\n",
+		  xp_chain_name(ctx, out), inv ? "! " : "",
+		  key == XS_PART_SRC ? "-s" : "-d", str, ctx->dispatch,
+		  ctx->gen[target].name);
+}
+
+/* Split at the first bit where the rules more specific than the node
+ * prefix differ. Rules covering the prefix they share go into both
+ * halves, those shorter than it also get what falls outside of it.
+ */
+static bool xp_split_prefix(struct xp_ctx *ctx, int out,
+			    const struct xp_node *node, enum xs_part_key key,
+			    const unsigned int *idx, unsigned int n)
+{
+	const struct xs_prefix *np = key == XS_PART_SRC ? &node->src :
+							  &node->dst;
+	unsigned int i, j, len = 0, max, nsub[2] = {}, nrest = 0;
+	const struct xs_prefix **p;
+	unsigned int *sub[2], *rest;
+	uint8_t common[16] = {};
+	const uint8_t *first;
+	struct xp_node child;
+	struct xs_prefix *cp;
+	bool *strict, again;
+	int c;
+
+	max = xp_addr_bits(ctx);
+	p = xtables_calloc(n, sizeof(*p));
+	strict = xtables_calloc(n, sizeof(*strict));
+	for (i = 0; i < n; i++) {
+		p[i] = xp_prefix(ctx, &ctx->chain->rules[idx[i]], key);
+		if (p[i] == NULL)
+			goto fail;
+		strict[i] = p[i]->len > np->len;
+	}
+
+	/* rules no longer than what the rest share have to go to both
+	 * halves, what is left may share more
+	 */
+	do {
+		first = NULL;
+		for (i = 0; i < n; i++) {
+			if (!strict[i])
+				continue;
+			if (first == NULL) {
+				first = p[i]->addr;
+				len = max;
+			}
+			len = xp_common(first, p[i]->addr, len);
+		}
+		again = false;
+		for (i = 0; i < n; i++) {
+			if (strict[i] && p[i]->len <= len) {
+				strict[i] = false;
+				again = true;
+			}
+		}
+	} while (again);
+	if (first == NULL)
+		goto fail;
+	xp_mask(common, first, len);
+
+	sub[0] = xtables_calloc(n, sizeof(**sub));
+	sub[1] = xtables_calloc(n, sizeof(**sub));
+	rest = xtables_calloc(n, sizeof(*rest));
+	for (i = 0; i < n; i++) {
+		if (strict[i]) {
+			j = xp_bit(p[i]->addr, len);
+			sub[j][nsub[j]++] = idx[i];
+			continue;
+		}
+		sub[0][nsub[0]++] = idx[i];
+		sub[1][nsub[1]++] = idx[i];
+		if (len > np->len && p[i]->len < len)
+			rest[nrest++] = idx[i];
+	}
+
+	for (j = 0; j < 2; j++) {
+		child = *node;
+		cp = key == XS_PART_SRC ? &child.src : &child.dst;
+		cp->family = ctx->family;
+		cp->len = len + 1;
+		memcpy(cp->addr, common, sizeof(cp->addr));
+		if (j)
+			cp->addr[len / 8] |= 0x80 >> (len % 8);
+		c = xp_sub_chain(ctx, &child, sub[j], nsub[j]);
+		xp_dispatch_prefix(ctx, out, false, key, cp->addr, cp->len, c);
+	}
+	if (nrest) {
+		c = xp_sub_chain(ctx, node, rest, nrest);
+		xp_dispatch_prefix(ctx, out, true, key, common, len, c);
+	}
+
+	free(sub[0]);
+	free(sub[1]);
+	free(rest);
+	free(strict);
+	free(p);
+	return true;
+fail:
+	free(strict);
+	free(p);
+	return false;
+}
+
+static int xp_port_cmp(const void *a, const void *b)
+{
+	return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+static void xp_dispatch_ports(struct xp_ctx *ctx, int out, uint8_t proto,
+			      unsigned int lo, unsigned int hi, int target)
+{
+	const char *name = xp_port_proto(proto);
+	char ports[16];
+
+	if (lo == hi)
+		snprintf(ports, sizeof(ports), "%u", lo);
+	else
+		snprintf(ports, sizeof(ports), "%u:%u", lo, hi);
+	xp_printf(xp_out(ctx, out), "[0:0] -A %s -p %s -m %s --dport %s %s %s\n",
+		  xp_chain_name(ctx, out), name, name, ports, ctx->dispatch,
+		  ctx->gen[target].name);
+}
+
+/* Split the destination port range at the median of the range ends of
+ * the rules, rules spanning the split go into both halves.
+ */
+static bool xp_split_ports(struct xp_ctx *ctx, int out,
+			   const struct xp_node *node,
+			   const unsigned int *idx, unsigned int n)
+{
+	uint8_t proto = node->proto ?: ctx->chain->rules[idx[0]].proto;
+	unsigned int i, ncand = 0, nsub[2] = {};
+	unsigned int *sub[2];
+	const struct xs_rule *r;
+	struct xp_node child;
+	uint16_t *cand, m;
+	int c;
+
+	for (i = 0; i < n; i++)
+		if (!xp_usable(ctx, &ctx->chain->rules[idx[i]],
+			       XS_PART_DPORT, proto))
+			return false;
+
+	cand = xtables_calloc(2 * n, sizeof(*cand));
+	for (i = 0; i < n; i++) {
+		r = &ctx->chain->rules[idx[i]];
+		if (r->dport.lo > node->lo)
+			cand[ncand++] = r->dport.lo;
+		if (r->dport.hi < node->hi)
+			cand[ncand++] = r->dport.hi + 1;
+	}
+	if (ncand == 0) {
+		free(cand);
+		return false;
+	}
+	qsort(cand, ncand, sizeof(*cand), xp_port_cmp);
+	m = cand[ncand / 2];
+	free(cand);
+
+	for (i = 0; i < n; i++) {
+		r = &ctx->chain->rules[idx[i]];
+		nsub[0] += r->dport.lo < m;
+		nsub[1] += r->dport.hi >= m;
+	}
+	if (nsub[0] == n || nsub[1] == n)
+		return false;
+
+	sub[0] = xtables_calloc(nsub[0], sizeof(**sub));
+	sub[1] = xtables_calloc(nsub[1], sizeof(**sub));
+	nsub[0] = nsub[1] = 0;
+	for (i = 0; i < n; i++) {
+		r = &ctx->chain->rules[idx[i]];
+		if (r->dport.lo < m)
+			sub[0][nsub[0]++] = idx[i];
+		if (r->dport.hi >= m)
+			sub[1][nsub[1]++] = idx[i];
+	}
+
+	child = *node;
+	child.proto = proto;
+	child.hi = m - 1;
+	c = xp_sub_chain(ctx, &child, sub[0], nsub[0]);
+	xp_dispatch_ports(ctx, out, proto, node->lo, m - 1, c);
+
+	child.lo = m;
+	child.hi = node->hi;
+	c = xp_sub_chain(ctx, &child, sub[1], nsub[1]);
+	xp_dispatch_ports(ctx, out, proto, m, node->hi, c);
+
+	free(sub[0]);
+	free(sub[1]);
+	return true;
+}
+
+static void xp_build(struct xp_ctx *ctx, int out, const struct xp_node *node,
+		     const unsigned int *idx, unsigned int n)
+{
+	enum xs_part_key key;
+	unsigned int i;
+
+	for (i = 0; n > ctx->pt->leaf && i < ctx->pt->nkeys; i++) {
+		key = ctx->pt->keys[i];
+		if (key == XS_PART_DPORT ?
+		    xp_split_ports(ctx, out, node, idx, n) :
+		    xp_split_prefix(ctx, out, node, key, idx, n))
+			return;
+	}
+
+	for (i = 0; i < n; i++)
+		xp_rule(ctx, out, idx[i]);
+}
+
+/* End of the run of rules starting at @first which can go into a tree */
+static unsigned int xp_run(struct xp_ctx *ctx, unsigned int first)
+{
+	const struct xs_rule_chain *c = ctx->chain;
+	const struct xs_rule *r;
+	unsigned int i, k, end = first;
+
+	for (k = 0; k < ctx->pt->nkeys; k++) {
+		for (i = first; i < c->num; i++)
+			if (!xp_usable(ctx, &c->rules[i], ctx->pt->keys[k],
+				       c->rules[first].proto))
+				break;
+		if (i > end)
+			end = i;
+	}
+	if (end == c->num)
+		return end;
+
+	/* in a sub-chain entered with -j these would leave the sub-chain
+	 * rather than the chain
+	 */
+	for (i = first; i < end; i++) {
+		r = &c->rules[i];
+		if (r->jump_goto || strcmp(r->verdict, "RETURN") == 0)
+			return i;
+	}
+	return end;
+}
+
+static void xp_chain(struct xp_ctx *ctx, struct xs_rule_chain *c)
+{
+	struct xp_node root = { .hi = UINT16_MAX };
+	unsigned int i, j, end, *idx;
+
+	ctx->chain = c;
+	ctx->done = xtables_calloc(c->num + 1, sizeof(*ctx->done));
+	idx = xtables_calloc(c->num + 1, sizeof(*idx));
+	xp_base(ctx, c->name);
+
+	/* a long name is cut down, and may be cut down to the same base */
+	ctx->next = 0;
+	for (i = 0; i < ctx->ngen; i++)
+		if (strncmp(ctx->gen[i].name, ctx->base,
+			    strlen(ctx->base)) == 0 &&
+		    ctx->gen[i].name[strlen(ctx->base)] == '~')
+			ctx->next = strtoul(ctx->gen[i].name +
+					    strlen(ctx->base) + 1, NULL, 10);
+
+	for (i = 0; i < c->num; i = end) {
+		end = xp_generated(c->name) ? i : xp_run(ctx, i);
+		if (end - i <= ctx->pt->leaf) {
+			xp_rule(ctx, -1, i);
+			end = i + 1;
+			continue;
+		}
+
+		ctx->dispatch = end == c->num ? "-g" : "-j";
+		for (j = i; j < end; j++)
+			idx[j - i] = j;
+		xp_build(ctx, -1, &root, idx, end - i);
+	}
+
+	free(idx);
+	free(ctx->done);
+}
+
+static void xp_table(FILE *out, struct xs_rule_table *t, int family,
+		     const struct xs_partition *pt)
+{
+	struct xp_ctx ctx = {
+		.pt	= pt,
+		.family	= family,
+		.table	= t,
+	};
+	struct xs_rule_chain *c;
+	unsigned int i;
+
+	for (i = 0; i < t->num; i++)
+		xp_chain(&ctx, &t->chains[i]);
+
+	fprintf(out, "*%s\n", t->name);
+	for (i = 0; i < t->num; i++) {
+		c = &t->chains[i];
+		fprintf(out, ":%s %s [%" PRIu64 ":%" PRIu64 "]\n", c->name,
+			c->policy ?: "-", c->pcnt, c->bcnt);
+	}
+	for (i = 0; i < ctx.ngen; i++)
+		fprintf(out, ":%s - [0:0]\n", ctx.gen[i].name);
+	if (ctx.rules.len)
+		fwrite(ctx.rules.s, 1, ctx.rules.len, out);
+	for (i = 0; i < ctx.ngen; i++) {
+		fwrite(ctx.gen[i].rules.s, 1, ctx.gen[i].rules.len, out);
+		free(ctx.gen[i].rules.s);
+	}
+	fprintf(out, "COMMIT\n");
+
+	free(ctx.rules.s);
+	free(ctx.gen);
+}
+
+/**
+ * xs_partition_input - partition the chains of restore input
+ * @in:		input in iptables-save format, closed when done
+ * @pt:		partition settings
+ *
+ * Returns a stream with the same ruleset, long runs of rules replaced by
+ * dispatch rules into trees of sub-chains. Those are named after their
+ * chain, "INPUT~1", "INPUT~2" and so on in the order the trees are built,
+ * so the same input always gives the same chains. Chains with a '~' in
+ * their name and rules jumping to them are left alone.
+ */
+FILE *xs_partition_input(FILE *in, const struct xs_partition *pt)
+{
+	struct xs_ruleset rs = {};
+	unsigned int i;
+	FILE *out;
+
+	out = tmpfile();
+	if (out == NULL)
+		xtables_error(OTHER_PROBLEM, "Can't partition input: %s",
+			      strerror(errno));
+
+	xs_ruleset_read(&rs, in);
+	fclose(in);
+
+	for (i = 0; i < rs.num; i++)
+		xp_table(out, &rs.tables[i], rs.family ?: AF_INET, pt);
+	xs_ruleset_free(&rs);
+
+	if (fflush(out) || ferror(out))
+		xtables_error(OTHER_PROBLEM, "Can't partition input: %s",
+			      strerror(errno));
+	rewind(out);
+	return out;
+}
@@ -0,0 +1,306 @@
+/*
+ * Phase profile of a command, for --profile and XTABLES_PROFILE: calls,
+ * monotonic time, heap growth and peak RSS growth of each phase, printed
+ * to stderr or written to a JSON file when the program exits.
+ *
+ * While disabled, a phase boundary costs the test of xs_profile_enabled.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#ifdef HAVE_MALLINFO2
+#include <malloc.h>
+#endif
+#include <xtables.h>
+#include "xshared.h"
+
+static const char *const xp_names[XS_PROF_MAX] = {
+	[XS_PROF_LOCK]		= "lock",
+	[XS_PROF_PARSE]		= "parse",
+	[XS_PROF_CACHE]		= "cache",
+	[XS_PROF_CACHE_GENID]	= "cache-genid",
+	[XS_PROF_CACHE_TABLES]	= "cache-tables",
+	[XS_PROF_CACHE_CHAINS]	= "cache-chains",
+	[XS_PROF_CACHE_RULES]	= "cache-rules",
+	[XS_PROF_CACHE_RETRY]	= "cache-retry",
+	[XS_PROF_COMMIT]	= "commit",
+	[XS_PROF_BATCH]		= "batch",
+	[XS_PROF_TALK]		= "talk",
+	[XS_PROF_REPLAY]	= "replay",
+	[XS_PROF_TC_INIT]	= "tc-init",
+	[XS_PROF_TC_GET_ENTRIES] = "tc-get-entries",
+	[XS_PROF_TC_PARSE]	= "tc-parse",
+	[XS_PROF_TC_COMMIT]	= "tc-commit",
+	[XS_PROF_TC_COMPILE]	= "tc-compile",
+	[XS_PROF_TC_REPLACE]	= "tc-replace",
+	[XS_PROF_TC_COUNTERS]	= "tc-counters",
+};
+
+/**
+ * struct xp_sample - resource usage at one point in time
+ * @ns:		CLOCK_MONOTONIC
+ * @heap:	bytes allocated from the heap and still in use
+ * @maxrss:	peak resident set size so far, in KiB
+ */
+struct xp_sample {
+	int64_t		ns;
+	int64_t		heap;
+	long		maxrss;
+};
+
+/**
+ * struct xp_stat - accumulated usage of a phase
+ * @calls:	completed outermost runs of the phase
+ * @depth:	nesting of the runs in progress
+ * @start:	usage when the outermost run in progress began
+ * @sum:	usage growth summed over the completed runs
+ */
+struct xp_stat {
+	unsigned int	calls;
+	unsigned int	depth;
+	struct xp_sample start;
+	struct xp_sample sum;
+};
+
+bool xs_profile_enabled;
+
+static struct xp_stat xp_stats[XS_PROF_MAX];
+static struct xp_stat xp_total;
+static const char *xp_prog = "xtables";
+static const char *xp_file;
+
+#ifdef HAVE_MALLINFO2
+#define XP_HAVE_HEAP	true
+
+/* mallinfo2() returns a struct, there is no other way to ask */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+static int64_t xp_heap(void)
+{
+	struct mallinfo2 mi = mallinfo2();
+
+	return mi.uordblks + mi.hblkhd;
+}
+#pragma GCC diagnostic pop
+#else
+#define XP_HAVE_HEAP	false
+
+static int64_t xp_heap(void)
+{
+	return 0;
+}
+#endif
+
+static int64_t xp_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void xp_sample_mem(struct xp_sample *s)
+{
+	struct rusage ru;
+
+	s->heap = xp_heap();
+	s->maxrss = getrusage(RUSAGE_SELF, &ru) < 0 ? 0 : ru.ru_maxrss;
+}
+
+/* The clock is read last on entry and first on exit, so the phase is not
+ * charged for the sampling of the other values.
+ */
+static void xp_enter(struct xp_stat *st)
+{
+	int err = errno;
+
+	if (st->depth++ == 0) {
+		xp_sample_mem(&st->start);
+		st->start.ns = xp_now();
+	}
+	errno = err;
+}
+
+static void xp_leave(struct xp_stat *st)
+{
+	struct xp_sample now;
+	int err = errno;
+
+	if (st->depth == 0 || --st->depth > 0)
+		return;
+
+	now.ns = xp_now();
+	xp_sample_mem(&now);
+
+	st->calls++;
+	st->sum.ns += now.ns - st->start.ns;
+	st->sum.heap += now.heap - st->start.heap;
+	st->sum.maxrss += now.maxrss - st->start.maxrss;
+	errno = err;
+}
+
+void __xs_profile_begin(enum xs_prof_phase phase)
+{
+	xp_enter(&xp_stats[phase]);
+}
+
+void __xs_profile_end(enum xs_prof_phase phase)
+{
+	xp_leave(&xp_stats[phase]);
+}
+
+/* Hook for iptc_set_phase_hook() and ip6tc_set_phase_hook() */
+void xs_profile_xtc(enum xtc_phase phase, int end)
+{
+	if (!xs_profile_enabled)
+		return;
+
+	if (end)
+		__xs_profile_end(XS_PROF_TC_INIT + phase);
+	else
+		__xs_profile_begin(XS_PROF_TC_INIT + phase);
+}
+
+static void xp_print_text(FILE *out)
+{
+	const struct xp_stat *st;
+	char heap[32];
+	int i;
+
+	fprintf(out, "%s profile:\n", xp_prog);
+	fprintf(out, "%-16s %8s %12s %12s %12s\n",
+		"phase", "calls", "seconds", "heap KiB", "maxrss KiB");
+
+	for (i = -1; i < XS_PROF_MAX; i++) {
+		st = i < 0 ? &xp_total : &xp_stats[i];
+		if (st->calls == 0)
+			continue;
+
+		if (XP_HAVE_HEAP)
+			snprintf(heap, sizeof(heap), "%+" PRId64,
+				 st->sum.heap / 1024);
+		else
+			snprintf(heap, sizeof(heap), "-");
+
+		fprintf(out, "%-16s %8u %5" PRId64 ".%06" PRId64
+			" %12s %+12ld\n", i < 0 ? "total" : xp_names[i],
+			st->calls, st->sum.ns / 1000000000,
+			st->sum.ns % 1000000000 / 1000, heap, st->sum.maxrss);
+	}
+}
+
+static void xp_print_json(FILE *out)
+{
+	const struct xp_stat *st;
+	bool first = true;
+	int i;
+
+	fprintf(out, "{\"program\":\"%s\",\"phases\":[", xp_prog);
+
+	for (i = -1; i < XS_PROF_MAX; i++) {
+		st = i < 0 ? &xp_total : &xp_stats[i];
+		if (st->calls == 0)
+			continue;
+
+		fprintf(out, "%s\n{\"phase\":\"%s\",\"calls\":%u,\"ns\":%" PRId64,
+			first ? "" : ",", i < 0 ? "total" : xp_names[i],
+			st->calls, st->sum.ns);
+		if (XP_HAVE_HEAP)
+			fprintf(out, ",\"heap_bytes\":%" PRId64, st->sum.heap);
+		else
+			fprintf(out, ",\"heap_bytes\":null");
+		fprintf(out, ",\"maxrss_kib\":%ld}", st->sum.maxrss);
+		first = false;
+	}
+	fprintf(out, "\n]}\n");
+}
+
+static void xp_report(void)
+{
+	FILE *out;
+	int i;
+
+	/* phases cut short by an exit end with it */
+	for (i = 0; i < XS_PROF_MAX; i++) {
+		if (xp_stats[i].depth > 0) {
+			xp_stats[i].depth = 1;
+			xp_leave(&xp_stats[i]);
+		}
+	}
+	xp_leave(&xp_total);
+
+	if (xp_file == NULL) {
+		xp_print_text(stderr);
+		return;
+	}
+
+	out = fopen(xp_file, "w");
+	if (out == NULL) {
+		fprintf(stderr, "%s: can't write profile to %s: %s\n",
+			xp_prog, xp_file, strerror(errno));
+		return;
+	}
+	xp_print_json(out);
+	fclose(out);
+}
+
+/**
+ * xs_profile_start - profile this process until it exits
+ * @file:	JSON file to write, or NULL or empty for a table on stderr
+ *
+ * Calling it again only changes where the profile goes.
+ */
+void xs_profile_start(const char *file)
+{
+	xp_file = file && *file ? file : NULL;
+	if (xs_profile_enabled)
+		return;
+
+	xp_enter(&xp_total);
+	xs_profile_enabled = true;
+	atexit(xp_report);
+}
+
+/**
+ * xs_profile_init - start profiling as the environment or arguments ask
+ * @prog:	name of the command, for the report
+ * @argc:	argument count
+ * @argv:	arguments of the command
+ *
+ * XTABLES_PROFILE takes the same value as --profile=, an empty value
+ * prints the profile to stderr. The last --profile argument wins over
+ * the environment. The argument is taken here, before anything else runs, so the
+ * command parsers only have to accept it.
+ */
+void xs_profile_init(const char *prog, int argc, char *argv[])
+{
+	const char *file = getenv("XTABLES_PROFILE");
+	bool enable = file != NULL;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--profile") == 0) {
+			file = NULL;
+			enable = true;
+		} else if (strncmp(argv[i], "--profile=", 10) == 0) {
+			file = argv[i] + 10;
+			enable = true;
+		}
+	}
+
+	xp_prog = prog;
+	if (enable)
+		xs_profile_start(file);
+}
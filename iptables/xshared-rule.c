@@ -0,0 +1,880 @@
+/*
+ * Rules of iptables-save output in a form that can be compared, for tools
+ * which reason about a ruleset without loading it into the kernel.
+ *
+ * The header fields and the port matches of tcp, udp and sctp are decoded,
+ * everything else is kept as normalized text. Comparisons built on that are
+ * conservative: two rules are only said to cover or exclude each other if
+ * the decoded fields prove it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <config.h>
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <xtables.h>
+#include "xshared.h"
+
+static const char *xs_terminal_targets[] = {
+	"ACCEPT", "DROP", "REJECT", "RETURN", "QUEUE", "NFQUEUE",
+	"DNAT", "SNAT", "MASQUERADE", "REDIRECT", "NETMAP", "TPROXY",
+	"SYNPROXY",
+};
+
+static const char *xs_port_matches[] = {
+	"tcp", "udp", "udplite", "sctp", "dccp",
+};
+
+/**
+ * struct xs_rule_builder - state while decoding the arguments of a rule
+ * @seg:	text of the "-m" block being read
+ * @seg_len:	length of @seg
+ * @seg_size:	allocated size of @seg
+ * @seg_ports:	the block is a port match, --sport and --dport are decoded
+ * @seg_args:	arguments of the block which were kept in @seg
+ */
+struct xs_rule_builder {
+	char		*seg;
+	size_t		seg_len;
+	size_t		seg_size;
+	bool		seg_ports;
+	unsigned int	seg_args;
+};
+
+static char *xs_strdup(const char *s)
+{
+	char *p = strdup(s);
+
+	if (p == NULL) {
+		perror("ip[6]tables: strdup failed");
+		exit(1);
+	}
+	return p;
+}
+
+static void xs_text_add(char **buf, size_t *len, size_t *size,
+			const char *what)
+{
+	size_t n = strlen(what) + 1;
+
+	if (*len + n + 1 > *size) {
+		*size = (*len + n + 1) * 2;
+		*buf = xtables_realloc(*buf, *size);
+	}
+	if (*len)
+		(*buf)[(*len)++] = ' ';
+	memcpy(*buf + *len, what, n);
+	*len += n - 1;
+}
+
+static void xs_rule_add_match(struct xs_rule *r, const char *text)
+{
+	r->matches = xtables_realloc(r->matches,
+				     (r->nmatches + 1) * sizeof(*r->matches));
+	r->matches[r->nmatches++] = xs_strdup(text);
+}
+
+static void xs_seg_close(struct xs_rule *r, struct xs_rule_builder *b)
+{
+	if (b->seg_len == 0)
+		return;
+
+	/* "-m tcp" with nothing but ports says no more than "-p tcp" */
+	if ((b->seg_ports && b->seg_args == 0) ||
+	    strcmp(b->seg, "comment") == 0 ||
+	    strncmp(b->seg, "comment ", 8) == 0)
+		b->seg_len = 0;
+
+	if (b->seg_len)
+		xs_rule_add_match(r, b->seg);
+	b->seg_len = 0;
+	b->seg_ports = false;
+	b->seg_args = 0;
+}
+
+static void xs_seg_add(struct xs_rule_builder *b, const char *what, bool inv)
+{
+	if (inv)
+		xs_text_add(&b->seg, &b->seg_len, &b->seg_size, "!");
+	xs_text_add(&b->seg, &b->seg_len, &b->seg_size, what);
+}
+
+static void xs_seg_open(struct xs_rule *r, struct xs_rule_builder *b,
+			const char *name)
+{
+	unsigned int i;
+
+	xs_seg_close(r, b);
+	xs_text_add(&b->seg, &b->seg_len, &b->seg_size, name);
+	for (i = 0; i < ARRAY_SIZE(xs_port_matches); i++)
+		if (strcmp(name, xs_port_matches[i]) == 0)
+			b->seg_ports = true;
+}
+
+/* Bits of the prefix length @len, or -1 if @mask is not contiguous. */
+static int xs_mask_len(const uint8_t *mask, unsigned int size)
+{
+	unsigned int i, len = 0;
+	uint8_t byte;
+
+	for (i = 0; i < size; i++) {
+		byte = mask[i];
+		while (byte & 0x80) {
+			byte <<= 1;
+			len++;
+		}
+		if (byte)
+			return -1;
+		if (len != (i + 1) * 8)
+			break;
+	}
+	for (i++; i < size; i++)
+		if (mask[i])
+			return -1;
+	return len;
+}
+
+/* Decode "addr[/len|/mask]", false if it is not a numeric address. */
+static bool xs_prefix_parse(struct xs_prefix *p, const char *arg, bool inv)
+{
+	uint8_t mask[16];
+	char buf[INET6_ADDRSTRLEN + 48], *slash;
+	unsigned int size, i;
+	int family, len;
+	char *end;
+
+	if (strlen(arg) >= sizeof(buf))
+		return false;
+	strcpy(buf, arg);
+	slash = strchr(buf, '/');
+	if (slash)
+		*slash++ = '\0';
+
+	memset(p, 0, sizeof(*p));
+	family = strchr(buf, ':') ? AF_INET6 : AF_INET;
+	size = family == AF_INET6 ? 16 : 4;
+	if (inet_pton(family, buf, p->addr) != 1)
+		return false;
+
+	if (slash == NULL) {
+		len = size * 8;
+	} else if (strchr(slash, '.') || strchr(slash, ':')) {
+		if (inet_pton(family, slash, mask) != 1)
+			return false;
+		len = xs_mask_len(mask, size);
+	} else {
+		len = strtol(slash, &end, 10);
+		if (*end || end == slash || len > (int)size * 8)
+			len = -1;
+	}
+	if (len < 0)
+		return false;
+
+	for (i = len; i < size * 8; i++)
+		p->addr[i / 8] &= ~(0x80 >> (i % 8));
+	p->family = family;
+	p->len = len;
+	p->inv = inv;
+	return true;
+}
+
+/* Decode "port", "lo:hi", ":hi" or "lo:", false if it is not numeric. */
+static bool xs_ports_parse(struct xs_ports *p, const char *arg, bool inv)
+{
+	unsigned long lo = 0, hi = UINT16_MAX;
+	const char *colon = strchr(arg, ':');
+	char *end;
+
+	if (arg[0] != ':') {
+		lo = strtoul(arg, &end, 10);
+		if (end == arg || (*end && *end != ':') || lo > UINT16_MAX)
+			return false;
+		if (colon == NULL)
+			hi = lo;
+	}
+	if (colon && colon[1]) {
+		hi = strtoul(colon + 1, &end, 10);
+		if (end == colon + 1 || *end || hi > UINT16_MAX)
+			return false;
+	}
+	if (lo > hi)
+		return false;
+
+	p->set = true;
+	p->inv = inv;
+	p->lo = lo;
+	p->hi = hi;
+	return true;
+}
+
+static void xs_iface_parse(struct xs_iface *iface, const char *arg, bool inv)
+{
+	snprintf(iface->name, sizeof(iface->name), "%s", arg);
+	iface->inv = inv;
+}
+
+static int xs_match_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static bool xs_arg_is(const char *arg, const char *s, const char *l)
+{
+	return strcmp(arg, s) == 0 || strcmp(arg, l) == 0;
+}
+
+/* Drop " -c pcnt bcnt" from the rule text, counters are kept apart. */
+static void xs_text_strip_counters(char *text, const char *pcnt,
+				   const char *bcnt)
+{
+	char buf[64], *p;
+
+	snprintf(buf, sizeof(buf), "-c %s %s", pcnt, bcnt);
+	p = strstr(text, buf);
+	if (p == NULL)
+		return;
+	memmove(p, p + strlen(buf), strlen(p + strlen(buf)) + 1);
+	if (p > text && p[-1] == ' ' && (p[0] == ' ' || p[0] == '\0'))
+		memmove(p - 1, p, strlen(p) + 1);
+}
+
+static void xs_rule_parse(struct xs_ruleset *rs, struct xs_rule *r,
+			  struct xs_argv *args, unsigned int first,
+			  unsigned int line)
+{
+	struct xs_rule_builder b = {};
+	size_t vlen = 0, vsize = 0;
+	struct xs_ports *ports;
+	unsigned int i;
+	bool inv = false;
+	char *arg;
+
+	r->line = line;
+	for (i = first; i < (unsigned int)args->argc; i++) {
+		arg = args->argv[i];
+
+		if (r->verdict) {
+			xs_text_add(&r->verdict, &vlen, &vsize, arg);
+			continue;
+		}
+		if (strcmp(arg, "!") == 0) {
+			inv = true;
+			continue;
+		}
+		if (i + 1 == (unsigned int)args->argc) {
+			if (xs_arg_is(arg, "-f", "--fragment")) {
+				r->frag = inv ? 2 : 1;
+			} else {
+				xs_seg_add(&b, arg, inv);
+				b.seg_args++;
+			}
+			break;
+		}
+
+		if (xs_arg_is(arg, "-s", "--source") ||
+		    xs_arg_is(arg, "-d", "--destination")) {
+			struct xs_prefix *p = arg[1] == 's' || arg[2] == 's' ?
+					      &r->src : &r->dst;
+
+			if (xs_prefix_parse(p, args->argv[++i], inv)) {
+				if (rs->family == 0)
+					rs->family = p->family;
+			} else {
+				if (b.seg_len)
+					xs_seg_close(r, &b);
+				xs_seg_add(&b, arg[1] == 's' || arg[2] == 's' ?
+					       "-s" : "-d", inv);
+				xs_seg_add(&b, args->argv[i], false);
+				b.seg_args++;
+				xs_seg_close(r, &b);
+			}
+		} else if (xs_arg_is(arg, "-i", "--in-interface")) {
+			xs_iface_parse(&r->iniface, args->argv[++i], inv);
+		} else if (xs_arg_is(arg, "-o", "--out-interface")) {
+			xs_iface_parse(&r->outiface, args->argv[++i], inv);
+		} else if (xs_arg_is(arg, "-p", "--protocol")) {
+			r->proto = xtables_parse_protocol(args->argv[++i]);
+			r->proto_inv = inv && r->proto;
+		} else if (xs_arg_is(arg, "-f", "--fragment")) {
+			r->frag = inv ? 2 : 1;
+		} else if (xs_arg_is(arg, "-c", "--set-counters") &&
+			   i + 2 < (unsigned int)args->argc) {
+			r->pcnt = strtoull(args->argv[i + 1], NULL, 10);
+			r->bcnt = strtoull(args->argv[i + 2], NULL, 10);
+			xs_text_strip_counters(r->text, args->argv[i + 1],
+					       args->argv[i + 2]);
+			i += 2;
+		} else if (xs_arg_is(arg, "-m", "--match")) {
+			xs_seg_open(r, &b, args->argv[++i]);
+		} else if (xs_arg_is(arg, "-j", "--jump") ||
+			   xs_arg_is(arg, "-g", "--goto")) {
+			xs_seg_close(r, &b);
+			r->jump_goto = arg[1] == 'g' || arg[2] == 'g';
+			r->verdict = xs_strdup(args->argv[++i]);
+			vlen = vsize = strlen(r->verdict) + 1;
+		} else if (b.seg_ports &&
+			   (xs_arg_is(arg, "--sport", "--source-port") ||
+			    xs_arg_is(arg, "--dport", "--destination-port"))) {
+			ports = arg[2] == 's' ? &r->sport : &r->dport;
+			if (!xs_ports_parse(ports, args->argv[i + 1], inv)) {
+				xs_seg_add(&b, arg, inv);
+				b.seg_args++;
+			} else {
+				i++;
+			}
+		} else {
+			xs_seg_add(&b, arg, inv);
+			b.seg_args++;
+		}
+		inv = false;
+	}
+	xs_seg_close(r, &b);
+	free(b.seg);
+
+	if (r->verdict == NULL)
+		r->verdict = xs_strdup("");
+	if (r->nmatches > 1)
+		qsort(r->matches, r->nmatches, sizeof(*r->matches),
+		      xs_match_cmp);
+}
+
+/* Each "*table" line starts a table of its own, as it does for restore. */
+static struct xs_rule_table *xs_ruleset_table(struct xs_ruleset *rs,
+					      const char *name)
+{
+	struct xs_rule_table *t;
+
+	if (rs->num == rs->size) {
+		rs->size = rs->size ? rs->size * 2 : 4;
+		rs->tables = xtables_realloc(rs->tables,
+					     rs->size * sizeof(*rs->tables));
+	}
+	t = &rs->tables[rs->num++];
+	memset(t, 0, sizeof(*t));
+	t->name = xs_strdup(name);
+	return t;
+}
+
+/**
+ * xs_rule_chain_find - look up a chain of a parsed table
+ * @t:		table
+ * @name:	chain name
+ *
+ * Returns the chain, or NULL if the table has none of that name.
+ */
+struct xs_rule_chain *xs_rule_chain_find(struct xs_rule_table *t,
+					 const char *name)
+{
+	unsigned int i;
+
+	for (i = t->num; i > 0; i--)
+		if (strcmp(t->chains[i - 1].name, name) == 0)
+			return &t->chains[i - 1];
+	return NULL;
+}
+
+static struct xs_rule_chain *xs_ruleset_chain(struct xs_rule_table *t,
+					      const char *name)
+{
+	struct xs_rule_chain *c = xs_rule_chain_find(t, name);
+
+	if (c)
+		return c;
+
+	if (t->num == t->size) {
+		t->size = t->size ? t->size * 2 : 8;
+		t->chains = xtables_realloc(t->chains,
+					    t->size * sizeof(*t->chains));
+	}
+	c = &t->chains[t->num++];
+	memset(c, 0, sizeof(*c));
+	c->name = xs_strdup(name);
+	return c;
+}
+
+static void xs_chain_policy(struct xs_rule_chain *c, const char *policy)
+{
+	free(c->policy);
+	c->policy = NULL;
+	if (policy && strcmp(policy, "-"))
+		c->policy = xs_strdup(policy);
+}
+
+static bool xs_counters_parse(const char *s, uint64_t *pcnt, uint64_t *bcnt)
+{
+	return sscanf(s, "[%" SCNu64 ":%" SCNu64 "]", pcnt, bcnt) == 2;
+}
+
+/**
+ * xs_ruleset_read - parse iptables-save or iptables -S output
+ * @rs:		ruleset to fill, zeroed by the caller
+ * @in:		input stream
+ *
+ * Counters are taken from "[pcnt:bcnt]" prefixes and "-c" options, so the
+ * output of iptables-save -c and iptables -v -S both carry them. Rules
+ * before any "*table" line belong to the filter table. Errors in the
+ * input exit through xtables_error().
+ */
+int xs_ruleset_read(struct xs_ruleset *rs, FILE *in)
+{
+	struct xs_rule_table *t = NULL;
+	struct xs_rule_chain *c = NULL;
+	struct xs_argv args = {};
+	struct xs_reader rd;
+	unsigned int line = 0, first;
+	char *buf, *p, *text, *copy = NULL;
+	size_t len, copy_size = 0;
+	uint64_t pcnt, bcnt;
+	struct xs_rule *r;
+	const char *cmd;
+
+	xs_reader_open(&rd, in);
+	while ((buf = xs_reader_getline(&rd))) {
+		line++;
+		buf[strcspn(buf, "\n")] = '\0';
+		if (buf[0] == '\0' || buf[0] == '#' ||
+		    strcmp(buf, "COMMIT") == 0)
+			continue;
+
+		if (buf[0] == '*') {
+			t = xs_ruleset_table(rs, buf + 1);
+			c = NULL;
+			continue;
+		}
+		if (t == NULL)
+			t = xs_ruleset_table(rs, "filter");
+
+		if (buf[0] == ':') {
+			char *name = strtok(buf + 1, " \t");
+			char *policy = strtok(NULL, " \t");
+			char *ctrs = strtok(NULL, " \t");
+
+			if (name == NULL)
+				xtables_error(PARAMETER_PROBLEM,
+					      "%s: line %u chain name invalid\n",
+					      xt_params->program_name, line);
+			c = xs_ruleset_chain(t, name);
+			xs_chain_policy(c, policy);
+			if (ctrs)
+				xs_counters_parse(ctrs, &c->pcnt, &c->bcnt);
+			continue;
+		}
+
+		pcnt = bcnt = 0;
+		p = buf;
+		if (p[0] == '[') {
+			if (!xs_counters_parse(p, &pcnt, &bcnt))
+				xtables_error(PARAMETER_PROBLEM,
+					      "%s: line %u counters invalid\n",
+					      xt_params->program_name, line);
+			p = strchr(p, ']') + 1;
+		}
+		p += strspn(p, " \t");
+
+		/* the text after "-A chain", before splitting changes it */
+		text = p + strcspn(p, " \t");
+		text += strspn(text, " \t");
+		text += strcspn(text, " \t");
+		text += strspn(text, " \t");
+		text = xs_strdup(text);
+
+		/* the splitter wants the newline to end the last argument */
+		len = strlen(p);
+		if (len + 2 > copy_size) {
+			copy_size = (len + 2) * 2;
+			copy = xtables_realloc(copy, copy_size);
+		}
+		memcpy(copy, p, len);
+		strcpy(copy + len, "\n");
+
+		xs_argv_reset(&args);
+		xs_argv_split(&args, copy, line);
+		cmd = args.argc ? args.argv[0] : "";
+		if (args.argc < 2) {
+			free(text);
+			xtables_error(PARAMETER_PROBLEM,
+				      "%s: line %u not understood\n",
+				      xt_params->program_name, line);
+		}
+
+		if (c == NULL || strcmp(c->name, args.argv[1]))
+			c = xs_ruleset_chain(t, args.argv[1]);
+
+		if (strcmp(cmd, "-N") == 0 || strcmp(cmd, "--new-chain") == 0) {
+			free(text);
+			continue;
+		}
+		if (strcmp(cmd, "-P") == 0 || strcmp(cmd, "--policy") == 0) {
+			xs_chain_policy(c, args.argc > 2 ? args.argv[2] : NULL);
+			for (first = 3; first + 2 < (unsigned int)args.argc;
+			     first++)
+				if (strcmp(args.argv[first], "-c") == 0) {
+					c->pcnt = strtoull(args.argv[first + 1],
+							   NULL, 10);
+					c->bcnt = strtoull(args.argv[first + 2],
+							   NULL, 10);
+				}
+			free(text);
+			continue;
+		}
+		if (strcmp(cmd, "-A") && strcmp(cmd, "--append")) {
+			free(text);
+			xtables_error(PARAMETER_PROBLEM,
+				      "%s: line %u: only -A, -N and -P are understood\n",
+				      xt_params->program_name, line);
+		}
+
+		if (c->num == c->size) {
+			c->size = c->size ? c->size * 2 : 16;
+			c->rules = xtables_realloc(c->rules,
+						   c->size * sizeof(*c->rules));
+		}
+		r = &c->rules[c->num++];
+		memset(r, 0, sizeof(*r));
+		r->text = text;
+		r->pcnt = pcnt;
+		r->bcnt = bcnt;
+		xs_rule_parse(rs, r, &args, 2, line);
+	}
+	xs_reader_close(&rd);
+	xs_argv_free(&args);
+	free(copy);
+	return 0;
+}
+
+static void xs_rule_free(struct xs_rule *r)
+{
+	unsigned int i;
+
+	for (i = 0; i < r->nmatches; i++)
+		free(r->matches[i]);
+	free(r->matches);
+	free(r->verdict);
+	free(r->text);
+}
+
+void xs_ruleset_free(struct xs_ruleset *rs)
+{
+	unsigned int i, j, k;
+
+	for (i = 0; i < rs->num; i++) {
+		struct xs_rule_table *t = &rs->tables[i];
+
+		for (j = 0; j < t->num; j++) {
+			struct xs_rule_chain *c = &t->chains[j];
+
+			for (k = 0; k < c->num; k++)
+				xs_rule_free(&c->rules[k]);
+			free(c->rules);
+			free(c->policy);
+			free(c->name);
+		}
+		free(t->chains);
+		free(t->name);
+	}
+	free(rs->tables);
+	memset(rs, 0, sizeof(*rs));
+}
+
+/**
+ * xs_rule_terminal - does a matching packet leave the chain?
+ * @r:		rule
+ *
+ * Packets matching @r are not seen by the rules after it, either because
+ * its target decides their fate or because it is a goto.
+ */
+bool xs_rule_terminal(const struct xs_rule *r)
+{
+	size_t len = strcspn(r->verdict, " ");
+	unsigned int i;
+
+	if (r->jump_goto)
+		return true;
+
+	for (i = 0; i < ARRAY_SIZE(xs_terminal_targets); i++)
+		if (strlen(xs_terminal_targets[i]) == len &&
+		    strncmp(r->verdict, xs_terminal_targets[i], len) == 0)
+			return true;
+	return false;
+}
+
+/*
+ * Relation of one field of two rules: whether each sets it, negates it,
+ * and how the plain values relate.
+ */
+struct xs_field_rel {
+	bool	a_set, a_inv;
+	bool	b_set, b_inv;
+	bool	a_in_b;		/* value of a contains value of b */
+	bool	b_in_a;
+	bool	overlap;
+};
+
+static bool xs_field_covers(const struct xs_field_rel *f)
+{
+	if (!f->a_set)
+		return true;
+	if (!f->b_set)
+		return false;
+	if (!f->a_inv)
+		return !f->b_inv && f->a_in_b;
+	if (f->b_inv)
+		return f->b_in_a;
+	return !f->overlap;
+}
+
+static bool xs_field_disjoint(const struct xs_field_rel *f)
+{
+	if (!f->a_set || !f->b_set || (f->a_inv && f->b_inv))
+		return false;
+	if (f->a_inv)
+		return f->a_in_b;
+	if (f->b_inv)
+		return f->b_in_a;
+	return !f->overlap;
+}
+
+static bool xs_bits_equal(const uint8_t *a, const uint8_t *b,
+			  unsigned int len)
+{
+	unsigned int bytes = len / 8, bits = len % 8;
+
+	if (memcmp(a, b, bytes))
+		return false;
+	return bits == 0 ||
+	       ((a[bytes] ^ b[bytes]) & (uint8_t)(0xff << (8 - bits))) == 0;
+}
+
+/**
+ * xs_prefix_contains - is every address of @b in @a?
+ *
+ * Negation is not looked at.
+ */
+bool xs_prefix_contains(const struct xs_prefix *a, const struct xs_prefix *b)
+{
+	return a->family == b->family && a->len <= b->len &&
+	       xs_bits_equal(a->addr, b->addr, a->len);
+}
+
+static void xs_prefix_rel(struct xs_field_rel *f, const struct xs_prefix *a,
+			  const struct xs_prefix *b)
+{
+	f->a_set = a->family;
+	f->a_inv = a->inv;
+	f->b_set = b->family;
+	f->b_inv = b->inv;
+	f->a_in_b = xs_prefix_contains(a, b);
+	f->b_in_a = xs_prefix_contains(b, a);
+	f->overlap = f->a_in_b || f->b_in_a;
+}
+
+static bool xs_iface_contains(const struct xs_iface *a,
+			      const struct xs_iface *b)
+{
+	size_t len = strlen(a->name);
+
+	if (len && a->name[len - 1] == '+')
+		return strncmp(a->name, b->name, len - 1) == 0;
+	return strcmp(a->name, b->name) == 0;
+}
+
+static void xs_iface_rel(struct xs_field_rel *f, const struct xs_iface *a,
+			 const struct xs_iface *b)
+{
+	f->a_set = a->name[0];
+	f->a_inv = a->inv;
+	f->b_set = b->name[0];
+	f->b_inv = b->inv;
+	f->a_in_b = xs_iface_contains(a, b);
+	f->b_in_a = xs_iface_contains(b, a);
+	f->overlap = f->a_in_b || f->b_in_a;
+}
+
+static void xs_ports_rel(struct xs_field_rel *f, const struct xs_ports *a,
+			 const struct xs_ports *b)
+{
+	f->a_set = a->set;
+	f->a_inv = a->inv;
+	f->b_set = b->set;
+	f->b_inv = b->inv;
+	f->a_in_b = a->lo <= b->lo && b->hi <= a->hi;
+	f->b_in_a = b->lo <= a->lo && a->hi <= b->hi;
+	f->overlap = a->lo <= b->hi && b->lo <= a->hi;
+}
+
+static void xs_value_rel(struct xs_field_rel *f, bool a_set, bool a_inv,
+			 bool b_set, bool b_inv, bool equal)
+{
+	f->a_set = a_set;
+	f->a_inv = a_inv;
+	f->b_set = b_set;
+	f->b_inv = b_inv;
+	f->a_in_b = f->b_in_a = f->overlap = equal;
+}
+
+enum {
+	XS_REL_SRC,
+	XS_REL_DST,
+	XS_REL_PROTO,
+	XS_REL_DPORT,
+	XS_REL_SPORT,
+	XS_REL_IN,
+	XS_REL_OUT,
+	XS_REL_FRAG,
+	__XS_REL_MAX
+};
+
+/* Relate field @field of @a and @b, most telling fields first. */
+static void xs_rule_rel(struct xs_field_rel *f, const struct xs_rule *a,
+			const struct xs_rule *b, unsigned int field)
+{
+	switch (field) {
+	case XS_REL_SRC:
+		xs_prefix_rel(f, &a->src, &b->src);
+		break;
+	case XS_REL_DST:
+		xs_prefix_rel(f, &a->dst, &b->dst);
+		break;
+	case XS_REL_PROTO:
+		xs_value_rel(f, a->proto, a->proto_inv,
+			     b->proto, b->proto_inv, a->proto == b->proto);
+		break;
+	case XS_REL_DPORT:
+		xs_ports_rel(f, &a->dport, &b->dport);
+		break;
+	case XS_REL_SPORT:
+		xs_ports_rel(f, &a->sport, &b->sport);
+		break;
+	case XS_REL_IN:
+		xs_iface_rel(f, &a->iniface, &b->iniface);
+		break;
+	case XS_REL_OUT:
+		xs_iface_rel(f, &a->outiface, &b->outiface);
+		break;
+	case XS_REL_FRAG:
+		/* "! -f" is the negation of "-f" */
+		xs_value_rel(f, a->frag, a->frag == 2,
+			     b->frag, b->frag == 2, true);
+		break;
+	}
+}
+
+/**
+ * xs_rule_covers - does @a match every packet @b matches?
+ *
+ * Matches kept as text must all appear in @b as well.
+ */
+bool xs_rule_covers(const struct xs_rule *a, const struct xs_rule *b)
+{
+	struct xs_field_rel f;
+	unsigned int i, j;
+
+	if (a->nmatches > b->nmatches)
+		return false;
+
+	for (i = 0; i < __XS_REL_MAX; i++) {
+		xs_rule_rel(&f, a, b, i);
+		if (!xs_field_covers(&f))
+			return false;
+	}
+
+	/* both lists are sorted */
+	for (i = 0, j = 0; i < a->nmatches; i++) {
+		while (j < b->nmatches &&
+		       strcmp(b->matches[j], a->matches[i]) < 0)
+			j++;
+		if (j == b->nmatches || strcmp(b->matches[j], a->matches[i]))
+			return false;
+		j++;
+	}
+	return true;
+}
+
+/**
+ * xs_rule_disjoint - can no packet match both @a and @b?
+ *
+ * Only the decoded fields are looked at, so rules which differ only in
+ * matches kept as text are never disjoint.
+ */
+bool xs_rule_disjoint(const struct xs_rule *a, const struct xs_rule *b)
+{
+	struct xs_field_rel f;
+	unsigned int i;
+
+	for (i = 0; i < __XS_REL_MAX; i++) {
+		xs_rule_rel(&f, a, b, i);
+		if (xs_field_disjoint(&f))
+			return true;
+	}
+	return false;
+}
+
+static bool xs_prefix_equal(const struct xs_prefix *a,
+			    const struct xs_prefix *b)
+{
+	return a->family == b->family && a->len == b->len &&
+	       a->inv == b->inv && !memcmp(a->addr, b->addr, sizeof(a->addr));
+}
+
+static bool xs_iface_equal(const struct xs_iface *a, const struct xs_iface *b)
+{
+	return a->inv == b->inv && strcmp(a->name, b->name) == 0;
+}
+
+static bool xs_ports_equal(const struct xs_ports *a, const struct xs_ports *b)
+{
+	return a->set == b->set &&
+	       (!a->set ||
+		(a->inv == b->inv && a->lo == b->lo && a->hi == b->hi));
+}
+
+/**
+ * xs_rule_diff - fields in which two rules differ
+ *
+ * Returns a mask of enum xs_rule_field, 0 for rules which match the same
+ * packets the same way and have the same target.
+ */
+unsigned int xs_rule_diff(const struct xs_rule *a, const struct xs_rule *b)
+{
+	unsigned int diff = 0, i;
+
+	if (!xs_prefix_equal(&a->src, &b->src))
+		diff |= XS_RULE_SRC;
+	if (!xs_prefix_equal(&a->dst, &b->dst))
+		diff |= XS_RULE_DST;
+	if (!xs_iface_equal(&a->iniface, &b->iniface))
+		diff |= XS_RULE_IN;
+	if (!xs_iface_equal(&a->outiface, &b->outiface))
+		diff |= XS_RULE_OUT;
+	if (a->proto != b->proto || a->proto_inv != b->proto_inv)
+		diff |= XS_RULE_PROTO;
+	if (a->frag != b->frag)
+		diff |= XS_RULE_FRAG;
+	if (!xs_ports_equal(&a->sport, &b->sport))
+		diff |= XS_RULE_SPORT;
+	if (!xs_ports_equal(&a->dport, &b->dport))
+		diff |= XS_RULE_DPORT;
+
+	if (a->nmatches != b->nmatches) {
+		diff |= XS_RULE_MATCHES;
+	} else {
+		for (i = 0; i < a->nmatches; i++)
+			if (strcmp(a->matches[i], b->matches[i])) {
+				diff |= XS_RULE_MATCHES;
+				break;
+			}
+	}
+
+	if (a->jump_goto != b->jump_goto || strcmp(a->verdict, b->verdict))
+		diff |= XS_RULE_VERDICT;
+	return diff;
+}
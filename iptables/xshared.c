@@ -1,6 +1,8 @@
+#define _GNU_SOURCE
 #include <config.h>
 #include <ctype.h>
 #include <getopt.h>
+#include <signal.h>
 #include <errno.h>
 #include <libgen.h>
 #include <netdb.h>
@@ -10,9 +12,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/utsname.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <xtables.h>
@@ -53,9 +59,9 @@ proto_to_name(uint8_t proto, int nolookup)
 	unsigned int i;
 
 	if (proto && !nolookup) {
-		struct protoent *pent = getprotobynumber(proto);
-		if (pent)
-			return pent->p_name;
+		const char *pname = xtables_protocol_name(proto);
+		if (pname)
+			return pname;
 	}
 
 	for (i = 0; xtables_chain_protos[i].name != NULL; ++i)
@@ -114,6 +120,301 @@ struct xtables_match *load_proto(struct iptables_command_state *cs)
 			  cs->options & OPT_NUMERIC, &cs->matches);
 }
 
+bool xs_memo_enabled;
+bool xs_diff_enabled;
+
+struct xs_memo_opt {
+	int		c;
+	bool		invert;
+	char		*arg;
+};
+
+/* Options collected for one extension instance of the current rule */
+struct xs_memo_ext {
+	struct xs_memo_ext	*next;
+	void			*ext;
+	struct xs_memo_opt	*opts;
+	unsigned int		nopts, size;
+	bool			hit;
+	char			*key;
+	size_t			keylen;
+	uint32_t		hash;
+};
+
+/* Finished xt_entry_match/xt_entry_target blob for one spec */
+struct xs_memo_entry {
+	struct xs_memo_entry	*next;
+	uint32_t		hash;
+	size_t			keylen;
+	char			*key;
+	void			*blob;
+};
+
+#define XS_MEMO_HSIZE	4096
+#define XS_MEMO_MAX	65536
+
+static struct xs_memo_entry *xs_memo_table[XS_MEMO_HSIZE];
+static unsigned int xs_memo_num;
+
+static void xs_memo_defer(struct iptables_command_state *cs, void *ext)
+{
+	struct xs_memo_ext *me, **pos;
+
+	for (pos = &cs->memo; *pos != NULL; pos = &(*pos)->next)
+		if ((*pos)->ext == ext)
+			break;
+
+	me = *pos;
+	if (me == NULL) {
+		me = xtables_calloc(1, sizeof(*me));
+		me->ext = ext;
+		*pos = me;
+	}
+	if (me->nopts == me->size) {
+		me->size = me->size ? me->size * 2 : 8;
+		me->opts = xtables_realloc(me->opts,
+					   me->size * sizeof(*me->opts));
+	}
+	me->opts[me->nopts].c      = cs->c;
+	me->opts[me->nopts].invert = cs->invert;
+	me->opts[me->nopts].arg    = optarg;
+	me->nopts++;
+}
+
+static struct xs_memo_ext *
+xs_memo_find(const struct iptables_command_state *cs, const void *ext)
+{
+	struct xs_memo_ext *me;
+
+	for (me = cs->memo; me != NULL; me = me->next)
+		if (me->ext == ext)
+			return me;
+
+	return NULL;
+}
+
+static void xs_memo_free(struct iptables_command_state *cs)
+{
+	struct xs_memo_ext *me, *next;
+
+	for (me = cs->memo; me != NULL; me = next) {
+		next = me->next;
+		free(me->opts);
+		free(me->key);
+		free(me);
+	}
+	cs->memo = NULL;
+}
+
+/*
+ * The key covers the extension, the option ids, inversions and arguments in
+ * command line order, plus the layer 4 protocol of the rule since a few
+ * extensions (multiport, the NAT targets) validate their arguments against
+ * it.
+ */
+static void xs_memo_key(const struct iptables_command_state *cs,
+			struct xs_memo_ext *me, const char *name,
+			uint8_t revision, uint16_t family,
+			unsigned int option_offset, bool is_target)
+{
+	struct {
+		char		name[XT_EXTENSION_MAXNAMELEN];
+		uint16_t	family;
+		uint8_t		revision, is_target;
+		uint8_t		proto, invflags, flags, nfproto;
+	} hdr = {
+		.family		= family,
+		.nfproto	= afinfo->family,
+		.revision	= revision,
+		.is_target	= is_target,
+	};
+	size_t len = sizeof(hdr), arglen;
+	uint32_t hash = 2166136261U;
+	unsigned int i;
+	char *p;
+
+	strncpy(hdr.name, name, sizeof(hdr.name) - 1);
+	switch (afinfo->family) {
+	case NFPROTO_IPV4:
+		hdr.proto    = cs->fw.ip.proto;
+		hdr.invflags = cs->fw.ip.invflags & XT_INV_PROTO;
+		break;
+	case NFPROTO_IPV6:
+		hdr.proto    = cs->fw6.ipv6.proto;
+		hdr.invflags = cs->fw6.ipv6.invflags & XT_INV_PROTO;
+		hdr.flags    = cs->fw6.ipv6.flags & IP6T_F_PROTO;
+		break;
+	}
+
+	for (i = 0; i < me->nopts; i++) {
+		len += sizeof(uint32_t) + 1;
+		if (me->opts[i].arg != NULL)
+			len += strlen(me->opts[i].arg) + 1;
+	}
+
+	p = me->key = xtables_malloc(len);
+	me->keylen = len;
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+	for (i = 0; i < me->nopts; i++) {
+		uint32_t id = me->opts[i].c - option_offset;
+
+		memcpy(p, &id, sizeof(id));
+		p += sizeof(id);
+		/* tell a missing argument apart from an empty one */
+		*p++ = me->opts[i].invert | (me->opts[i].arg != NULL) << 1;
+		if (me->opts[i].arg == NULL)
+			continue;
+		arglen = strlen(me->opts[i].arg) + 1;
+		memcpy(p, me->opts[i].arg, arglen);
+		p += arglen;
+	}
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)me->key[i];
+		hash *= 16777619U;
+	}
+	me->hash = hash;
+}
+
+static const void *xs_memo_lookup(const struct xs_memo_ext *me)
+{
+	const struct xs_memo_entry *e;
+
+	e = xs_memo_table[me->hash % XS_MEMO_HSIZE];
+	for (; e != NULL; e = e->next)
+		if (e->hash == me->hash && e->keylen == me->keylen &&
+		    memcmp(e->key, me->key, me->keylen) == 0)
+			return e->blob;
+
+	return NULL;
+}
+
+static void xs_memo_store(struct xs_memo_ext *me, const void *blob,
+			  size_t size)
+{
+	struct xs_memo_entry *e;
+	unsigned int h;
+
+	if (xs_memo_num >= XS_MEMO_MAX)
+		return;
+
+	e = xtables_malloc(sizeof(*e));
+	e->blob = xtables_malloc(size);
+	memcpy(e->blob, blob, size);
+
+	/* take over the key, it is not needed by the rule anymore */
+	e->key    = me->key;
+	e->keylen = me->keylen;
+	e->hash   = me->hash;
+	me->key   = NULL;
+
+	h = e->hash % XS_MEMO_HSIZE;
+	e->next = xs_memo_table[h];
+	xs_memo_table[h] = e;
+	xs_memo_num++;
+}
+
+static void xs_memo_match(struct iptables_command_state *cs,
+			  struct xtables_match *m)
+{
+	struct xs_memo_ext *me = xs_memo_find(cs, m);
+	const struct xt_entry_match *blob;
+	char *saved_optarg = optarg;
+	unsigned int i;
+
+	if (me == NULL)
+		return;
+
+	xs_memo_key(cs, me, m->name, m->revision, m->family,
+		    m->option_offset, false);
+	blob = xs_memo_lookup(me);
+	if (blob != NULL) {
+		if (m->m->u.match_size != blob->u.match_size)
+			m->m = xtables_realloc(m->m, blob->u.match_size);
+		memcpy(m->m, blob, blob->u.match_size);
+		me->hit = true;
+		return;
+	}
+
+	for (i = 0; i < me->nopts; i++) {
+		optarg = me->opts[i].arg;
+		xtables_option_mpcall(me->opts[i].c, cs->argv,
+				      me->opts[i].invert, m, &cs->fw);
+	}
+	optarg = saved_optarg;
+}
+
+static void xs_memo_target(struct iptables_command_state *cs,
+			   struct xtables_target *t)
+{
+	struct xs_memo_ext *me = xs_memo_find(cs, t);
+	const struct xt_entry_target *blob;
+	char *saved_optarg = optarg;
+	unsigned int i;
+
+	if (me == NULL)
+		return;
+
+	xs_memo_key(cs, me, t->name, t->revision, t->family,
+		    t->option_offset, true);
+	blob = xs_memo_lookup(me);
+	if (blob != NULL) {
+		if (t->t->u.target_size != blob->u.target_size)
+			t->t = xtables_realloc(t->t, blob->u.target_size);
+		memcpy(t->t, blob, blob->u.target_size);
+		me->hit = true;
+		return;
+	}
+
+	for (i = 0; i < me->nopts; i++) {
+		optarg = me->opts[i].arg;
+		xtables_option_tpcall(me->opts[i].c, cs->argv,
+				      me->opts[i].invert, t, &cs->fw);
+	}
+	optarg = saved_optarg;
+}
+
+/**
+ * xs_option_fcheck - finish option parsing of all extensions of a rule
+ *
+ * Options deferred by command_default() are either satisfied from the
+ * memoization table, or replayed in command line order. Final checks then
+ * run for every extension that was not a cache hit, and the resulting
+ * blobs are remembered for the next identical spec.
+ */
+void xs_option_fcheck(struct iptables_command_state *cs)
+{
+	struct xtables_rule_match *matchp;
+	struct xs_memo_ext *me;
+
+	for (matchp = cs->matches; matchp; matchp = matchp->next)
+		xs_memo_match(cs, matchp->match);
+	if (cs->target != NULL)
+		xs_memo_target(cs, cs->target);
+
+	for (matchp = cs->matches; matchp; matchp = matchp->next) {
+		me = xs_memo_find(cs, matchp->match);
+		if (me != NULL && me->hit)
+			continue;
+		xtables_option_mfcall(matchp->match);
+		if (me != NULL)
+			xs_memo_store(me, matchp->match->m,
+				      matchp->match->m->u.match_size);
+	}
+	if (cs->target != NULL) {
+		me = xs_memo_find(cs, cs->target);
+		if (me == NULL || !me->hit) {
+			xtables_option_tfcall(cs->target);
+			if (me != NULL)
+				xs_memo_store(me, cs->target->t,
+					      cs->target->t->u.target_size);
+		}
+	}
+
+	xs_memo_free(cs);
+}
+
 int command_default(struct iptables_command_state *cs,
 		    struct xtables_globals *gl)
 {
@@ -124,8 +425,11 @@ int command_default(struct iptables_command_state *cs,
 	    (cs->target->parse != NULL || cs->target->x6_parse != NULL) &&
 	    cs->c >= cs->target->option_offset &&
 	    cs->c < cs->target->option_offset + XT_OPTION_OFFSET_SCALE) {
-		xtables_option_tpcall(cs->c, cs->argv, cs->invert,
-				      cs->target, &cs->fw);
+		if (xs_memo_enabled && cs->target->x6_parse != NULL)
+			xs_memo_defer(cs, cs->target);
+		else
+			xtables_option_tpcall(cs->c, cs->argv, cs->invert,
+					      cs->target, &cs->fw);
 		return 0;
 	}
 
@@ -138,7 +442,11 @@ int command_default(struct iptables_command_state *cs,
 		if (cs->c < matchp->match->option_offset ||
 		    cs->c >= matchp->match->option_offset + XT_OPTION_OFFSET_SCALE)
 			continue;
-		xtables_option_mpcall(cs->c, cs->argv, cs->invert, m, &cs->fw);
+		if (xs_memo_enabled && m->x6_parse != NULL)
+			xs_memo_defer(cs, m);
+		else
+			xtables_option_mpcall(cs->c, cs->argv, cs->invert,
+					      m, &cs->fw);
 		return 0;
 	}
 
@@ -208,8 +516,10 @@ int subcmd_main(int argc, char **argv, const struct subcommand *cb)
 	}
 
 	/* now we should have a valid function pointer */
-	if (f != NULL)
+	if (f != NULL) {
+		xs_profile_init(basename(*argv), argc, argv);
 		return f(argc, argv);
+	}
 
 	fprintf(stderr, "ERROR: No valid subcommand given.\nValid subcommands:\n");
 	for (; cb->name != NULL; ++cb)
@@ -247,57 +557,399 @@ void xs_init_match(struct xtables_match *match)
 		match->init(match->m);
 }
 
-static int xtables_lock(int wait, struct timeval *wait_interval)
+/*
+ * Every (family, table) has its own lock file XT_LOCK_NAME.<family>.<table>,
+ * taken exclusively, so that tools working on different tables do not wait
+ * for each other. XT_LOCK_NAME itself is taken shared on top, which keeps
+ * programs unaware of the table locks, taking it exclusively, serialised
+ * against everyone. Multiple table locks are always taken in sorted order.
+ *
+ * Waiters for a lock queue up in a second file next to it, <lock>.queue,
+ * so that queueing never waits for the holder of the lock: each one
+ * draws a ticket and holds an OFD lock on byte XT_LOCK_QUEUE_BASE + ticket
+ * until it is done with the table, and before trying the table lock it waits
+ * for the byte of its predecessor to be released. The flock() on the lock
+ * file still provides the mutual exclusion, the queue only orders the
+ * waiters. OFD locks are dropped by the kernel when the holder exits, so a
+ * crashed waiter does not stall the queue.
+ */
+#define XT_LOCK_QUEUE_BASE	sizeof(uint64_t)
+#define XT_LOCK_QUEUE_SLOTS	(1 << 20)
+
+struct xt_lock_file {
+	char	name[PATH_MAX];
+	int	fd;
+	int	queue_fd;
+};
+
+static struct xt_lock_file xt_lock_files[XT_LOCK_TABLES_MAX + 1];
+static unsigned int xt_lock_num;
+static struct xt_lock_stats xt_lock_stats;
+static struct timespec xt_lock_acquired;
+static bool xt_lock_held;
+
+static void xt_ts_now(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static void xt_ts_sub(const struct timespec *a, const struct timespec *b,
+		      struct timespec *res)
+{
+	res->tv_sec = a->tv_sec - b->tv_sec;
+	res->tv_nsec = a->tv_nsec - b->tv_nsec;
+	if (res->tv_nsec < 0) {
+		res->tv_sec--;
+		res->tv_nsec += 1000000000L;
+	}
+}
+
+static void xt_ts_add(struct timespec *acc, const struct timespec *start,
+		      const struct timespec *end)
+{
+	struct timespec diff;
+
+	xt_ts_sub(end, start, &diff);
+	acc->tv_sec += diff.tv_sec;
+	acc->tv_nsec += diff.tv_nsec;
+	if (acc->tv_nsec >= 1000000000L) {
+		acc->tv_sec++;
+		acc->tv_nsec -= 1000000000L;
+	}
+}
+
+static void xt_lock_alarm(int sig)
+{
+}
+
+static int xt_lock_op_flock(int fd, void *data)
+{
+	return flock(fd, *(int *)data);
+}
+
+#ifdef F_OFD_SETLKW
+static int xt_lock_op_ofd(int fd, void *data)
+{
+	return fcntl(fd, F_OFD_SETLKW, data);
+}
+#endif
+
+/*
+ * Run the blocking lock operation @op until it succeeds or @deadline has
+ * passed. The operation is interrupted by SIGALRM at the deadline, or every
+ * @wait_interval to report progress. The timer keeps firing every 10ms after
+ * its first expiry, in case the signal arrives before @op went to sleep.
+ */
+static int xt_lock_block(int fd, int (*op)(int fd, void *data), void *data,
+			 int wait, const struct timeval *wait_interval,
+			 const struct timespec *deadline)
 {
-	struct timeval time_left, wait_time;
-	int fd, i = 0;
+	struct itimerval timer = {
+		.it_interval = { .tv_usec = 10000 },
+	}, off = {};
+	struct timespec now, left;
+	int ret, i = 0;
+
+	while (1) {
+		if (wait >= 0) {
+			xt_ts_now(&now);
+			xt_ts_sub(deadline, &now, &left);
+			if (left.tv_sec < 0 ||
+			    (left.tv_sec == 0 && left.tv_nsec == 0)) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			timer.it_value.tv_sec = left.tv_sec;
+			timer.it_value.tv_usec = left.tv_nsec / 1000 + 1;
+			if (timer.it_value.tv_usec >= 1000000) {
+				timer.it_value.tv_sec++;
+				timer.it_value.tv_usec -= 1000000;
+			}
+			if (timerisset(wait_interval) &&
+			    timercmp(wait_interval, &timer.it_value, <))
+				timer.it_value = *wait_interval;
+			setitimer(ITIMER_REAL, &timer, NULL);
+		}
 
-	time_left.tv_sec = wait;
-	time_left.tv_usec = 0;
+		ret = op(fd, data);
+
+		if (wait >= 0)
+			setitimer(ITIMER_REAL, &off, NULL);
+		if (ret == 0)
+			return 0;
+		if (errno != EINTR)
+			return -1;
+
+		if (wait >= 0 && ++i % 10 == 0) {
+			xt_ts_now(&now);
+			xt_ts_sub(deadline, &now, &left);
+			if (left.tv_sec >= 0)
+				fprintf(stderr, "Another app is currently holding the xtables lock; "
+					"still %lds %ldus time ahead to have a chance to grab the lock...\n",
+					(long)left.tv_sec, left.tv_nsec / 1000);
+		}
+	}
+}
 
-	fd = open(XT_LOCK_NAME, O_CREAT, 0600);
-	if (fd < 0) {
-		fprintf(stderr, "Fatal: can't open lock file %s: %s\n",
-			XT_LOCK_NAME, strerror(errno));
-		return XT_LOCK_FAILED;
+/*
+ * Draw a ticket from the queue file <name>.queue and wait for the waiter
+ * ahead of us to finish. Returns the queue file descriptor to close once
+ * done with the lock, -2 on timeout or -1 if there is no usable queue.
+ */
+static int xt_lock_queue(const char *name, int wait,
+			 const struct timeval *wait_interval,
+			 const struct timespec *deadline)
+{
+#ifdef F_OFD_SETLKW
+	struct flock fl = {
+		.l_whence	= SEEK_SET,
+		.l_len		= 1,
+	};
+	uint64_t ticket = 0, next;
+	char qname[PATH_MAX];
+	int fd, op = LOCK_EX;
+
+	if (snprintf(qname, sizeof(qname), "%s.queue", name) >=
+	    (int)sizeof(qname))
+		return -1;
+
+	fd = open(qname, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -1;
+
+	/* Taking our own slot is part of drawing the ticket, so that our
+	 * successor always finds it locked. The flock() on the queue file is
+	 * only held that long, but it still must not outlast -w.
+	 */
+	if (xt_lock_block(fd, xt_lock_op_flock, &op,
+			  wait, wait_interval, deadline) < 0) {
+		close(fd);
+		return errno == ETIMEDOUT ? -2 : -1;
 	}
+	if (pread(fd, &ticket, sizeof(ticket), 0) != sizeof(ticket))
+		ticket = 0;
+	next = ticket + 1;
+	if (pwrite(fd, &next, sizeof(next), 0) != sizeof(next))
+		goto err_unlock;
+
+	fl.l_type = F_WRLCK;
+	fl.l_start = XT_LOCK_QUEUE_BASE + ticket % XT_LOCK_QUEUE_SLOTS;
+	if (fcntl(fd, F_OFD_SETLK, &fl) < 0)
+		goto err_unlock;
+	flock(fd, LOCK_UN);
+
+	fl.l_type = F_RDLCK;
+	fl.l_start = XT_LOCK_QUEUE_BASE +
+		     (ticket - 1) % XT_LOCK_QUEUE_SLOTS;
+	if (xt_lock_block(fd, xt_lock_op_ofd, &fl,
+			  wait, wait_interval, deadline) < 0) {
+		close(fd);
+		return errno == ETIMEDOUT ? -2 : -1;
+	}
+	fl.l_type = F_UNLCK;
+	fcntl(fd, F_OFD_SETLK, &fl);
+
+	return fd;
+err_unlock:
+	flock(fd, LOCK_UN);
+	close(fd);
+#endif
+	return -1;
+}
+
+static int xt_lock_take(struct xt_lock_file *lf, int op, int wait,
+			const struct timeval *wait_interval,
+			const struct timespec *deadline)
+{
+	if (wait == 0)
+		return flock(lf->fd, op | LOCK_NB);
 
-	if (wait == -1) {
-		if (flock(fd, LOCK_EX) == 0)
-			return fd;
+	if (xt_lock_block(lf->fd, xt_lock_op_flock, &op,
+			  wait, wait_interval, deadline) == 0)
+		return 0;
 
-		fprintf(stderr, "Can't lock %s: %s\n", XT_LOCK_NAME,
+	if (wait == -1 || errno != ETIMEDOUT)
+		fprintf(stderr, "Can't lock %s: %s\n", lf->name,
 			strerror(errno));
-		return XT_LOCK_BUSY;
+	return -1;
+}
+
+static void xt_lock_release(void)
+{
+	while (xt_lock_num > 0) {
+		struct xt_lock_file *lf = &xt_lock_files[--xt_lock_num];
+
+		if (lf->fd >= 0)
+			close(lf->fd);
+		if (lf->queue_fd >= 0)
+			close(lf->queue_fd);
 	}
+}
 
-	while (1) {
-		if (flock(fd, LOCK_EX | LOCK_NB) == 0)
-			return fd;
-		else if (timercmp(&time_left, wait_interval, <))
-			return XT_LOCK_BUSY;
-
-		if (++i % 10 == 0) {
-			fprintf(stderr, "Another app is currently holding the xtables lock; "
-				"still %lds %ldus time ahead to have a chance to grab the lock...\n",
-				time_left.tv_sec, time_left.tv_usec);
+static bool xt_lock_table_name(char *buf, size_t len, const char *table)
+{
+	const char *family;
+
+	switch (afinfo->family) {
+	case NFPROTO_IPV4:
+		family = "ipv4";
+		break;
+	case NFPROTO_IPV6:
+		family = "ipv6";
+		break;
+	default:
+		return false;
+	}
+
+	/* no dots, so that no table lock is another one's queue file */
+	if (table[0] == '\0' || strchr(table, '.') || strchr(table, '/'))
+		return false;
+
+	return snprintf(buf, len, "%s.%s.%s",
+			XT_LOCK_NAME, family, table) < (int)len;
+}
+
+static int xt_lock_name_cmp(const void *a, const void *b)
+{
+	return strcmp(a, b);
+}
+
+static void xtables_lock_report(void)
+{
+	struct xt_lock_stats st;
+
+	xtables_lock_stats(&st);
+	fprintf(stderr, "xtables lock: acquired %u times, "
+		"waited %ld.%06lds, held %ld.%06lds\n", st.acquired,
+		(long)st.wait.tv_sec, st.wait.tv_nsec / 1000,
+		(long)st.hold.tv_sec, st.hold.tv_nsec / 1000);
+}
+
+static int xtables_lock(int wait, struct timeval *wait_interval,
+			const char **tables, unsigned int num)
+{
+	struct sigaction sa = {
+		.sa_handler = xt_lock_alarm,
+	}, old_sa;
+	struct xt_lock_file *lf = xt_lock_files;
+	struct timespec start, deadline;
+	static bool report_registered;
+	unsigned int i, n = 0;
+	int ret = 0;
+
+	xs_profile_begin(XS_PROF_LOCK);
+	xt_ts_now(&start);
+	deadline = start;
+	if (wait > 0)
+		deadline.tv_sec += wait;
+
+	/* Lock everything through XT_LOCK_NAME if a table lock can not be
+	 * named.
+	 */
+	for (i = 0; i < num && num <= XT_LOCK_TABLES_MAX; i++) {
+		if (!xt_lock_table_name(lf[n + 1].name, sizeof(lf->name),
+					tables[i]))
+			break;
+		n++;
+	}
+	if (i < num || num > XT_LOCK_TABLES_MAX)
+		n = 0;
+
+	qsort(&lf[1], n, sizeof(*lf), xt_lock_name_cmp);
+	for (i = 1, num = n, n = 0; i <= num; i++) {
+		if (n > 0 && strcmp(lf[i].name, lf[n].name) == 0)
+			continue;
+		if (++n != i)
+			lf[n] = lf[i];
+	}
+	snprintf(lf->name, sizeof(lf->name), "%s", XT_LOCK_NAME);
+
+	for (xt_lock_num = 0; xt_lock_num <= n; xt_lock_num++) {
+		lf = &xt_lock_files[xt_lock_num];
+		lf->queue_fd = -1;
+		lf->fd = open(lf->name, O_CREAT, 0600);
+		if (lf->fd < 0) {
+			fprintf(stderr, "Fatal: can't open lock file %s: %s\n",
+				lf->name, strerror(errno));
+			xt_lock_release();
+			xs_profile_end(XS_PROF_LOCK);
+			return XT_LOCK_FAILED;
 		}
+	}
+
+	/* no SA_RESTART, the timer must interrupt the blocking calls */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGALRM, &sa, &old_sa);
+
+	/* Queue up for all exclusive locks before taking any of them, and
+	 * take XT_LOCK_NAME first. Without a usable queue, fall back to plain
+	 * flock() ordering.
+	 */
+	for (i = n ? 1 : 0; wait != 0 && i <= n; i++) {
+		lf = &xt_lock_files[i];
+		ret = xt_lock_queue(lf->name, wait, wait_interval, &deadline);
+		if (ret == -2)
+			break;
+		lf->queue_fd = ret;
+		ret = 0;
+	}
+	for (i = 0; ret == 0 && i <= n; i++)
+		ret = xt_lock_take(&xt_lock_files[i],
+				   i == 0 && n ? LOCK_SH : LOCK_EX,
+				   wait, wait_interval, &deadline);
+
+	sigaction(SIGALRM, &old_sa, NULL);
+
+	if (ret < 0) {
+		xt_lock_release();
+		xs_profile_end(XS_PROF_LOCK);
+		return XT_LOCK_BUSY;
+	}
+
+	xs_profile_end(XS_PROF_LOCK);
+	xt_ts_now(&xt_lock_acquired);
+	xt_ts_add(&xt_lock_stats.wait, &start, &xt_lock_acquired);
+	xt_lock_stats.acquired++;
+	xt_lock_held = true;
 
-		wait_time = *wait_interval;
-		select(0, NULL, NULL, NULL, &wait_time);
-		timersub(&time_left, wait_interval, &time_left);
+	if (!report_registered && getenv("XTABLES_LOCK_STATS")) {
+		atexit(xtables_lock_report);
+		report_registered = true;
+	}
+	return xt_lock_files[0].fd;
+}
+
+void xtables_lock_stats(struct xt_lock_stats *st)
+{
+	struct timespec now;
+
+	*st = xt_lock_stats;
+	if (xt_lock_held) {
+		xt_ts_now(&now);
+		xt_ts_add(&st->hold, &xt_lock_acquired, &now);
 	}
 }
 
 void xtables_unlock(int lock)
 {
-	if (lock >= 0)
-		close(lock);
+	struct timespec now;
+
+	if (lock < 0)
+		return;
+
+	xt_lock_release();
+
+	if (xt_lock_held) {
+		xt_ts_now(&now);
+		xt_ts_add(&xt_lock_stats.hold, &xt_lock_acquired, &now);
+		xt_lock_held = false;
+	}
 }
 
-int xtables_lock_or_exit(int wait, struct timeval *wait_interval)
+int xtables_lock_tables_or_exit(int wait, struct timeval *wait_interval,
+				const char **tables, unsigned int num)
 {
-	int lock = xtables_lock(wait, wait_interval);
+	int lock = xtables_lock(wait, wait_interval, tables, num);
 
 	if (lock == XT_LOCK_FAILED) {
 		xtables_free_opts(1);
@@ -317,6 +969,13 @@ int xtables_lock_or_exit(int wait, struct timeval *wait_interval)
 	return lock;
 }
 
+int xtables_lock_or_exit(int wait, struct timeval *wait_interval,
+			 const char *table)
+{
+	return xtables_lock_tables_or_exit(wait, wait_interval,
+					   &table, table ? 1 : 0);
+}
+
 int parse_wait_time(int argc, char *argv[])
 {
 	int wait = -1;
@@ -433,33 +1092,209 @@ void save_argv(void)
 	}
 }
 
-struct xt_param_buf {
-	char	buffer[1024];
-	int 	len;
+/* Input is read in blocks of this size unless it can be mapped. */
+#define XS_READER_BLOCK		65536
+
+/**
+ * xs_reader_open - prepare reading restore input line by line
+ * @rd:	reader to initialise
+ * @in:	input stream, positioned where reading should start
+ *
+ * A regular file is mapped privately, so that lines can be returned and
+ * tokenised in place without copying. Other input, such as a pipe, is
+ * read in large blocks. Lines are not limited in length either way.
+ */
+void xs_reader_open(struct xs_reader *rd, FILE *in)
+{
+	struct stat st;
+	off_t pos;
+
+	memset(rd, 0, sizeof(*rd));
+	rd->in = in;
+
+	pos = ftello(in);
+	if (pos < 0 || fstat(fileno(in), &st) < 0 ||
+	    !S_ISREG(st.st_mode) || st.st_size <= pos)
+		return;
+
+	rd->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE, fileno(in), 0);
+	if (rd->map == MAP_FAILED) {
+		rd->map = NULL;
+		return;
+	}
+	madvise(rd->map, st.st_size, MADV_SEQUENTIAL);
+	rd->data = rd->map;
+	rd->len = st.st_size;
+	rd->pos = pos;
+	rd->eof = true;
+}
+
+static bool xs_reader_fill(struct xs_reader *rd)
+{
+	size_t n;
+
+	if (rd->eof)
+		return false;
+
+	/* move the partial line to the front, leave room for a NUL */
+	if (rd->pos > 0) {
+		memmove(rd->data, rd->data + rd->pos, rd->len - rd->pos);
+		rd->len -= rd->pos;
+		rd->pos = 0;
+	}
+	if (rd->size - rd->len < XS_READER_BLOCK + 1) {
+		rd->size += XS_READER_BLOCK + 1;
+		rd->data = xtables_realloc(rd->data, rd->size);
+	}
+
+	n = fread(rd->data + rd->len, 1, rd->size - rd->len - 1, rd->in);
+	if (n == 0)
+		rd->eof = true;
+	rd->len += n;
+	return n > 0;
+}
+
+/**
+ * xs_reader_getline - return the next line of input
+ * @rd:	reader
+ *
+ * Returns the line like fgets() would, including the trailing newline if
+ * present, or NULL at the end of input. The line may be modified, it stays
+ * valid until the next call.
+ */
+char *xs_reader_getline(struct xs_reader *rd)
+{
+	char *line, *nl;
+	size_t len;
+
+	/* undo the termination of the previous line */
+	if (rd->saved_at) {
+		*rd->saved_at = rd->saved;
+		rd->saved_at = NULL;
+	}
+
+	for (;;) {
+		nl = NULL;
+		if (rd->pos < rd->len)
+			nl = memchr(rd->data + rd->pos, '\n',
+				    rd->len - rd->pos);
+		if (nl || !xs_reader_fill(rd))
+			break;
+	}
+
+	line = rd->data + rd->pos;
+	if (nl) {
+		len = nl - line + 1;
+	} else {
+		len = rd->len - rd->pos;
+		if (len == 0)
+			return NULL;
+	}
+	rd->pos += len;
+
+	if (line + len < rd->data + rd->len) {
+		/* borrow the first byte of the next line */
+		rd->saved_at = line + len;
+		rd->saved = line[len];
+	} else if (rd->map) {
+		/* the mapping ends with this line, copy it */
+		rd->tail = xtables_realloc(rd->tail, len + 1);
+		memcpy(rd->tail, line, len);
+		line = rd->tail;
+	}
+	/* block buffers always have room for the terminator */
+	line[len] = '\0';
+
+	return line;
+}
+
+void xs_reader_close(struct xs_reader *rd)
+{
+	if (rd->map)
+		munmap(rd->map, rd->len);
+	else
+		free(rd->data);
+	free(rd->tail);
+	memset(rd, 0, sizeof(*rd));
+}
+
+/* Strings added by xs_argv_add() are copied into chunks of this size. */
+#define XS_ARENA_CHUNK		4096
+
+struct xs_arena_chunk {
+	struct xs_arena_chunk	*next;
+	size_t			size;
+	size_t			used;
+	char			data[];
 };
 
-static void add_param(struct xt_param_buf *param, const char *curchar)
+static char *xs_arena_strdup(struct xs_argv *args, const char *s)
 {
-	param->buffer[param->len++] = *curchar;
-	if (param->len >= sizeof(param->buffer))
-		xtables_error(PARAMETER_PROBLEM,
-			      "Parameter too long!");
+	struct xs_arena_chunk *chunk = args->arena;
+	size_t len = strlen(s) + 1;
+	char *ret;
+
+	if (!chunk || chunk->size - chunk->used < len) {
+		size_t size = len > XS_ARENA_CHUNK ? len : XS_ARENA_CHUNK;
+
+		chunk = xtables_malloc(sizeof(*chunk) + size);
+		chunk->size = size;
+		chunk->used = 0;
+		chunk->next = args->arena;
+		args->arena = chunk;
+	}
+
+	ret = chunk->data + chunk->used;
+	memcpy(ret, s, len);
+	chunk->used += len;
+	return ret;
+}
+
+static void xs_argv_push(struct xs_argv *args, char *arg)
+{
+	if (args->argc + 1 >= args->size) {
+		args->size = args->size ? args->size * 2 : 64;
+		args->argv = xtables_realloc(args->argv,
+					     args->size * sizeof(*args->argv));
+	}
+	args->argv[args->argc++] = arg;
+	args->argv[args->argc] = NULL;
+}
+
+/**
+ * xs_argv_add - append a copy of @what to the argument vector
+ */
+void xs_argv_add(struct xs_argv *args, const char *what)
+{
+	xs_argv_push(args, xs_arena_strdup(args, what));
 }
 
-void add_param_to_argv(char *parsestart, int line)
+/**
+ * xs_argv_split - split a restore line into arguments
+ * @args:	argument vector to append to
+ * @parsestart:	line to split, modified in place
+ * @line:	line number for error messages
+ *
+ * Arguments are separated by blanks; double quotes group blanks into an
+ * argument and a backslash escapes the next character inside quotes. The
+ * unquoted arguments are written back into @parsestart, which the vector
+ * then points into.
+ */
+void xs_argv_split(struct xs_argv *args, char *parsestart, int line)
 {
 	int quote_open = 0, escaped = 0;
-	struct xt_param_buf param = {};
-	char *curchar;
+	char *curchar, *param, *w;
 
 	/* After fighting with strtok enough, here's now
 	 * a 'real' parser. According to Rusty I'm now no
 	 * longer a real hacker, but I can live with that */
 
+	param = w = parsestart;
 	for (curchar = parsestart; *curchar; curchar++) {
 		if (quote_open) {
 			if (escaped) {
-				add_param(&param, curchar);
+				*w++ = *curchar;
 				escaped = 0;
 				continue;
 			} else if (*curchar == '\\') {
@@ -467,9 +1302,8 @@ void add_param_to_argv(char *parsestart, int line)
 				continue;
 			} else if (*curchar == '"') {
 				quote_open = 0;
-				*curchar = '"';
 			} else {
-				add_param(&param, curchar);
+				*w++ = *curchar;
 				continue;
 			}
 		} else {
@@ -485,99 +1319,566 @@ void add_param_to_argv(char *parsestart, int line)
 		case ' ':
 		case '\t':
 		case '\n':
-			if (!param.len) {
+			if (w == param) {
 				/* two spaces? */
+				param = w = curchar + 1;
 				continue;
 			}
 			break;
 		default:
-			/* regular character, copy to buffer */
-			add_param(&param, curchar);
+			/* regular character, keep it */
+			*w++ = *curchar;
 			continue;
 		}
 
-		param.buffer[param.len] = '\0';
+		*w = '\0';
 
 		/* check if table name specified */
-		if ((param.buffer[0] == '-' &&
-		     param.buffer[1] != '-' &&
-		     strchr(param.buffer, 't')) ||
-		    (!strncmp(param.buffer, "--t", 3) &&
-		     !strncmp(param.buffer, "--table", strlen(param.buffer)))) {
+		if ((param[0] == '-' &&
+		     param[1] != '-' &&
+		     strchr(param, 't')) ||
+		    (!strncmp(param, "--t", 3) &&
+		     !strncmp(param, "--table", strlen(param)))) {
 			xtables_error(PARAMETER_PROBLEM,
 				      "The -t option (seen in line %u) cannot be used in %s.\n",
 				      line, xt_params->program_name);
 		}
 
-		add_argv(param.buffer, 0);
-		param.len = 0;
+		xs_argv_push(args, param);
+		param = w = curchar + 1;
+	}
+}
+
+/**
+ * xs_argv_reset - drop all arguments, keeping the allocations for reuse
+ */
+void xs_argv_reset(struct xs_argv *args)
+{
+	struct xs_arena_chunk *chunk = args->arena;
+
+	args->argc = 0;
+	if (!chunk)
+		return;
+
+	while (chunk->next) {
+		struct xs_arena_chunk *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+	chunk->used = 0;
+	args->arena = chunk;
+}
+
+void xs_argv_free(struct xs_argv *args)
+{
+	xs_argv_reset(args);
+	free(args->arena);
+	free(args->argv);
+	memset(args, 0, sizeof(*args));
+}
+
+/**
+ * xs_argv_check_batch - prepare a rule line of --check-batch input
+ * @args:	arguments of the line, starting with program, -t and table
+ * @check:	gets the same rule as a check, without counters
+ * @line:	line number for error messages
+ *
+ * The line must append or check a rule. @args is turned into an append
+ * of that rule, which adds it if the check finds it missing.
+ */
+void xs_argv_check_batch(struct xs_argv *args, struct xs_argv *check,
+			 int line)
+{
+	const char *cmd;
+	int i, pos = 3;
+
+	if (pos < args->argc &&
+	    strcmp(args->argv[pos], "--set-counters") == 0)
+		pos += 3;
+
+	cmd = pos < args->argc ? args->argv[pos] : "";
+	if (strcmp(cmd, "-A") && strcmp(cmd, "--append") &&
+	    strcmp(cmd, "-C") && strcmp(cmd, "--check"))
+		xtables_error(PARAMETER_PROBLEM,
+			      "Bad line %u: only -A and -C can be checked\n",
+			      line);
+
+	for (i = 0; i < 3; i++)
+		xs_argv_add(check, args->argv[i]);
+	xs_argv_add(check, "-C");
+	for (i = pos + 1; i < args->argc; i++)
+		xs_argv_add(check, args->argv[i]);
+
+	args->argv[pos] = "-A";
+}
+
+static void xs_prefetch_add(const char ***names, unsigned int *num,
+			    unsigned int *size, char *arg)
+{
+	char *name, *next, *mask;
+
+	for (name = arg; name != NULL; name = next) {
+		next = strchr(name, ',');
+		if (next != NULL)
+			*next++ = '\0';
+		mask = strchr(name, '/');
+		if (mask != NULL)
+			*mask = '\0';
+		if (*name == '\0')
+			continue;
+
+		if (*num == *size) {
+			*size = *size ? *size * 2 : 64;
+			*names = xtables_realloc(*names,
+						 *size * sizeof(**names));
+		}
+		(*names)[*num] = strdup(name);
+		if ((*names)[*num] == NULL)
+			xtables_error(RESOURCE_PROBLEM, "strdup");
+		(*num)++;
 	}
 }
 
+/**
+ * xs_restore_prefetch_hosts - resolve host names of restore input up front
+ * @in:		restore input
+ * @family:	address family of the rules
+ *
+ * Collects the arguments of -s and -d in rule lines and has their host
+ * names resolved concurrently, so parsing the rules later on is served
+ * from the resolver cache. Input which can not be rewound is left alone.
+ */
+void xs_restore_prefetch_hosts(FILE *in, int family)
+{
+	unsigned int i, num = 0, size = 0;
+	char *buffer, *tok, *save, *c;
+	const char **names = NULL;
+	struct xs_reader rd;
+	bool quoted, want;
+	long pos;
+
+	pos = ftell(in);
+	if (pos < 0)
+		return;
+
+	/* the parser's reader, so that long lines are not split up */
+	xs_reader_open(&rd, in);
+	while ((buffer = xs_reader_getline(&rd))) {
+		if (buffer[0] != '-' && buffer[0] != '[')
+			continue;
+
+		/* quoted arguments can not name hosts, blank them out */
+		for (c = buffer, quoted = false; *c != '\0'; c++) {
+			if (*c == '"')
+				quoted = !quoted;
+			if (quoted || *c == '"')
+				*c = ' ';
+		}
+
+		want = false;
+		for (tok = strtok_r(buffer, " \t\n", &save); tok != NULL;
+		     tok = strtok_r(NULL, " \t\n", &save)) {
+			if (want && strcmp(tok, "!") != 0) {
+				xs_prefetch_add(&names, &num, &size, tok);
+				want = false;
+				continue;
+			}
+			want = !strcmp(tok, "-s") || !strcmp(tok, "-d") ||
+			       !strcmp(tok, "--source") ||
+			       !strcmp(tok, "--destination") ||
+			       !strcmp(tok, "--src") || !strcmp(tok, "--dst");
+		}
+	}
+	xs_reader_close(&rd);
+
+	if (fseek(in, pos, SEEK_SET) < 0)
+		xtables_error(OTHER_PROBLEM, "Can't rewind input: %s\n",
+			      strerror(errno));
+
+	xtables_resolve_prefetch(family, names, num);
+
+	for (i = 0; i < num; i++)
+		free((char *)names[i]);
+	free(names);
+}
+
+/*
+ * Snapshot layout: header, the text save and one section per table, each
+ * padded to 8 bytes.  Everything is in host byte order, the fingerprint
+ * tells a reader whether it runs on the same kind of system.
+ */
+#define XS_SNAPSHOT_MAGIC	"xtsnap\n"
+#define XS_SNAPSHOT_VERSION	1
+#define XS_SNAPSHOT_ALIGN(x)	(((x) + 7) & ~(uint64_t)7)
+
+struct xs_snapshot_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	family;
+	uint64_t	fingerprint;
+	uint64_t	text_len;
+	uint32_t	flags;
+	uint32_t	reserved;
+};
+
+/* Sections carry the counters of the tables. */
+#define XS_SNAPSHOT_F_COUNTERS	0x1
+
+struct xs_snapshot_sect {
+	char		table[XT_TABLE_MAXNAMELEN];
+	uint64_t	len;
+};
+
+static uint64_t xs_fnv1a(uint64_t hash, const char *s)
+{
+	do {
+		hash ^= (unsigned char)*s;
+		hash *= 0x100000001b3ULL;
+	} while (*s++);
+
+	return hash;
+}
+
+/* Kernel build, package version, backend and family: sections are only
+ * loaded by the very same combination they were taken with.
+ */
+static uint64_t xs_snapshot_fingerprint(int family, const char *backend)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	struct utsname uts;
+	char buf[16];
+
+	if (uname(&uts) < 0)
+		return 0;
+
+	snprintf(buf, sizeof(buf), "%d", family);
+	hash = xs_fnv1a(hash, uts.sysname);
+	hash = xs_fnv1a(hash, uts.release);
+	hash = xs_fnv1a(hash, uts.version);
+	hash = xs_fnv1a(hash, uts.machine);
+	hash = xs_fnv1a(hash, PACKAGE_VERSION);
+	hash = xs_fnv1a(hash, backend);
+	return xs_fnv1a(hash, buf);
+}
+
+/**
+ * xs_snapshot_capture - start collecting a snapshot
+ * @snap:	snapshot to fill
+ *
+ * Standard output is redirected into a temporary file until
+ * xs_snapshot_write(), so the regular save code produces the text part.
+ */
+int xs_snapshot_capture(struct xs_snapshot *snap)
+{
+	memset(snap, 0, sizeof(*snap));
+
+	snap->capture = tmpfile();
+	if (!snap->capture)
+		return -1;
+
+	fflush(stdout);
+	snap->stdout_fd = dup(STDOUT_FILENO);
+	if (snap->stdout_fd < 0 ||
+	    dup2(fileno(snap->capture), STDOUT_FILENO) < 0) {
+		fclose(snap->capture);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * xs_snapshot_add - append the binary form of a table
+ * @snap:	snapshot being collected
+ * @table:	table name
+ * @data:	backend specific blob
+ * @len:	size of @data
+ */
+void xs_snapshot_add(struct xs_snapshot *snap, const char *table,
+		     const void *data, size_t len)
+{
+	struct xs_snapshot_sect *sect;
+	size_t need = sizeof(*sect) + XS_SNAPSHOT_ALIGN(len);
+
+	if (snap->size - snap->len < need) {
+		snap->size = (snap->len + need) * 2;
+		snap->buf = xtables_realloc(snap->buf, snap->size);
+	}
+
+	sect = (void *)(snap->buf + snap->len);
+	memset(sect, 0, need);
+	strncpy(sect->table, table, sizeof(sect->table) - 1);
+	sect->len = len;
+	memcpy(sect + 1, data, len);
+	snap->len += need;
+}
+
+/**
+ * xs_snapshot_write - write out a collected snapshot
+ * @snap:	snapshot from xs_snapshot_capture()
+ * @family:	address family of the tables
+ * @backend:	name of the backend which understands the sections
+ *
+ * Restores standard output and writes the snapshot to it.
+ */
+int xs_snapshot_write(struct xs_snapshot *snap, int family,
+		      const char *backend)
+{
+	static const char pad[8];
+	struct xs_snapshot_hdr hdr = {
+		.magic		= XS_SNAPSHOT_MAGIC,
+		.version	= XS_SNAPSHOT_VERSION,
+		.family		= family,
+		.fingerprint	= xs_snapshot_fingerprint(family, backend),
+		.flags		= snap->counters ? XS_SNAPSHOT_F_COUNTERS : 0,
+	};
+	char buf[XS_READER_BLOCK];
+	struct stat st;
+	size_t n;
+	int ret = 0;
+
+	fflush(stdout);
+	if (dup2(snap->stdout_fd, STDOUT_FILENO) < 0 ||
+	    fstat(fileno(snap->capture), &st) < 0)
+		ret = -1;
+	close(snap->stdout_fd);
+
+	if (ret == 0) {
+		hdr.text_len = st.st_size;
+		fwrite(&hdr, sizeof(hdr), 1, stdout);
+
+		rewind(snap->capture);
+		while ((n = fread(buf, 1, sizeof(buf), snap->capture)) > 0)
+			fwrite(buf, 1, n, stdout);
+		fwrite(pad, 1, XS_SNAPSHOT_ALIGN(hdr.text_len) - hdr.text_len,
+		       stdout);
+
+		fwrite(snap->buf, 1, snap->len, stdout);
+		if (fflush(stdout) != 0 || ferror(snap->capture))
+			ret = -1;
+	}
+
+	fclose(snap->capture);
+	xs_snapshot_free(snap);
+	return ret;
+}
+
+/**
+ * xs_snapshot_read - read a snapshot
+ * @snap:	snapshot to fill
+ * @in:		input stream
+ * @family:	address family expected
+ * @backend:	name of the backend reading it
+ *
+ * Sets @snap->match if the sections may be handed to the kernel as they
+ * are, otherwise only xs_snapshot_text() is of use.  Returns -1 with
+ * errno set if @in does not hold a snapshot.
+ */
+int xs_snapshot_read(struct xs_snapshot *snap, FILE *in, int family,
+		     const char *backend)
+{
+	const struct xs_snapshot_sect *sect;
+	const struct xs_snapshot_hdr *hdr;
+	size_t n, left;
+
+	memset(snap, 0, sizeof(*snap));
+
+	do {
+		if (snap->size - snap->len < XS_READER_BLOCK) {
+			snap->size = snap->size * 2 + XS_READER_BLOCK;
+			snap->buf = xtables_realloc(snap->buf, snap->size);
+		}
+		n = fread(snap->buf + snap->len, 1, snap->size - snap->len, in);
+		snap->len += n;
+	} while (n > 0);
+
+	hdr = (const void *)snap->buf;
+	if (ferror(in) || snap->len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, XS_SNAPSHOT_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != XS_SNAPSHOT_VERSION || hdr->family != family ||
+	    XS_SNAPSHOT_ALIGN(hdr->text_len) > snap->len - sizeof(*hdr)) {
+		xs_snapshot_free(snap);
+		errno = EINVAL;
+		return -1;
+	}
+
+	snap->text = snap->buf + sizeof(*hdr);
+	snap->text_len = hdr->text_len;
+	snap->pos = sizeof(*hdr) + XS_SNAPSHOT_ALIGN(hdr->text_len);
+	snap->counters = hdr->flags & XS_SNAPSHOT_F_COUNTERS;
+	snap->match = hdr->fingerprint != 0 &&
+		hdr->fingerprint == xs_snapshot_fingerprint(family, backend);
+
+	/* a damaged section leaves just the text usable */
+	for (n = snap->pos; n < snap->len; n += sizeof(*sect) + sect->len) {
+		sect = (const void *)(snap->buf + n);
+		left = snap->len - n;
+		if (left < sizeof(*sect) ||
+		    XS_SNAPSHOT_ALIGN(sect->len) > left - sizeof(*sect) ||
+		    !memchr(sect->table, '\0', sizeof(sect->table))) {
+			snap->match = false;
+			break;
+		}
+		n += XS_SNAPSHOT_ALIGN(sect->len) - sect->len;
+	}
+
+	return 0;
+}
+
+/**
+ * xs_snapshot_next - return the next table section
+ * @snap:	snapshot from xs_snapshot_read()
+ * @table:	set to the table name
+ * @len:	set to the size of the returned blob
+ */
+const void *xs_snapshot_next(struct xs_snapshot *snap, const char **table,
+			     size_t *len)
+{
+	const struct xs_snapshot_sect *sect;
+
+	if (!snap->match || snap->len - snap->pos < sizeof(*sect))
+		return NULL;
+
+	sect = (const void *)(snap->buf + snap->pos);
+	snap->pos += sizeof(*sect) + XS_SNAPSHOT_ALIGN(sect->len);
+
+	*table = sect->table;
+	*len = sect->len;
+	return sect + 1;
+}
+
+/**
+ * xs_snapshot_text - open the text part of a snapshot for reading
+ * @snap:	snapshot from xs_snapshot_read()
+ */
+FILE *xs_snapshot_text(struct xs_snapshot *snap)
+{
+	static char empty[] = "\n";
+
+	if (snap->text_len == 0)
+		return fmemopen(empty, 1, "r");
+
+	return fmemopen(snap->text, snap->text_len, "r");
+}
+
+void xs_snapshot_free(struct xs_snapshot *snap)
+{
+	free(snap->buf);
+	snap->buf = NULL;
+	snap->len = snap->size = 0;
+}
+
+/* Room for a host name and the longest mask suffix */
+#define ADDR_STRING_SIZE	(NI_MAXHOST + 64)
+
+static char *addr_name_to_string(char *buf, const char *name)
+{
+	size_t len = strnlen(name, NI_MAXHOST - 1);
+
+	memcpy(buf, name, len);
+	return buf + len;
+}
+
 static const char *ipv4_addr_to_string(const struct in_addr *addr,
 				       const struct in_addr *mask,
 				       unsigned int format)
 {
-	static char buf[BUFSIZ];
+	static char buf[ADDR_STRING_SIZE];
+	char *p;
 
 	if (!mask->s_addr && !(format & FMT_NUMERIC))
 		return "anywhere";
 
 	if (format & FMT_NUMERIC)
-		strncpy(buf, xtables_ipaddr_to_numeric(addr), BUFSIZ - 1);
+		p = xtables_fmt_ipaddr(buf, addr);
 	else
-		strncpy(buf, xtables_ipaddr_to_anyname(addr), BUFSIZ - 1);
-	buf[BUFSIZ - 1] = '\0';
-
-	strncat(buf, xtables_ipmask_to_numeric(mask),
-		BUFSIZ - strlen(buf) - 1);
+		p = addr_name_to_string(buf, xtables_ipaddr_to_anyname(addr));
 
+	xtables_fmt_ipmask(p, mask);
 	return buf;
 }
 
+/* Print @addr like printf(FMT("%-19s ", @notab)) would, for @notab either
+ * "%s " or "-> %s".
+ */
+static void print_addr_column(const char *addr, unsigned int format,
+			      bool arrow)
+{
+	size_t len;
+
+	if (format & FMT_NOTABLE) {
+		if (arrow)
+			fputs("-> ", stdout);
+		fputs(addr, stdout);
+		if (!arrow)
+			fputc(' ', stdout);
+		return;
+	}
+
+	fputs(addr, stdout);
+	for (len = strlen(addr); len < 19; len++)
+		fputc(' ', stdout);
+	fputc(' ', stdout);
+}
+
 void print_ipv4_addresses(const struct ipt_entry *fw, unsigned int format)
 {
 	fputc(fw->ip.invflags & IPT_INV_SRCIP ? '!' : ' ', stdout);
-	printf(FMT("%-19s ", "%s "),
-	       ipv4_addr_to_string(&fw->ip.src, &fw->ip.smsk, format));
+	print_addr_column(ipv4_addr_to_string(&fw->ip.src, &fw->ip.smsk,
+					      format), format, false);
 
 	fputc(fw->ip.invflags & IPT_INV_DSTIP ? '!' : ' ', stdout);
-	printf(FMT("%-19s ", "-> %s"),
-	       ipv4_addr_to_string(&fw->ip.dst, &fw->ip.dmsk, format));
+	print_addr_column(ipv4_addr_to_string(&fw->ip.dst, &fw->ip.dmsk,
+					      format), format, true);
 }
 
 static const char *ipv6_addr_to_string(const struct in6_addr *addr,
 				       const struct in6_addr *mask,
 				       unsigned int format)
 {
-	static char buf[BUFSIZ];
+	static char buf[ADDR_STRING_SIZE];
+	char *p;
 
 	if (IN6_IS_ADDR_UNSPECIFIED(addr) && !(format & FMT_NUMERIC))
 		return "anywhere";
 
 	if (format & FMT_NUMERIC)
-		strncpy(buf, xtables_ip6addr_to_numeric(addr), BUFSIZ - 1);
+		p = xtables_fmt_ip6addr(buf, addr);
 	else
-		strncpy(buf, xtables_ip6addr_to_anyname(addr), BUFSIZ - 1);
-	buf[BUFSIZ - 1] = '\0';
-
-	strncat(buf, xtables_ip6mask_to_numeric(mask),
-		BUFSIZ - strlen(buf) - 1);
+		p = addr_name_to_string(buf, xtables_ip6addr_to_anyname(addr));
 
+	xtables_fmt_ip6mask(p, mask);
 	return buf;
 }
 
 void print_ipv6_addresses(const struct ip6t_entry *fw6, unsigned int format)
 {
 	fputc(fw6->ipv6.invflags & IP6T_INV_SRCIP ? '!' : ' ', stdout);
-	printf(FMT("%-19s ", "%s "),
-	       ipv6_addr_to_string(&fw6->ipv6.src,
-				   &fw6->ipv6.smsk, format));
+	print_addr_column(ipv6_addr_to_string(&fw6->ipv6.src,
+					      &fw6->ipv6.smsk, format),
+			  format, false);
 
 	fputc(fw6->ipv6.invflags & IP6T_INV_DSTIP ? '!' : ' ', stdout);
-	printf(FMT("%-19s ", "-> %s"),
-	       ipv6_addr_to_string(&fw6->ipv6.dst,
-				   &fw6->ipv6.dmsk, format));
+	print_addr_column(ipv6_addr_to_string(&fw6->ipv6.dst,
+					      &fw6->ipv6.dmsk, format),
+			  format, true);
+}
+
+/**
+ * print_counter_pair - print "<prefix><pcnt><sep><bcnt><suffix>"
+ */
+void print_counter_pair(const char *prefix, uint64_t pcnt, char sep,
+			uint64_t bcnt, const char *suffix)
+{
+	char buf[64], *p;
+
+	p = xtables_fmt_u64(buf, pcnt);
+	*p++ = sep;
+	xtables_fmt_u64(p, bcnt);
+
+	fputs(prefix, stdout);
+	fputs(buf, stdout);
+	fputs(suffix, stdout);
 }
 
 /* Luckily, IPT_INV_VIA_IN and IPT_INV_VIA_OUT
@@ -4,11 +4,13 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <netinet/in.h>
 #include <net/if.h>
 #include <linux/netfilter_arp/arp_tables.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
 #include <linux/netfilter_ipv6/ip6_tables.h>
+#include <libiptc/xtcshared.h>
 
 #ifdef DEBUG
 #define DEBUGP(x, args...) fprintf(stdout, x, ## args)
@@ -85,6 +87,8 @@ struct ebt_entry {
 	unsigned char destmsk[6];
 };
 
+struct xs_memo_ext;
+
 struct iptables_command_state {
 	union {
 		struct ebt_entry eb;
@@ -104,6 +108,7 @@ struct iptables_command_state {
 	const char *jumpto;
 	char **argv;
 	bool restore;
+	struct xs_memo_ext *memo;
 };
 
 typedef int (*mainfunc_t)(int, char **);
@@ -127,10 +132,25 @@ extern int subcmd_main(int, char **, const struct subcommand *);
 extern void xs_init_target(struct xtables_target *);
 extern void xs_init_match(struct xtables_match *);
 
+/*
+ * Parsed-argument memoization, enabled by the restore front ends: options of
+ * x6-style extensions are collected while getopt runs, and identical
+ * (extension, revision, arguments) specs reuse the finished entry blob.
+ */
+extern bool xs_memo_enabled;
+
+/*
+ * Differential restore: appended rules are matched against the rules
+ * already in the chain instead of being added, see iptc_diff_entry().
+ */
+extern bool xs_diff_enabled;
+extern void xs_option_fcheck(struct iptables_command_state *cs);
+
 /**
  * Values for the iptables lock.
  *
- * A value >= 0 indicates the lock filedescriptor. Other values are:
+ * A value >= 0 indicates the lock is held, xtables_unlock() releases it
+ * along with all table locks taken at once. Other values are:
  *
  * XT_LOCK_FAILED : The lock could not be acquired.
  *
@@ -145,8 +165,74 @@ enum {
 	XT_LOCK_FAILED = -2,
 	XT_LOCK_NOT_ACQUIRED  = -3,
 };
+/* Maximum number of table locks held at once */
+#define XT_LOCK_TABLES_MAX	16
+
 extern void xtables_unlock(int lock);
-extern int xtables_lock_or_exit(int wait, struct timeval *tv);
+extern int xtables_lock_or_exit(int wait, struct timeval *tv,
+				const char *table);
+extern int xtables_lock_tables_or_exit(int wait, struct timeval *tv,
+				       const char **tables, unsigned int num);
+
+/**
+ * Accumulated xtables lock timing of this process: number of acquisitions,
+ * time spent waiting for and time spent holding the lock. The latter
+ * includes a currently held lock. Setting XTABLES_LOCK_STATS in the
+ * environment prints these values to stderr on exit.
+ */
+struct xt_lock_stats {
+	unsigned int	acquired;
+	struct timespec	wait;
+	struct timespec	hold;
+};
+extern void xtables_lock_stats(struct xt_lock_stats *st);
+
+/*
+ * Phases timed by --profile or XTABLES_PROFILE. They nest, the time, heap
+ * growth and peak RSS growth of a phase include those of the phases run
+ * inside it. The tc- phases are reported by libiptc.
+ */
+enum xs_prof_phase {
+	XS_PROF_LOCK,		/* waiting for the xtables lock */
+	XS_PROF_PARSE,		/* a command, or restore input up to COMMIT */
+	XS_PROF_CACHE,		/* __nft_build_cache() */
+	XS_PROF_CACHE_GENID,	/* NFT_MSG_GETGEN */
+	XS_PROF_CACHE_TABLES,	/* table dump */
+	XS_PROF_CACHE_CHAINS,	/* chain dump */
+	XS_PROF_CACHE_RULES,	/* rule dumps */
+	XS_PROF_CACHE_RETRY,	/* cache dropped, ruleset changed meanwhile */
+	XS_PROF_COMMIT,		/* nft_action() */
+	XS_PROF_BATCH,		/* batch built from the cached changes */
+	XS_PROF_TALK,		/* mnl_batch_talk() */
+	XS_PROF_REPLAY,		/* cache rebuilt and batch refreshed on ERESTART */
+	XS_PROF_TC_INIT,	/* XTC_PHASE_INIT and on, in that order */
+	XS_PROF_TC_GET_ENTRIES,
+	XS_PROF_TC_PARSE,
+	XS_PROF_TC_COMMIT,
+	XS_PROF_TC_COMPILE,
+	XS_PROF_TC_REPLACE,
+	XS_PROF_TC_COUNTERS,
+	XS_PROF_MAX
+};
+
+extern bool xs_profile_enabled;
+extern void xs_profile_init(const char *prog, int argc, char *argv[]);
+extern void xs_profile_start(const char *file);
+extern void __xs_profile_begin(enum xs_prof_phase phase);
+extern void __xs_profile_end(enum xs_prof_phase phase);
+extern void xs_profile_xtc(enum xtc_phase phase, int end);
+
+static inline void xs_profile_begin(enum xs_prof_phase phase)
+{
+	if (xs_profile_enabled)
+		__xs_profile_begin(phase);
+}
+
+static inline void xs_profile_end(enum xs_prof_phase phase)
+{
+	if (xs_profile_enabled)
+		__xs_profile_end(phase);
+}
 
 int parse_wait_time(int argc, char *argv[]);
 void parse_wait_interval(int argc, char *argv[], struct timeval *wait_interval);
@@ -155,6 +241,16 @@ bool xs_has_arg(int argc, char *argv[]);
 
 extern const struct xtables_afinfo *afinfo;
 
+/* Option table memo of libxtables, shared by xtables.c and xtoptions.c
+ * only: hidden, so it is not part of the library's ABI. */
+struct option;
+extern struct option *xtables_opts_lookup(const struct option *parent,
+					  unsigned int *option_offset)
+	__attribute__((visibility("hidden")));
+extern void xtables_opts_store(const struct option *parent,
+			       unsigned int offset, struct option *opts)
+	__attribute__((visibility("hidden")));
+
 extern char *newargv[];
 extern int newargc;
 
@@ -166,10 +262,368 @@ extern int newargvattr[];
 int add_argv(const char *what, int quoted);
 void free_argv(void);
 void save_argv(void);
-void add_param_to_argv(char *parsestart, int line);
+
+/**
+ * struct xs_reader - line reader for restore input
+ * @in:		input stream
+ * @map:	private mapping of a regular input file, or NULL
+ * @data:	@map or the block buffer
+ * @len:	bytes of valid data
+ * @size:	allocated size of the block buffer
+ * @pos:	start of the next line
+ * @eof:	no more data to read into the block buffer
+ * @saved_at:	byte replaced by the current line's terminator
+ * @saved:	original value of *@saved_at
+ * @tail:	copy of an unterminated last line of @map
+ */
+struct xs_reader {
+	FILE	*in;
+	char	*map;
+	char	*data;
+	size_t	len;
+	size_t	size;
+	size_t	pos;
+	bool	eof;
+	char	*saved_at;
+	char	saved;
+	char	*tail;
+};
+
+void xs_reader_open(struct xs_reader *rd, FILE *in);
+char *xs_reader_getline(struct xs_reader *rd);
+void xs_reader_close(struct xs_reader *rd);
+
+struct xs_arena_chunk;
+
+/**
+ * struct xs_argv - argument vector built per restore line
+ * @argv:	NULL-terminated arguments
+ * @argc:	number of arguments
+ * @size:	allocated entries in @argv
+ * @arena:	storage for copied arguments
+ */
+struct xs_argv {
+	char			**argv;
+	int			argc;
+	int			size;
+	struct xs_arena_chunk	*arena;
+};
+
+void xs_argv_add(struct xs_argv *args, const char *what);
+void xs_argv_split(struct xs_argv *args, char *parsestart, int line);
+void xs_argv_reset(struct xs_argv *args);
+void xs_argv_free(struct xs_argv *args);
+void xs_argv_check_batch(struct xs_argv *args, struct xs_argv *check,
+			 int line);
+void xs_restore_prefetch_hosts(FILE *in, int family);
+
+/**
+ * struct xs_snapshot - binary ruleset snapshot
+ * @buf:	snapshot read, or table sections collected for writing
+ * @len:	bytes used in @buf
+ * @size:	allocated size of @buf
+ * @pos:	offset of the next section to read
+ * @text:	text form of the ruleset
+ * @text_len:	length of @text
+ * @match:	taken on this system, the sections may be loaded as they are
+ * @counters:	sections carry the counters of the tables
+ * @capture:	temporary file collecting the text
+ * @stdout_fd:	standard output while @capture replaces it
+ */
+struct xs_snapshot {
+	char	*buf;
+	size_t	len;
+	size_t	size;
+	size_t	pos;
+	char	*text;
+	size_t	text_len;
+	bool	match;
+	bool	counters;
+	FILE	*capture;
+	int	stdout_fd;
+};
+
+int xs_snapshot_capture(struct xs_snapshot *snap);
+void xs_snapshot_add(struct xs_snapshot *snap, const char *table,
+		     const void *data, size_t len);
+int xs_snapshot_write(struct xs_snapshot *snap, int family,
+		      const char *backend);
+int xs_snapshot_read(struct xs_snapshot *snap, FILE *in, int family,
+		     const char *backend);
+const void *xs_snapshot_next(struct xs_snapshot *snap, const char **table,
+			     size_t *len);
+FILE *xs_snapshot_text(struct xs_snapshot *snap);
+void xs_snapshot_free(struct xs_snapshot *snap);
+
+/**
+ * struct xs_prefix - address prefix of a parsed rule
+ * @family:	AF_INET or AF_INET6, 0 if the rule matches any address
+ * @len:	prefix length in bits
+ * @inv:	negated with "!"
+ * @addr:	address with the host bits cleared
+ */
+struct xs_prefix {
+	uint8_t		family;
+	uint8_t		len;
+	bool		inv;
+	uint8_t		addr[16];
+};
+
+/**
+ * struct xs_ports - tcp, udp or sctp port range of a parsed rule
+ * @set:	the rule matches on the port
+ * @inv:	negated with "!"
+ * @lo:		first port of the range
+ * @hi:		last port of the range
+ */
+struct xs_ports {
+	bool		set;
+	bool		inv;
+	uint16_t	lo;
+	uint16_t	hi;
+};
+
+/**
+ * struct xs_iface - interface name of a parsed rule
+ * @name:	name, ending in '+' for a prefix, empty for any
+ * @inv:	negated with "!"
+ */
+struct xs_iface {
+	char		name[IFNAMSIZ];
+	bool		inv;
+};
+
+enum xs_rule_field {
+	XS_RULE_SRC	= 1 << 0,
+	XS_RULE_DST	= 1 << 1,
+	XS_RULE_IN	= 1 << 2,
+	XS_RULE_OUT	= 1 << 3,
+	XS_RULE_PROTO	= 1 << 4,
+	XS_RULE_FRAG	= 1 << 5,
+	XS_RULE_SPORT	= 1 << 6,
+	XS_RULE_DPORT	= 1 << 7,
+	XS_RULE_MATCHES	= 1 << 8,
+	XS_RULE_VERDICT	= 1 << 9,
+};
+
+/**
+ * struct xs_rule - rule of iptables-save output, in comparable form
+ * @line:	input line number
+ * @text:	rule arguments after the chain name, without counters
+ * @pcnt:	packet counter, from "[pcnt:bcnt]" or "-c"
+ * @bcnt:	byte counter
+ * @src:	source address
+ * @dst:	destination address
+ * @iniface:	input interface
+ * @outiface:	output interface
+ * @proto:	protocol number, 0 for any
+ * @proto_inv:	protocol negated with "!"
+ * @frag:	0 for any packet, 1 for fragments, 2 for non-fragments
+ * @sport:	source port of a tcp, udp or sctp match
+ * @dport:	destination port of a tcp, udp or sctp match
+ * @matches:	other matches, one normalized string per "-m" block
+ * @nmatches:	entries in @matches
+ * @verdict:	target with its options, empty if the rule has none
+ * @jump_goto:	target given with -g
+ *
+ * A rule matches the packets all of its fields match. Matches whose
+ * meaning is not known here are kept as @matches and only compared as
+ * text, "-m comment" is dropped.
+ */
+struct xs_rule {
+	unsigned int	line;
+	char		*text;
+	uint64_t	pcnt;
+	uint64_t	bcnt;
+	struct xs_prefix src;
+	struct xs_prefix dst;
+	struct xs_iface	iniface;
+	struct xs_iface	outiface;
+	uint8_t		proto;
+	bool		proto_inv;
+	uint8_t		frag;
+	struct xs_ports	sport;
+	struct xs_ports	dport;
+	char		**matches;
+	unsigned int	nmatches;
+	char		*verdict;
+	bool		jump_goto;
+};
+
+/**
+ * struct xs_rule_chain - chain of iptables-save output
+ * @name:	chain name
+ * @policy:	policy of a base chain, NULL for a user chain
+ * @pcnt:	packets that got the policy
+ * @bcnt:	bytes that got the policy
+ * @rules:	rules in order
+ * @num:	entries in @rules
+ * @size:	allocated entries in @rules
+ */
+struct xs_rule_chain {
+	char		*name;
+	char		*policy;
+	uint64_t	pcnt;
+	uint64_t	bcnt;
+	struct xs_rule	*rules;
+	unsigned int	num;
+	unsigned int	size;
+};
+
+/**
+ * struct xs_rule_table - table of iptables-save output
+ * @name:	table name
+ * @chains:	chains in input order
+ * @num:	entries in @chains
+ * @size:	allocated entries in @chains
+ */
+struct xs_rule_table {
+	char			*name;
+	struct xs_rule_chain	*chains;
+	unsigned int		num;
+	unsigned int		size;
+};
+
+/**
+ * struct xs_ruleset - all tables of iptables-save output
+ * @family:	AF_INET or AF_INET6, from the first address seen
+ * @tables:	tables in input order
+ * @num:	entries in @tables
+ * @size:	allocated entries in @tables
+ */
+struct xs_ruleset {
+	int			family;
+	struct xs_rule_table	*tables;
+	unsigned int		num;
+	unsigned int		size;
+};
+
+int xs_ruleset_read(struct xs_ruleset *rs, FILE *in);
+void xs_ruleset_free(struct xs_ruleset *rs);
+struct xs_rule_chain *xs_rule_chain_find(struct xs_rule_table *t,
+					 const char *name);
+bool xs_rule_terminal(const struct xs_rule *r);
+unsigned int xs_rule_diff(const struct xs_rule *a, const struct xs_rule *b);
+bool xs_rule_covers(const struct xs_rule *a, const struct xs_rule *b);
+bool xs_rule_disjoint(const struct xs_rule *a, const struct xs_rule *b);
+bool xs_prefix_contains(const struct xs_prefix *a, const struct xs_prefix *b);
+
+#define XS_PART_KEYS	3
+
+enum xs_part_key {
+	XS_PART_SRC,
+	XS_PART_DST,
+	XS_PART_DPORT,
+};
+
+/**
+ * struct xs_partition - how restore input is split into chain trees
+ * @leaf:	most rules a sub-chain is left with
+ * @nkeys:	entries in @keys
+ * @keys:	what rules are told apart by, in the order tried
+ */
+struct xs_partition {
+	unsigned int	leaf;
+	unsigned int	nkeys;
+	enum xs_part_key keys[XS_PART_KEYS];
+};
+
+void xs_partition_parse(struct xs_partition *pt, const char *arg);
+FILE *xs_partition_input(FILE *in, const struct xs_partition *pt);
+
+/**
+ * struct xs_counter - counters of a rule
+ * @handle:	nf_tables rule handle, 0 for legacy rules
+ * @pcnt:	packet counter
+ * @bcnt:	byte counter
+ * @comment:	offset of the rule comment in the string pool, 0 for none
+ */
+struct xs_counter {
+	uint64_t	handle;
+	uint64_t	pcnt;
+	uint64_t	bcnt;
+	uint32_t	comment;
+};
+
+/**
+ * struct xs_counter_chain - counters of the rules of a chain
+ * @table:	offset of the table name in the string pool
+ * @name:	offset of the chain name in the string pool
+ * @policy:	base chain, @pcnt and @bcnt count the packets of its policy
+ * @pcnt:	policy packet counter
+ * @bcnt:	policy byte counter
+ * @rules:	rules in order, the one at index i is at position i + 1
+ * @num:	entries in @rules
+ * @size:	allocated entries in @rules
+ */
+struct xs_counter_chain {
+	uint32_t	table;
+	uint32_t	name;
+	bool		policy;
+	uint64_t	pcnt;
+	uint64_t	bcnt;
+	struct xs_counter *rules;
+	unsigned int	num;
+	unsigned int	size;
+};
+
+/**
+ * struct xs_counters - rule counters of a family, as exported
+ * @family:	NFPROTO_IPV4 or NFPROTO_IPV6
+ * @delta:	counters are increments since the previous scrape
+ * @chains:	chains in the order they were fetched
+ * @num:	entries in @chains
+ * @size:	allocated entries in @chains
+ * @hash:	index of @chains by table and name, entries are index + 1
+ * @hash_size:	entries in @hash, a power of two
+ * @cursor:	chain last looked up
+ * @pool:	table names, chain names and comments
+ * @pool_len:	bytes used in @pool
+ * @pool_size:	allocated size of @pool
+ */
+struct xs_counters {
+	int			family;
+	bool			delta;
+	struct xs_counter_chain	*chains;
+	unsigned int		num;
+	unsigned int		size;
+	unsigned int		*hash;
+	unsigned int		hash_size;
+	unsigned int		cursor;
+	char			*pool;
+	size_t			pool_len;
+	size_t			pool_size;
+};
+
+static inline const char *xs_counters_str(const struct xs_counters *cs,
+					  uint32_t off)
+{
+	return off ? cs->pool + off : NULL;
+}
+
+typedef int (*xs_counters_fetch)(struct xs_counters *cs, const char *table,
+				 void *data);
+
+void xs_counters_init(struct xs_counters *cs, int family);
+void xs_counters_free(struct xs_counters *cs);
+struct xs_counter_chain *xs_counters_chain(struct xs_counters *cs,
+					   const char *table,
+					   const char *chain);
+void xs_counters_add(struct xs_counters *cs, struct xs_counter_chain *c,
+		     uint64_t handle, uint64_t pcnt, uint64_t bcnt,
+		     const char *comment);
+void xs_counters_delta(struct xs_counters *cs,
+		       const struct xs_counters *prev);
+int xs_counters_read(struct xs_counters *cs, FILE *in);
+int xs_counters_write(const struct xs_counters *cs, FILE *out);
+int xs_counters_print(const struct xs_counters *cs, FILE *out);
+int xs_counters_main(int argc, char *argv[], int family, const char *backend,
+		     xs_counters_fetch fetch, void *data);
 
 void print_ipv4_addresses(const struct ipt_entry *fw, unsigned int format);
 void print_ipv6_addresses(const struct ip6t_entry *fw6, unsigned int format);
+void print_counter_pair(const char *prefix, uint64_t pcnt, char sep,
+			uint64_t bcnt, const char *suffix);
 
 void print_ifaces(const char *iniface, const char *outiface, uint8_t invflags,
 		  unsigned int format);
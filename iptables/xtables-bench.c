@@ -0,0 +1,1051 @@
+/*
+ * xtables-bench: time the userspace hot paths of restore, save and rule
+ * decoding on a given ruleset, and print a line of results for each of
+ * them. Nothing is committed, the kernel ruleset is left alone.
+ *
+ * The same source builds xtables-legacy-bench and, with ENABLE_NFTABLES,
+ * xtables-nft-bench; "make bench" runs both on generated rulesets. The
+ * latter talks to the in-memory stand-in of nft-memnl.c instead of the
+ * kernel, so it also times commits and cache fetches, end to end.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <xtables.h>
+#include "iptables.h"
+#include "xshared.h"
+#ifdef ENABLE_NFTABLES
+#include <libnftnl/chain.h>
+#include <libnftnl/rule.h>
+#include "nft.h"
+#include "nft-shared.h"
+#else
+#include "libiptc/libiptc.h"
+#include "libiptc/libip6tc.h"
+#include "ip6tables.h"
+#endif
+
+#ifdef ENABLE_NFTABLES
+#define BENCH_BACKEND	"nf_tables"
+#define BENCH_PROG	"xtables-nft-bench"
+#else
+#define BENCH_BACKEND	"legacy"
+#define BENCH_PROG	"xtables-legacy-bench"
+#endif
+
+static const struct option options[] = {
+	{.name = "runs",    .has_arg = true,  .val = 'n'},
+	{.name = "bench",   .has_arg = true,  .val = 'b'},
+	{.name = "label",   .has_arg = true,  .val = 'l'},
+	{.name = "ipv6",    .has_arg = false, .val = '6'},
+	{.name = "help",    .has_arg = false, .val = 'h'},
+	{NULL},
+};
+
+#define BENCH_TABLES_MAX	8
+
+/**
+ * struct bench_table - table of the ruleset
+ * @name:	table name
+ * @empty:	legacy blob of the table without rules
+ * @empty_len:	size of @empty
+ * @blob:	legacy blob of the table with the ruleset, captured or compiled
+ * @len:	size of @blob
+ * @handle:	libiptc handle of the table with the ruleset
+ */
+struct bench_table {
+	char			name[XT_TABLE_MAXNAMELEN + 1];
+	void			*empty;
+	size_t			empty_len;
+	void			*blob;
+	size_t			len;
+	struct xtc_handle	*handle;
+};
+
+/**
+ * struct bench_ext - extension named by a rule
+ * @name:	name given to -m or -j
+ * @target:	a target rather than a match
+ */
+struct bench_ext {
+	char			name[XT_EXTENSION_MAXNAMELEN];
+	bool			target;
+};
+
+/**
+ * struct bench - state shared by the benchmarks
+ * @in:		text form of the ruleset, in a temporary file
+ * @label:	name of the ruleset in the results
+ * @family:	AF_INET or AF_INET6
+ * @runs:	timed runs of each benchmark
+ * @ns:		time of each run
+ * @start:	start of the current run
+ * @rules:	rules in the ruleset
+ * @tables:	tables in the ruleset
+ * @ntables:	entries in @tables
+ * @exts:	extensions named by the rules, in order and repeated
+ * @nexts:	entries in @exts
+ * @out:	results, standard output goes to /dev/null while timing
+ * @h:		nf_tables handle, its cache holds the parsed ruleset
+ */
+struct bench {
+	FILE			*in;
+	const char		*label;
+	int			family;
+	unsigned int		runs;
+	uint64_t		*ns;
+	struct timespec		start;
+	unsigned int		rules;
+	struct bench_table	tables[BENCH_TABLES_MAX];
+	unsigned int		ntables;
+	struct bench_ext	*exts;
+	unsigned int		nexts;
+	FILE			*out;
+#ifdef ENABLE_NFTABLES
+	struct nft_handle	h;
+#endif
+};
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr, "%s v%s\n\n"
+		"Usage: %s [-n runs] [-b bench[,bench...]] [-l label] [-6] ruleset\n\n"
+		"Time the userspace paths of %s on a ruleset in\n"
+		"iptables-save format or a snapshot of iptables-save --binary.\n"
+		"Prints one line of key=value pairs per benchmark.\n",
+		name, PACKAGE_VERSION, name, BENCH_BACKEND);
+}
+
+static void bench_start(struct bench *b)
+{
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &b->start);
+}
+
+static void bench_stop(struct bench *b, unsigned int run)
+{
+	struct timespec now;
+
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	b->ns[run] = (now.tv_sec - b->start.tv_sec) * 1000000000ULL +
+		     now.tv_nsec - b->start.tv_nsec;
+}
+
+static int bench_cmp_ns(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+/* Run 0 warms the caches up and is left out. */
+static void bench_report(struct bench *b, const char *name, unsigned int ops)
+{
+	uint64_t *ns = b->ns + 1;
+	double median;
+
+	if (ops == 0)
+		ops = 1;
+
+	qsort(ns, b->runs, sizeof(*ns), bench_cmp_ns);
+	median = b->runs % 2 ? ns[b->runs / 2] :
+		 (ns[b->runs / 2 - 1] + ns[b->runs / 2]) / 2.0;
+
+	fprintf(b->out, "bench=%s backend=%s family=ipv%d ruleset=%s "
+		"rules=%u ops=%u runs=%u ns_per_op=%.1f min_ns_per_op=%.1f\n",
+		name, BENCH_BACKEND, b->family == AF_INET6 ? 6 : 4, b->label,
+		b->rules, ops, b->runs, median / ops, (double)ns[0] / ops);
+	fflush(b->out);
+}
+
+static struct bench_table *bench_table(struct bench *b, const char *name)
+{
+	struct bench_table *t;
+	unsigned int i;
+
+	if (name == NULL)
+		xtables_error(PARAMETER_PROBLEM, "table name invalid");
+
+	for (i = 0; i < b->ntables; i++)
+		if (strcmp(b->tables[i].name, name) == 0)
+			return &b->tables[i];
+
+	if (b->ntables == BENCH_TABLES_MAX || strlen(name) > XT_TABLE_MAXNAMELEN)
+		xtables_error(PARAMETER_PROBLEM, "table \"%s\" unsupported",
+			      name);
+	t = &b->tables[b->ntables++];
+	strcpy(t->name, name);
+	return t;
+}
+
+static void bench_add_ext(struct bench *b, const char *name, bool target)
+{
+	struct bench_ext *e;
+
+	if (strlen(name) >= XT_EXTENSION_MAXNAMELEN)
+		return;
+
+	if (b->nexts % 256 == 0)
+		b->exts = xtables_realloc(b->exts,
+					  (b->nexts + 256) * sizeof(*b->exts));
+	e = &b->exts[b->nexts++];
+	strcpy(e->name, name);
+	e->target = target;
+}
+
+/* Count the rules and note the tables and extensions they use. */
+static void bench_scan(struct bench *b)
+{
+	struct xs_argv args = {};
+	struct xs_reader rd;
+	unsigned int lineno = 0;
+	char *buf;
+	int i;
+
+	rewind(b->in);
+	xs_reader_open(&rd, b->in);
+	while ((buf = xs_reader_getline(&rd))) {
+		lineno++;
+		if (buf[0] == '\n' || buf[0] == '#' || buf[0] == ':' ||
+		    strcmp(buf, "COMMIT\n") == 0)
+			continue;
+		if (buf[0] == '*') {
+			bench_table(b, strtok(buf + 1, " \t\n"));
+			continue;
+		}
+
+		b->rules++;
+		xs_argv_split(&args, buf, lineno);
+		for (i = 0; i + 1 < args.argc; i++) {
+			if (strcmp(args.argv[i], "-m") == 0 ||
+			    strcmp(args.argv[i], "--match") == 0)
+				bench_add_ext(b, args.argv[i + 1], false);
+			else if (strcmp(args.argv[i], "-j") == 0 ||
+				 strcmp(args.argv[i], "--jump") == 0)
+				bench_add_ext(b, args.argv[i + 1], true);
+		}
+		xs_argv_reset(&args);
+	}
+	xs_reader_close(&rd);
+	xs_argv_free(&args);
+}
+
+/* Look the extensions of all rules up as the rule parser does. */
+static void bench_ext_lookup(struct bench *b)
+{
+	unsigned int run, i;
+
+	for (run = 0; run <= b->runs; run++) {
+		bench_start(b);
+		for (i = 0; i < b->nexts; i++) {
+			if (b->exts[i].target)
+				xtables_find_target(b->exts[i].name,
+						    XTF_TRY_LOAD);
+			else
+				xtables_find_match(b->exts[i].name,
+						   XTF_TRY_LOAD, NULL);
+		}
+		bench_stop(b, run);
+	}
+	bench_report(b, "ext-lookup", b->nexts);
+}
+
+#ifndef ENABLE_NFTABLES
+
+/**
+ * struct bench_family - libiptc and rule parser of a family
+ */
+struct bench_family {
+	const struct xtc_ops	*ops;
+	struct xtables_globals	*globals;
+	int	(*for_each_chain)(int (*fn)(const xt_chainlabel, int,
+					    struct xtc_handle *),
+				  int verbose, int builtinstoo,
+				  struct xtc_handle *handle);
+	int	(*flush_entries)(const xt_chainlabel, int,
+				 struct xtc_handle *);
+	int	(*delete_chain)(const xt_chainlabel, int,
+				struct xtc_handle *);
+	int	(*do_command)(int argc, char *argv[], char **table,
+			      struct xtc_handle **handle, bool restore);
+	void	(*dump_rules)(const char *chain, struct xtc_handle *h);
+};
+
+static const struct bench_family *fam;
+
+#ifdef ENABLE_IPV4
+static void bench_dump_rules4(const char *chain, struct xtc_handle *h)
+{
+	const struct ipt_entry *e;
+
+	for (e = iptc_first_rule(chain, h); e; e = iptc_next_rule(e, h))
+		print_rule4(e, h, chain, 1);
+}
+
+static const struct bench_family bench_ipv4 = {
+	.ops		= &iptc_ops,
+	.globals	= &iptables_globals,
+	.for_each_chain	= for_each_chain4,
+	.flush_entries	= flush_entries4,
+	.delete_chain	= delete_chain4,
+	.do_command	= do_command4,
+	.dump_rules	= bench_dump_rules4,
+};
+#endif
+
+#ifdef ENABLE_IPV6
+static void bench_dump_rules6(const char *chain, struct xtc_handle *h)
+{
+	const struct ip6t_entry *e;
+
+	for (e = ip6tc_first_rule(chain, h); e; e = ip6tc_next_rule(e, h))
+		print_rule6(e, h, chain, 1);
+}
+
+static const struct bench_family bench_ipv6 = {
+	.ops		= &ip6tc_ops,
+	.globals	= &ip6tables_globals,
+	.for_each_chain	= for_each_chain6,
+	.flush_entries	= flush_entries6,
+	.delete_chain	= delete_chain6,
+	.do_command	= do_command6,
+	.dump_rules	= bench_dump_rules6,
+};
+#endif
+
+/*
+ * The restore parser starts from the empty tables, as with a flush.
+ * These come from the kernel, emptied in the cache only.
+ */
+static void bench_legacy_empty(struct bench *b)
+{
+	struct xtc_handle *h;
+	unsigned int i;
+
+	for (i = 0; i < b->ntables; i++) {
+		struct bench_table *t = &b->tables[i];
+
+		h = fam->ops->init(t->name);
+		if (h == NULL) {
+			xtables_load_ko(xtables_modprobe_program, false);
+			h = fam->ops->init(t->name);
+		}
+		if (h == NULL)
+			xtables_error(OTHER_PROBLEM,
+				      "can't initialize table %s: %s",
+				      t->name, fam->ops->strerror(errno));
+
+		fam->for_each_chain(fam->flush_entries, 0, 1, h);
+		fam->for_each_chain(fam->delete_chain, 0, 0, h);
+		t->empty = fam->ops->snapshot(h, 0, &t->empty_len);
+		if (t->empty == NULL)
+			xtables_error(OTHER_PROBLEM, "can't compile table %s: %s",
+				      t->name, fam->ops->strerror(errno));
+		fam->ops->free(h);
+	}
+}
+
+/*
+ * Parse the text as iptables-restore does, into handles made from the
+ * empty tables, and leave the commit out. The handles are stored in
+ * @handles in table order.
+ */
+static void bench_legacy_parse(struct bench *b, struct xtc_handle **handles)
+{
+	struct xtc_handle *handle = NULL;
+	struct xs_argv args = {};
+	struct bench_table *t = NULL;
+	struct xs_reader rd;
+	struct xt_counters count;
+	unsigned int lineno = 0;
+	char *buf, *chain, *policy, *ptr;
+
+	rewind(b->in);
+	xs_reader_open(&rd, b->in);
+	while ((buf = xs_reader_getline(&rd))) {
+		lineno++;
+		if (buf[0] == '\n' || buf[0] == '#')
+			continue;
+
+		if (strcmp(buf, "COMMIT\n") == 0) {
+			handles[t - b->tables] = handle;
+			handle = NULL;
+		} else if (buf[0] == '*') {
+			t = bench_table(b, strtok(buf + 1, " \t\n"));
+			handle = fam->ops->init_snapshot(t->empty,
+							 t->empty_len);
+			if (handle == NULL)
+				xtables_error(OTHER_PROBLEM,
+					      "can't initialize table %s: %s",
+					      t->name,
+					      fam->ops->strerror(errno));
+		} else if (handle && buf[0] == ':') {
+			chain = strtok(buf + 1, " \t\n");
+			policy = strtok(NULL, " \t\n");
+			if (!chain || !policy)
+				xtables_error(PARAMETER_PROBLEM,
+					      "line %u: chain invalid", lineno);
+
+			if (fam->ops->builtin(chain, handle) > 0) {
+				memset(&count, 0, sizeof(count));
+				if (!fam->ops->set_policy(chain, policy, &count,
+							  handle))
+					xtables_error(OTHER_PROBLEM,
+						      "line %u: %s", lineno,
+						      fam->ops->strerror(errno));
+			} else if (!fam->ops->create_chain(chain, handle)) {
+				xtables_error(OTHER_PROBLEM, "line %u: %s",
+					      lineno, fam->ops->strerror(errno));
+			}
+		} else if (handle) {
+			xs_argv_add(&args, BENCH_PROG);
+			xs_argv_add(&args, "-t");
+			xs_argv_add(&args, t->name);
+
+			ptr = buf;
+			if (buf[0] == '[') {
+				ptr = strchr(buf, ']');
+				if (!ptr)
+					xtables_error(PARAMETER_PROBLEM,
+						      "line %u: need ]", lineno);
+				*ptr++ = '\0';
+				xs_argv_add(&args, "--set-counters");
+				xs_argv_add(&args, strtok(buf + 1, ":"));
+				xs_argv_add(&args, strtok(NULL, ""));
+			}
+
+			xs_argv_split(&args, ptr, lineno);
+			if (!fam->do_command(args.argc, args.argv,
+					     &args.argv[2], &handle, true))
+				xtables_error(PARAMETER_PROBLEM,
+					      "line %u failed", lineno);
+			xs_argv_reset(&args);
+		}
+	}
+	xs_reader_close(&rd);
+	xs_argv_free(&args);
+
+	if (handle)
+		xtables_error(PARAMETER_PROBLEM, "COMMIT expected at line %u",
+			      lineno + 1);
+}
+
+static void bench_legacy_free(struct bench *b, struct xtc_handle **handles)
+{
+	unsigned int i;
+
+	for (i = 0; i < b->ntables; i++) {
+		if (handles[i])
+			fam->ops->free(handles[i]);
+		handles[i] = NULL;
+	}
+}
+
+static void bench_legacy_restore(struct bench *b)
+{
+	struct xtc_handle *handles[BENCH_TABLES_MAX] = {};
+	unsigned int run;
+
+	for (run = 0; run <= b->runs; run++) {
+		bench_start(b);
+		bench_legacy_parse(b, handles);
+		bench_stop(b, run);
+		bench_legacy_free(b, handles);
+	}
+	bench_report(b, "restore-parse", b->rules);
+}
+
+/* parse_table(), from the blob to the chains and rules of a handle */
+static void bench_legacy_parse_table(struct bench *b)
+{
+	struct xtc_handle *handles[BENCH_TABLES_MAX] = {};
+	unsigned int run, i;
+
+	for (run = 0; run <= b->runs; run++) {
+		bench_start(b);
+		for (i = 0; i < b->ntables; i++)
+			handles[i] = fam->ops->init_snapshot(b->tables[i].blob,
+							     b->tables[i].len);
+		bench_stop(b, run);
+		bench_legacy_free(b, handles);
+	}
+	bench_report(b, "parse-table", b->rules);
+}
+
+/* the compile step of TC_COMMIT, back from the handle to a blob */
+static void bench_legacy_compile(struct bench *b)
+{
+	void *blobs[BENCH_TABLES_MAX];
+	unsigned int run, i;
+	size_t len;
+
+	for (run = 0; run <= b->runs; run++) {
+		bench_start(b);
+		for (i = 0; i < b->ntables; i++)
+			blobs[i] = fam->ops->snapshot(b->tables[i].handle, 1,
+						      &len);
+		bench_stop(b, run);
+		for (i = 0; i < b->ntables; i++)
+			free(blobs[i]);
+	}
+	bench_report(b, "compile", b->rules);
+}
+
+static void bench_legacy_save(struct bench *b)
+{
+	const struct xtc_ops *ops = fam->ops;
+	struct xt_counters count;
+	struct xtc_handle *h;
+	const char *chain;
+	unsigned int run, i;
+
+	for (run = 0; run <= b->runs; run++) {
+		bench_start(b);
+		for (i = 0; i < b->ntables; i++) {
+			h = b->tables[i].handle;
+			printf("*%s\n", b->tables[i].name);
+			for (chain = ops->first_chain(h); chain;
+			     chain = ops->next_chain(h)) {
+				if (ops->builtin(chain, h)) {
+					printf(":%s %s", chain,
+					       ops->get_policy(chain, &count, h));
+					print_counter_pair(" [", count.pcnt,
+							   ':', count.bcnt,
+							   "]\n");
+				} else {
+					printf(":%s - [0:0]\n", chain);
+				}
+			}
+			for (chain = ops->first_chain(h); chain;
+			     chain = ops->next_chain(h))
+				fam->dump_rules(chain, h);
+			printf("COMMIT\n");
+		}
+		bench_stop(b, run);
+	}
+	bench_report(b, "save", b->rules);
+}
+
+/*
+ * Set up the handles the other benchmarks work on, and the blobs, unless
+ * a snapshot taken on this system brought them.
+ */
+static void bench_legacy_setup(struct bench *b, struct xs_snapshot *snap)
+{
+	struct xtc_handle *handles[BENCH_TABLES_MAX] = {};
+	const char *name;
+	const void *blob;
+	unsigned int i;
+	size_t len;
+
+	while ((blob = xs_snapshot_next(snap, &name, &len))) {
+		struct bench_table *t = bench_table(b, name);
+
+		t->blob = xtables_malloc(len);
+		memcpy(t->blob, blob, len);
+		t->len = len;
+	}
+
+	bench_legacy_empty(b);
+	bench_legacy_parse(b, handles);
+
+	for (i = 0; i < b->ntables; i++) {
+		struct bench_table *t = &b->tables[i];
+
+		if (t->blob)
+			t->handle = fam->ops->init_snapshot(t->blob, t->len);
+		if (t->handle) {
+			if (handles[i])
+				fam->ops->free(handles[i]);
+			continue;
+		}
+		if (t->blob)
+			fprintf(stderr, "%s: blob of table %s unusable, "
+				"compiling it from the text\n", BENCH_PROG,
+				t->name);
+
+		free(t->blob);
+		t->handle = handles[i];
+		if (t->handle == NULL)
+			xtables_error(PARAMETER_PROBLEM, "no text of table %s",
+				      t->name);
+		t->blob = fam->ops->snapshot(t->handle, 1, &t->len);
+		if (t->blob == NULL)
+			xtables_error(OTHER_PROBLEM, "can't compile table %s: %s",
+				      t->name, fam->ops->strerror(errno));
+	}
+}
+
+static void bench_init(struct bench *b, const char *progname)
+{
+#ifdef ENABLE_IPV6
+	if (b->family == AF_INET6)
+		fam = &bench_ipv6;
+#endif
+#ifdef ENABLE_IPV4
+	if (b->family == AF_INET)
+		fam = &bench_ipv4;
+#endif
+	if (fam == NULL)
+		xtables_error(PARAMETER_PROBLEM, "family not supported");
+
+	fam->globals->program_name = progname;
+	if (xtables_init_all(fam->globals, b->family == AF_INET6 ?
+			     NFPROTO_IPV6 : NFPROTO_IPV4) < 0) {
+		fprintf(stderr, "%s: failed to initialize xtables\n",
+			progname);
+		exit(1);
+	}
+#if defined(ALL_INCLUSIVE) || defined(NO_SHARED_LIBS)
+	init_extensions();
+	if (b->family == AF_INET6)
+		init_extensions6();
+	else
+		init_extensions4();
+#endif
+}
+
+static const struct {
+	const char	*name;
+	void		(*run)(struct bench *b);
+} benches[] = {
+	{ "restore-parse",	bench_legacy_restore },
+	{ "parse-table",	bench_legacy_parse_table },
+	{ "compile",		bench_legacy_compile },
+	{ "save",		bench_legacy_save },
+	{ "ext-lookup",		bench_ext_lookup },
+};
+
+#else /* ENABLE_NFTABLES */
+
+static int bench_nft_commit(struct nft_handle *h)
+{
+	return 1;
+}
+
+/* xtables_restore_parse() as in xtables-restore, with or without commit */
+static void bench_nft_parse(struct bench *b, bool commit)
+{
+	struct nft_xt_restore_cb cb = restore_cb;
+	struct nft_xt_restore_parse p = {
+		.in	= b->in,
+		.commit	= true,
+	};
+	char *argv[] = { BENCH_PROG, NULL };
+
+	if (!commit) {
+		cb.commit = bench_nft_commit;
+		cb.abort = NULL;
+	}
+
+	rewind(b->in);
+	xtables_restore_parse(&b->h, &p, &cb, 1, argv);
+}
+
+static void bench_nft_restore_parse(struct bench *b)
+{
+	unsigned int run;
+
+	for (run = 0; run <= b->runs; run++) {
+		nft_discard(&b->h);
+		bench_start(b);
+		bench_nft_parse(b, false);
+		bench_stop(b, run);
+	}
+	bench_report(b, "restore-parse", b->rules);
+}
+
+/*
+ * A whole restore into the stand-in, from a fresh cache as a new process
+ * would: fetch, parse, batch, commit and acknowledgments. Run 0 restores
+ * into the empty ruleset, the timed ones replace that.
+ */
+static void bench_nft_restore(struct bench *b)
+{
+	unsigned int run;
+
+	for (run = 0; run <= b->runs; run++) {
+		nft_discard(&b->h);
+		bench_start(b);
+		bench_nft_parse(b, true);
+		bench_stop(b, run);
+	}
+	bench_report(b, "restore", b->rules);
+}
+
+/* __nft_build_cache() of the committed ruleset: generation id and dumps */
+static void bench_nft_fetch(struct bench *b)
+{
+	unsigned int run;
+
+	nft_discard(&b->h);
+	bench_nft_parse(b, true);
+
+	for (run = 0; run <= b->runs; run++) {
+		nft_discard(&b->h);
+		bench_start(b);
+		nft_build_cache(&b->h);
+		bench_stop(b, run);
+	}
+	bench_report(b, "fetch", b->rules);
+}
+
+/* Call @fn on each chain of the parsed ruleset, with its table. */
+static void bench_nft_chains(struct bench *b,
+			     void (*fn)(struct bench *b, const char *table,
+					struct nftnl_chain *c, void *data),
+			     void *data)
+{
+	struct nftnl_chain_list_iter *iter;
+	struct nftnl_chain_list *list;
+	struct nftnl_chain *c;
+	unsigned int i;
+
+	for (i = 0; i < b->ntables; i++) {
+		list = nft_chain_list_get(&b->h, b->tables[i].name);
+		if (list == NULL)
+			continue;
+
+		iter = nftnl_chain_list_iter_create(list);
+		while ((c = nftnl_chain_list_iter_next(iter)))
+			fn(b, b->tables[i].name, c, data);
+		nftnl_chain_list_iter_destroy(iter);
+	}
+}
+
+static void bench_nft_decode_chain(struct bench *b, const char *table,
+				   struct nftnl_chain *c, void *data)
+{
+	struct iptables_command_state cs;
+	struct nftnl_rule_iter *iter;
+	struct nftnl_rule *r;
+
+	iter = nftnl_rule_iter_create(c);
+	while ((r = nftnl_rule_iter_next(iter))) {
+		memset(&cs, 0, sizeof(cs));
+		nft_rule_to_iptables_command_state(r, &cs);
+		b->h.ops->clear_cs(&cs);
+	}
+	nftnl_rule_iter_destroy(iter);
+}
+
+/* nft_rule_to_iptables_command_state(), as for listing and saving */
+static void bench_nft_decode(struct bench *b)
+{
+	unsigned int run;
+
+	for (run = 0; run <= b->runs; run++) {
+		bench_start(b);
+		bench_nft_chains(b, bench_nft_decode_chain, NULL);
+		bench_stop(b, run);
+	}
+	bench_report(b, "nft-decode", b->rules);
+}
+
+/**
+ * struct bench_nft_find - last rule of a chain, to look up by content
+ * @table:	table of the chain
+ * @chain:	chain name
+ * @rules:	rules compared before it is found
+ * @cs:		the rule, decoded
+ */
+struct bench_nft_find {
+	const char			*table;
+	const char			*chain;
+	unsigned int			rules;
+	struct iptables_command_state	cs;
+};
+
+static void bench_nft_find_chain(struct bench *b, const char *table,
+				 struct nftnl_chain *c, void *data)
+{
+	struct bench_nft_find **finds = data, *f;
+	struct nftnl_rule_iter *iter;
+	struct nftnl_rule *r, *last = NULL;
+	unsigned int n = 0;
+
+	iter = nftnl_rule_iter_create(c);
+	while ((r = nftnl_rule_iter_next(iter))) {
+		last = r;
+		n++;
+	}
+	nftnl_rule_iter_destroy(iter);
+	if (last == NULL)
+		return;
+
+	for (f = *finds; f->chain; f++)
+		;
+	f->table = table;
+	f->chain = nftnl_chain_get_str(c, NFTNL_CHAIN_NAME);
+	f->rules = n;
+	nft_rule_to_iptables_command_state(last, &f->cs);
+}
+
+static void bench_nft_count_chain(struct bench *b, const char *table,
+				  struct nftnl_chain *c, void *data)
+{
+	(*(unsigned int *)data)++;
+}
+
+/*
+ * nft_rule_find() through nft_rule_check(), as for -C and -D by content.
+ * The last rule of each chain is looked up, an operation is comparing one
+ * rule.
+ */
+static void bench_nft_find(struct bench *b)
+{
+	struct bench_nft_find *finds, *f;
+	unsigned int nchains = 0, ops = 0, run;
+
+	bench_nft_chains(b, bench_nft_count_chain, &nchains);
+	finds = xtables_calloc(nchains + 1, sizeof(*finds));
+	bench_nft_chains(b, bench_nft_find_chain, &finds);
+
+	for (f = finds; f->chain; f++)
+		ops += f->rules;
+
+	for (run = 0; run <= b->runs; run++) {
+		bench_start(b);
+		for (f = finds; f->chain; f++)
+			if (!nft_rule_check(&b->h, f->chain, f->table, &f->cs,
+					    false))
+				xtables_error(OTHER_PROBLEM,
+					      "last rule of %s not found",
+					      f->chain);
+		bench_stop(b, run);
+	}
+	bench_report(b, "nft-rule-find", ops);
+
+	for (f = finds; f->chain; f++)
+		b->h.ops->clear_cs(&f->cs);
+	free(finds);
+}
+
+static void bench_nft_save(struct bench *b)
+{
+	struct nftnl_chain_list *list;
+	unsigned int run, i;
+
+	for (run = 0; run <= b->runs; run++) {
+		bench_start(b);
+		for (i = 0; i < b->ntables; i++) {
+			list = nft_chain_list_get(&b->h, b->tables[i].name);
+			if (list == NULL)
+				continue;
+			printf("*%s\n", b->tables[i].name);
+			nft_chain_save(&b->h, list);
+			nft_rule_save(&b->h, b->tables[i].name, 0);
+			printf("COMMIT\n");
+		}
+		bench_stop(b, run);
+	}
+	bench_report(b, "save", b->rules);
+}
+
+/* The cache of the last parse is the ruleset of the other benchmarks. */
+static void bench_nft_setup(struct bench *b, struct xs_snapshot *snap)
+{
+	bench_nft_parse(b, false);
+}
+
+static void bench_init(struct bench *b, const char *progname)
+{
+	int family = b->family == AF_INET6 ? NFPROTO_IPV6 : NFPROTO_IPV4;
+
+	/* revisions are probed through it as well */
+	setenv("XTABLES_NFT_TRANSPORT", nft_transport_memory.name, 1);
+
+	xtables_globals.program_name = progname;
+	if (xtables_init_all(&xtables_globals, family) < 0) {
+		fprintf(stderr, "%s: failed to initialize xtables\n",
+			progname);
+		exit(1);
+	}
+#if defined(ALL_INCLUSIVE) || defined(NO_SHARED_LIBS)
+	init_extensions();
+	init_extensions4();
+	init_extensions6();
+#endif
+
+	b->h.family = family;
+	b->h.restore = true;
+	if (nft_init(&b->h, xtables_ipv4) < 0)
+		xtables_error(OTHER_PROBLEM, "failed to initialize nft: %s",
+			      strerror(errno));
+	b->h.ops = nft_family_ops_lookup(family);
+}
+
+static const struct {
+	const char	*name;
+	void		(*run)(struct bench *b);
+} benches[] = {
+	{ "restore-parse",	bench_nft_restore_parse },
+	{ "restore",		bench_nft_restore },
+	{ "fetch",		bench_nft_fetch },
+	{ "nft-decode",		bench_nft_decode },
+	{ "nft-rule-find",	bench_nft_find },
+	{ "save",		bench_nft_save },
+	{ "ext-lookup",		bench_ext_lookup },
+};
+
+#endif /* ENABLE_NFTABLES */
+
+static bool bench_selected(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	if (list == NULL)
+		return true;
+
+	for (p = list; (p = strstr(p, name)); p += len)
+		if ((p == list || p[-1] == ',') &&
+		    (p[len] == '\0' || p[len] == ','))
+			return true;
+	return false;
+}
+
+/*
+ * Keep the ruleset text in a temporary file, so that the restore parser
+ * maps it as it maps a ruleset file.
+ */
+static void bench_open(struct bench *b, const char *path,
+		       struct xs_snapshot *snap)
+{
+	char buf[BUFSIZ];
+	FILE *in, *text;
+	size_t n;
+
+	in = fopen(path, "re");
+	if (in == NULL)
+		xtables_error(OTHER_PROBLEM, "can't open %s: %s", path,
+			      strerror(errno));
+
+	if (xs_snapshot_read(snap, in, b->family, BENCH_BACKEND) == 0) {
+		text = xs_snapshot_text(snap);
+		if (text == NULL)
+			xtables_error(OTHER_PROBLEM, "can't read snapshot: %s",
+				      strerror(errno));
+		fclose(in);
+		in = text;
+	} else if (fseek(in, 0, SEEK_SET) < 0) {
+		xtables_error(OTHER_PROBLEM, "can't rewind %s: %s", path,
+			      strerror(errno));
+	}
+
+	b->in = tmpfile();
+	if (b->in == NULL)
+		xtables_error(OTHER_PROBLEM, "can't create temporary file: %s",
+			      strerror(errno));
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+		fwrite(buf, 1, n, b->in);
+	if (ferror(in) || fflush(b->in) != 0)
+		xtables_error(OTHER_PROBLEM, "can't copy %s: %s", path,
+			      strerror(errno));
+	fclose(in);
+}
+
+/*
+ * Results go to the original standard output. Standard output itself is
+ * sent to /dev/null, with the buffer iptables-save uses, for the save
+ * benchmark.
+ */
+static void bench_redirect(struct bench *b)
+{
+	int fd, null;
+
+	fd = dup(STDOUT_FILENO);
+	null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (fd < 0 || null < 0 || dup2(null, STDOUT_FILENO) < 0)
+		xtables_error(OTHER_PROBLEM, "can't redirect output: %s",
+			      strerror(errno));
+	close(null);
+
+	b->out = fdopen(fd, "w");
+	if (b->out == NULL)
+		xtables_error(OTHER_PROBLEM, "can't redirect output: %s",
+			      strerror(errno));
+	xtables_output_init(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench b = {
+		.family	= AF_INET,
+		.runs	= 10,
+	};
+	struct xs_snapshot snap = {};
+	const char *list = NULL;
+	unsigned int i;
+	char *end;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "n:b:l:6h", options,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			b.runs = strtoul(optarg, &end, 10);
+			if (*end || b.runs == 0)
+				xtables_error(PARAMETER_PROBLEM,
+					      "runs \"%s\" invalid", optarg);
+			break;
+		case 'b':
+			list = optarg;
+			break;
+		case 'l':
+			b.label = optarg;
+			break;
+		case '6':
+			b.family = AF_INET6;
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			exit(0);
+		default:
+			print_usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (optind != argc - 1) {
+		print_usage(argv[0]);
+		exit(1);
+	}
+
+	if (b.label == NULL)
+		b.label = basename(argv[optind]);
+	b.ns = xtables_calloc(b.runs + 1, sizeof(*b.ns));
+
+	bench_init(&b, BENCH_PROG);
+	bench_open(&b, argv[optind], &snap);
+	bench_scan(&b);
+	bench_redirect(&b);
+
+#ifdef ENABLE_NFTABLES
+	bench_nft_setup(&b, &snap);
+#else
+	bench_legacy_setup(&b, &snap);
+#endif
+
+	for (i = 0; i < ARRAY_SIZE(benches); i++)
+		if (bench_selected(list, benches[i].name))
+			benches[i].run(&b);
+
+	xs_snapshot_free(&snap);
+	return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Counter export of the nf_tables backend, see xshared-counters.c and
+ * nft_counters_fetch().
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include "config.h"
+#include <errno.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iptables.h"
+#include "xtables-multi.h"
+#include "nft.h"
+
+static int xtables_counters_fetch(struct xs_counters *cs, const char *table,
+				  void *data)
+{
+	return nft_counters_fetch(data, table, cs);
+}
+
+static int xtables_counters_main(int family, int argc, char *argv[])
+{
+	struct nft_handle h = {
+		.family	= family,
+	};
+	int ret;
+
+	xtables_globals.program_name = basename(*argv);
+	if (xtables_init_all(&xtables_globals, family) < 0) {
+		fprintf(stderr, "%s/%s Failed to initialize xtables\n",
+				xtables_globals.program_name,
+				xtables_globals.program_version);
+		exit(1);
+	}
+
+	if (nft_init(&h, xtables_ipv4) < 0) {
+		fprintf(stderr, "%s/%s Failed to initialize nft: %s\n",
+				xtables_globals.program_name,
+				xtables_globals.program_version,
+				strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	ret = xs_counters_main(argc, argv, family, "nf_tables",
+			       xtables_counters_fetch, &h);
+	nft_fini(&h);
+	return ret;
+}
+
+int xtables_ip4_counters_main(int argc, char *argv[])
+{
+	return xtables_counters_main(NFPROTO_IPV4, argc, argv);
+}
+
+int xtables_ip6_counters_main(int argc, char *argv[])
+{
+	return xtables_counters_main(NFPROTO_IPV6, argc, argv);
+}
@@ -0,0 +1,617 @@
+/*
+ * xtables-daemon: run iptables and ip6tables command lines sent over a
+ * Unix socket in one long-lived process.
+ *
+ * Each fork of iptables-nft registers the extensions, probes revisions
+ * and fetches the whole ruleset before it can change a single rule. The
+ * daemon does that once and keeps its cache in step with the kernel via
+ * the ruleset generation id. Command lines that arrive together are
+ * committed in one batch; if that batch fails, they are run again one by
+ * one so each caller gets its own result.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include "config.h"
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <iptables.h>
+#include "xtables-multi.h"
+#include "xshared.h"
+#include "nft.h"
+
+#define XT_DAEMON_SOCKET	"/run/xtables-daemon.sock"
+#define XT_DAEMON_MAGIC		0x78746431	/* "xtd1" */
+#define XT_DAEMON_DECLINED	-1		/* caller runs it itself */
+#define XT_DAEMON_MAX_ARGC	4096
+#define XT_DAEMON_MAX_LEN	(1 << 20)
+#define XT_DAEMON_BATCH		256		/* requests per round */
+
+struct xt_daemon_req {
+	uint32_t	magic;
+	uint32_t	family;
+	uint64_t	netns_dev;	/* net namespace of the caller */
+	uint64_t	netns_ino;
+	uint32_t	argc;
+	uint32_t	len;		/* NUL separated argv that follows */
+};
+
+struct xt_daemon_resp {
+	int32_t		status;		/* exit status */
+	uint32_t	out_len;	/* stdout, then stderr follow */
+	uint32_t	err_len;
+};
+
+struct xt_daemon_client {
+	int			fd;
+	struct xt_daemon_req	req;
+	char			*buf;
+	char			**argv;
+	int			status;
+	FILE			*out, *err;
+	char			*out_buf, *err_buf;
+	size_t			out_len, err_len;
+};
+
+static const char *xt_daemon_socket(void)
+{
+	const char *path = getenv("XTABLES_DAEMON_SOCKET");
+
+	return path ? path : XT_DAEMON_SOCKET;
+}
+
+static int xt_daemon_netns(uint64_t *dev, uint64_t *ino)
+{
+	struct stat st;
+
+	if (stat("/proc/self/ns/net", &st) < 0)
+		return -1;
+
+	*dev = st.st_dev;
+	*ino = st.st_ino;
+	return 0;
+}
+
+static int xt_daemon_read(int fd, void *data, size_t len)
+{
+	char *p = data;
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int xt_daemon_write(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Options that print help or a version exit on the spot, and -4/-6 switch
+ * the family under the handle; such command lines are run locally.
+ */
+static bool xt_daemon_forwardable(int argc, char *argv[])
+{
+	const char *arg;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		arg = argv[i];
+		if (arg[0] != '-' || arg[1] == '\0')
+			continue;
+		if (arg[1] == '-') {
+			if (!strcmp(arg, "--help") || !strcmp(arg, "--version") ||
+			    !strcmp(arg, "--ipv4") || !strcmp(arg, "--ipv6"))
+				return false;
+			continue;
+		}
+		if (strpbrk(arg + 1, "hV46") &&
+		    strspn(arg + 1, "abcdefghijklmnopqrstuvwxyz"
+				    "ABCDEFGHIJKLMNOPQRSTUVWXYZ46") ==
+		    strlen(arg + 1))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * xtables_daemon_forward - hand a command line to a running xtables-daemon
+ * @family:	NFPROTO_IPV4 or NFPROTO_IPV6
+ * @argc:	argument count
+ * @argv:	arguments, as passed to iptables
+ *
+ * Returns the exit status of the command, or -1 if no daemon took it, in
+ * which case the caller runs it itself.
+ */
+int xtables_daemon_forward(int family, int argc, char *argv[])
+{
+	struct xt_daemon_resp resp;
+	struct xt_daemon_req req = {
+		.magic	= XT_DAEMON_MAGIC,
+		.family	= family,
+		.argc	= argc,
+	};
+	struct sockaddr_un sun = {
+		.sun_family = AF_UNIX,
+	};
+	const char *path = xt_daemon_socket();
+	char *buf, *p;
+	uint32_t len;
+	int fd, i;
+
+	/* a profile is of the caller's process */
+	if (path[0] == '\0' || strlen(path) >= sizeof(sun.sun_path) ||
+	    xs_profile_enabled || !xt_daemon_forwardable(argc, argv) ||
+	    xt_daemon_netns(&req.netns_dev, &req.netns_ino) < 0)
+		return -1;
+
+	for (i = 0; i < argc; i++)
+		req.len += strlen(argv[i]) + 1;
+	if (argc > XT_DAEMON_MAX_ARGC || req.len > XT_DAEMON_MAX_LEN)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	strcpy(sun.sun_path, path);
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	buf = p = xtables_malloc(req.len);
+	for (i = 0; i < argc; i++)
+		p = stpcpy(p, argv[i]) + 1;
+
+	if (xt_daemon_write(fd, &req, sizeof(req)) < 0 ||
+	    xt_daemon_write(fd, buf, req.len) < 0 ||
+	    xt_daemon_read(fd, &resp, sizeof(resp)) < 0) {
+		/* it may have been applied already, don't run it twice */
+		fprintf(stderr, "%s: lost connection to xtables-daemon\n",
+			argv[0]);
+		free(buf);
+		close(fd);
+		return RESOURCE_PROBLEM;
+	}
+	free(buf);
+
+	if (resp.status == XT_DAEMON_DECLINED) {
+		close(fd);
+		return -1;
+	}
+
+	for (i = 0; i < 2; i++) {
+		char chunk[4096];
+
+		len = i ? resp.err_len : resp.out_len;
+		while (len) {
+			uint32_t n = len < sizeof(chunk) ? len : sizeof(chunk);
+
+			if (xt_daemon_read(fd, chunk, n) < 0)
+				break;
+			fwrite(chunk, 1, n, i ? stderr : stdout);
+			len -= n;
+		}
+	}
+	close(fd);
+
+	return resp.status;
+}
+
+static sigjmp_buf xt_daemon_jmp;
+static volatile sig_atomic_t xt_daemon_stop;
+
+/*
+ * Commands end early through xtables_exit(). Unwind to the request loop
+ * instead, passing the exit status plus one as it may be zero.
+ */
+static void xt_daemon_exit(int status)
+{
+	siglongjmp(xt_daemon_jmp, status + 1);
+}
+
+static void xt_daemon_output_reset(struct xt_daemon_client *cl)
+{
+	if (cl->out)
+		fclose(cl->out);
+	if (cl->err)
+		fclose(cl->err);
+	free(cl->out_buf);
+	free(cl->err_buf);
+	cl->out_buf = cl->err_buf = NULL;
+	cl->out = open_memstream(&cl->out_buf, &cl->out_len);
+	cl->err = open_memstream(&cl->err_buf, &cl->err_len);
+	if (!cl->out || !cl->err)
+		xtables_error(RESOURCE_PROBLEM, "out of memory");
+}
+
+/*
+ * Run the command line of @cl on @h with its output going to the client,
+ * commit it too if @commit is set. Returns the exit status.
+ */
+static int xt_daemon_run(struct nft_handle *h, struct xt_daemon_client *cl,
+			 bool commit)
+{
+	FILE *out = stdout, *err = stderr;
+	char *table = "filter";
+	int ret;
+
+	xt_daemon_output_reset(cl);
+	stdout = cl->out;
+	stderr = cl->err;
+
+	xtables_set_nfproto(h->family);
+	xt_params->program_name = h->family == NFPROTO_IPV6 ?
+				  "ip6tables" : "iptables";
+
+	ret = sigsetjmp(xt_daemon_jmp, 1);
+	if (ret) {
+		/* free what the command parsed before the next one runs */
+		do_commandx_abort();
+		ret--;
+	} else {
+		ret = do_commandx(h, cl->req.argc, cl->argv, &table, false);
+		if (ret && commit)
+			ret = nft_commit(h);
+
+		if (ret) {
+			ret = 0;
+		} else {
+			fprintf(stderr, "%s: %s.%s\n", xt_params->program_name,
+				nft_strerror(errno), errno == EINVAL ?
+				" Run `dmesg' for more information." : "");
+			ret = errno == EAGAIN ? RESOURCE_PROBLEM : 1;
+		}
+	}
+
+	/* nor may a failed command leave its objects to the next commit */
+	if (ret && commit && h->obj_list_num)
+		nft_abort(h);
+
+	fflush(stdout);
+	fflush(stderr);
+	stdout = out;
+	stderr = err;
+	return ret;
+}
+
+/*
+ * Run all requests for @h in one batch. A command that fails without
+ * queueing anything does not spoil it; otherwise, or if the commit
+ * fails, the batch is dropped and each request is run on its own.
+ */
+static void xt_daemon_round(struct nft_handle *h,
+			    struct xt_daemon_client **cl, int n)
+{
+	bool ok = true;
+	int i, queued;
+
+	if (n == 0)
+		return;
+
+	nft_cache_refresh(h);
+	for (i = 0; i < n && ok; i++) {
+		queued = h->obj_list_num;
+		cl[i]->status = xt_daemon_run(h, cl[i], false);
+		if (cl[i]->status && h->obj_list_num != queued)
+			ok = false;
+	}
+
+	if (ok && h->obj_list_num) {
+		if (sigsetjmp(xt_daemon_jmp, 1) == 0)
+			ok = nft_commit(h);
+		else
+			ok = false;
+	}
+	if (ok)
+		return;
+
+	if (sigsetjmp(xt_daemon_jmp, 1) == 0)
+		nft_abort(h);
+
+	for (i = 0; i < n; i++) {
+		nft_cache_refresh(h);
+		cl[i]->status = xt_daemon_run(h, cl[i], true);
+	}
+}
+
+static void xt_daemon_reply(struct xt_daemon_client *cl)
+{
+	struct xt_daemon_resp resp = {
+		.status	= cl->status,
+	};
+
+	if (cl->out)
+		fclose(cl->out);
+	if (cl->err)
+		fclose(cl->err);
+	cl->out = cl->err = NULL;
+
+	if (cl->status != XT_DAEMON_DECLINED) {
+		resp.out_len = cl->out_len;
+		resp.err_len = cl->err_len;
+	}
+
+	if (xt_daemon_write(cl->fd, &resp, sizeof(resp)) == 0 &&
+	    resp.out_len)
+		xt_daemon_write(cl->fd, cl->out_buf, resp.out_len);
+	if (resp.err_len)
+		xt_daemon_write(cl->fd, cl->err_buf, resp.err_len);
+
+	close(cl->fd);
+	free(cl->out_buf);
+	free(cl->err_buf);
+	free(cl->buf);
+	free(cl->argv);
+	memset(cl, 0, sizeof(*cl));
+}
+
+/*
+ * Read the request on @fd into @cl. Callers from another user or network
+ * namespace are declined, they run their command themselves.
+ */
+static int xt_daemon_accept(int fd, struct xt_daemon_client *cl,
+			    const struct xt_daemon_req *self)
+{
+	struct timeval tv = { .tv_sec = 1 };
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	uint32_t i, argc = 0;
+	char *p;
+
+	cl->fd = fd;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (xt_daemon_read(fd, &cl->req, sizeof(cl->req)) < 0 ||
+	    cl->req.magic != XT_DAEMON_MAGIC ||
+	    cl->req.argc == 0 || cl->req.argc > XT_DAEMON_MAX_ARGC ||
+	    cl->req.len == 0 || cl->req.len > XT_DAEMON_MAX_LEN)
+		return -1;
+
+	cl->buf = xtables_malloc(cl->req.len);
+	if (xt_daemon_read(fd, cl->buf, cl->req.len) < 0 ||
+	    cl->buf[cl->req.len - 1] != '\0')
+		return -1;
+
+	cl->argv = xtables_calloc(cl->req.argc + 1, sizeof(*cl->argv));
+	for (p = cl->buf, i = 0; i < cl->req.len; i++) {
+		if (cl->buf[i] != '\0')
+			continue;
+		if (argc == cl->req.argc)
+			return -1;
+		cl->argv[argc++] = p;
+		p = cl->buf + i + 1;
+	}
+	if (argc != cl->req.argc)
+		return -1;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0 ||
+	    cred.uid != geteuid() ||
+	    cl->req.netns_dev != self->netns_dev ||
+	    cl->req.netns_ino != self->netns_ino ||
+	    (cl->req.family != NFPROTO_IPV4 &&
+	     cl->req.family != NFPROTO_IPV6))
+		cl->status = XT_DAEMON_DECLINED;
+
+	return 0;
+}
+
+static void xt_daemon_signal(int sig)
+{
+	xt_daemon_stop = 1;
+}
+
+static int xt_daemon_listen(const char *path)
+{
+	struct sockaddr_un sun = {
+		.sun_family = AF_UNIX,
+	};
+	mode_t mask;
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "xtables-daemon: socket path too long\n");
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		goto err;
+
+	/* only replace a socket nobody listens on any more */
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0) {
+		fprintf(stderr, "xtables-daemon: already running on %s\n",
+			path);
+		close(fd);
+		return -1;
+	}
+	unlink(path);
+
+	mask = umask(0077);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		umask(mask);
+		goto err;
+	}
+	umask(mask);
+
+	if (listen(fd, SOMAXCONN) < 0)
+		goto err;
+
+	return fd;
+err:
+	fprintf(stderr, "xtables-daemon: %s: %s\n", path, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+static const struct option options[] = {
+	{.name = "socket", .has_arg = 1, .val = 's'},
+	{.name = "help",   .has_arg = 0, .val = 'h'},
+	{.name = "version", .has_arg = 0, .val = 'V'},
+	{NULL},
+};
+
+static void print_usage(void)
+{
+	printf("xtables-daemon %s: serve iptables and ip6tables commands\n"
+	       "Usage: xtables-daemon [ -s path ]\n"
+	       "	--socket	-s path		socket to listen on "
+	       "(default " XT_DAEMON_SOCKET ")\n",
+	       PACKAGE_VERSION);
+}
+
+int xtables_daemon_main(int argc, char *argv[])
+{
+	static struct xt_daemon_client clients[XT_DAEMON_BATCH];
+	struct xt_daemon_client *fam[2][XT_DAEMON_BATCH];
+	struct nft_handle h[2] = {
+		{ .family = NFPROTO_IPV4, },
+		{ .family = NFPROTO_IPV6, },
+	};
+	const char *path = xt_daemon_socket();
+	struct xt_daemon_req self = {};
+	struct sigaction sa = {
+		.sa_handler = xt_daemon_signal,
+	};
+	struct pollfd pfd;
+	int c, i, n, nfam[2];
+
+	xtables_globals.program_name = "xtables-daemon";
+	c = xtables_init_all(&xtables_globals, NFPROTO_IPV4);
+	if (c < 0) {
+		fprintf(stderr, "%s/%s Failed to initialize xtables\n",
+				xtables_globals.program_name,
+				xtables_globals.program_version);
+		exit(1);
+	}
+#if defined(ALL_INCLUSIVE) || defined(NO_SHARED_LIBS)
+	init_extensions();
+	init_extensions4();
+	init_extensions6();
+#endif
+
+	while ((c = getopt_long(argc, argv, "s:hV", options, NULL)) != -1) {
+		switch (c) {
+		case 's':
+			path = optarg;
+			break;
+		case 'h':
+			print_usage();
+			exit(0);
+		case 'V':
+			printf("xtables-daemon %s\n", PACKAGE_VERSION);
+			exit(0);
+		default:
+			fprintf(stderr, "Try `xtables-daemon -h' for more "
+				"information.\n");
+			exit(PARAMETER_PROBLEM);
+		}
+	}
+
+	if (xt_daemon_netns(&self.netns_dev, &self.netns_ino) < 0) {
+		perror("xtables-daemon: cannot find network namespace");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (nft_init(&h[i], xtables_ipv4) < 0) {
+			fprintf(stderr, "%s/%s Failed to initialize nft: %s\n",
+				xtables_globals.program_name,
+				xtables_globals.program_version,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pfd.fd = xt_daemon_listen(path);
+	if (pfd.fd < 0)
+		exit(EXIT_FAILURE);
+	pfd.events = POLLIN;
+
+	signal(SIGPIPE, SIG_IGN);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	xtables_exit_hook = xt_daemon_exit;
+
+	while (!xt_daemon_stop) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("xtables-daemon: poll");
+			break;
+		}
+
+		/* whatever queued up meanwhile makes up one round */
+		n = nfam[0] = nfam[1] = 0;
+		while (n < XT_DAEMON_BATCH) {
+			int fd = accept4(pfd.fd, NULL, NULL, SOCK_CLOEXEC);
+
+			if (fd < 0)
+				break;
+			if (xt_daemon_accept(fd, &clients[n], &self) < 0) {
+				clients[n].status = XT_DAEMON_DECLINED;
+				xt_daemon_reply(&clients[n]);
+				continue;
+			}
+			if (clients[n].status != XT_DAEMON_DECLINED) {
+				i = clients[n].req.family == NFPROTO_IPV6;
+				fam[i][nfam[i]++] = &clients[n];
+			}
+			n++;
+		}
+
+		for (i = 0; i < 2; i++)
+			xt_daemon_round(&h[i], fam[i], nfam[i]);
+
+		for (i = 0; i < n; i++)
+			xt_daemon_reply(&clients[i]);
+	}
+
+	close(pfd.fd);
+	unlink(path);
+	for (i = 0; i < 2; i++)
+		nft_fini(&h[i]);
+
+	return EXIT_SUCCESS;
+}
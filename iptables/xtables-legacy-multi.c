@@ -7,10 +7,12 @@
 #include "xtables-multi.h"
 
 #ifdef ENABLE_IPV4
+#include <libiptc/libiptc.h>
 #include "iptables-multi.h"
 #endif
 
 #ifdef ENABLE_IPV6
+#include <libiptc/libip6tc.h>
 #include "ip6tables-multi.h"
 #endif
 
@@ -29,11 +31,17 @@ static const struct subcommand multi_subcommands[] = {
 	{"iptables-legacy",     iptables_main},
 	{"iptables-legacy-save",iptables_save_main},
 	{"iptables-legacy-restore",iptables_restore_main},
+	{"iptables-counters",   iptables_counters_main},
+	{"iptables-legacy-counters",iptables_counters_main},
 
 
 #endif
 	{"iptables-xml",        iptables_xml_main},
 	{"xml",                 iptables_xml_main},
+	{"iptables-analyze",    iptables_analyze_main},
+	{"analyze",             iptables_analyze_main},
+	{"xtables-sim",         xtables_sim_main},
+	{"sim",                 xtables_sim_main},
 #ifdef ENABLE_IPV6
 	{"ip6tables",           ip6tables_main},
 	{"main6",               ip6tables_main},
@@ -44,11 +52,23 @@ static const struct subcommand multi_subcommands[] = {
 	{"ip6tables-legacy",    ip6tables_main},
 	{"ip6tables-legacy-save",ip6tables_save_main},
 	{"ip6tables-legacy-restore",ip6tables_restore_main},
+	{"ip6tables-counters",  ip6tables_counters_main},
+	{"ip6tables-legacy-counters",ip6tables_counters_main},
+#endif
+#if defined ENABLE_IPV4 && defined ENABLE_IPV6
+	{"ip46tables-restore",  ip46tables_dual_restore_main},
+	{"ip46tables-legacy-restore",ip46tables_dual_restore_main},
 #endif
 	{NULL},
 };
 
 int main(int argc, char **argv)
 {
+#ifdef ENABLE_IPV4
+	iptc_set_phase_hook(xs_profile_xtc);
+#endif
+#ifdef ENABLE_IPV6
+	ip6tc_set_phase_hook(xs_profile_xtc);
+#endif
 	return subcmd_main(argc, argv, multi_subcommands);
 }
@@ -11,9 +11,16 @@
 
 #define _GNU_SOURCE
 #include "config.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <unistd.h>
 #include <netinet/ether.h>
 #include <netinet/in.h>
 #include <netinet/ip6.h>
@@ -23,6 +30,8 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nf_tables.h>
 
@@ -41,6 +50,7 @@
 struct cb_arg {
 	uint32_t nfproto;
 	bool is_event;
+	FILE *out;	/* of the line and json formats */
 };
 
 static int table_cb(const struct nlmsghdr *nlh, void *data)
@@ -162,32 +172,38 @@ err:
 	return MNL_CB_OK;
 }
 
-static int newgen_cb(const struct nlmsghdr *nlh, void *data)
+static void newgen_parse(const struct nlmsghdr *nlh, uint32_t *genid,
+			 uint32_t *pid, const char **name)
 {
-	uint32_t genid = 0, pid = 0;
 	const struct nlattr *attr;
-	const char *name = NULL;
 
 	mnl_attr_for_each(attr, nlh, sizeof(struct nfgenmsg)) {
 		switch (mnl_attr_get_type(attr)) {
 		case NFTA_GEN_ID:
 			if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
 				break;
-		        genid = ntohl(mnl_attr_get_u32(attr));
+		        *genid = ntohl(mnl_attr_get_u32(attr));
 			break;
 		case NFTA_GEN_PROC_NAME:
 			if (mnl_attr_validate(attr, MNL_TYPE_NUL_STRING) < 0)
 				break;
-			name = mnl_attr_get_str(attr);
+			*name = mnl_attr_get_str(attr);
 			break;
 		case NFTA_GEN_PROC_PID:
 			if (mnl_attr_validate(attr, MNL_TYPE_U32) < 0)
 				break;
-			pid = ntohl(mnl_attr_get_u32(attr));
+			*pid = ntohl(mnl_attr_get_u32(attr));
 			break;
 		}
 	}
+}
 
+static int newgen_cb(const struct nlmsghdr *nlh, void *data)
+{
+	uint32_t genid = 0, pid = 0;
+	const char *name = NULL;
+
+	newgen_parse(nlh, &genid, &pid, &name);
 	if (name)
 		printf("NEWGEN: GENID=%u PID=%u NAME=%s\n", genid, pid, name);
 
@@ -530,12 +546,507 @@ err:
 	return MNL_CB_OK;
 }
 
+enum mon_format {
+	MON_FMT_TEXT,
+	MON_FMT_LINE,
+	MON_FMT_JSON,
+};
+
+static enum mon_format format = MON_FMT_TEXT;
+
+/**
+ * struct mon_stats - what the monitor received, printed and lost
+ * @datagrams:	datagrams read from the socket
+ * @messages:	netlink messages in them
+ * @printed:	events printed in the line and json formats
+ * @errors:	datagrams that did not parse
+ * @overruns:	reads that failed with ENOBUFS, events were lost before each
+ * @truncated:	datagrams larger than a read buffer, their events are lost
+ * @stalls:	reads put off because decoding fell behind
+ * @drops_base:	sk_drops of the socket when monitoring started
+ *
+ * The receiver and the decoder of --high-rate update them concurrently,
+ * so they are only accessed through mon_inc() and mon_get().
+ */
+struct mon_stats {
+	uint64_t	datagrams;
+	uint64_t	messages;
+	uint64_t	printed;
+	uint64_t	errors;
+	uint64_t	overruns;
+	uint64_t	truncated;
+	uint64_t	stalls;
+	uint32_t	drops_base;
+};
+
+static struct mon_stats mon_stats;
+
+#define mon_inc(field, n) \
+	__atomic_fetch_add(&mon_stats.field, (n), __ATOMIC_RELAXED)
+#define mon_get(field) \
+	__atomic_load_n(&mon_stats.field, __ATOMIC_RELAXED)
+
+/**
+ * struct mon_rec - event being printed in the line or json format
+ * @out:	stream the event goes to
+ * @json:	a JSON object rather than a line of key=value pairs
+ *
+ * Either way an event is one line, so the output can be split and
+ * filtered line by line.
+ */
+struct mon_rec {
+	FILE	*out;
+	bool	json;
+};
+
+static void mon_line_str(FILE *out, const char *s)
+{
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)s; *p; p++) {
+		if (*p <= ' ' || *p == '"' || *p == '\\' || *p == '=' ||
+		    *p == 0x7f)
+			break;
+	}
+	if (*s && !*p) {
+		fputs(s, out);
+		return;
+	}
+
+	fputc('"', out);
+	for (p = (const unsigned char *)s; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(out, "\\%c", *p);
+		else if (*p < ' ' || *p == 0x7f)
+			fprintf(out, "\\x%02x", *p);
+		else
+			fputc(*p, out);
+	}
+	fputc('"', out);
+}
+
+static void mon_json_str(FILE *out, const char *s)
+{
+	const unsigned char *p;
+
+	fputc('"', out);
+	for (p = (const unsigned char *)s; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(out, "\\%c", *p);
+		else if (*p < ' ')
+			fprintf(out, "\\u%04x", *p);
+		else
+			fputc(*p, out);
+	}
+	fputc('"', out);
+}
+
+static void rec_begin(struct mon_rec *r, FILE *out, const char *type)
+{
+	r->out = out;
+	r->json = format == MON_FMT_JSON;
+
+	if (r->json)
+		fprintf(out, "{\"type\":\"%s\"", type);
+	else
+		fputs(type, out);
+}
+
+static void rec_str(struct mon_rec *r, const char *key, const char *val)
+{
+	if (val == NULL)
+		return;
+
+	if (r->json) {
+		fprintf(r->out, ",\"%s\":", key);
+		mon_json_str(r->out, val);
+	} else {
+		fprintf(r->out, " %s=", key);
+		mon_line_str(r->out, val);
+	}
+}
+
+static void rec_u64(struct mon_rec *r, const char *key, uint64_t val)
+{
+	fprintf(r->out, r->json ? ",\"%s\":%" PRIu64 : " %s=%" PRIu64,
+		key, val);
+}
+
+static void rec_end(struct mon_rec *r)
+{
+	fputs(r->json ? "}\n" : "\n", r->out);
+}
+
+static void rec_family(struct mon_rec *r, uint32_t family)
+{
+	static const char *const names[] = {
+		[NFPROTO_INET]		= "inet",
+		[NFPROTO_IPV4]		= "ipv4",
+		[NFPROTO_ARP]		= "arp",
+		[NFPROTO_NETDEV]	= "netdev",
+		[NFPROTO_BRIDGE]	= "bridge",
+		[NFPROTO_IPV6]		= "ipv6",
+	};
+
+	if (family < ARRAY_SIZE(names) && names[family])
+		rec_str(r, "family", names[family]);
+	else
+		rec_u64(r, "family", family);
+}
+
+static const char *mon_verdict(uint32_t verdict)
+{
+	switch (verdict) {
+	case NF_ACCEPT:
+		return "accept";
+	case NF_DROP:
+		return "drop";
+	case NF_QUEUE:
+		return "queue";
+	case NF_STOLEN:
+		return "stolen";
+	case NFT_BREAK:
+		return "break";
+	case NFT_CONTINUE:
+		return "continue";
+	case NFT_RETURN:
+		return "return";
+	case NFT_GOTO:
+		return "goto";
+	case NFT_JUMP:
+		return "jump";
+	}
+	return NULL;
+}
+
+static void rec_verdict(struct mon_rec *r, const char *key, uint32_t verdict)
+{
+	const char *name = mon_verdict(verdict);
+	char buf[16];
+
+	if (name == NULL) {
+		snprintf(buf, sizeof(buf), "0x%x", verdict);
+		name = buf;
+	}
+	rec_str(r, key, name);
+}
+
+/*
+ * if_indextoname() is a socket and an ioctl per call; the names are
+ * looked up again every second as interfaces come and go.
+ */
+#define MON_IFCACHE	64
+
+struct mon_ifname {
+	unsigned int	index;
+	time_t		when;
+	char		name[IFNAMSIZ];
+};
+
+static const char *mon_ifname(unsigned int index)
+{
+	static struct mon_ifname cache[MON_IFCACHE];
+	struct mon_ifname *e = &cache[index % MON_IFCACHE];
+	time_t now = time(NULL);
+
+	if (e->index != index || e->when != now) {
+		if (if_indextoname(index, e->name) == NULL)
+			snprintf(e->name, sizeof(e->name), "%u", index);
+		e->index = index;
+		e->when = now;
+	}
+	return e->name;
+}
+
+/* The fields of a packet that tell flows apart, headers are not dumped */
+static void rec_packet(struct mon_rec *r, const struct nftnl_trace *nlt)
+{
+	uint32_t nfproto = nftnl_trace_get_u32(nlt, NFTNL_TRACE_FAMILY);
+	char addrbuf[INET6_ADDRSTRLEN], markbuf[16];
+	const struct ip6_hdr *ip6h;
+	const struct iphdr *iph;
+	uint8_t l4proto = 0;
+	uint16_t port[2];
+	uint32_t len, mark;
+	const void *hdr;
+
+	if (nftnl_trace_is_set(nlt, NFTNL_TRACE_IIF))
+		rec_str(r, "in",
+			mon_ifname(nftnl_trace_get_u32(nlt, NFTNL_TRACE_IIF)));
+	if (nftnl_trace_is_set(nlt, NFTNL_TRACE_OIF))
+		rec_str(r, "out",
+			mon_ifname(nftnl_trace_get_u32(nlt, NFTNL_TRACE_OIF)));
+	if (nftnl_trace_is_set(nlt, NFTNL_TRACE_NFPROTO))
+		nfproto = nftnl_trace_get_u32(nlt, NFTNL_TRACE_NFPROTO);
+
+	if (nftnl_trace_is_set(nlt, NFTNL_TRACE_NETWORK_HEADER)) {
+		hdr = nftnl_trace_get_data(nlt, NFTNL_TRACE_NETWORK_HEADER,
+					   &len);
+		switch (nfproto) {
+		case NFPROTO_IPV4:
+			if (len < sizeof(*iph))
+				break;
+			iph = hdr;
+			inet_ntop(AF_INET, &iph->saddr, addrbuf, sizeof(addrbuf));
+			rec_str(r, "src", addrbuf);
+			inet_ntop(AF_INET, &iph->daddr, addrbuf, sizeof(addrbuf));
+			rec_str(r, "dst", addrbuf);
+			rec_u64(r, "len", ntohs(iph->tot_len));
+			l4proto = iph->protocol;
+			break;
+		case NFPROTO_IPV6:
+			if (len < sizeof(*ip6h))
+				break;
+			ip6h = hdr;
+			inet_ntop(AF_INET6, &ip6h->ip6_src, addrbuf,
+				  sizeof(addrbuf));
+			rec_str(r, "src", addrbuf);
+			inet_ntop(AF_INET6, &ip6h->ip6_dst, addrbuf,
+				  sizeof(addrbuf));
+			rec_str(r, "dst", addrbuf);
+			rec_u64(r, "len", ntohs(ip6h->ip6_plen) + sizeof(*ip6h));
+			l4proto = ip6h->ip6_nxt;
+			break;
+		}
+		if (l4proto)
+			rec_u64(r, "proto", l4proto);
+	}
+
+	if (nftnl_trace_is_set(nlt, NFTNL_TRACE_TRANSPORT_HEADER)) {
+		hdr = nftnl_trace_get_data(nlt, NFTNL_TRACE_TRANSPORT_HEADER,
+					   &len);
+		switch (l4proto) {
+		case IPPROTO_TCP:
+		case IPPROTO_DCCP:
+		case IPPROTO_SCTP:
+		case IPPROTO_UDPLITE:
+		case IPPROTO_UDP:
+			if (len < sizeof(port))
+				break;
+			memcpy(port, hdr, sizeof(port));
+			rec_u64(r, "sport", ntohs(port[0]));
+			rec_u64(r, "dport", ntohs(port[1]));
+			break;
+		}
+	}
+
+	mark = nftnl_trace_get_u32(nlt, NFTNL_TRACE_MARK);
+	if (mark) {
+		snprintf(markbuf, sizeof(markbuf), "0x%x", mark);
+		rec_str(r, "mark", markbuf);
+	}
+}
+
+/*
+ * Unlike the text format, a traced rule is not fetched from the kernel to
+ * print it: its handle names it, and the dump per event is what limits the
+ * rate the text format keeps up with.
+ */
+static int mon_trace_cb(const struct nlmsghdr *nlh, struct cb_arg *arg)
+{
+	struct nftnl_trace *nlt;
+	uint32_t family, verdict;
+	struct mon_rec r;
+	char id[16];
+
+	nlt = nftnl_trace_alloc();
+	if (nlt == NULL)
+		return MNL_CB_OK;
+
+	if (nftnl_trace_nlmsg_parse(nlh, nlt) < 0)
+		goto err_free;
+
+	family = nftnl_trace_get_u32(nlt, NFTNL_TRACE_FAMILY);
+	if (arg->nfproto && arg->nfproto != family)
+		goto err_free;
+
+	rec_begin(&r, arg->out, "trace");
+	rec_family(&r, family);
+	snprintf(id, sizeof(id), "%08x", nftnl_trace_get_u32(nlt, NFTNL_TRACE_ID));
+	rec_str(&r, "id", id);
+	rec_str(&r, "table", nftnl_trace_get_str(nlt, NFTNL_TRACE_TABLE));
+	rec_str(&r, "chain", nftnl_trace_get_str(nlt, NFTNL_TRACE_CHAIN));
+
+	switch (nftnl_trace_get_u32(nlt, NFTNL_TRACE_TYPE)) {
+	case NFT_TRACETYPE_RULE:
+		rec_str(&r, "kind", "rule");
+		if (nftnl_trace_is_set(nlt, NFTNL_TRACE_RULE_HANDLE))
+			rec_u64(&r, "handle",
+				nftnl_trace_get_u64(nlt, NFTNL_TRACE_RULE_HANDLE));
+		verdict = nftnl_trace_get_u32(nlt, NFTNL_TRACE_VERDICT);
+		rec_verdict(&r, "verdict", verdict);
+		if (verdict == (uint32_t)NFT_JUMP || verdict == (uint32_t)NFT_GOTO)
+			rec_str(&r, "target", nftnl_trace_get_str(nlt,
+						NFTNL_TRACE_JUMP_TARGET));
+		break;
+	case NFT_TRACETYPE_POLICY:
+		rec_str(&r, "kind", "policy");
+		rec_verdict(&r, "verdict",
+			    nftnl_trace_get_u32(nlt, NFTNL_TRACE_POLICY));
+		break;
+	case NFT_TRACETYPE_RETURN:
+		rec_str(&r, "kind", "return");
+		rec_str(&r, "target",
+			nftnl_trace_get_str(nlt, NFTNL_TRACE_JUMP_TARGET));
+		break;
+	}
+
+	if (nftnl_trace_is_set(nlt, NFTNL_TRACE_NETWORK_HEADER) ||
+	    nftnl_trace_is_set(nlt, NFTNL_TRACE_IIF) ||
+	    nftnl_trace_is_set(nlt, NFTNL_TRACE_OIF))
+		rec_packet(&r, nlt);
+	rec_end(&r);
+	mon_inc(printed, 1);
+err_free:
+	nftnl_trace_free(nlt);
+	return MNL_CB_OK;
+}
+
+static int mon_table_cb(const struct nlmsghdr *nlh, struct cb_arg *arg)
+{
+	uint32_t type = nlh->nlmsg_type & 0xFF;
+	struct nftnl_table *t;
+	struct mon_rec r;
+	uint32_t family;
+
+	t = nftnl_table_alloc();
+	if (t == NULL)
+		return MNL_CB_OK;
+
+	if (nftnl_table_nlmsg_parse(nlh, t) < 0)
+		goto err_free;
+
+	family = nftnl_table_get_u32(t, NFTNL_TABLE_FAMILY);
+	if (arg->nfproto && arg->nfproto != family)
+		goto err_free;
+
+	rec_begin(&r, arg->out, "table");
+	rec_str(&r, "op", type == NFT_MSG_NEWTABLE ? "new" : "del");
+	rec_family(&r, family);
+	rec_str(&r, "table", nftnl_table_get_str(t, NFTNL_TABLE_NAME));
+	rec_end(&r);
+	mon_inc(printed, 1);
+err_free:
+	nftnl_table_free(t);
+	return MNL_CB_OK;
+}
+
+static int mon_chain_cb(const struct nlmsghdr *nlh, struct cb_arg *arg)
+{
+	uint32_t type = nlh->nlmsg_type & 0xFF;
+	struct nftnl_chain *c;
+	struct mon_rec r;
+	uint32_t family;
+
+	c = nftnl_chain_alloc();
+	if (c == NULL)
+		return MNL_CB_OK;
+
+	if (nftnl_chain_nlmsg_parse(nlh, c) < 0)
+		goto err_free;
+
+	family = nftnl_chain_get_u32(c, NFTNL_CHAIN_FAMILY);
+	if (arg->nfproto && arg->nfproto != family)
+		goto err_free;
+
+	rec_begin(&r, arg->out, "chain");
+	rec_str(&r, "op", type == NFT_MSG_NEWCHAIN ? "new" : "del");
+	rec_family(&r, family);
+	rec_str(&r, "table", nftnl_chain_get_str(c, NFTNL_CHAIN_TABLE));
+	rec_str(&r, "chain", nftnl_chain_get_str(c, NFTNL_CHAIN_NAME));
+	if (nftnl_chain_is_set(c, NFTNL_CHAIN_POLICY))
+		rec_verdict(&r, "policy",
+			    nftnl_chain_get_u32(c, NFTNL_CHAIN_POLICY));
+	rec_end(&r);
+	mon_inc(printed, 1);
+err_free:
+	nftnl_chain_free(c);
+	return MNL_CB_OK;
+}
+
+/* A rule is named by its handle and comment, its matches are not decoded */
+static int mon_rule_cb(const struct nlmsghdr *nlh, struct cb_arg *arg)
+{
+	uint32_t type = nlh->nlmsg_type & 0xFF;
+	struct nftnl_rule *nr;
+	const void *udata;
+	struct mon_rec r;
+	uint32_t family;
+	uint32_t len;
+
+	nr = nftnl_rule_alloc();
+	if (nr == NULL)
+		return MNL_CB_OK;
+
+	if (nftnl_rule_nlmsg_parse(nlh, nr) < 0)
+		goto err_free;
+
+	family = nftnl_rule_get_u32(nr, NFTNL_RULE_FAMILY);
+	if (arg->nfproto && arg->nfproto != family)
+		goto err_free;
+
+	rec_begin(&r, arg->out, "rule");
+	rec_str(&r, "op", type == NFT_MSG_NEWRULE ? "new" : "del");
+	rec_family(&r, family);
+	rec_str(&r, "table", nftnl_rule_get_str(nr, NFTNL_RULE_TABLE));
+	rec_str(&r, "chain", nftnl_rule_get_str(nr, NFTNL_RULE_CHAIN));
+	rec_u64(&r, "handle", nftnl_rule_get_u64(nr, NFTNL_RULE_HANDLE));
+	if (nftnl_rule_is_set(nr, NFTNL_RULE_USERDATA)) {
+		udata = nftnl_rule_get_data(nr, NFTNL_RULE_USERDATA, &len);
+		rec_str(&r, "comment", get_comment(udata, len));
+	}
+	rec_end(&r);
+	mon_inc(printed, 1);
+err_free:
+	nftnl_rule_free(nr);
+	return MNL_CB_OK;
+}
+
+static int mon_newgen_cb(const struct nlmsghdr *nlh, struct cb_arg *arg)
+{
+	uint32_t genid = 0, pid = 0;
+	const char *name = NULL;
+	struct mon_rec r;
+
+	newgen_parse(nlh, &genid, &pid, &name);
+	if (name == NULL)
+		return MNL_CB_OK;
+
+	rec_begin(&r, arg->out, "gen");
+	rec_u64(&r, "id", genid);
+	rec_u64(&r, "pid", pid);
+	rec_str(&r, "name", name);
+	rec_end(&r);
+	mon_inc(printed, 1);
+	return MNL_CB_OK;
+}
+
 static int monitor_cb(const struct nlmsghdr *nlh, void *data)
 {
 	uint32_t type = nlh->nlmsg_type & 0xFF;
 	struct cb_arg *arg = data;
 	int ret = MNL_CB_OK;
 
+	mon_inc(messages, 1);
+	if (format != MON_FMT_TEXT) {
+		switch (type) {
+		case NFT_MSG_NEWTABLE:
+		case NFT_MSG_DELTABLE:
+			return mon_table_cb(nlh, arg);
+		case NFT_MSG_NEWCHAIN:
+		case NFT_MSG_DELCHAIN:
+			return mon_chain_cb(nlh, arg);
+		case NFT_MSG_NEWRULE:
+		case NFT_MSG_DELRULE:
+			return mon_rule_cb(nlh, arg);
+		case NFT_MSG_NEWGEN:
+			return mon_newgen_cb(nlh, arg);
+		case NFT_MSG_TRACE:
+			return mon_trace_cb(nlh, arg);
+		}
+		return MNL_CB_OK;
+	}
+
 	switch(type) {
 	case NFT_MSG_NEWTABLE:
 	case NFT_MSG_DELTABLE:
@@ -561,12 +1072,500 @@ static int monitor_cb(const struct nlmsghdr *nlh, void *data)
 	return ret;
 }
 
+static volatile sig_atomic_t mon_stop;
+static unsigned int stats_interval;
+static time_t stats_next;
+
+static void mon_sighandler(int sig)
+{
+	mon_stop = 1;
+}
+
+/* Events the kernel dropped at the socket, NETLINK_NO_ENOBUFS hides them */
+static uint32_t mon_sk_drops(int fd)
+{
+#ifdef SO_MEMINFO
+	uint32_t mem[SK_MEMINFO_VARS];
+	socklen_t len = sizeof(mem);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, mem, &len) == 0 &&
+	    len > SK_MEMINFO_DROPS * sizeof(mem[0]))
+		return mem[SK_MEMINFO_DROPS];
+#endif
+	return 0;
+}
+
+static bool mon_stats_due(void)
+{
+	struct timespec ts;
+
+	if (stats_interval == 0)
+		return false;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (ts.tv_sec < stats_next)
+		return false;
+	stats_next = ts.tv_sec + stats_interval;
+	return true;
+}
+
+static bool mon_lost(int fd)
+{
+	return mon_sk_drops(fd) != mon_stats.drops_base ||
+	       mon_get(overruns) || mon_get(truncated);
+}
+
+/* Statistics go along with the events in the line and json formats */
+static void mon_print_stats(FILE *out, int fd)
+{
+	uint32_t drops = mon_sk_drops(fd) - mon_stats.drops_base;
+	struct mon_rec r;
+
+	if (format == MON_FMT_TEXT) {
+		fprintf(stderr, "xtables-monitor: %" PRIu64 " messages in %"
+			PRIu64 " datagrams, %u dropped by the kernel, %" PRIu64
+			" overruns, %" PRIu64 " truncated\n",
+			mon_get(messages), mon_get(datagrams), drops,
+			mon_get(overruns), mon_get(truncated));
+		return;
+	}
+
+	rec_begin(&r, out, "stats");
+	rec_u64(&r, "datagrams", mon_get(datagrams));
+	rec_u64(&r, "messages", mon_get(messages));
+	rec_u64(&r, "events", mon_get(printed));
+	rec_u64(&r, "errors", mon_get(errors));
+	rec_u64(&r, "kernel_drops", drops);
+	rec_u64(&r, "overruns", mon_get(overruns));
+	rec_u64(&r, "truncated", mon_get(truncated));
+	rec_u64(&r, "stalls", mon_get(stalls));
+	rec_end(&r);
+}
+
+static void mon_setup(struct mnl_socket *nl, int rcvbuf, bool no_enobufs)
+{
+	int fd = mnl_socket_get_fd(nl), one = 1;
+	struct sigaction sa = {
+		.sa_handler = mon_sighandler,
+	};
+	struct timespec ts;
+
+	/* SO_RCVBUFFORCE may go past net.core.rmem_max */
+	if (rcvbuf &&
+	    setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0 &&
+	    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+		perror("cannot set receive buffer size");
+
+	if (no_enobufs &&
+	    mnl_socket_setsockopt(nl, NETLINK_NO_ENOBUFS, &one, sizeof(one)) < 0)
+		perror("cannot set NETLINK_NO_ENOBUFS");
+
+	mon_stats.drops_base = mon_sk_drops(fd);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	stats_next = ts.tv_sec + stats_interval;
+
+	/* no SA_RESTART, a blocked read returns to see mon_stop */
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
+static int mon_run(struct mnl_socket *nl, struct cb_arg *arg)
+{
+	struct pollfd pfd = {
+		.fd	= mnl_socket_get_fd(nl),
+		.events	= POLLIN,
+	};
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	int ret;
+
+	arg->out = stdout;
+	while (!mon_stop) {
+		if (stats_interval) {
+			if (mon_stats_due()) {
+				mon_print_stats(stdout, pfd.fd);
+				fflush(stdout);
+			}
+			if (poll(&pfd, 1, 1000) <= 0)
+				continue;
+		}
+
+		ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				mon_inc(overruns, 1);
+				continue;
+			}
+			perror("cannot receive from nfnetlink socket");
+			return -1;
+		}
+		mon_inc(datagrams, 1);
+
+		ret = mnl_cb_run(buf, ret, 0, 0, monitor_cb, arg);
+		if (ret == -1) {
+			perror("cannot receive from nfnetlink socket");
+			return -1;
+		}
+		if (format != MON_FMT_TEXT)
+			fflush(stdout);
+		if (ret == 0)
+			break;
+	}
+	return 0;
+}
+
+/*
+ * --high-rate: the main thread only reads datagrams into a ring of slots, a
+ * decoder thread turns them into text in memory and a writer thread writes
+ * that out.  Slow output backs up the queued text first, then the ring and
+ * only then the socket, where the kernel counts what it drops.
+ */
+#define MON_SLOT_SIZE	8192		/* NLMSG_GOODSIZE is at most this */
+#define MON_SLOTS	1024
+#define MON_BATCH	64		/* datagrams per recvmmsg() */
+#define MON_QUEUE_MAX	(16 << 20)	/* bytes of text waiting for output */
+#define MON_RCVBUF	(32 << 20)	/* default receive buffer */
+
+struct mon_chunk {
+	struct mon_chunk	*next;
+	char			*buf;
+	size_t			len;
+};
+
+/**
+ * struct mon_pipe - state shared by the threads of --high-rate
+ * @lock:	protects the rest
+ * @filled:	signalled when slots are filled or reading is done
+ * @freed:	signalled when slots are freed
+ * @queued_cond: signalled when text is queued or decoding is done
+ * @written:	signalled when text is written
+ * @fd:		the socket
+ * @slot:	datagrams
+ * @slot_len:	length of each datagram, 0 for a truncated one
+ * @head:	slots filled so far
+ * @tail:	slots decoded so far
+ * @read_done:	the receiver stopped, the decoder stops when the ring is empty
+ * @decode_done: the decoder stopped, the writer stops when the queue is empty
+ * @first:	oldest text queued
+ * @last:	where the next text goes
+ * @queued:	bytes of text queued
+ */
+struct mon_pipe {
+	pthread_mutex_t		lock;
+	pthread_cond_t		filled;
+	pthread_cond_t		freed;
+	pthread_cond_t		queued_cond;
+	pthread_cond_t		written;
+	int			fd;
+	char			(*slot)[MON_SLOT_SIZE];
+	unsigned int		slot_len[MON_SLOTS];
+	unsigned int		head;
+	unsigned int		tail;
+	bool			read_done;
+	bool			decode_done;
+	struct mon_chunk	*first;
+	struct mon_chunk	**last;
+	size_t			queued;
+};
+
+static struct mon_pipe mon = {
+	.lock		= PTHREAD_MUTEX_INITIALIZER,
+	.filled		= PTHREAD_COND_INITIALIZER,
+	.freed		= PTHREAD_COND_INITIALIZER,
+	.queued_cond	= PTHREAD_COND_INITIALIZER,
+	.written	= PTHREAD_COND_INITIALIZER,
+	.last		= &mon.first,
+};
+
+static void mon_timedwait(pthread_cond_t *cond, int ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(cond, &mon.lock, &ts);
+}
+
+static void *mon_decode(void *data)
+{
+	struct cb_arg *arg = data;
+	struct mon_chunk *chunk;
+	unsigned int i, n, slot;
+	bool stats;
+
+	pthread_mutex_lock(&mon.lock);
+	for (;;) {
+		stats = mon_stats_due();
+		n = mon.head - mon.tail;
+		if (n == 0 && !stats) {
+			if (mon.read_done)
+				break;
+			mon_timedwait(&mon.filled, 1000);
+			continue;
+		}
+		if (n > MON_BATCH)
+			n = MON_BATCH;
+		slot = mon.tail;
+		pthread_mutex_unlock(&mon.lock);
+
+		chunk = xtables_calloc(1, sizeof(*chunk));
+		arg->out = open_memstream(&chunk->buf, &chunk->len);
+		if (arg->out == NULL) {
+			perror("OOM");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < n; i++, slot++) {
+			slot %= MON_SLOTS;
+			if (mon.slot_len[slot] &&
+			    mnl_cb_run(mon.slot[slot], mon.slot_len[slot],
+				       0, 0, monitor_cb, arg) == -1)
+				mon_inc(errors, 1);
+		}
+		if (stats)
+			mon_print_stats(arg->out, mon.fd);
+		fclose(arg->out);
+
+		pthread_mutex_lock(&mon.lock);
+		mon.tail += n;
+		pthread_cond_signal(&mon.freed);
+
+		if (chunk->len == 0) {
+			free(chunk->buf);
+			free(chunk);
+			continue;
+		}
+		*mon.last = chunk;
+		mon.last = &chunk->next;
+		mon.queued += chunk->len;
+		pthread_cond_signal(&mon.queued_cond);
+		while (mon.queued > MON_QUEUE_MAX)
+			pthread_cond_wait(&mon.written, &mon.lock);
+	}
+	mon.decode_done = true;
+	pthread_cond_signal(&mon.queued_cond);
+	pthread_mutex_unlock(&mon.lock);
+	return NULL;
+}
+
+static int mon_write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* After a failed write the rest is dropped, so that nothing waits on it */
+static void *mon_write(void *data)
+{
+	struct mon_chunk *chunk, *next;
+	bool failed = false;
+	size_t len;
+
+	pthread_mutex_lock(&mon.lock);
+	for (;;) {
+		while (mon.first == NULL && !mon.decode_done)
+			pthread_cond_wait(&mon.queued_cond, &mon.lock);
+		chunk = mon.first;
+		if (chunk == NULL)
+			break;
+		mon.first = NULL;
+		mon.last = &mon.first;
+		pthread_mutex_unlock(&mon.lock);
+
+		for (len = 0; chunk; chunk = next) {
+			next = chunk->next;
+			if (!failed &&
+			    mon_write_all(STDOUT_FILENO, chunk->buf, chunk->len) < 0) {
+				perror("cannot write events");
+				failed = true;
+				mon_stop = 1;
+			}
+			len += chunk->len;
+			free(chunk->buf);
+			free(chunk);
+		}
+
+		pthread_mutex_lock(&mon.lock);
+		mon.queued -= len;
+		pthread_cond_signal(&mon.written);
+	}
+	pthread_mutex_unlock(&mon.lock);
+	return NULL;
+}
+
+/*
+ * The socket is polled only once it was read dry, as long as events keep
+ * coming each read is a single recvmmsg() of up to MON_BATCH datagrams.
+ */
+static int mon_receive(void)
+{
+	struct pollfd pfd = {
+		.fd	= mon.fd,
+		.events	= POLLIN,
+	};
+	struct mmsghdr msg[MON_BATCH];
+	struct iovec iov[MON_BATCH];
+	unsigned int i, n, start;
+	bool busy = false;
+	int ret, err = 0;
+
+	memset(msg, 0, sizeof(msg));
+	while (!mon_stop) {
+		pthread_mutex_lock(&mon.lock);
+		if (mon.head - mon.tail == MON_SLOTS) {
+			mon_inc(stalls, 1);
+			while (mon.head - mon.tail == MON_SLOTS && !mon_stop)
+				mon_timedwait(&mon.freed, 500);
+		}
+		start = mon.head % MON_SLOTS;
+		n = MON_SLOTS - (mon.head - mon.tail);
+		pthread_mutex_unlock(&mon.lock);
+
+		if (n > MON_SLOTS - start)
+			n = MON_SLOTS - start;
+		if (n > MON_BATCH)
+			n = MON_BATCH;
+		if (n == 0 || (!busy && poll(&pfd, 1, 500) <= 0))
+			continue;
+
+		for (i = 0; i < n; i++) {
+			iov[i].iov_base = mon.slot[start + i];
+			iov[i].iov_len = MON_SLOT_SIZE;
+			msg[i].msg_hdr.msg_iov = &iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+		}
+		ret = recvmmsg(mon.fd, msg, n, MSG_DONTWAIT, NULL);
+		busy = ret == (int)n;
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			if (errno == ENOBUFS) {
+				mon_inc(overruns, 1);
+				continue;
+			}
+			perror("cannot receive from nfnetlink socket");
+			err = -1;
+			break;
+		}
+
+		for (i = 0; i < (unsigned int)ret; i++) {
+			mon.slot_len[start + i] = msg[i].msg_len;
+			if (msg[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				mon.slot_len[start + i] = 0;
+				mon_inc(truncated, 1);
+			}
+		}
+		mon_inc(datagrams, ret);
+
+		pthread_mutex_lock(&mon.lock);
+		mon.head += ret;
+		pthread_cond_signal(&mon.filled);
+		pthread_mutex_unlock(&mon.lock);
+	}
+
+	pthread_mutex_lock(&mon.lock);
+	mon.read_done = true;
+	pthread_cond_signal(&mon.filled);
+	pthread_mutex_unlock(&mon.lock);
+	return err;
+}
+
+static int mon_run_high_rate(struct mnl_socket *nl, struct cb_arg *arg)
+{
+	pthread_t decoder, writer;
+	sigset_t set, old;
+	int ret;
+
+	mon.fd = mnl_socket_get_fd(nl);
+	mon.slot = xtables_malloc(MON_SLOTS * sizeof(*mon.slot));
+
+	/* signals go to the receiver, the other threads follow it */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	ret = pthread_create(&decoder, NULL, mon_decode, arg);
+	if (ret == 0) {
+		ret = pthread_create(&writer, NULL, mon_write, NULL);
+		if (ret)
+			pthread_cancel(decoder);
+	}
+	if (ret) {
+		fprintf(stderr, "cannot start threads: %s\n", strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	ret = mon_receive();
+	pthread_join(decoder, NULL);
+	pthread_join(writer, NULL);
+	free(mon.slot);
+	return ret;
+}
+
+/* A buffer size in bytes, with an optional K, M or G suffix */
+static int parse_size(const char *s)
+{
+	unsigned long long val;
+	unsigned int shift = 0;
+	char *end;
+
+	errno = 0;
+	val = strtoull(s, &end, 0);
+	switch (*end) {
+	case 'k':
+	case 'K':
+		shift = 10;
+		break;
+	case 'm':
+	case 'M':
+		shift = 20;
+		break;
+	case 'g':
+	case 'G':
+		shift = 30;
+		break;
+	}
+	if (shift)
+		end++;
+
+	if (errno || end == s || *end || val == 0 ||
+	    val > (unsigned long long)INT_MAX >> shift) {
+		fprintf(stderr, "xtables-monitor %s: Bad buffer size `%s'.\n",
+			PACKAGE_VERSION, s);
+		exit(PARAMETER_PROBLEM);
+	}
+	return val << shift;
+}
+
 static const struct option options[] = {
 	{.name = "counters", .has_arg = false, .val = 'c'},
 	{.name = "trace", .has_arg = false, .val = 't'},
 	{.name = "event", .has_arg = false, .val = 'e'},
 	{.name = "ipv4", .has_arg = false, .val = '4'},
 	{.name = "ipv6", .has_arg = false, .val = '6'},
+	{.name = "format", .has_arg = true, .val = 'f'},
+	{.name = "high-rate", .has_arg = false, .val = 'H'},
+	{.name = "rcvbuf", .has_arg = true, .val = 'b'},
+	{.name = "no-enobufs", .has_arg = false, .val = 'N'},
+	{.name = "stats", .has_arg = true, .val = 's'},
 	{.name = "version", .has_arg = false, .val = 'V'},
 	{.name = "help", .has_arg = false, .val = 'h'},
 	{NULL},
@@ -583,6 +1582,11 @@ static void print_usage(void)
 	       "        --ipv4     -4    only monitor IPv4\n"
 	       "        --ipv6     -6    only monitor IPv6\n"
 	       "	--counters -c    show counters in rules\n"
+	       "	--format   -f    text, line or json\n"
+	       "	--high-rate -H   read, decode and write in threads of their own\n"
+	       "	--rcvbuf   -b    socket receive buffer size\n"
+	       "	--no-enobufs     do not fail reads after the kernel dropped events\n"
+	       "	--stats    -s    report received and dropped events every N seconds\n"
 
 	       , xtables_globals.program_name);
 	exit(EXIT_FAILURE);
@@ -591,9 +1595,10 @@ static void print_usage(void)
 int xtables_monitor_main(int argc, char *argv[])
 {
 	struct mnl_socket *nl;
-	char buf[MNL_SOCKET_BUFFER_SIZE];
 	uint32_t nfgroup = 0;
 	struct cb_arg cb_arg = {};
+	bool high_rate = false, no_enobufs = false, fmt_set = false;
+	int rcvbuf = 0;
 	int ret, c;
 
 	xtables_globals.program_name = "xtables-monitor";
@@ -611,7 +1616,7 @@ int xtables_monitor_main(int argc, char *argv[])
 #endif
 
 	opterr = 0;
-	while ((c = getopt_long(argc, argv, "ceht46V", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "ceht46f:Hb:s:V", options, NULL)) != -1) {
 		switch (c) {
 	        case 'c':
 			counters = true;
@@ -631,16 +1636,55 @@ int xtables_monitor_main(int argc, char *argv[])
 		case '6':
 			cb_arg.nfproto = NFPROTO_IPV6;
 			break;
+		case 'f':
+			if (!strcmp(optarg, "text"))
+				format = MON_FMT_TEXT;
+			else if (!strcmp(optarg, "line"))
+				format = MON_FMT_LINE;
+			else if (!strcmp(optarg, "json"))
+				format = MON_FMT_JSON;
+			else
+				goto bad_arg;
+			fmt_set = true;
+			break;
+		case 'H':
+			high_rate = true;
+			break;
+		case 'b':
+			rcvbuf = parse_size(optarg);
+			break;
+		case 'N':
+			no_enobufs = true;
+			break;
+		case 's':
+			if (!xtables_strtoui(optarg, NULL, &stats_interval,
+					     1, 86400))
+				goto bad_arg;
+			break;
 		case 'V':
 			printf("xtables-monitor %s\n", PACKAGE_VERSION);
 			exit(0);
 		default:
+bad_arg:
 			fprintf(stderr, "xtables-monitor %s: Bad argument.\n", PACKAGE_VERSION);
 			fprintf(stderr, "Try `xtables-monitor -h' for more information.\n");
 			exit(PARAMETER_PROBLEM);
 		}
 	}
 
+	/* the text format dumps each traced rule, which is what is slow */
+	if (high_rate) {
+		if (!fmt_set)
+			format = MON_FMT_LINE;
+		else if (format == MON_FMT_TEXT) {
+			fprintf(stderr, "xtables-monitor %s: --high-rate needs the line or json format.\n",
+				PACKAGE_VERSION);
+			exit(PARAMETER_PROBLEM);
+		}
+		if (rcvbuf == 0)
+			rcvbuf = MON_RCVBUF;
+	}
+
 	if (trace)
 		nfgroup |= 1 << (NFNLGRP_NFTRACE - 1);
 	if (events)
@@ -662,19 +1706,17 @@ int xtables_monitor_main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
-	while (ret > 0) {
-		ret = mnl_cb_run(buf, ret, 0, 0, monitor_cb, &cb_arg);
-		if (ret <= 0)
-			break;
-		ret = mnl_socket_recvfrom(nl, buf, sizeof(buf));
-	}
-	if (ret == -1) {
-		perror("cannot receive from nfnetlink socket");
-		exit(EXIT_FAILURE);
+	mon_setup(nl, rcvbuf, no_enobufs);
+	if (high_rate)
+		ret = mon_run_high_rate(nl, &cb_arg);
+	else
+		ret = mon_run(nl, &cb_arg);
+
+	if (stats_interval || mon_lost(mnl_socket_get_fd(nl))) {
+		mon_print_stats(stdout, mnl_socket_get_fd(nl));
+		fflush(stdout);
 	}
 	mnl_socket_close(nl);
 
-	return EXIT_SUCCESS;
+	return ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
-
@@ -2,6 +2,8 @@
 #define _XTABLES_MULTI_H 1
 
 extern int iptables_xml_main(int, char **);
+extern int iptables_analyze_main(int, char **);
+extern int xtables_sim_main(int, char **);
 #ifdef ENABLE_NFTABLES
 extern int xtables_ip4_main(int, char **);
 extern int xtables_ip4_save_main(int, char **);
@@ -9,6 +11,9 @@ extern int xtables_ip4_restore_main(int, char **);
 extern int xtables_ip6_main(int, char **);
 extern int xtables_ip6_save_main(int, char **);
 extern int xtables_ip6_restore_main(int, char **);
+extern int xtables_ip4_counters_main(int, char **);
+extern int xtables_ip6_counters_main(int, char **);
+extern int xtables_ip46_restore_main(int, char **);
 extern int xtables_ip4_xlate_main(int, char **);
 extern int xtables_ip6_xlate_main(int, char **);
 extern int xtables_eb_xlate_main(int, char **);
@@ -22,6 +27,8 @@ extern int xtables_eb_restore_main(int, char **);
 extern int xtables_eb_save_main(int, char **);
 extern int xtables_config_main(int, char **);
 extern int xtables_monitor_main(int, char **);
+extern int xtables_daemon_main(int, char **);
+extern int xtables_daemon_forward(int, int, char **);
 #endif
 
 #endif /* _XTABLES_MULTI_H */
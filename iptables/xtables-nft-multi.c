@@ -8,6 +8,10 @@
 static const struct subcommand multi_subcommands[] = {
 	{"iptables-xml",		iptables_xml_main},
 	{"xml",				iptables_xml_main},
+	{"iptables-analyze",		iptables_analyze_main},
+	{"analyze",			iptables_analyze_main},
+	{"xtables-sim",			xtables_sim_main},
+	{"sim",				xtables_sim_main},
 	{"iptables",			xtables_ip4_main},
 	{"iptables-nft",		xtables_ip4_main},
 	{"main4",			xtables_ip4_main},
@@ -17,6 +21,8 @@ static const struct subcommand multi_subcommands[] = {
 	{"iptables-restore",		xtables_ip4_restore_main},
 	{"iptables-nft-save",	xtables_ip4_save_main},
 	{"iptables-nft-restore",	xtables_ip4_restore_main},
+	{"iptables-counters",		xtables_ip4_counters_main},
+	{"iptables-nft-counters",	xtables_ip4_counters_main},
 	{"ip6tables",			xtables_ip6_main},
 	{"ip6tables-nft",		xtables_ip6_main},
 	{"main6",			xtables_ip6_main},
@@ -26,6 +32,10 @@ static const struct subcommand multi_subcommands[] = {
 	{"ip6tables-restore",		xtables_ip6_restore_main},
 	{"ip6tables-nft-save",	xtables_ip6_save_main},
 	{"ip6tables-nft-restore",	xtables_ip6_restore_main},
+	{"ip6tables-counters",		xtables_ip6_counters_main},
+	{"ip6tables-nft-counters",	xtables_ip6_counters_main},
+	{"ip46tables-restore",		xtables_ip46_restore_main},
+	{"ip46tables-nft-restore",	xtables_ip46_restore_main},
 	{"iptables-translate",		xtables_ip4_xlate_main},
 	{"ip6tables-translate",		xtables_ip6_xlate_main},
 	{"iptables-restore-translate",	xtables_ip4_xlate_restore_main},
@@ -44,6 +54,7 @@ static const struct subcommand multi_subcommands[] = {
 	{"ebtables-nft-restore",	xtables_eb_restore_main},
 	{"ebtables-nft-save",		xtables_eb_save_main},
 	{"xtables-monitor",		xtables_monitor_main},
+	{"xtables-daemon",		xtables_daemon_main},
 	{NULL},
 };
 
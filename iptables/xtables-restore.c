@@ -21,10 +21,16 @@
 #include <libnftnl/chain.h>
 
 static int counters, verbose;
+static int check_batch, append_missing;
+static bool dual_stack;
 
 /* Keeping track of external matches and targets.  */
 static const struct option options[] = {
+	{.name = "append-missing", .has_arg = false, .val = 'A'},
+	{.name = "binary",   .has_arg = false, .val = 'b'},
 	{.name = "counters", .has_arg = false, .val = 'c'},
+	{.name = "check-batch", .has_arg = false, .val = 'C'},
+	{.name = "diff",     .has_arg = false, .val = 'd'},
 	{.name = "verbose",  .has_arg = false, .val = 'v'},
 	{.name = "version",       .has_arg = 0, .val = 'V'},
 	{.name = "test",     .has_arg = false, .val = 't'},
@@ -36,6 +42,9 @@ static const struct option options[] = {
 	{.name = "ipv6",     .has_arg = false, .val = '6'},
 	{.name = "wait",          .has_arg = 2, .val = 'w'},
 	{.name = "wait-interval", .has_arg = 2, .val = 'W'},
+	{.name = "parse-cache", .has_arg = 0, .val = 'P'},
+	{.name = "partition", .has_arg = true, .val = 'p'},
+	{.name = "profile",  .has_arg = 2,     .val = 'Q'},
 	{NULL},
 };
 
@@ -44,8 +53,13 @@ static const struct option options[] = {
 
 static void print_usage(const char *name, const char *version)
 {
-	fprintf(stderr, "Usage: %s [-c] [-v] [-V] [-t] [-h] [-n] [-T table] [-M command] [-4] [-6]\n"
+	fprintf(stderr, "Usage: %s [-A] [-b] [-c] [-C] [-d] [-v] [-V] [-t] [-h] [-n] [-T table] [-M command] [-4] [-6] [-P]\n"
+			"	   [-p N[,src|dst|dport...]]\n"
+			"	   [ --append-missing ]\n"
+			"	   [ --binary ]\n"
 			"	   [ --counters ]\n"
+			"	   [ --check-batch ]\n"
+			"	   [ --diff ]\n"
 			"	   [ --verbose ]\n"
 			"	   [ --version]\n"
 			"	   [ --test ]\n"
@@ -54,7 +68,10 @@ static void print_usage(const char *name, const char *version)
 			"	   [ --table=<TABLE> ]\n"
 			"	   [ --modprobe=<command> ]\n"
 			"	   [ --ipv4 ]\n"
-			"	   [ --ipv6 ]\n", name);
+			"	   [ --ipv6 ]\n"
+			"	   [ --parse-cache ]\n"
+			"	   [ --partition=N[,src|dst|dport...] ]\n"
+			"	   [ --profile[=<file>] ]\n", name);
 }
 
 static struct nftnl_chain_list *get_chain_list(struct nft_handle *h,
@@ -84,20 +101,47 @@ static const struct xtc_ops xtc_ops = {
 	.strerror	= nft_strerror,
 };
 
+/*
+ * Answer a rule line of --check-batch input with "present" or "absent",
+ * and append the rule if it is absent and --append-missing was given.
+ */
+static int check_batch_rule(struct nft_handle *h,
+			    struct nft_xt_restore_cb *cb,
+			    struct xs_argv *args, struct xs_argv *check)
+{
+	int ret;
+
+	xs_argv_check_batch(args, check, line);
+	ret = cb->do_command(h, check->argc, check->argv, &check->argv[2],
+			     true);
+	if (ret < 0 || (!ret && errno != ENOENT))
+		return ret;
+
+	printf("%u %s\n", line, ret ? "present" : "absent");
+	if (ret || !append_missing)
+		return 1;
+
+	return cb->do_command(h, args->argc, args->argv, &args->argv[2],
+			      true);
+}
+
 void xtables_restore_parse(struct nft_handle *h,
 			   struct nft_xt_restore_parse *p,
 			   struct nft_xt_restore_cb *cb,
 			   int argc, char *argv[])
 {
 	const struct builtin_table *curtable = NULL;
-	char buffer[10240];
+	struct xs_reader rd;
+	struct xs_argv args = {}, check = {};
+	char *buffer;
 	int in_table = 0;
 	const struct xtc_ops *ops = &xtc_ops;
 
 	line = 0;
 
 	/* Grab standard input. */
-	while (fgets(buffer, sizeof(buffer), p->in)) {
+	xs_reader_open(&rd, p->in);
+	while ((buffer = xs_reader_getline(&rd))) {
 		int ret = 0;
 
 		line++;
@@ -110,7 +154,17 @@ void xtables_restore_parse(struct nft_handle *h,
 				fputs(buffer, stdout);
 			continue;
 		} else if ((strcmp(buffer, "COMMIT\n") == 0) && (in_table)) {
-			if (!p->testing) {
+			xs_profile_end(XS_PROF_PARSE);
+			if (h->diff && !nft_diff_end(h, curtable->name))
+				xtables_error(OTHER_PROBLEM,
+					      "Can't update table `%s': %s\n",
+					      curtable->name,
+					      ops->strerror(errno));
+
+			if (!p->testing && h->peer) {
+				DEBUGP("Deferring commit\n");
+				ret = 1;
+			} else if (!p->testing) {
 				/* Commit per table, although we support
 				 * global commit at once, stick by now to
 				 * the existing behaviour.
@@ -125,6 +179,26 @@ void xtables_restore_parse(struct nft_handle *h,
 			}
 			in_table = 0;
 
+		} else if (buffer[0] == '@' && !in_table && h->peer) {
+			/* Dual-stack input: switch to the other family */
+			char *tag = strtok(buffer + 1, " \t\n");
+			int family;
+
+			if (tag && strcmp(tag, "ipv4") == 0)
+				family = NFPROTO_IPV4;
+			else if (tag && strcmp(tag, "ipv6") == 0)
+				family = NFPROTO_IPV6;
+			else
+				xtables_error(PARAMETER_PROBLEM,
+					"%s: line %u unknown family\n",
+					xt_params->program_name, line);
+
+			if (h->family != family)
+				h = h->peer;
+			xtables_set_nfproto(h->family);
+			curtable = NULL;
+			ret = 1;
+
 		} else if ((buffer[0] == '*') && (!in_table || !p->commit)) {
 			/* New table */
 			char *table;
@@ -148,7 +222,7 @@ void xtables_restore_parse(struct nft_handle *h,
 
 			nft_build_cache(h);
 
-			if (h->noflush == 0) {
+			if (h->noflush == 0 && !h->diff) {
 				DEBUGP("Cleaning all chains of table '%s'\n",
 					table);
 				if (cb->table_flush)
@@ -156,11 +230,31 @@ void xtables_restore_parse(struct nft_handle *h,
 			}
 
 			ret = 1;
+			if (!in_table)
+				xs_profile_begin(XS_PROF_PARSE);
 			in_table = 1;
 
 			if (cb->table_new)
 				cb->table_new(h, table);
 
+		} else if (buffer[0] == ':' && in_table && check_batch) {
+			/* Only create chains that rules to append need. */
+			char *chain = strtok(buffer+1, " \t\n");
+
+			if (!chain)
+				xtables_error(PARAMETER_PROBLEM,
+					   "%s: line %u chain name invalid\n",
+					   xt_params->program_name, line);
+
+			if (append_missing &&
+			    !nft_chain_exists(h, curtable->name, chain) &&
+			    !nft_chain_user_add(h, chain, curtable->name))
+				xtables_error(PARAMETER_PROBLEM,
+					      "cannot create chain "
+					      "'%s' (%s)\n", chain,
+					      strerror(errno));
+			ret = 1;
+
 		} else if ((buffer[0] == ':') && (in_table)) {
 			/* New chain. */
 			char *policy, *chain = NULL;
@@ -190,6 +284,13 @@ void xtables_restore_parse(struct nft_handle *h,
 				exit(1);
 			}
 
+			if (h->diff &&
+			    nft_diff_chain(h, curtable->name, chain) < 0)
+				xtables_error(PARAMETER_PROBLEM,
+					      "cannot create chain "
+					      "'%s' (%s)\n", chain,
+					      strerror(errno));
+
 			if (nft_chain_builtin_find(curtable, chain)) {
 				if (counters) {
 					char *ctrs;
@@ -202,6 +303,9 @@ void xtables_restore_parse(struct nft_handle *h,
 
 				}
 				if (cb->chain_set &&
+				    (!h->diff || counters ||
+				     nft_diff_policy(h, curtable->name, chain,
+						     policy, &count)) &&
 				    cb->chain_set(h, curtable->name,
 					          chain, policy, &count) < 0) {
 					xtables_error(OTHER_PROBLEM,
@@ -212,7 +316,8 @@ void xtables_restore_parse(struct nft_handle *h,
 				}
 				DEBUGP("Setting policy of chain %s to %s\n",
 				       chain, policy);
-			} else if (cb->chain_restore(h, chain, curtable->name) < 0 &&
+			} else if (!h->diff &&
+				   cb->chain_restore(h, chain, curtable->name) < 0 &&
 				   errno != EEXIST) {
 				xtables_error(PARAMETER_PROBLEM,
 					      "cannot create chain "
@@ -234,9 +339,6 @@ void xtables_restore_parse(struct nft_handle *h,
 			char *bcnt = NULL;
 			char *parsestart;
 
-			/* reset the newargv */
-			newargc = 0;
-
 			if (buffer[0] == '[') {
 				/* we have counters in our input */
 				char *ptr = strchr(buffer, ']');
@@ -265,26 +367,31 @@ void xtables_restore_parse(struct nft_handle *h,
 				parsestart = buffer;
 			}
 
-			add_argv(argv[0], 0);
-			add_argv("-t", 0);
-			add_argv(curtable->name, 0);
+			xs_argv_add(&args, argv[0]);
+			xs_argv_add(&args, "-t");
+			xs_argv_add(&args, curtable->name);
 
 			if (counters && pcnt && bcnt) {
-				add_argv("--set-counters", 0);
-				add_argv((char *) pcnt, 0);
-				add_argv((char *) bcnt, 0);
+				xs_argv_add(&args, "--set-counters");
+				xs_argv_add(&args, pcnt);
+				xs_argv_add(&args, bcnt);
 			}
 
-			add_param_to_argv(parsestart, line);
+			xs_argv_split(&args, parsestart, line);
 
 			DEBUGP("calling do_command4(%u, argv, &%s, handle):\n",
-				newargc, curtable->name);
+				args.argc, curtable->name);
 
-			for (a = 0; a < newargc; a++)
-				DEBUGP("argv[%u]: %s\n", a, newargv[a]);
+			for (a = 0; a < args.argc; a++)
+				DEBUGP("argv[%u]: %s\n", a, args.argv[a]);
 
-			ret = cb->do_command(h, newargc, newargv,
-					    &newargv[2], true);
+			if (check_batch) {
+				ret = check_batch_rule(h, cb, &args, &check);
+				xs_argv_reset(&check);
+			} else {
+				ret = cb->do_command(h, args.argc, args.argv,
+						    &args.argv[2], true);
+			}
 			if (ret < 0) {
 				if (cb->abort)
 					ret = cb->abort(h);
@@ -298,7 +405,7 @@ void xtables_restore_parse(struct nft_handle *h,
 				exit(1);
 			}
 
-			free_argv();
+			xs_argv_reset(&args);
 			fflush(stdout);
 		}
 		if (p->tablename && curtable &&
@@ -310,14 +417,54 @@ void xtables_restore_parse(struct nft_handle *h,
 			exit(1);
 		}
 	}
+	xs_profile_end(XS_PROF_PARSE);
 	if (in_table && p->commit) {
 		fprintf(stderr, "%s: COMMIT expected at line %u\n",
 				xt_params->program_name, line + 1);
 		exit(1);
-	} else if (in_table && cb->commit && !cb->commit(h)) {
+	} else if (in_table && cb->commit &&
+		   ((h->diff && !nft_diff_end(h, curtable->name)) ||
+		    !cb->commit(h))) {
 		xtables_error(OTHER_PROBLEM, "%s: final implicit COMMIT failed",
 			      xt_params->program_name);
+	} else if (h->peer && !p->testing && cb->commit && !cb->commit(h)) {
+		/* both families at once, in one transaction */
+		xtables_error(OTHER_PROBLEM, "%s: COMMIT failed",
+			      xt_params->program_name);
 	}
+
+	xs_argv_free(&args);
+	xs_argv_free(&check);
+	xs_reader_close(&rd);
+}
+
+/*
+ * Replay the tables of a snapshot as they are. Returns false if the
+ * kernel refused any of them, the caller restores the text form then.
+ */
+static bool xtables_restore_snapshot(struct nft_handle *h,
+				     struct xs_snapshot *snap,
+				     const char *tablename)
+{
+	const char *table;
+	const void *blob;
+	bool ok = false;
+	size_t len;
+
+	while ((blob = xs_snapshot_next(snap, &table, &len))) {
+		if (tablename && strcmp(tablename, table) != 0)
+			continue;
+
+		if (nft_snapshot_replay(h, blob, len) < 0) {
+			if (verbose)
+				fprintf(stderr, "%s: table `%s' not restored "
+					"from snapshot: %s\n", prog_name,
+					table, strerror(errno));
+			return false;
+		}
+		ok = true;
+	}
+	return ok;
 }
 
 static int
@@ -327,11 +474,14 @@ xtables_restore_main(int family, const char *progname, int argc, char *argv[])
 	struct nft_handle h = {
 		.family = family,
 		.restore = true,
-	};
+	}, h6;
 	int c;
 	struct nft_xt_restore_parse p = {
 		.commit = true,
 	};
+	struct xs_snapshot snap = {};
+	struct xs_partition partition = {};
+	bool binary = false;
 
 	line = 0;
 
@@ -344,14 +494,23 @@ xtables_restore_main(int family, const char *progname, int argc, char *argv[])
 		exit(1);
 	}
 
-	while ((c = getopt_long(argc, argv, "bcvVthnM:T:46wW", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "AbcCdvVthnM:T:46wWPp:", options, NULL)) != -1) {
 		switch (c) {
+			case 'A':
+				append_missing = 1;
+				/* fall through */
+			case 'C':
+				check_batch = 1;
+				break;
 			case 'b':
-				fprintf(stderr, "-b/--binary option is not implemented\n");
+				binary = true;
 				break;
 			case 'c':
 				counters = 1;
 				break;
+			case 'd':
+				h.diff = true;
+				break;
 			case 'v':
 				verbose = 1;
 				break;
@@ -373,6 +532,15 @@ xtables_restore_main(int family, const char *progname, int argc, char *argv[])
 			case 'T':
 				p.tablename = optarg;
 				break;
+			case 'P':
+				xs_memo_enabled = true;
+				break;
+			case 'p':
+				xs_partition_parse(&partition, optarg);
+				break;
+			case 'Q':
+				/* taken by xs_profile_init() already */
+				break;
 			case '4':
 				h.family = AF_INET;
 				break;
@@ -407,6 +575,51 @@ xtables_restore_main(int family, const char *progname, int argc, char *argv[])
 		p.in = stdin;
 	}
 
+	if (h.diff && h.noflush) {
+		fprintf(stderr, "Options --diff and --noflush are exclusive\n");
+		exit(1);
+	}
+
+	if (check_batch) {
+		if (h.diff) {
+			fprintf(stderr, "Options --diff and --check-batch are "
+				"exclusive\n");
+			exit(1);
+		}
+		h.noflush = 1;
+	}
+
+	if (dual_stack && (binary || h.family != NFPROTO_IPV4)) {
+		fprintf(stderr, "%s: options -b and -6 take one family only\n",
+			prog_name);
+		exit(1);
+	}
+
+	if (partition.leaf) {
+		if (binary || h.noflush || dual_stack) {
+			fprintf(stderr, "%s: --partition wants a full ruleset "
+				"of one family in text form\n", prog_name);
+			exit(1);
+		}
+		p.in = xs_partition_input(p.in, &partition);
+	}
+
+	if (binary) {
+		if (xs_snapshot_read(&snap, p.in, h.family, "nf_tables") < 0) {
+			fprintf(stderr, "%s: input is not a snapshot\n",
+				prog_name);
+			exit(1);
+		}
+		fclose(p.in);
+
+		p.in = xs_snapshot_text(&snap);
+		if (!p.in) {
+			fprintf(stderr, "Can't read snapshot: %s\n",
+				strerror(errno));
+			exit(1);
+		}
+	}
+
 	switch (family) {
 	case NFPROTO_IPV4:
 	case NFPROTO_IPV6: /* fallthough, same table */
@@ -427,6 +640,11 @@ xtables_restore_main(int family, const char *progname, int argc, char *argv[])
 		return 1;
 	}
 
+	/* saved rules carry addresses only, nothing to resolve */
+	if (!binary && !dual_stack &&
+	    (h.family == AF_INET || h.family == AF_INET6))
+		xs_restore_prefetch_hosts(p.in, h.family);
+
 	if (nft_init(&h, tables) < 0) {
 		fprintf(stderr, "%s/%s Failed to initialize nft: %s\n",
 				xtables_globals.program_name,
@@ -435,10 +653,48 @@ xtables_restore_main(int family, const char *progname, int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	/* The IPv6 tables of dual-stack input have their own cache, the
+	 * changes to both are committed together.
+	 */
+	if (dual_stack) {
+		h6 = (struct nft_handle) {
+			.family		= NFPROTO_IPV6,
+			.restore	= true,
+			.noflush	= h.noflush,
+			.diff		= h.diff,
+		};
+		if (nft_init(&h6, tables) < 0) {
+			fprintf(stderr, "%s/%s Failed to initialize nft: %s\n",
+					xtables_globals.program_name,
+					xtables_globals.program_version,
+					strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		h.peer = &h6;
+		h6.peer = &h;
+	}
+
+	/* Counters in the sections can't be left out, take the text then */
+	if (binary && !p.testing && !h.noflush && !h.diff &&
+	    (counters || !snap.counters)) {
+		if (xtables_restore_snapshot(&h, &snap, p.tablename)) {
+			nft_fini(&h);
+			fclose(p.in);
+			xs_snapshot_free(&snap);
+			return 0;
+		}
+		if (verbose)
+			fprintf(stderr, "%s: restoring text form of snapshot\n",
+				prog_name);
+	}
+
 	xtables_restore_parse(&h, &p, &restore_cb, argc, argv);
 
+	if (dual_stack)
+		nft_fini(&h6);
 	nft_fini(&h);
 	fclose(p.in);
+	xs_snapshot_free(&snap);
 	return 0;
 }
 
@@ -454,6 +710,14 @@ int xtables_ip6_restore_main(int argc, char *argv[])
 				    argc, argv);
 }
 
+int xtables_ip46_restore_main(int argc, char *argv[])
+{
+	/* input without a section line is IPv4 */
+	dual_stack = true;
+	return xtables_restore_main(NFPROTO_IPV4, basename(*argv),
+				    argc, argv);
+}
+
 static int ebt_table_flush(struct nft_handle *h, const char *table)
 {
 	/* drop any pending policy rule add/removal jobs */
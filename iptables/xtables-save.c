@@ -33,6 +33,7 @@
 
 static const char *ipt_save_optstring = "bcdt:M:f:46V";
 static const struct option ipt_save_options[] = {
+	{.name = "binary",   .has_arg = false, .val = 'b'},
 	{.name = "counters", .has_arg = false, .val = 'c'},
 	{.name = "version",  .has_arg = false, .val = 'V'},
 	{.name = "dump",     .has_arg = false, .val = 'd'},
@@ -41,6 +42,7 @@ static const struct option ipt_save_options[] = {
 	{.name = "file",     .has_arg = true,  .val = 'f'},
 	{.name = "ipv4",     .has_arg = false, .val = '4'},
 	{.name = "ipv6",     .has_arg = false, .val = '6'},
+	{.name = "profile",  .has_arg = 2,     .val = 'Q'},
 	{NULL},
 };
 
@@ -64,6 +66,7 @@ static const struct option ebt_save_options[] = {
 struct do_output_data {
 	unsigned int format;
 	bool commit;
+	struct xs_snapshot *snapshot;
 };
 
 static int
@@ -100,6 +103,19 @@ __do_output(struct nft_handle *h, const char *tablename, void *data)
 
 	now = time(NULL);
 	printf("# Completed on %s", ctime(&now));
+
+	if (d->snapshot) {
+		void *blob;
+		size_t len;
+
+		blob = nft_snapshot_table(h, tablename,
+					  !(d->format & FMT_NOCOUNTS), &len);
+		if (!blob)
+			xtables_error(OTHER_PROBLEM,
+				      "Cannot snapshot table `%s'\n", tablename);
+		xs_snapshot_add(d->snapshot, tablename, blob, len);
+		free(blob);
+	}
 	return 0;
 }
 
@@ -138,6 +154,8 @@ xtables_save_main(int family, int argc, char *argv[],
 	struct do_output_data d = {
 		.format = FMT_NOCOUNTS,
 	};
+	struct xs_snapshot snap;
+	bool binary = false;
 	bool dump = false;
 	struct nft_handle h = {
 		.family	= family,
@@ -157,7 +175,7 @@ xtables_save_main(int family, int argc, char *argv[],
 	while ((c = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
 		switch (c) {
 		case 'b':
-			fprintf(stderr, "-b/--binary option is not implemented\n");
+			binary = true;
 			break;
 		case 'c':
 			d.format &= ~FMT_NOCOUNTS;
@@ -188,6 +206,9 @@ xtables_save_main(int family, int argc, char *argv[],
 		case 'd':
 			dump = true;
 			break;
+		case 'Q':
+			/* taken by xs_profile_init() already */
+			break;
 		case '4':
 			h.family = AF_INET;
 			break;
@@ -249,7 +270,20 @@ xtables_save_main(int family, int argc, char *argv[],
 		exit(EXIT_FAILURE);
 	}
 
+	xtables_output_init(stdout);
+	if (binary) {
+		/* The text goes along, restore falls back to it elsewhere */
+		if (xs_snapshot_capture(&snap) < 0)
+			xtables_error(OTHER_PROBLEM,
+				      "Cannot capture output: %s\n",
+				      strerror(errno));
+		snap.counters = !(d.format & FMT_NOCOUNTS);
+		d.snapshot = &snap;
+	}
 	ret = do_output(&h, tablename, &d);
+	if (binary && xs_snapshot_write(&snap, h.family, "nf_tables") < 0)
+		xtables_error(OTHER_PROBLEM, "Cannot write snapshot: %s\n",
+			      strerror(errno));
 	nft_fini(&h);
 	if (dump)
 		exit(0);
@@ -0,0 +1,1078 @@
+/*
+ * xtables-sim: replay the packets of a pcap file against a ruleset in
+ * iptables-save format, without the kernel, and report the path each
+ * packet takes through the chains and how many rules it is matched
+ * against on the way.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "config.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <xtables.h>
+#include "xshared.h"
+#include "xtables-multi.h"
+
+struct xtables_globals xtables_sim_globals = {
+	.option_offset = 0,
+	.program_version = PACKAGE_VERSION,
+	.program_name = "xtables-sim",
+};
+
+static const struct option options[] = {
+	{.name = "table",         .has_arg = true,  .val = 't'},
+	{.name = "chain",         .has_arg = true,  .val = 'c'},
+	{.name = "in-interface",  .has_arg = true,  .val = 'i'},
+	{.name = "out-interface", .has_arg = true,  .val = 'o'},
+	{.name = "state",         .has_arg = true,  .val = 's'},
+	{.name = "mark",          .has_arg = true,  .val = 'm'},
+	{.name = "ipv6",          .has_arg = false, .val = '6'},
+	{.name = "quiet",         .has_arg = false, .val = 'q'},
+	{.name = "help",          .has_arg = false, .val = 'h'},
+	{NULL},
+};
+
+/* ports one multiport match takes */
+#define XSIM_PORTS_MAX	15
+
+enum xsim_verdict {
+	XSIM_CONTINUE,		/* no target, or one letting the packet on */
+	XSIM_ACCEPT,
+	XSIM_DROP,
+	XSIM_STOP,		/* any other target ending the evaluation */
+	XSIM_RETURN,
+	XSIM_JUMP,
+	XSIM_GOTO,
+	XSIM_MARK,
+};
+
+enum xsim_match_type {
+	XSIM_TCP_FLAGS,
+	XSIM_MULTIPORT,
+	XSIM_IPRANGE,
+	XSIM_STATE,
+	XSIM_MARK_MATCH,
+};
+
+enum xsim_state {
+	XSIM_INVALID		= 1 << 0,
+	XSIM_NEW		= 1 << 1,
+	XSIM_ESTABLISHED	= 1 << 2,
+	XSIM_RELATED		= 1 << 3,
+	XSIM_UNTRACKED		= 1 << 4,
+};
+
+static const struct {
+	const char	*name;
+	unsigned int	bit;
+} xsim_states[] = {
+	{ "INVALID",	 XSIM_INVALID },
+	{ "NEW",	 XSIM_NEW },
+	{ "ESTABLISHED", XSIM_ESTABLISHED },
+	{ "RELATED",	 XSIM_RELATED },
+	{ "UNTRACKED",	 XSIM_UNTRACKED },
+};
+
+static const struct {
+	const char	*name;
+	uint8_t		bits;
+} xsim_tcp_flags[] = {
+	{ "FIN",  0x01 }, { "SYN",  0x02 }, { "RST",  0x04 }, { "PSH",  0x08 },
+	{ "ACK",  0x10 }, { "URG",  0x20 }, { "ECE",  0x40 }, { "CWR",  0x80 },
+	{ "ALL",  0xff }, { "NONE", 0x00 },
+};
+
+/**
+ * struct xsim_match - decoded match of a rule
+ * @type:	what is matched
+ * @inv:	negated with "!"
+ * @dir:	multiport and iprange: 1 source, 2 destination, 3 either
+ * @mask:	tcp flags looked at, or mark bits
+ * @cmp:	tcp flags set of those, or mark value
+ * @n:		port ranges in @lo and @hi
+ * @lo:		first ports of the ranges
+ * @hi:		last ports of the ranges
+ * @from:	first address of an iprange
+ * @to:		last address of an iprange
+ * @states:	conntrack states, enum xsim_state bits
+ */
+struct xsim_match {
+	enum xsim_match_type type;
+	bool		inv;
+	unsigned int	dir;
+	uint32_t	mask;
+	uint32_t	cmp;
+	unsigned int	n;
+	uint16_t	lo[XSIM_PORTS_MAX];
+	uint16_t	hi[XSIM_PORTS_MAX];
+	uint8_t		from[16];
+	uint8_t		to[16];
+	unsigned int	states;
+};
+
+/**
+ * struct xsim_rule - rule ready for evaluation
+ * @r:		parsed rule
+ * @matches:	decoded matches
+ * @nmatches:	entries in @matches
+ * @never:	has a match which is not simulated, never matches
+ * @verdict:	what a matching packet gets
+ * @target:	chain of a jump or goto
+ * @mark:	value a MARK target xors in
+ * @mark_mask:	bits a MARK target clears first
+ * @evals:	packets the rule was matched against
+ * @hits:	packets it matched
+ */
+struct xsim_rule {
+	const struct xs_rule	*r;
+	struct xsim_match	*matches;
+	unsigned int		nmatches;
+	bool			never;
+	enum xsim_verdict	verdict;
+	unsigned int		target;
+	uint32_t		mark;
+	uint32_t		mark_mask;
+	uint64_t		evals;
+	uint64_t		hits;
+};
+
+/**
+ * struct xsim_chain - chain ready for evaluation
+ * @c:		parsed chain
+ * @rules:	its rules
+ * @policy:	packets which got the policy of a base chain
+ * @state:	loop check: 0 not seen, 1 being walked, 2 done
+ */
+struct xsim_chain {
+	const struct xs_rule_chain *c;
+	struct xsim_rule	*rules;
+	uint64_t		policy;
+	int			state;
+};
+
+/**
+ * struct xsim_pkt - header fields of a captured packet
+ * @family:	AF_INET or AF_INET6
+ * @src:	source address
+ * @dst:	destination address
+ * @proto:	protocol, for IPv6 the one after the extension headers
+ * @frag:	not the first fragment
+ * @ports:	@sport and @dport were read
+ * @sport:	source port
+ * @dport:	destination port
+ * @flags:	@tcp_flags were read
+ * @tcp_flags:	tcp header flags
+ * @mark:	packet mark, changed by MARK rules
+ */
+struct xsim_pkt {
+	int		family;
+	uint8_t		src[16];
+	uint8_t		dst[16];
+	uint8_t		proto;
+	bool		frag;
+	bool		ports;
+	uint16_t	sport;
+	uint16_t	dport;
+	bool		flags;
+	uint8_t		tcp_flags;
+	uint32_t	mark;
+};
+
+/**
+ * struct xsim_step - rule on the path of a packet
+ * @chain:	chain of the rule
+ * @rule:	rule number from 1, 0 for the policy
+ */
+struct xsim_step {
+	unsigned int	chain;
+	unsigned int	rule;
+};
+
+static struct xsim_chain *chains;
+static unsigned int nchains;
+static unsigned int *stack;
+static const struct xs_rule_table *table;
+static const char *iniface = "", *outiface = "";
+static unsigned int state = XSIM_NEW;
+static uint32_t mark;
+static int family = AF_INET;
+static bool quiet;
+
+static void print_usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t table] [-c chain] [-i iface] [-o iface]\n"
+		"	[--state state] [--mark value] [-6] [-q] ruleset pcap\n"
+		"       %s -h\n\n"
+		"Replays the packets of a pcap file against a ruleset in\n"
+		"iptables-save format and reports the verdict, the path and\n"
+		"the rules evaluated per packet, and the hits per rule.\n\n"
+		"  -t, --table		table to use, filter by default\n"
+		"  -c, --chain		base chain packets enter, INPUT by default\n"
+		"  -i, --in-interface	input interface of the packets\n"
+		"  -o, --out-interface	output interface of the packets\n"
+		"      --state		conntrack state of the packets, NEW by default\n"
+		"      --mark		mark of the packets, 0 by default\n"
+		"  -6, --ipv6		the ruleset is an IPv6 one\n"
+		"  -q, --quiet		print the hits per rule only\n",
+		name, name);
+}
+
+static unsigned int xsim_parse_states(const char *arg)
+{
+	unsigned int i, bits = 0;
+	const char *p, *end;
+	size_t len;
+
+	for (p = arg; *p; p = *end ? end + 1 : end) {
+		end = p + strcspn(p, ",");
+		len = end - p;
+		for (i = 0; i < ARRAY_SIZE(xsim_states); i++)
+			if (strlen(xsim_states[i].name) == len &&
+			    strncasecmp(xsim_states[i].name, p, len) == 0)
+				break;
+		if (i == ARRAY_SIZE(xsim_states))
+			return 0;
+		bits |= xsim_states[i].bit;
+	}
+	return bits;
+}
+
+static bool xsim_parse_tcp_flags(const char *arg, uint32_t *bits)
+{
+	const char *p, *end;
+	unsigned int i;
+	size_t len;
+
+	*bits = 0;
+	for (p = arg; *p; p = *end ? end + 1 : end) {
+		end = p + strcspn(p, ",");
+		len = end - p;
+		for (i = 0; i < ARRAY_SIZE(xsim_tcp_flags); i++)
+			if (strlen(xsim_tcp_flags[i].name) == len &&
+			    strncmp(xsim_tcp_flags[i].name, p, len) == 0)
+				break;
+		if (i == ARRAY_SIZE(xsim_tcp_flags))
+			return false;
+		*bits |= xsim_tcp_flags[i].bits;
+	}
+	return true;
+}
+
+static bool xsim_parse_ports(struct xsim_match *m, const char *arg)
+{
+	unsigned long lo, hi;
+	const char *p;
+	char *end;
+
+	for (p = arg, m->n = 0; *p; p = *end ? end + 1 : end) {
+		if (m->n == XSIM_PORTS_MAX)
+			return false;
+		lo = hi = strtoul(p, &end, 10);
+		if (*end == ':')
+			hi = strtoul(end + 1, &end, 10);
+		if (end == p || (*end && *end != ',') || lo > hi ||
+		    hi > UINT16_MAX)
+			return false;
+		m->lo[m->n] = lo;
+		m->hi[m->n++] = hi;
+	}
+	return m->n > 0;
+}
+
+static bool xsim_parse_range(struct xsim_match *m, char *arg)
+{
+	char *dash = strchr(arg, '-');
+
+	if (dash == NULL)
+		return false;
+	*dash = '\0';
+	return inet_pton(family, arg, m->from) == 1 &&
+	       inet_pton(family, dash + 1, m->to) == 1;
+}
+
+static bool xsim_parse_mark(struct xsim_match *m, const char *arg)
+{
+	char *end;
+
+	m->mask = UINT32_MAX;
+	m->cmp = strtoul(arg, &end, 0);
+	if (*end == '/')
+		m->mask = strtoul(end + 1, &end, 0);
+	return *end == '\0';
+}
+
+/* Decode one option of the "-m" block @name, false if not simulated. */
+static bool xsim_parse_option(struct xsim_match *m, const char *name,
+			      char **argv, unsigned int *i, unsigned int argc)
+{
+	const char *opt = argv[*i];
+	uint32_t cmp;
+
+	if (*i + 1 >= argc)
+		return false;
+
+	if (strcmp(opt, "--tcp-flags") == 0 && strcmp(name, "tcp") == 0) {
+		if (*i + 2 >= argc ||
+		    !xsim_parse_tcp_flags(argv[*i + 1], &m->mask) ||
+		    !xsim_parse_tcp_flags(argv[*i + 2], &cmp))
+			return false;
+		m->type = XSIM_TCP_FLAGS;
+		m->cmp = cmp;
+		*i += 3;
+		return true;
+	}
+	if (strcmp(name, "multiport") == 0) {
+		m->type = XSIM_MULTIPORT;
+		if (strcmp(opt, "--sports") == 0 ||
+		    strcmp(opt, "--source-ports") == 0)
+			m->dir = 1;
+		else if (strcmp(opt, "--dports") == 0 ||
+			 strcmp(opt, "--destination-ports") == 0)
+			m->dir = 2;
+		else if (strcmp(opt, "--ports") == 0)
+			m->dir = 3;
+		else
+			return false;
+		*i += 2;
+		return xsim_parse_ports(m, argv[*i - 1]);
+	}
+	if (strcmp(name, "iprange") == 0) {
+		m->type = XSIM_IPRANGE;
+		if (strcmp(opt, "--src-range") == 0)
+			m->dir = 1;
+		else if (strcmp(opt, "--dst-range") == 0)
+			m->dir = 2;
+		else
+			return false;
+		*i += 2;
+		return xsim_parse_range(m, argv[*i - 1]);
+	}
+	if ((strcmp(name, "state") == 0 && strcmp(opt, "--state") == 0) ||
+	    (strcmp(name, "conntrack") == 0 && strcmp(opt, "--ctstate") == 0)) {
+		m->type = XSIM_STATE;
+		*i += 2;
+		m->states = xsim_parse_states(argv[*i - 1]);
+		return m->states != 0;
+	}
+	if (strcmp(name, "mark") == 0 && strcmp(opt, "--mark") == 0) {
+		m->type = XSIM_MARK_MATCH;
+		*i += 2;
+		return xsim_parse_mark(m, argv[*i - 1]);
+	}
+	return false;
+}
+
+/* Decode the "-m" blocks of a rule, warning once per block not simulated */
+static void xsim_rule_matches(struct xsim_rule *sr)
+{
+	static struct xs_argv args, warned;
+	unsigned int i, j, k, argc;
+	struct xsim_match m;
+	char *copy, *tok, *save;
+	bool inv;
+
+	for (i = 0; i < sr->r->nmatches && !sr->never; i++) {
+		copy = xtables_malloc(strlen(sr->r->matches[i]) + 1);
+		strcpy(copy, sr->r->matches[i]);
+		xs_argv_reset(&args);
+		for (tok = strtok_r(copy, " ", &save); tok;
+		     tok = strtok_r(NULL, " ", &save))
+			xs_argv_add(&args, tok);
+		free(copy);
+		argc = args.argc;
+
+		for (j = 1; j < argc && !sr->never; ) {
+			memset(&m, 0, sizeof(m));
+			inv = strcmp(args.argv[j], "!") == 0;
+			j += inv;
+			if (j < argc && xsim_parse_option(&m, args.argv[0],
+							  args.argv, &j, argc)) {
+				m.inv = inv;
+				sr->matches = xtables_realloc(sr->matches,
+					(sr->nmatches + 1) * sizeof(m));
+				sr->matches[sr->nmatches++] = m;
+			} else {
+				sr->never = true;
+			}
+		}
+		if (argc < 2)
+			sr->never = true;
+		if (!sr->never)
+			continue;
+
+		for (k = 0; k < (unsigned int)warned.argc; k++)
+			if (strcmp(warned.argv[k], args.argv[0]) == 0)
+				break;
+		if (k == (unsigned int)warned.argc) {
+			fprintf(stderr, "%s: \"-m %s\" is not simulated, rules "
+				"using it never match\n",
+				xt_params->program_name, sr->r->matches[i]);
+			xs_argv_add(&warned, args.argv[0]);
+		}
+	}
+}
+
+static void xsim_rule_verdict(struct xsim_rule *sr)
+{
+	const struct xs_rule *r = sr->r;
+	size_t len = strcspn(r->verdict, " ");
+	const struct xs_rule_chain *c;
+	char name[XT_EXTENSION_MAXNAMELEN];
+	const char *p;
+	char *end;
+
+	snprintf(name, sizeof(name), "%.*s", (int)len, r->verdict);
+	if (name[0] == '\0') {
+		sr->verdict = XSIM_CONTINUE;
+	} else if (strcmp(name, "ACCEPT") == 0) {
+		sr->verdict = XSIM_ACCEPT;
+	} else if (strcmp(name, "DROP") == 0) {
+		sr->verdict = XSIM_DROP;
+	} else if (strcmp(name, "RETURN") == 0) {
+		sr->verdict = XSIM_RETURN;
+	} else if ((c = xs_rule_chain_find((struct xs_rule_table *)table,
+					   name))) {
+		sr->verdict = r->jump_goto ? XSIM_GOTO : XSIM_JUMP;
+		sr->target = c - table->chains;
+	} else if (strcmp(name, "MARK") == 0 &&
+		   ((p = strstr(r->verdict, "--set-xmark ")) ||
+		    (p = strstr(r->verdict, "--set-mark ")))) {
+		sr->verdict = XSIM_MARK;
+		sr->mark_mask = UINT32_MAX;
+		sr->mark = strtoul(strchr(p, ' ') + 1, &end, 0);
+		if (*end == '/')
+			sr->mark_mask = strtoul(end + 1, NULL, 0);
+	} else if (xs_rule_terminal(r)) {
+		sr->verdict = XSIM_STOP;
+	} else {
+		sr->verdict = XSIM_CONTINUE;
+	}
+}
+
+/* The kernel refuses rulesets with loops, a walk would never end here. */
+static void xsim_loop_check(unsigned int i)
+{
+	struct xsim_chain *sc = &chains[i];
+	unsigned int j;
+
+	if (sc->state == 2)
+		return;
+	if (sc->state == 1)
+		xtables_error(PARAMETER_PROBLEM, "chain %s loops",
+			      sc->c->name);
+	sc->state = 1;
+	for (j = 0; j < sc->c->num; j++)
+		if (sc->rules[j].verdict == XSIM_JUMP ||
+		    sc->rules[j].verdict == XSIM_GOTO)
+			xsim_loop_check(sc->rules[j].target);
+	sc->state = 2;
+}
+
+static void xsim_load(void)
+{
+	unsigned int i, j;
+
+	nchains = table->num;
+	chains = xtables_calloc(nchains, sizeof(*chains));
+	for (i = 0; i < nchains; i++) {
+		chains[i].c = &table->chains[i];
+		chains[i].rules = xtables_calloc(chains[i].c->num + 1,
+						 sizeof(*chains[i].rules));
+		for (j = 0; j < chains[i].c->num; j++) {
+			chains[i].rules[j].r = &chains[i].c->rules[j];
+			xsim_rule_matches(&chains[i].rules[j]);
+			xsim_rule_verdict(&chains[i].rules[j]);
+		}
+	}
+	for (i = 0; i < nchains; i++)
+		xsim_loop_check(i);
+
+	/* chain and position to return to, per chain jumped from */
+	stack = xtables_calloc(2 * nchains + 2, sizeof(*stack));
+}
+
+static bool xsim_prefix_match(const struct xs_prefix *p, const uint8_t *addr)
+{
+	unsigned int bytes = p->len / 8, bits = p->len % 8;
+	bool match;
+
+	match = memcmp(p->addr, addr, bytes) == 0 &&
+		(bits == 0 ||
+		 ((p->addr[bytes] ^ addr[bytes]) & (0xff << (8 - bits))) == 0);
+	return match != p->inv;
+}
+
+static bool xsim_iface_match(const struct xs_iface *iface, const char *name)
+{
+	size_t len = strlen(iface->name);
+	bool match;
+
+	if (len == 0)
+		return true;
+	if (iface->name[len - 1] == '+')
+		match = strncmp(iface->name, name, len - 1) == 0;
+	else
+		match = strcmp(iface->name, name) == 0;
+	return match != iface->inv;
+}
+
+static bool xsim_ports_match(const struct xs_ports *p, uint16_t port)
+{
+	return (port >= p->lo && port <= p->hi) != p->inv;
+}
+
+static bool xsim_in_ranges(const struct xsim_match *m, uint16_t port)
+{
+	unsigned int i;
+
+	for (i = 0; i < m->n; i++)
+		if (port >= m->lo[i] && port <= m->hi[i])
+			return true;
+	return false;
+}
+
+static bool xsim_in_range(const struct xsim_match *m, const uint8_t *addr)
+{
+	size_t len = family == AF_INET6 ? 16 : 4;
+
+	return memcmp(addr, m->from, len) >= 0 && memcmp(addr, m->to, len) <= 0;
+}
+
+static bool xsim_match(const struct xsim_match *m, const struct xsim_pkt *p)
+{
+	bool match = false;
+
+	switch (m->type) {
+	case XSIM_TCP_FLAGS:
+		if (!p->flags)
+			return false;
+		match = (p->tcp_flags & m->mask) == m->cmp;
+		break;
+	case XSIM_MULTIPORT:
+		if (!p->ports)
+			return false;
+		match = ((m->dir & 1) && xsim_in_ranges(m, p->sport)) ||
+			((m->dir & 2) && xsim_in_ranges(m, p->dport));
+		break;
+	case XSIM_IPRANGE:
+		match = xsim_in_range(m, m->dir == 1 ? p->src : p->dst);
+		break;
+	case XSIM_STATE:
+		match = m->states & state;
+		break;
+	case XSIM_MARK_MATCH:
+		match = (p->mark & m->mask) == m->cmp;
+		break;
+	}
+	return match != m->inv;
+}
+
+static bool xsim_rule_match(const struct xsim_rule *sr,
+			    const struct xsim_pkt *p)
+{
+	const struct xs_rule *r = sr->r;
+	unsigned int i;
+
+	if (sr->never)
+		return false;
+	if (r->src.family && !xsim_prefix_match(&r->src, p->src))
+		return false;
+	if (r->dst.family && !xsim_prefix_match(&r->dst, p->dst))
+		return false;
+	if (!xsim_iface_match(&r->iniface, iniface) ||
+	    !xsim_iface_match(&r->outiface, outiface))
+		return false;
+	if (r->proto && (p->proto == r->proto) == r->proto_inv)
+		return false;
+	if ((r->frag == 1 && !p->frag) || (r->frag == 2 && p->frag))
+		return false;
+	if ((r->sport.set || r->dport.set) && !p->ports)
+		return false;
+	if (r->sport.set && !xsim_ports_match(&r->sport, p->sport))
+		return false;
+	if (r->dport.set && !xsim_ports_match(&r->dport, p->dport))
+		return false;
+
+	for (i = 0; i < sr->nmatches; i++)
+		if (!xsim_match(&sr->matches[i], p))
+			return false;
+	return true;
+}
+
+static void xsim_step(struct xsim_step **path, unsigned int *len,
+		      unsigned int *size, unsigned int chain,
+		      unsigned int rule)
+{
+	if (*len == *size) {
+		*size = *size ? *size * 2 : 16;
+		*path = xtables_realloc(*path, *size * sizeof(**path));
+	}
+	(*path)[*len].chain = chain;
+	(*path)[(*len)++].rule = rule;
+}
+
+/**
+ * xsim_run - walk a packet through the chains
+ * @p:		packet
+ * @start:	base chain it enters
+ * @path:	rules deciding where it goes, grown as needed
+ * @len:	set to the entries in @path
+ * @size:	allocated entries in @path
+ * @evals:	set to the rules it was matched against
+ *
+ * Returns the verdict, as target name.
+ */
+static const char *xsim_run(struct xsim_pkt *p, unsigned int start,
+			    struct xsim_step **path, unsigned int *len,
+			    unsigned int *size, uint64_t *evals)
+{
+	unsigned int chain = start, pos = 0, depth = 0;
+	const char *verdict = NULL;
+	struct xsim_rule *sr;
+	static char name[XT_EXTENSION_MAXNAMELEN];
+
+	*len = 0;
+	*evals = 0;
+	while (verdict == NULL) {
+		if (pos == chains[chain].c->num) {
+			/* end of a user chain returns */
+			if (depth) {
+				depth--;
+				chain = stack[2 * depth];
+				pos = stack[2 * depth + 1];
+				continue;
+			}
+			chains[start].policy++;
+			xsim_step(path, len, size, start, 0);
+			verdict = chains[start].c->policy;
+			break;
+		}
+
+		sr = &chains[chain].rules[pos++];
+		sr->evals++;
+		(*evals)++;
+		if (!xsim_rule_match(sr, p))
+			continue;
+		sr->hits++;
+
+		switch (sr->verdict) {
+		case XSIM_CONTINUE:
+			break;
+		case XSIM_MARK:
+			p->mark = (p->mark & ~sr->mark_mask) ^ sr->mark;
+			break;
+		case XSIM_ACCEPT:
+		case XSIM_DROP:
+		case XSIM_STOP:
+			xsim_step(path, len, size, chain, pos);
+			snprintf(name, sizeof(name), "%.*s",
+				 (int)strcspn(sr->r->verdict, " "),
+				 sr->r->verdict);
+			verdict = name;
+			break;
+		case XSIM_RETURN:
+			xsim_step(path, len, size, chain, pos);
+			pos = chains[chain].c->num;
+			break;
+		case XSIM_JUMP:
+			stack[2 * depth] = chain;
+			stack[2 * depth + 1] = pos;
+			depth++;
+			/* fall through */
+		case XSIM_GOTO:
+			xsim_step(path, len, size, chain, pos);
+			chain = sr->target;
+			pos = 0;
+			break;
+		}
+	}
+
+	return verdict;
+}
+
+/**
+ * struct xsim_pcap - pcap file being read
+ * @in:		file
+ * @swap:	written with the other byte order
+ * @linktype:	link layer header type
+ * @buf:	last packet read
+ * @size:	allocated size of @buf
+ */
+struct xsim_pcap {
+	FILE		*in;
+	bool		swap;
+	uint32_t	linktype;
+	uint8_t		*buf;
+	size_t		size;
+};
+
+#define XSIM_PCAP_MAGIC		0xa1b2c3d4
+#define XSIM_PCAP_MAGIC_NS	0xa1b23c4d
+
+static uint32_t xsim_pcap_u32(const struct xsim_pcap *pc, uint32_t v)
+{
+	return pc->swap ? __builtin_bswap32(v) : v;
+}
+
+static void xsim_pcap_open(struct xsim_pcap *pc, const char *file)
+{
+	uint32_t hdr[6];
+
+	memset(pc, 0, sizeof(*pc));
+	pc->in = fopen(file, "re");
+	if (pc->in == NULL)
+		xtables_error(OTHER_PROBLEM, "Can't open %s: %s", file,
+			      strerror(errno));
+	if (fread(hdr, sizeof(hdr), 1, pc->in) != 1)
+		xtables_error(OTHER_PROBLEM, "%s is not a pcap file", file);
+
+	if (hdr[0] == __builtin_bswap32(XSIM_PCAP_MAGIC) ||
+	    hdr[0] == __builtin_bswap32(XSIM_PCAP_MAGIC_NS))
+		pc->swap = true;
+	else if (hdr[0] != XSIM_PCAP_MAGIC && hdr[0] != XSIM_PCAP_MAGIC_NS)
+		xtables_error(OTHER_PROBLEM, "%s is not a pcap file", file);
+	pc->linktype = xsim_pcap_u32(pc, hdr[5]) & 0xffff;
+}
+
+/* Next packet, NULL at the end of the file. */
+static const uint8_t *xsim_pcap_next(struct xsim_pcap *pc, size_t *len)
+{
+	uint32_t hdr[4];
+
+	if (fread(hdr, sizeof(hdr), 1, pc->in) != 1)
+		return NULL;
+
+	*len = xsim_pcap_u32(pc, hdr[2]);
+	if (*len > 0x4000000)
+		xtables_error(OTHER_PROBLEM, "pcap record too large");
+	if (*len > pc->size) {
+		pc->size = *len;
+		pc->buf = xtables_realloc(pc->buf, pc->size);
+	}
+	if (*len && fread(pc->buf, *len, 1, pc->in) != 1)
+		xtables_error(OTHER_PROBLEM, "pcap file is truncated");
+	return pc->buf;
+}
+
+/* Strip the link layer header, returning the ethertype of what is left. */
+static const uint8_t *xsim_link(const struct xsim_pcap *pc,
+				const uint8_t *d, size_t *len, uint16_t *type)
+{
+	size_t hlen;
+
+	switch (pc->linktype) {
+	case 1:		/* Ethernet */
+		if (*len < 14)
+			return NULL;
+		*type = d[12] << 8 | d[13];
+		hlen = 14;
+		while ((*type == 0x8100 || *type == 0x88a8) &&
+		       *len >= hlen + 4) {
+			*type = d[hlen + 2] << 8 | d[hlen + 3];
+			hlen += 4;
+		}
+		break;
+	case 113:	/* Linux cooked */
+		if (*len < 16)
+			return NULL;
+		*type = d[14] << 8 | d[15];
+		hlen = 16;
+		break;
+	case 276:	/* Linux cooked v2 */
+		if (*len < 20)
+			return NULL;
+		*type = d[0] << 8 | d[1];
+		hlen = 20;
+		break;
+	case 12:
+	case 14:
+	case 101:	/* raw IP */
+	case 228:
+	case 229:
+		if (*len < 1)
+			return NULL;
+		*type = d[0] >> 4 == 6 ? 0x86dd : 0x0800;
+		hlen = 0;
+		break;
+	default:
+		xtables_error(OTHER_PROBLEM, "pcap link type %u unknown",
+			      pc->linktype);
+	}
+
+	*len -= hlen;
+	return d + hlen;
+}
+
+static void xsim_l4(struct xsim_pkt *p, const uint8_t *d, size_t len)
+{
+	if (p->frag)
+		return;
+
+	switch (p->proto) {
+	case IPPROTO_TCP:
+		if (len >= 14) {
+			p->flags = true;
+			p->tcp_flags = d[13];
+		}
+		/* fall through */
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+	case IPPROTO_SCTP:
+	case IPPROTO_DCCP:
+		if (len >= 4) {
+			p->ports = true;
+			p->sport = d[0] << 8 | d[1];
+			p->dport = d[2] << 8 | d[3];
+		}
+		break;
+	}
+}
+
+/* Decode an IPv4 or IPv6 packet, false for anything else. */
+static bool xsim_decode(struct xsim_pkt *p, const struct xsim_pcap *pc,
+			const uint8_t *d, size_t len)
+{
+	unsigned int hlen, off;
+	uint16_t type;
+	uint8_t next;
+
+	memset(p, 0, sizeof(*p));
+	p->mark = mark;
+	d = xsim_link(pc, d, &len, &type);
+	if (d == NULL)
+		return false;
+
+	if (type == 0x0800 && family == AF_INET) {
+		hlen = (d[0] & 0x0f) * 4;
+		if (len < 20 || d[0] >> 4 != 4 || hlen < 20 || len < hlen)
+			return false;
+		p->family = AF_INET;
+		p->proto = d[9];
+		p->frag = ((d[6] << 8 | d[7]) & 0x1fff) != 0;
+		memcpy(p->src, d + 12, 4);
+		memcpy(p->dst, d + 16, 4);
+		xsim_l4(p, d + hlen, len - hlen);
+		return true;
+	}
+
+	if (type != 0x86dd || family != AF_INET6 || len < 40 ||
+	    d[0] >> 4 != 6)
+		return false;
+	p->family = AF_INET6;
+	memcpy(p->src, d + 8, 16);
+	memcpy(p->dst, d + 24, 16);
+	next = d[6];
+	off = 40;
+	/* -p matches the protocol after the extension headers */
+	while (off + 8 <= len) {
+		if (next == IPPROTO_HOPOPTS || next == IPPROTO_ROUTING ||
+		    next == IPPROTO_DSTOPTS) {
+			hlen = (d[off + 1] + 1) * 8;
+		} else if (next == IPPROTO_AH) {
+			hlen = (d[off + 1] + 2) * 4;
+		} else if (next == IPPROTO_FRAGMENT) {
+			hlen = 8;
+			if ((d[off + 2] << 8 | d[off + 3]) & 0xfff8)
+				p->frag = true;
+		} else {
+			break;
+		}
+		next = d[off];
+		off += hlen;
+		if (p->frag)
+			break;
+	}
+	p->proto = next;
+	if (off <= len)
+		xsim_l4(p, d + off, len - off);
+	return true;
+}
+
+static void xsim_print_path(const char *verdict, uint64_t evals,
+			    uint64_t n, const struct xsim_step *path,
+			    unsigned int len)
+{
+	unsigned int i;
+
+	printf("%" PRIu64 " %s %" PRIu64, n, verdict, evals);
+	for (i = 0; i < len; i++) {
+		if (path[i].rule)
+			printf(" %s:%u", chains[path[i].chain].c->name,
+			       path[i].rule);
+		else
+			printf(" %s:policy", chains[path[i].chain].c->name);
+	}
+	printf("\n");
+}
+
+static void xsim_print_hits(uint64_t packets, uint64_t skipped,
+			    uint64_t evals)
+{
+	const struct xsim_chain *sc;
+	unsigned int i, j;
+
+	for (i = 0; i < nchains; i++) {
+		sc = &chains[i];
+		for (j = 0; j < sc->c->num; j++)
+			printf("%s %s rule %u: %" PRIu64 " evaluated, %"
+			       PRIu64 " matched\n", table->name, sc->c->name,
+			       j + 1, sc->rules[j].evals, sc->rules[j].hits);
+		if (sc->c->policy)
+			printf("%s %s policy: %" PRIu64 " packets\n",
+			       table->name, sc->c->name, sc->policy);
+	}
+	printf("total: %" PRIu64 " packets, %" PRIu64 " skipped, %" PRIu64
+	       " rule evaluations, %.2f per packet\n", packets, skipped,
+	       evals, packets ? (double)evals / packets : 0);
+}
+
+static FILE *xsim_open_ruleset(const char *file)
+{
+	static struct xs_snapshot snap;
+	FILE *in;
+
+	if (strcmp(file, "-") == 0)
+		return stdin;
+
+	in = fopen(file, "re");
+	if (in == NULL)
+		xtables_error(OTHER_PROBLEM, "Can't open %s: %s", file,
+			      strerror(errno));
+
+	/* a snapshot of iptables-save --binary carries the text as well */
+	if (xs_snapshot_read(&snap, in, family, "legacy") == 0) {
+		fclose(in);
+		return xs_snapshot_text(&snap);
+	}
+	rewind(in);
+	return in;
+}
+
+int xtables_sim_main(int argc, char *argv[])
+{
+	uint64_t n = 0, packets = 0, skipped = 0, evals = 0, pevals;
+	const char *tablename = "filter", *chain = "INPUT";
+	struct xs_ruleset rs = {};
+	struct xsim_step *path = NULL;
+	unsigned int i, j, len, size = 0, start;
+	const struct xs_rule_chain *c;
+	const char *verdict;
+	struct xsim_pcap pc;
+	struct xsim_pkt p;
+	const uint8_t *d;
+	size_t plen;
+	FILE *in;
+	char *end;
+	int opt;
+
+	xtables_set_params(&xtables_sim_globals);
+
+	while ((opt = getopt_long(argc, argv, "t:c:i:o:6qh", options,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			tablename = optarg;
+			break;
+		case 'c':
+			chain = optarg;
+			break;
+		case 'i':
+			iniface = optarg;
+			break;
+		case 'o':
+			outiface = optarg;
+			break;
+		case 's':
+			state = xsim_parse_states(optarg);
+			if (state == 0)
+				xtables_error(PARAMETER_PROBLEM,
+					      "state \"%s\" unknown", optarg);
+			break;
+		case 'm':
+			mark = strtoul(optarg, &end, 0);
+			if (*end)
+				xtables_error(PARAMETER_PROBLEM,
+					      "mark \"%s\" invalid", optarg);
+			break;
+		case '6':
+			family = AF_INET6;
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			exit(0);
+		default:
+			print_usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	if (optind != argc - 2) {
+		print_usage(argv[0]);
+		exit(1);
+	}
+
+	in = xsim_open_ruleset(argv[optind]);
+	xs_ruleset_read(&rs, in);
+	if (in != stdin)
+		fclose(in);
+	if (rs.family)
+		family = rs.family;
+
+	for (i = rs.num; i > 0 && table == NULL; i--)
+		if (strcmp(rs.tables[i - 1].name, tablename) == 0)
+			table = &rs.tables[i - 1];
+	if (table == NULL)
+		xtables_error(PARAMETER_PROBLEM, "no table %s in the ruleset",
+			      tablename);
+	c = xs_rule_chain_find((struct xs_rule_table *)table, chain);
+	if (c == NULL || c->policy == NULL)
+		xtables_error(PARAMETER_PROBLEM, "no base chain %s in table %s",
+			      chain, tablename);
+	start = c - table->chains;
+
+	xsim_load();
+
+	xsim_pcap_open(&pc, argv[optind + 1]);
+	while ((d = xsim_pcap_next(&pc, &plen))) {
+		n++;
+		if (!xsim_decode(&p, &pc, d, plen)) {
+			skipped++;
+			continue;
+		}
+		verdict = xsim_run(&p, start, &path, &len, &size, &pevals);
+		packets++;
+		evals += pevals;
+		if (!quiet)
+			xsim_print_path(verdict, pevals, n, path, len);
+	}
+	fclose(pc.in);
+
+	xsim_print_hits(packets, skipped, evals);
+
+	for (i = 0; i < nchains; i++) {
+		for (j = 0; j < chains[i].c->num; j++)
+			free(chains[i].rules[j].matches);
+		free(chains[i].rules);
+	}
+	free(chains);
+	free(stack);
+	free(path);
+	free(pc.buf);
+	xs_ruleset_free(&rs);
+	return 0;
+}
@@ -48,6 +48,10 @@ xtables_main(int family, const char *progname, int argc, char *argv[])
 		.family = family,
 	};
 
+	ret = xtables_daemon_forward(family, argc, argv);
+	if (ret >= 0)
+		exit(ret);
+
 	xtables_globals.program_name = progname;
 	ret = xtables_init_all(&xtables_globals, family);
 	if (ret < 0) {
@@ -69,7 +73,10 @@ xtables_main(int family, const char *progname, int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	xtables_output_init(stdout);
+	xs_profile_begin(XS_PROF_PARSE);
 	ret = do_commandx(&h, argc, argv, &table, false);
+	xs_profile_end(XS_PROF_PARSE);
 	if (ret)
 		ret = nft_commit(&h);
 
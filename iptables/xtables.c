@@ -87,6 +87,7 @@ static struct option original_opts[] = {
 	{.name = "verbose",	  .has_arg = 0, .val = 'v'},
 	{.name = "wait",	  .has_arg = 2, .val = 'w'},
 	{.name = "wait-interval", .has_arg = 2, .val = 'W'},
+	{.name = "profile",	  .has_arg = 2, .val = 'Q'},
 	{.name = "exact",	  .has_arg = 0, .val = 'x'},
 	{.name = "fragments",	  .has_arg = 0, .val = 'f'},
 	{.name = "version",	  .has_arg = 0, .val = 'V'},
@@ -160,6 +161,17 @@ static const int inverse_for_options[NUMBER_OF_OPT] =
 #define prog_name xt_params->program_name
 #define prog_vers xt_params->program_version
 
+/* Called instead of exit() if set, for commands run in-process */
+void (*xtables_exit_hook)(int status);
+
+static void __attribute__((noreturn))
+xtables_exit(int status)
+{
+	if (xtables_exit_hook)
+		xtables_exit_hook(status);
+	exit(status);
+}
+
 static void __attribute__((noreturn))
 exit_tryhelp(int status)
 {
@@ -168,7 +180,7 @@ exit_tryhelp(int status)
 	fprintf(stderr, "Try `%s -h' or '%s --help' for more information.\n",
 			prog_name, prog_name);
 	xtables_free_opts(1);
-	exit(status);
+	xtables_exit(status);
 }
 
 static void
@@ -243,6 +255,7 @@ exit_printhelp(const struct xtables_rule_match *matches)
 "  --wait	-w [seconds]	maximum wait to acquire xtables lock before give up\n"
 "  --wait-interval -W [usecs]	wait time to try to acquire xtables lock\n"
 "				default is 1 second\n"
+"  --profile[=file]		report time and memory per phase\n"
 "  --line-numbers		print line numbers when listing\n"
 "  --exact	-x		expand numbers (display exact values)\n"
 "[!] --fragment	-f		match second or further fragments only\n"
@@ -251,7 +264,7 @@ exit_printhelp(const struct xtables_rule_match *matches)
 "[!] --version	-V		print package version.\n");
 
 	print_extension_helps(xtables_targets, matches);
-	exit(0);
+	xtables_exit(0);
 }
 
 void
@@ -271,7 +284,7 @@ xtables_exit_error(enum xtables_exittype status, const char *msg, ...)
 			"Perhaps iptables or your kernel needs to be upgraded.\n");
 	/* On error paths, make sure that we don't leak memory */
 	xtables_free_opts(1);
-	exit(status);
+	xtables_exit(status);
 }
 
 static void
@@ -581,12 +594,25 @@ list_rules(struct nft_handle *h, const char *chain, const char *table,
 	return nft_rule_list_save(h, chain, table, rulenum, counters);
 }
 
+/*
+ * Listing with -Z: have the kernel zero the rule counters while handing
+ * them out, so the listing shows exactly what was zeroed.
+ */
+static void list_zero_counters(struct nft_handle *h,
+			       const struct nft_xt_cmd_parse *p)
+{
+	if (p->command & CMD_ZERO)
+		nft_rule_counters_reset(h, p->chain, p->table, -1);
+	else if (p->command & CMD_ZERO_NUM)
+		nft_rule_counters_reset(h, p->chain, p->table,
+					p->rulenum - 1);
+}
+
 void do_parse(struct nft_handle *h, int argc, char *argv[],
 	      struct nft_xt_cmd_parse *p, struct iptables_command_state *cs,
 	      struct xtables_args *args)
 {
 	struct xtables_match *m;
-	struct xtables_rule_match *matchp;
 	bool wait_interval_set = false;
 	struct timeval wait_interval;
 	struct xtables_target *t;
@@ -897,7 +923,7 @@ void do_parse(struct nft_handle *h, int argc, char *argv[],
 			else
 				printf("%s v%s (nf_tables)\n",
 				       prog_name, prog_vers);
-			exit(0);
+			xtables_exit(0);
 
 		case 'w':
 			if (p->restore) {
@@ -920,6 +946,15 @@ void do_parse(struct nft_handle *h, int argc, char *argv[],
 			wait_interval_set = true;
 			break;
 
+		case 'Q':
+			if (p->restore) {
+				xtables_error(PARAMETER_PROBLEM,
+					      "You cannot use `--profile' from "
+					      "iptables-restore");
+			}
+			/* taken by xs_profile_init() already */
+			break;
+
 		case '0':
 			set_option(&cs->options, OPT_LINENUMBERS,
 				   &args->invflags, cs->invert);
@@ -1010,10 +1045,7 @@ void do_parse(struct nft_handle *h, int argc, char *argv[],
 		xtables_error(PARAMETER_PROBLEM,
 			      "--wait-interval only makes sense with --wait\n");
 
-	for (matchp = cs->matches; matchp; matchp = matchp->next)
-		xtables_option_mfcall(matchp->match);
-	if (cs->target != NULL)
-		xtables_option_tfcall(cs->target);
+	xs_option_fcheck(cs);
 
 	/* Fix me: must put inverse options checking here --MN */
 
@@ -1077,6 +1109,73 @@ void do_parse(struct nft_handle *h, int argc, char *argv[],
 	}
 }
 
+static void release_parse(struct nft_handle *h,
+			  struct iptables_command_state *cs,
+			  struct xtables_args *args)
+{
+	xtables_rule_matches_free(&cs->matches);
+	if (cs->target) {
+		free(cs->target->t);
+		cs->target->t = NULL;
+	}
+
+	if (h->family == AF_INET) {
+		free(args->s.addr.v4);
+		free(args->s.mask.v4);
+		free(args->d.addr.v4);
+		free(args->d.mask.v4);
+	} else if (h->family == AF_INET6) {
+		free(args->s.addr.v6);
+		free(args->s.mask.v6);
+		free(args->d.addr.v6);
+		free(args->d.mask.v6);
+	}
+	xtables_free_opts(1);
+}
+
+/*
+ * The parse state of the command in progress lives here rather than on
+ * the stack of do_commandx(), so that do_commandx_abort() can still
+ * release it once xtables_exit_hook has unwound past that frame.
+ */
+static struct {
+	struct nft_handle		*h;
+	struct iptables_command_state	cs;
+	struct xtables_args		args;
+} xt_cmd;
+
+static void xt_cmd_end(void)
+{
+	struct nft_handle *h = xt_cmd.h;
+
+	if (!h)
+		return;
+
+	xt_cmd.h = NULL;
+	release_parse(h, &xt_cmd.cs, &xt_cmd.args);
+}
+
+static void xt_cmd_begin(struct nft_handle *h)
+{
+	/* left over if the last command was not released */
+	xt_cmd_end();
+	memset(&xt_cmd, 0, sizeof(xt_cmd));
+	xt_cmd.h = h;
+	xt_cmd.args.family = h->family;
+}
+
+/**
+ * do_commandx_abort - release a command that ended through xtables_exit()
+ *
+ * Callers that catch xtables_exit_hook and go on running commands call
+ * this first, otherwise the matches, target and addresses parsed for the
+ * aborted command are leaked and the extensions keep pointing at them.
+ */
+void do_commandx_abort(void)
+{
+	xt_cmd_end();
+}
+
 int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
 		bool restore)
 {
@@ -1085,50 +1184,49 @@ int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
 		.table		= *table,
 		.restore	= restore,
 	};
-	struct iptables_command_state cs;
-	struct xtables_args args = {
-		.family = h->family,
-	};
+	struct iptables_command_state *cs = &xt_cmd.cs;
+	struct xtables_args *args = &xt_cmd.args;
 
-	do_parse(h, argc, argv, &p, &cs, &args);
+	xt_cmd_begin(h);
+	do_parse(h, argc, argv, &p, cs, args);
 
 	switch (p.command) {
 	case CMD_APPEND:
-		ret = add_entry(p.chain, p.table, &cs, 0, h->family,
-				args.s, args.d,
-				cs.options & OPT_VERBOSE, h, true);
+		ret = add_entry(p.chain, p.table, cs, 0, h->family,
+				args->s, args->d,
+				cs->options & OPT_VERBOSE, h, true);
 		break;
 	case CMD_DELETE:
-		ret = delete_entry(p.chain, p.table, &cs, h->family,
-				   args.s, args.d,
-				   cs.options & OPT_VERBOSE, h);
+		ret = delete_entry(p.chain, p.table, cs, h->family,
+				   args->s, args->d,
+				   cs->options & OPT_VERBOSE, h);
 		break;
 	case CMD_DELETE_NUM:
 		ret = nft_rule_delete_num(h, p.chain, p.table,
 					  p.rulenum - 1, p.verbose);
 		break;
 	case CMD_CHECK:
-		ret = check_entry(p.chain, p.table, &cs, h->family,
-				  args.s, args.d,
-				  cs.options & OPT_VERBOSE, h);
+		ret = check_entry(p.chain, p.table, cs, h->family,
+				  args->s, args->d,
+				  cs->options & OPT_VERBOSE, h);
 		break;
 	case CMD_REPLACE:
-		ret = replace_entry(p.chain, p.table, &cs, p.rulenum - 1,
-				    h->family, args.s, args.d,
-				    cs.options & OPT_VERBOSE, h);
+		ret = replace_entry(p.chain, p.table, cs, p.rulenum - 1,
+				    h->family, args->s, args->d,
+				    cs->options & OPT_VERBOSE, h);
 		break;
 	case CMD_INSERT:
-		ret = add_entry(p.chain, p.table, &cs, p.rulenum - 1,
-				h->family, args.s, args.d,
-				cs.options&OPT_VERBOSE, h, false);
+		ret = add_entry(p.chain, p.table, cs, p.rulenum - 1,
+				h->family, args->s, args->d,
+				cs->options&OPT_VERBOSE, h, false);
 		break;
 	case CMD_FLUSH:
 		ret = nft_rule_flush(h, p.chain, p.table,
-				     cs.options & OPT_VERBOSE);
+				     cs->options & OPT_VERBOSE);
 		break;
 	case CMD_ZERO:
 		ret = nft_chain_zero_counters(h, p.chain, p.table,
-					      cs.options & OPT_VERBOSE);
+					      cs->options & OPT_VERBOSE);
 		break;
 	case CMD_ZERO_NUM:
 		ret = nft_rule_zero_counters(h, p.chain, p.table,
@@ -1137,14 +1235,15 @@ int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
 	case CMD_LIST:
 	case CMD_LIST|CMD_ZERO:
 	case CMD_LIST|CMD_ZERO_NUM:
+		list_zero_counters(h, &p);
 		ret = list_entries(h, p.chain, p.table, p.rulenum,
-				   cs.options & OPT_VERBOSE,
-				   cs.options & OPT_NUMERIC,
-				   cs.options & OPT_EXPANDED,
-				   cs.options & OPT_LINENUMBERS);
+				   cs->options & OPT_VERBOSE,
+				   cs->options & OPT_NUMERIC,
+				   cs->options & OPT_EXPANDED,
+				   cs->options & OPT_LINENUMBERS);
 		if (ret && (p.command & CMD_ZERO)) {
 			ret = nft_chain_zero_counters(h, p.chain, p.table,
-						      cs.options & OPT_VERBOSE);
+						      cs->options & OPT_VERBOSE);
 		}
 		if (ret && (p.command & CMD_ZERO_NUM)) {
 			ret = nft_rule_zero_counters(h, p.chain, p.table,
@@ -1155,11 +1254,12 @@ int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
 	case CMD_LIST_RULES:
 	case CMD_LIST_RULES|CMD_ZERO:
 	case CMD_LIST_RULES|CMD_ZERO_NUM:
+		list_zero_counters(h, &p);
 		ret = list_rules(h, p.chain, p.table, p.rulenum,
-				 cs.options & OPT_VERBOSE);
+				 cs->options & OPT_VERBOSE);
 		if (ret && (p.command & CMD_ZERO)) {
 			ret = nft_chain_zero_counters(h, p.chain, p.table,
-						      cs.options & OPT_VERBOSE);
+						      cs->options & OPT_VERBOSE);
 		}
 		if (ret && (p.command & CMD_ZERO_NUM)) {
 			ret = nft_rule_zero_counters(h, p.chain, p.table,
@@ -1172,7 +1272,7 @@ int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
 		break;
 	case CMD_DELETE_CHAIN:
 		ret = nft_chain_user_del(h, p.chain, p.table,
-					 cs.options & OPT_VERBOSE);
+					 cs->options & OPT_VERBOSE);
 		break;
 	case CMD_RENAME_CHAIN:
 		ret = nft_chain_user_rename(h, p.chain, p.table, p.newname);
@@ -1188,26 +1288,27 @@ int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
 		exit_tryhelp(2);
 	}
 
+	h->counters_reset = false;
 	*table = p.table;
+	xt_cmd_end();
 
-	xtables_rule_matches_free(&cs.matches);
-	if (cs.target) {
-		free(cs.target->t);
-		cs.target->t = NULL;
-	}
+	return ret;
+}
 
-	if (h->family == AF_INET) {
-		free(args.s.addr.v4);
-		free(args.s.mask.v4);
-		free(args.d.addr.v4);
-		free(args.d.mask.v4);
-	} else if (h->family == AF_INET6) {
-		free(args.s.addr.v6);
-		free(args.s.mask.v6);
-		free(args.d.addr.v6);
-		free(args.d.mask.v6);
-	}
-	xtables_free_opts(1);
+/* Parse a command line like do_commandx(), but do not run it. */
+int do_parsex(struct nft_handle *h, int argc, char *argv[], char **table)
+{
+	struct nft_xt_cmd_parse p = {
+		.table		= *table,
+	};
+	struct iptables_command_state *cs = &xt_cmd.cs;
+	struct xtables_args *args = &xt_cmd.args;
 
-	return ret;
+	xt_cmd_begin(h);
+	do_parse(h, argc, argv, &p, cs, args);
+
+	*table = p.table;
+	xt_cmd_end();
+
+	return 1;
 }
@@ -84,9 +84,16 @@ typedef unsigned int socklen_t;
 #define TC_RENAME_CHAIN		iptc_rename_chain
 #define TC_SET_POLICY		iptc_set_policy
 #define TC_GET_RAW_SOCKET	iptc_get_raw_socket
+#define TC_SET_PHASE_HOOK	iptc_set_phase_hook
 #define TC_INIT			iptc_init
+#define TC_INIT_SNAPSHOT	iptc_init_snapshot
 #define TC_FREE			iptc_free
 #define TC_COMMIT		iptc_commit
+#define TC_SNAPSHOT		iptc_snapshot
+#define TC_REPLACE_SNAPSHOT	iptc_replace_snapshot
+#define TC_DIFF_CHAIN		iptc_diff_chain
+#define TC_DIFF_ENTRY		iptc_diff_entry
+#define TC_DIFF_END		iptc_diff_end
 #define TC_STRERROR		iptc_strerror
 #define TC_NUM_RULES		iptc_num_rules
 #define TC_GET_RULE		iptc_get_rule
@@ -100,6 +107,8 @@ typedef unsigned int socklen_t;
 #define SO_GET_INFO		IPT_SO_GET_INFO
 #define SO_GET_ENTRIES		IPT_SO_GET_ENTRIES
 #define SO_GET_VERSION		IPT_SO_GET_VERSION
+#define SO_GET_REVISION_MATCH	IPT_SO_GET_REVISION_MATCH
+#define SO_GET_REVISION_TARGET	IPT_SO_GET_REVISION_TARGET
 
 #define STANDARD_TARGET		XT_STANDARD_TARGET
 #define LABEL_RETURN		IPTC_LABEL_RETURN
@@ -209,6 +218,33 @@ is_same(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b, unsigned char *matchmask)
 	return mptr;
 }
 
+/* Hash the fields is_same() compares regardless of the mask. */
+static uint32_t
+entry_digest(const STRUCT_ENTRY *e)
+{
+	uint32_t h = 2166136261U;
+	unsigned char c;
+	unsigned int i;
+
+	h = iptcc_fnv(h, &e->ip.src, sizeof(e->ip.src));
+	h = iptcc_fnv(h, &e->ip.dst, sizeof(e->ip.dst));
+	h = iptcc_fnv(h, &e->ip.smsk, sizeof(e->ip.smsk));
+	h = iptcc_fnv(h, &e->ip.dmsk, sizeof(e->ip.dmsk));
+	h = iptcc_fnv(h, &e->ip.proto, sizeof(e->ip.proto));
+	h = iptcc_fnv(h, &e->ip.flags, sizeof(e->ip.flags));
+	h = iptcc_fnv(h, &e->ip.invflags, sizeof(e->ip.invflags));
+
+	for (i = 0; i < IFNAMSIZ; i++) {
+		c = e->ip.iniface[i] & e->ip.iniface_mask[i];
+		h = iptcc_fnv(h, &c, 1);
+		c = e->ip.outiface[i] & e->ip.outiface_mask[i];
+		h = iptcc_fnv(h, &c, 1);
+	}
+
+	h = iptcc_fnv(h, &e->target_offset, sizeof(e->target_offset));
+	return iptcc_fnv(h, &e->next_offset, sizeof(e->next_offset));
+}
+
 #if 0
 /***************************** DEBUGGING ********************************/
 static inline int
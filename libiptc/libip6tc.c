@@ -82,9 +82,16 @@ typedef unsigned int socklen_t;
 #define TC_RENAME_CHAIN		ip6tc_rename_chain
 #define TC_SET_POLICY		ip6tc_set_policy
 #define TC_GET_RAW_SOCKET	ip6tc_get_raw_socket
+#define TC_SET_PHASE_HOOK	ip6tc_set_phase_hook
 #define TC_INIT			ip6tc_init
+#define TC_INIT_SNAPSHOT	ip6tc_init_snapshot
 #define TC_FREE			ip6tc_free
 #define TC_COMMIT		ip6tc_commit
+#define TC_SNAPSHOT		ip6tc_snapshot
+#define TC_REPLACE_SNAPSHOT	ip6tc_replace_snapshot
+#define TC_DIFF_CHAIN		ip6tc_diff_chain
+#define TC_DIFF_ENTRY		ip6tc_diff_entry
+#define TC_DIFF_END		ip6tc_diff_end
 #define TC_STRERROR		ip6tc_strerror
 #define TC_NUM_RULES		ip6tc_num_rules
 #define TC_GET_RULE		ip6tc_get_rule
@@ -98,6 +105,8 @@ typedef unsigned int socklen_t;
 #define SO_GET_INFO		IP6T_SO_GET_INFO
 #define SO_GET_ENTRIES		IP6T_SO_GET_ENTRIES
 #define SO_GET_VERSION		IP6T_SO_GET_VERSION
+#define SO_GET_REVISION_MATCH	IP6T_SO_GET_REVISION_MATCH
+#define SO_GET_REVISION_TARGET	IP6T_SO_GET_REVISION_TARGET
 
 #define STANDARD_TARGET		XT_STANDARD_TARGET
 #define LABEL_RETURN		IP6TC_LABEL_RETURN
@@ -244,6 +253,34 @@ is_same(const STRUCT_ENTRY *a, const STRUCT_ENTRY *b,
 	return mptr;
 }
 
+/* Hash the fields is_same() compares regardless of the mask. */
+static uint32_t
+entry_digest(const STRUCT_ENTRY *e)
+{
+	uint32_t h = 2166136261U;
+	unsigned char c;
+	unsigned int i;
+
+	h = iptcc_fnv(h, &e->ipv6.src, sizeof(e->ipv6.src));
+	h = iptcc_fnv(h, &e->ipv6.dst, sizeof(e->ipv6.dst));
+	h = iptcc_fnv(h, &e->ipv6.smsk, sizeof(e->ipv6.smsk));
+	h = iptcc_fnv(h, &e->ipv6.dmsk, sizeof(e->ipv6.dmsk));
+	h = iptcc_fnv(h, &e->ipv6.proto, sizeof(e->ipv6.proto));
+	h = iptcc_fnv(h, &e->ipv6.tos, sizeof(e->ipv6.tos));
+	h = iptcc_fnv(h, &e->ipv6.flags, sizeof(e->ipv6.flags));
+	h = iptcc_fnv(h, &e->ipv6.invflags, sizeof(e->ipv6.invflags));
+
+	for (i = 0; i < IFNAMSIZ; i++) {
+		c = e->ipv6.iniface[i] & e->ipv6.iniface_mask[i];
+		h = iptcc_fnv(h, &c, 1);
+		c = e->ipv6.outiface[i] & e->ipv6.outiface_mask[i];
+		h = iptcc_fnv(h, &c, 1);
+	}
+
+	h = iptcc_fnv(h, &e->target_offset, sizeof(e->target_offset));
+	return iptcc_fnv(h, &e->next_offset, sizeof(e->next_offset));
+}
+
 /* All zeroes == unconditional rule. */
 static inline int
 unconditional(const struct ip6t_ip6 *ipv6)
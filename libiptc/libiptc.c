@@ -57,6 +57,7 @@
 #endif
 
 static void *iptc_fn = NULL;
+static xtc_phase_hook iptc_phase_hook;
 
 static const char *hooknames[] = {
 	[HOOK_PRE_ROUTING]	= "PREROUTING",
@@ -122,6 +123,14 @@ struct chain_head
 	unsigned int head_offset;	/* offset in rule blob */
 	unsigned int foot_index;	/* index (needed for counter_map) */
 	unsigned int foot_offset;	/* offset in rule blob */
+
+	/* differential update state, see TC_DIFF_ENTRY() */
+	int diff_kept;			/* declared part of the new ruleset */
+	unsigned int diff_pos;		/* position of diff_next */
+	struct rule_head *diff_next;	/* first old rule not matched yet */
+	struct iptcc_diff_node **diff_hash;
+	struct iptcc_diff_node *diff_nodes;
+	unsigned int diff_hsize;
 };
 
 struct xtc_handle {
@@ -1299,15 +1308,25 @@ out_free_handle:
 	return NULL;
 }
 
+static inline void iptcc_phase(enum xtc_phase phase, int end)
+{
+	if (iptc_phase_hook)
+		iptc_phase_hook(phase, end);
+}
 
-struct xtc_handle *
-TC_INIT(const char *tablename)
+void TC_SET_PHASE_HOOK(xtc_phase_hook hook)
+{
+	iptc_phase_hook = hook;
+}
+
+static struct xtc_handle *
+iptcc_init(const char *tablename)
 {
 	struct xtc_handle *h;
 	STRUCT_GETINFO info;
 	unsigned int tmp;
 	socklen_t s;
-	int sockfd;
+	int sockfd, ret;
 
 retry:
 	iptc_fn = TC_INIT;
@@ -1352,8 +1371,11 @@ retry:
 
 	tmp = sizeof(STRUCT_GET_ENTRIES) + h->info.size;
 
-	if (getsockopt(h->sockfd, TC_IPPROTO, SO_GET_ENTRIES, h->entries,
-		       &tmp) < 0)
+	iptcc_phase(XTC_PHASE_GET_ENTRIES, 0);
+	ret = getsockopt(h->sockfd, TC_IPPROTO, SO_GET_ENTRIES, h->entries,
+			 &tmp);
+	iptcc_phase(XTC_PHASE_GET_ENTRIES, 1);
+	if (ret < 0)
 		goto error;
 
 #ifdef IPTC_DEBUG2
@@ -1367,7 +1389,10 @@ retry:
 	}
 #endif
 
-	if (parse_table(h) < 0)
+	iptcc_phase(XTC_PHASE_PARSE, 0);
+	ret = parse_table(h);
+	iptcc_phase(XTC_PHASE_PARSE, 1);
+	if (ret < 0)
 		goto error;
 
 	CHECK(h);
@@ -1380,13 +1405,26 @@ error:
 	return NULL;
 }
 
+struct xtc_handle *
+TC_INIT(const char *tablename)
+{
+	struct xtc_handle *h;
+
+	iptcc_phase(XTC_PHASE_INIT, 0);
+	h = iptcc_init(tablename);
+	iptcc_phase(XTC_PHASE_INIT, 1);
+
+	return h;
+}
+
 void
 TC_FREE(struct xtc_handle *h)
 {
 	struct chain_head *c, *tmp;
 
 	iptc_fn = TC_FREE;
-	close(h->sockfd);
+	if (h->sockfd >= 0)
+		close(h->sockfd);
 
 	list_for_each_entry_safe(c, tmp, &h->chains, list) {
 		struct rule_head *r, *rtmp;
@@ -1395,6 +1433,8 @@ TC_FREE(struct xtc_handle *h)
 			free(r);
 		}
 
+		free(c->diff_hash);
+		free(c->diff_nodes);
 		free(c);
 	}
 
@@ -2408,6 +2448,252 @@ int TC_RENAME_CHAIN(const IPT_CHAINLABEL oldname,
 	return 1;
 }
 
+/**********************************************************************
+ * DIFFERENTIAL UPDATE
+ **********************************************************************/
+
+/* Old rules of a chain, hashed by the parts of a rule is_same() and
+ * target_same() compare without a mask.  Buckets keep chain order, so
+ * the first node past the cursor is the earliest candidate. */
+struct iptcc_diff_node {
+	struct iptcc_diff_node *next;
+	struct rule_head *r;
+	unsigned int pos;		/* position among the old rules */
+};
+
+/* Candidates to compare before a new rule is taken as an insertion. */
+#define IPTCC_DIFF_TRIES	1024
+
+static uint32_t entry_digest(const STRUCT_ENTRY *e);
+
+static uint32_t iptcc_fnv(uint32_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619;
+	}
+	return h;
+}
+
+static uint32_t iptcc_diff_digest(struct rule_head *r)
+{
+	STRUCT_ENTRY_TARGET *t = GET_TARGET(r->entry);
+	uint32_t h = entry_digest(r->entry);
+
+	h = iptcc_fnv(h, &r->type, sizeof(r->type));
+	switch (r->type) {
+	case IPTCC_R_JUMP:
+		return iptcc_fnv(h, &r->jump, sizeof(r->jump));
+	case IPTCC_R_STANDARD:
+		return iptcc_fnv(h, &((STRUCT_STANDARD_TARGET *)t)->verdict,
+				 sizeof(int));
+	case IPTCC_R_MODULE:
+		return iptcc_fnv(h, t->u.user.name, strlen(t->u.user.name));
+	default:
+		return h;
+	}
+}
+
+static void iptcc_diff_free(struct chain_head *c)
+{
+	free(c->diff_hash);
+	free(c->diff_nodes);
+	c->diff_hash = NULL;
+	c->diff_nodes = NULL;
+	c->diff_hsize = 0;
+}
+
+/* Put the cursor on the first rule of chain `c' and index its rules. */
+static int iptcc_diff_start(struct chain_head *c)
+{
+	struct iptcc_diff_node *n;
+	struct rule_head *r;
+	unsigned int pos = c->num_rules;
+
+	c->diff_kept = 1;
+	c->diff_pos = 0;
+	c->diff_next = c->num_rules ?
+		list_entry(c->rules.next, struct rule_head, list) : NULL;
+	if (!c->num_rules)
+		return 1;
+
+	c->diff_hsize = c->num_rules * 2;
+	c->diff_hash = calloc(c->diff_hsize, sizeof(*c->diff_hash));
+	c->diff_nodes = calloc(c->num_rules, sizeof(*c->diff_nodes));
+	if (!c->diff_hash || !c->diff_nodes) {
+		iptcc_diff_free(c);
+		errno = ENOMEM;
+		return 0;
+	}
+
+	/* walk backwards and push, so each bucket is in chain order */
+	list_for_each_entry_reverse(r, &c->rules, list) {
+		uint32_t h = iptcc_diff_digest(r) % c->diff_hsize;
+
+		n = &c->diff_nodes[--pos];
+		n->r = r;
+		n->pos = pos;
+		n->next = c->diff_hash[h];
+		c->diff_hash[h] = n;
+	}
+	return 1;
+}
+
+/* Delete the old rules from the cursor up to, not including, `stop'. */
+static void iptcc_diff_drop(struct chain_head *c, struct rule_head *stop,
+			    struct xtc_handle *handle)
+{
+	struct rule_head *r;
+
+	while (c->diff_next && c->diff_next != stop) {
+		r = c->diff_next;
+		c->diff_next = r->list.next == &c->rules ? NULL :
+			list_entry(r->list.next, struct rule_head, list);
+		c->diff_pos++;
+
+		if (r == handle->rule_iterator_cur)
+			handle->rule_iterator_cur =
+				list_entry(r->list.prev, struct rule_head,
+					   list);
+		c->num_rules--;
+		iptcc_delete_rule(r);
+		set_changed(handle);
+	}
+}
+
+/* Declare `chain' part of the new ruleset, creating it if needed.  Its
+ * old rules are matched against the ones passed to TC_DIFF_ENTRY() from
+ * here on. */
+int
+TC_DIFF_CHAIN(const IPT_CHAINLABEL chain, struct xtc_handle *handle)
+{
+	struct chain_head *c;
+
+	iptc_fn = TC_DIFF_CHAIN;
+
+	c = iptcc_find_label(chain, handle);
+	if (!c) {
+		if (!TC_CREATE_CHAIN(chain, handle))
+			return 0;
+		c = iptcc_find_label(chain, handle);
+	}
+	if (c->diff_kept)
+		return 1;
+
+	return iptcc_diff_start(c);
+}
+
+/* Make `e' the next rule of `chain'.  An equal old rule further down
+ * the chain is kept along with its counters, and the old rules skipped
+ * to reach it are deleted; otherwise `e' is inserted at the cursor. */
+int
+TC_DIFF_ENTRY(const IPT_CHAINLABEL chain, const STRUCT_ENTRY *e,
+	      unsigned char *matchmask, struct xtc_handle *handle)
+{
+	struct iptcc_diff_node **pp, *n;
+	struct chain_head *c;
+	struct rule_head *r;
+	unsigned int tries;
+
+	iptc_fn = TC_DIFF_ENTRY;
+	if (!(c = iptcc_find_label(chain, handle))) {
+		errno = ENOENT;
+		return 0;
+	}
+	if (!c->diff_kept && !iptcc_diff_start(c))
+		return 0;
+
+	if (!(r = iptcc_alloc_rule(c, e->next_offset))) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	memcpy(r->entry, e, e->next_offset);
+	r->counter_map.maptype = COUNTER_MAP_SET;
+	if (!iptcc_map_target(handle, r, true)) {
+		free(r);
+		return 0;
+	}
+
+	n = NULL;
+	if (c->diff_next) {
+		pp = &c->diff_hash[iptcc_diff_digest(r) % c->diff_hsize];
+
+		/* nodes behind the cursor may have been freed, unlink
+		 * them before touching anything else */
+		while (*pp && (*pp)->pos < c->diff_pos)
+			*pp = (*pp)->next;
+
+		for (n = *pp, tries = 0; n && tries < IPTCC_DIFF_TRIES;
+		     n = n->next, tries++) {
+			unsigned char *mask;
+
+			mask = is_same(r->entry, n->r->entry, matchmask);
+			if (mask && target_same(r, n->r, mask))
+				break;
+		}
+		if (tries == IPTCC_DIFF_TRIES)
+			n = NULL;
+	}
+
+	if (n) {
+		iptcc_diff_drop(c, n->r, handle);
+		c->diff_next = n->r->list.next == &c->rules ? NULL :
+			list_entry(n->r->list.next, struct rule_head, list);
+		c->diff_pos++;
+
+		if (r->type == IPTCC_R_JUMP)
+			r->jump->references--;
+		free(r);
+		return 1;
+	}
+
+	list_add_tail(&r->list, c->diff_next ? &c->diff_next->list :
+					       &c->rules);
+	c->num_rules++;
+	set_changed(handle);
+
+	return 1;
+}
+
+/* Finish a differential update: delete the old rules left after each
+ * cursor, flush built-in chains that were not declared and delete such
+ * user-defined chains. */
+int
+TC_DIFF_END(struct xtc_handle *handle)
+{
+	struct chain_head *c, *tmp;
+	struct rule_head *r, *rtmp;
+
+	iptc_fn = TC_DIFF_END;
+
+	list_for_each_entry(c, &handle->chains, list) {
+		if (c->diff_kept) {
+			iptcc_diff_drop(c, NULL, handle);
+			iptcc_diff_free(c);
+			continue;
+		}
+		list_for_each_entry_safe(r, rtmp, &c->rules, list) {
+			iptcc_delete_rule(r);
+			set_changed(handle);
+		}
+		c->num_rules = 0;
+	}
+
+	list_for_each_entry_safe(c, tmp, &handle->chains, list) {
+		if (c->diff_kept) {
+			c->diff_kept = 0;
+			continue;
+		}
+		if (!iptcc_is_builtin(c) && !TC_DELETE_CHAIN(c->name, handle))
+			return 0;
+	}
+
+	return 1;
+}
+
 /* Sets the policy on a built-in chain. */
 int
 TC_SET_POLICY(const IPT_CHAINLABEL chain,
@@ -2519,13 +2805,14 @@ static void counters_map_set(STRUCT_COUNTERS_INFO *newcounters,
 }
 
 
-int
-TC_COMMIT(struct xtc_handle *handle)
+static int
+iptcc_commit(struct xtc_handle *handle)
 {
 	/* Replace, then map back the counters. */
 	STRUCT_REPLACE *repl;
 	STRUCT_COUNTERS_INFO *newcounters;
 	struct chain_head *c;
+	bool compiling = true;
 	int ret;
 	size_t counterlen;
 	int new_number;
@@ -2538,6 +2825,7 @@ TC_COMMIT(struct xtc_handle *handle)
 	if (!handle->changed)
 		goto finished;
 
+	iptcc_phase(XTC_PHASE_COMPILE, 0);
 	new_number = iptcc_compile_table_prep(handle, &new_size);
 	if (new_number < 0) {
 		errno = ENOMEM;
@@ -2584,6 +2872,8 @@ TC_COMMIT(struct xtc_handle *handle)
 		repl->num_entries, repl->size, repl->num_counters);
 
 	ret = iptcc_compile_table(handle, repl);
+	iptcc_phase(XTC_PHASE_COMPILE, 1);
+	compiling = false;
 	if (ret < 0) {
 		errno = ret;
 		goto out_free_newcounters;
@@ -2601,12 +2891,15 @@ TC_COMMIT(struct xtc_handle *handle)
 	}
 #endif
 
+	iptcc_phase(XTC_PHASE_REPLACE, 0);
 	ret = setsockopt(handle->sockfd, TC_IPPROTO, SO_SET_REPLACE, repl,
 			 sizeof(*repl) + repl->size);
+	iptcc_phase(XTC_PHASE_REPLACE, 1);
 	if (ret < 0)
 		goto out_free_newcounters;
 
 	/* Put counters back. */
+	iptcc_phase(XTC_PHASE_COUNTERS, 0);
 	strcpy(newcounters->name, handle->info.name);
 	newcounters->num_counters = new_number;
 
@@ -2679,6 +2972,7 @@ TC_COMMIT(struct xtc_handle *handle)
 
 	ret = setsockopt(handle->sockfd, TC_IPPROTO, SO_SET_ADD_COUNTERS,
 			 newcounters, counterlen);
+	iptcc_phase(XTC_PHASE_COUNTERS, 1);
 	if (ret < 0)
 		goto out_free_newcounters;
 
@@ -2696,9 +2990,268 @@ out_free_repl_counters:
 out_free_repl:
 	free(repl);
 out_zero:
+	if (compiling)
+		iptcc_phase(XTC_PHASE_COMPILE, 1);
 	return 0;
 }
 
+int
+TC_COMMIT(struct xtc_handle *handle)
+{
+	int ret;
+
+	iptcc_phase(XTC_PHASE_COMMIT, 0);
+	ret = iptcc_commit(handle);
+	iptcc_phase(XTC_PHASE_COMMIT, 1);
+
+	return ret;
+}
+
+/* Compile the cached table into a blob TC_REPLACE_SNAPSHOT() hands to
+ * the kernel as is.  Rule and policy counters are kept only if @counters
+ * is set.  Returns NULL on error.
+ */
+void *
+TC_SNAPSHOT(struct xtc_handle *handle, int counters, size_t *len)
+{
+	STRUCT_REPLACE *repl;
+	STRUCT_ENTRY *e;
+	unsigned int new_size, off;
+	int new_number;
+
+	iptc_fn = TC_SNAPSHOT;
+	CHECK(handle);
+
+	new_number = iptcc_compile_table_prep(handle, &new_size);
+	if (new_number < 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	repl = calloc(1, sizeof(*repl) + new_size);
+	if (!repl) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	strcpy(repl->name, handle->info.name);
+	repl->num_entries = new_number;
+	repl->size = new_size;
+	repl->valid_hooks = handle->info.valid_hooks;
+
+	if (iptcc_compile_table(handle, repl) < 0) {
+		free(repl);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if (!counters) {
+		for (off = 0; off < repl->size; off += e->next_offset) {
+			e = (void *)repl->entries + off;
+			memset(&e->counters, 0, sizeof(e->counters));
+		}
+	}
+
+	*len = sizeof(*repl) + repl->size;
+	return repl;
+}
+
+/* Check the layout of a snapshot blob before trusting its offsets, and
+ * ask @compatible whether the kernel has every match and target revision
+ * used in it.
+ */
+static int
+iptcc_snapshot_check(const STRUCT_REPLACE *repl, size_t len,
+		     int (*compatible)(const char *, uint8_t, int))
+{
+	const STRUCT_ENTRY_TARGET *t;
+	const STRUCT_ENTRY_MATCH *m;
+	const STRUCT_ENTRY *e;
+	unsigned int off, moff, num = 0;
+
+	if (len < sizeof(*repl) || len - sizeof(*repl) != repl->size ||
+	    !memchr(repl->name, '\0', sizeof(repl->name)))
+		return 0;
+
+	for (off = 0; off < repl->size; off += e->next_offset, num++) {
+		e = (const void *)repl->entries + off;
+		if (repl->size - off < sizeof(*e) ||
+		    e->target_offset < sizeof(*e) ||
+		    e->next_offset < e->target_offset + sizeof(*t) ||
+		    e->next_offset > repl->size - off)
+			return 0;
+
+		for (moff = sizeof(*e); moff < e->target_offset;
+		     moff += m->u.match_size) {
+			m = (const void *)e + moff;
+			if (e->target_offset - moff < sizeof(*m) ||
+			    m->u.match_size < sizeof(*m) ||
+			    m->u.match_size > e->target_offset - moff ||
+			    !memchr(m->u.user.name, '\0',
+				    sizeof(m->u.user.name)))
+				return 0;
+			if (compatible &&
+			    !compatible(m->u.user.name, m->u.user.revision,
+					SO_GET_REVISION_MATCH))
+				return 0;
+		}
+
+		t = (const void *)e + e->target_offset;
+		if (t->u.target_size < sizeof(*t) ||
+		    t->u.target_size > e->next_offset - e->target_offset ||
+		    !memchr(t->u.user.name, '\0', sizeof(t->u.user.name)))
+			return 0;
+		if (strcmp(t->u.user.name, STANDARD_TARGET) == 0 ||
+		    strcmp(t->u.user.name, ERROR_TARGET) == 0)
+			continue;
+		if (compatible &&
+		    !compatible(t->u.user.name, t->u.user.revision,
+				SO_GET_REVISION_TARGET))
+			return 0;
+	}
+
+	return num == repl->num_entries;
+}
+
+/* Replace the table named in a blob from TC_SNAPSHOT(), and add the
+ * counters it carries if @counters is set.  @compatible, if given, is
+ * asked about each extension revision first.
+ */
+int
+TC_REPLACE_SNAPSHOT(const void *blob, size_t len, int counters,
+		    int (*compatible)(const char *, uint8_t, int))
+{
+	STRUCT_COUNTERS_INFO *newcounters;
+	STRUCT_REPLACE *repl;
+	STRUCT_GETINFO info;
+	const STRUCT_ENTRY *e;
+	unsigned int off, i;
+	size_t counterlen;
+	int sockfd, ret = 0;
+	socklen_t s;
+
+	iptc_fn = TC_REPLACE_SNAPSHOT;
+
+	if (!iptcc_snapshot_check(blob, len, compatible)) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	sockfd = socket(TC_AF, SOCK_RAW, IPPROTO_RAW);
+	if (sockfd < 0)
+		return 0;
+
+	repl = malloc(len);
+	if (!repl) {
+		errno = ENOMEM;
+		goto out_close;
+	}
+	memcpy(repl, blob, len);
+	repl->counters = NULL;
+
+retry:
+	s = sizeof(info);
+	strcpy(info.name, repl->name);
+	if (getsockopt(sockfd, TC_IPPROTO, SO_GET_INFO, &info, &s) < 0)
+		goto out_free_repl;
+
+	if (info.valid_hooks != repl->valid_hooks) {
+		errno = EINVAL;
+		goto out_free_repl;
+	}
+
+	/* These are the old counters we will get from kernel */
+	free(repl->counters);
+	repl->counters = malloc(sizeof(STRUCT_COUNTERS) * info.num_entries);
+	if (!repl->counters) {
+		errno = ENOMEM;
+		goto out_free_repl;
+	}
+	repl->num_counters = info.num_entries;
+
+	if (setsockopt(sockfd, TC_IPPROTO, SO_SET_REPLACE, repl, len) < 0) {
+		/* A different process changed the ruleset size, retry */
+		if (errno == EAGAIN)
+			goto retry;
+		goto out_free_repl;
+	}
+
+	if (!counters) {
+		ret = 1;
+		goto out_free_repl;
+	}
+
+	counterlen = sizeof(STRUCT_COUNTERS_INFO)
+			+ sizeof(STRUCT_COUNTERS) * repl->num_entries;
+	newcounters = malloc(counterlen);
+	if (!newcounters) {
+		errno = ENOMEM;
+		goto out_free_repl;
+	}
+
+	strcpy(newcounters->name, repl->name);
+	newcounters->num_counters = repl->num_entries;
+	for (off = 0, i = 0; off < repl->size; off += e->next_offset, i++) {
+		e = (const void *)repl->entries + off;
+		memcpy(&newcounters->counters[i], &e->counters,
+		       sizeof(STRUCT_COUNTERS));
+	}
+
+	if (setsockopt(sockfd, TC_IPPROTO, SO_SET_ADD_COUNTERS,
+		       newcounters, counterlen) == 0)
+		ret = 1;
+
+	free(newcounters);
+out_free_repl:
+	free(repl->counters);
+	free(repl);
+out_close:
+	close(sockfd);
+	return ret;
+}
+
+/* Build a handle from a blob of TC_SNAPSHOT() as TC_INIT() does from the
+ * table in the kernel, to look at a ruleset without privileges.  There is
+ * no socket behind the handle, so it can't be committed.
+ */
+struct xtc_handle *
+TC_INIT_SNAPSHOT(const void *blob, size_t len)
+{
+	const STRUCT_REPLACE *repl = blob;
+	STRUCT_GETINFO info = {};
+	struct xtc_handle *h;
+
+	iptc_fn = TC_INIT_SNAPSHOT;
+
+	if (!iptcc_snapshot_check(repl, len, NULL)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	strcpy(info.name, repl->name);
+	info.valid_hooks = repl->valid_hooks;
+	memcpy(info.hook_entry, repl->hook_entry, sizeof(info.hook_entry));
+	memcpy(info.underflow, repl->underflow, sizeof(info.underflow));
+	info.num_entries = repl->num_entries;
+	info.size = repl->size;
+
+	h = alloc_handle(&info);
+	if (h == NULL)
+		return NULL;
+
+	h->sockfd = -1;
+	h->info = info;
+	memcpy(h->entries->entrytable, repl->entries, repl->size);
+
+	if (parse_table(h) < 0) {
+		TC_FREE(h);
+		return NULL;
+	}
+
+	CHECK(h);
+	return h;
+}
+
 /* Translates errno numbers into more human-readable form than strerror. */
 const char *
 TC_STRERROR(int err)
@@ -2732,6 +3285,9 @@ TC_STRERROR(int err)
 	      "Bad built-in chain name" },
 	    { TC_SET_POLICY, EINVAL,
 	      "Bad policy name" },
+	    { TC_REPLACE_SNAPSHOT, EINVAL,
+	      "Snapshot is damaged or does not fit this kernel" },
+	    { TC_INIT_SNAPSHOT, EINVAL, "Snapshot is damaged" },
 
 	    { NULL, 0, "Incompatible with this kernel" },
 	    { NULL, ENOPROTOOPT, "iptables who? (do you need to insmod?)" },
@@ -2762,4 +3318,9 @@ const struct xtc_ops TC_OPS = {
 	.get_policy    = TC_GET_POLICY,
 	.set_policy    = TC_SET_POLICY,
 	.strerror      = TC_STRERROR,
+	.snapshot      = TC_SNAPSHOT,
+	.replace_snapshot = TC_REPLACE_SNAPSHOT,
+	.diff_chain    = TC_DIFF_CHAIN,
+	.diff_end      = TC_DIFF_END,
+	.init_snapshot = TC_INIT_SNAPSHOT,
 };
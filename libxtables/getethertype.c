@@ -127,34 +127,126 @@ again:
 	return (&et_ent);
 }
 
-struct xt_ethertypeent *xtables_getethertypebyname(const char *name)
+/*
+ * The database is read once into hashed indexes by name, including aliases,
+ * and by number. Like the scans they replace, both keep the first entry
+ * of the file for each key.
+ */
+#define ETHERTYPE_HSIZE	256
+
+struct ethertype_node {
+	struct ethertype_node	*next;
+	const char		*name;
+	int			number;
+	struct xt_ethertypeent	*ent;
+};
+
+static struct ethertype_node *ethertype_byname[ETHERTYPE_HSIZE];
+static struct ethertype_node *ethertype_bynumber[ETHERTYPE_HSIZE];
+static int ethertype_loaded;
+
+static unsigned int ethertype_hash_name(const char *name)
+{
+	unsigned int hash = 0;
+
+	for (; *name != '\0'; name++)
+		hash = hash * 31 + tolower((unsigned char)*name);
+	return hash % ETHERTYPE_HSIZE;
+}
+
+static char *ethertype_strdup(const char *s)
+{
+	char *ret = strdup(s);
+
+	if (ret == NULL)
+		xtables_error(RESOURCE_PROBLEM, "strdup");
+	return ret;
+}
+
+static void ethertype_add_name(const char *name, struct xt_ethertypeent *ent)
+{
+	unsigned int h = ethertype_hash_name(name);
+	struct ethertype_node *n;
+
+	for (n = ethertype_byname[h]; n != NULL; n = n->next)
+		if (strcasecmp(n->name, name) == 0)
+			return;
+
+	n = xtables_malloc(sizeof(*n));
+	n->name = name;
+	n->ent = ent;
+	n->next = ethertype_byname[h];
+	ethertype_byname[h] = n;
+}
+
+static void ethertype_add_number(struct xt_ethertypeent *ent)
 {
-	register struct xt_ethertypeent *e;
-	register char **cp;
+	unsigned int h = ent->e_ethertype % ETHERTYPE_HSIZE;
+	struct ethertype_node *n;
+
+	for (n = ethertype_bynumber[h]; n != NULL; n = n->next)
+		if (n->number == ent->e_ethertype)
+			return;
 
-	setethertypeent(ethertype_stayopen);
+	n = xtables_malloc(sizeof(*n));
+	n->number = ent->e_ethertype;
+	n->ent = ent;
+	n->next = ethertype_bynumber[h];
+	ethertype_bynumber[h] = n;
+}
+
+static void ethertype_load(void)
+{
+	struct xt_ethertypeent *e, *copy;
+	unsigned int i, naliases;
+
+	if (ethertype_loaded)
+		return;
+	ethertype_loaded = 1;
+
+	setethertypeent(0);
 	while ((e = getethertypeent()) != NULL) {
-		if (strcasecmp(e->e_name, name) == 0)
-			break;
-		for (cp = e->e_aliases; *cp != 0; cp++)
-			if (strcasecmp(*cp, name) == 0)
-				goto found;
+		for (naliases = 0; e->e_aliases[naliases] != NULL; naliases++)
+			;
+
+		copy = xtables_malloc(sizeof(*copy));
+		copy->e_name = ethertype_strdup(e->e_name);
+		copy->e_ethertype = e->e_ethertype;
+		copy->e_aliases = xtables_calloc(naliases + 1,
+						 sizeof(*copy->e_aliases));
+		for (i = 0; i < naliases; i++)
+			copy->e_aliases[i] = ethertype_strdup(e->e_aliases[i]);
+
+		ethertype_add_name(copy->e_name, copy);
+		for (i = 0; i < naliases; i++)
+			ethertype_add_name(copy->e_aliases[i], copy);
+		ethertype_add_number(copy);
 	}
-found:
-	if (!ethertype_stayopen)
-		endethertypeent();
-	return (e);
+	endethertypeent();
+}
+
+struct xt_ethertypeent *xtables_getethertypebyname(const char *name)
+{
+	struct ethertype_node *n;
+
+	ethertype_load();
+	n = ethertype_byname[ethertype_hash_name(name)];
+	for (; n != NULL; n = n->next)
+		if (strcasecmp(n->name, name) == 0)
+			return n->ent;
+
+	return NULL;
 }
 
 struct xt_ethertypeent *xtables_getethertypebynumber(int type)
 {
-	register struct xt_ethertypeent *e;
-
-	setethertypeent(ethertype_stayopen);
-	while ((e = getethertypeent()) != NULL)
-		if (e->e_ethertype == type)
-			break;
-	if (!ethertype_stayopen)
-		endethertypeent();
-	return (e);
+	struct ethertype_node *n;
+
+	ethertype_load();
+	n = ethertype_bynumber[(unsigned int)type % ETHERTYPE_HSIZE];
+	for (; n != NULL; n = n->next)
+		if (n->number == type)
+			return n->ent;
+
+	return NULL;
 }
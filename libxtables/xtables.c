@@ -21,12 +21,15 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <spawn.h>
+#include <stdio_ext.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -92,12 +95,102 @@ void basic_exit_err(enum xtables_exittype status, const char *msg, ...)
 	exit(status);
 }
 
+/*
+ * Merged getopt tables are memoised per (parent table, extension), so that
+ * loading the same extensions again for every line of a restore reuses the
+ * table built the first time instead of reallocating and copying it.
+ * An extension keeps the option offset it was given on its first merge.
+ *
+ * Once the cache is full, new tables are allocated as before and freed as
+ * soon as they are superseded.
+ */
+#define XT_OPTS_HSIZE		256
+#define XT_OPTS_CACHE_MAX	4096
+
+struct xt_opts_node {
+	struct xt_opts_node	*next;
+	const struct option	*parent;
+	unsigned int		offset;
+	struct option		*opts;
+};
+
+static struct xt_opts_node *xt_opts_cache[XT_OPTS_HSIZE];
+static unsigned int xt_opts_cache_num;
+static struct option *xt_opts_uncached;
+
+static unsigned int xt_opts_hash(const struct option *parent,
+				 unsigned int offset)
+{
+	uintptr_t key = (uintptr_t)parent / sizeof(*parent);
+
+	key ^= (offset / XT_OPTION_OFFSET_SCALE) * 2654435761U;
+	return (key ^ (key >> 11)) % XT_OPTS_HSIZE;
+}
+
+/**
+ * xtables_opts_lookup - find a memoised merge of an extension's options
+ * @parent:		table the options are merged into
+ * @option_offset:	the extension's option offset, assigned if still unset
+ *
+ * Returns the merged table, or NULL if it has to be built.
+ */
+struct option *xtables_opts_lookup(const struct option *parent,
+				   unsigned int *option_offset)
+{
+	struct xt_opts_node *node;
+
+	if (*option_offset == 0) {
+		xt_params->option_offset += XT_OPTION_OFFSET_SCALE;
+		*option_offset = xt_params->option_offset;
+		return NULL;
+	}
+
+	node = xt_opts_cache[xt_opts_hash(parent, *option_offset)];
+	for (; node != NULL; node = node->next)
+		if (node->parent == parent && node->offset == *option_offset)
+			return node->opts;
+
+	return NULL;
+}
+
+/**
+ * xtables_opts_store - take ownership of a freshly merged table
+ * @parent:	table @opts was built from
+ * @offset:	option offset of the extension merged into @parent
+ * @opts:	the new table
+ */
+void xtables_opts_store(const struct option *parent, unsigned int offset,
+			struct option *opts)
+{
+	struct xt_opts_node *node = NULL;
+	unsigned int h;
+
+	if (parent != xt_opts_uncached &&
+	    xt_opts_cache_num < XT_OPTS_CACHE_MAX)
+		node = malloc(sizeof(*node));
+
+	xtables_free_opts(0);
+	if (node == NULL) {
+		xt_opts_uncached = opts;
+		return;
+	}
+
+	h = xt_opts_hash(parent, offset);
+	node->parent = parent;
+	node->offset = offset;
+	node->opts   = opts;
+	node->next   = xt_opts_cache[h];
+	xt_opts_cache[h] = node;
+	xt_opts_cache_num++;
+}
+
 void xtables_free_opts(int unused)
 {
-	if (xt_params->opts != xt_params->orig_opts) {
-		free(xt_params->opts);
+	free(xt_opts_uncached);
+	xt_opts_uncached = NULL;
+
+	if (xt_params->opts != xt_params->orig_opts)
 		xt_params->opts = NULL;
-	}
 }
 
 struct option *xtables_merge_options(struct option *orig_opts,
@@ -106,11 +199,18 @@ struct option *xtables_merge_options(struct option *orig_opts,
 				     unsigned int *option_offset)
 {
 	unsigned int num_oold = 0, num_old = 0, num_new = 0, i;
-	struct option *merge, *mp;
+	struct option *merge, *mp, *parent;
 
 	if (newopts == NULL)
 		return oldopts;
 
+	parent = oldopts != NULL ? oldopts : orig_opts;
+	merge = xtables_opts_lookup(parent, option_offset);
+	if (merge != NULL) {
+		xtables_free_opts(0);
+		return merge;
+	}
+
 	for (num_oold = 0; orig_opts[num_oold].name; num_oold++) ;
 	if (oldopts != NULL)
 		for (num_old = 0; oldopts[num_old].name; num_old++) ;
@@ -134,8 +234,6 @@ struct option *xtables_merge_options(struct option *orig_opts,
 	mp = merge + num_oold;
 
 	/* Second, the new options */
-	xt_params->option_offset += XT_OPTION_OFFSET_SCALE;
-	*option_offset = xt_params->option_offset;
 	memcpy(mp, newopts, sizeof(*mp) * num_new);
 
 	for (i = 0; i < num_new; ++i, ++mp)
@@ -146,10 +244,10 @@ struct option *xtables_merge_options(struct option *orig_opts,
 		memcpy(mp, oldopts, sizeof(*mp) * num_old);
 		mp += num_old;
 	}
-	xtables_free_opts(0);
 
 	/* Clear trailing entry */
 	memset(mp, 0, sizeof(*mp));
+	xtables_opts_store(parent, *option_offset, merge);
 	return merge;
 }
 
@@ -202,6 +300,9 @@ struct xtables_target *xtables_pending_targets;
 struct xtables_match *xtables_matches;
 struct xtables_target *xtables_targets;
 
+/* Bumped whenever the result of an extension lookup may change */
+static unsigned int xt_ext_gen = 1;
+
 /* Fully register a match/target which was previously partially registered. */
 static bool xtables_fully_register_pending_match(struct xtables_match *me);
 static bool xtables_fully_register_pending_target(struct xtables_target *me);
@@ -235,6 +336,7 @@ void xtables_init(void)
 
 void xtables_set_nfproto(uint8_t nfproto)
 {
+	xt_ext_gen++;
 	switch (nfproto) {
 	case NFPROTO_IPV4:
 		afinfo = &afinfo_ipv4;
@@ -492,14 +594,278 @@ bool xtables_strtoui(const char *s, char **end, unsigned int *value,
 	return ret;
 }
 
-int xtables_service_to_port(const char *name, const char *proto)
+/*
+ * The protocol and service databases are enumerated once through NSS into
+ * hashed indexes for both lookup directions, keeping the first entry for
+ * each key like the getXbyY() functions do. Keys missing from an index,
+ * e.g. with NSS sources which can not be enumerated, are queried directly
+ * and the outcome, found or not, is added to the index as well.
+ * Services without a protocol are indexed under "" for lookups of any
+ * protocol.
+ */
+#define XT_NETDB_HSIZE	2048
+
+struct xt_netdb_entry {
+	struct xt_netdb_entry	*next;
+	const char		*name;
+	const char		*proto;
+	int			number;
+};
+
+struct xt_netdb {
+	struct xt_netdb_entry	*byname[XT_NETDB_HSIZE];
+	struct xt_netdb_entry	*bynum[XT_NETDB_HSIZE];
+	bool			loaded;
+};
+
+static struct xt_netdb xt_protocols, xt_services;
+
+static unsigned int xt_netdb_hash(const char *name, const char *proto,
+				  int number)
 {
-	struct servent *service;
+	uint32_t hash = 2166136261U ^ number;
 
-	if ((service = getservbyname(name, proto)) != NULL)
-		return ntohs((unsigned short) service->s_port);
+	for (; name != NULL && *name != '\0'; name++)
+		hash = (hash ^ (unsigned char)*name) * 16777619U;
+	for (hash = (hash ^ '/') * 16777619U; *proto != '\0'; proto++)
+		hash = (hash ^ (unsigned char)*proto) * 16777619U;
+	return hash % XT_NETDB_HSIZE;
+}
 
-	return -1;
+static struct xt_netdb_entry *
+xt_netdb_byname(const struct xt_netdb *db, const char *name, const char *proto)
+{
+	struct xt_netdb_entry *e;
+
+	e = db->byname[xt_netdb_hash(name, proto, 0)];
+	for (; e != NULL; e = e->next)
+		if (strcmp(e->name, name) == 0 && strcmp(e->proto, proto) == 0)
+			return e;
+
+	return NULL;
+}
+
+static struct xt_netdb_entry *
+xt_netdb_bynum(const struct xt_netdb *db, int number, const char *proto)
+{
+	struct xt_netdb_entry *e;
+
+	e = db->bynum[xt_netdb_hash(NULL, proto, number)];
+	for (; e != NULL; e = e->next)
+		if (e->number == number && strcmp(e->proto, proto) == 0)
+			return e;
+
+	return NULL;
+}
+
+static char *xt_netdb_strdup(const char *s)
+{
+	char *ret;
+
+	if (s == NULL)
+		return NULL;
+
+	ret = strdup(s);
+	if (ret == NULL)
+		xt_params->exit_err(RESOURCE_PROBLEM, "strdup");
+	return ret;
+}
+
+/* Index @name under (@name, @proto), unless already present. A NULL
+ * @name is a negative entry for @number, a negative @number one for @name.
+ */
+static void xt_netdb_add_name(struct xt_netdb *db, const char *name,
+			      const char *proto, int number)
+{
+	struct xt_netdb_entry *e;
+	unsigned int h;
+
+	if (xt_netdb_byname(db, name, proto) != NULL)
+		return;
+
+	h = xt_netdb_hash(name, proto, 0);
+	e = xtables_malloc(sizeof(*e));
+	e->name = xt_netdb_strdup(name);
+	e->proto = xt_netdb_strdup(proto);
+	e->number = number;
+	e->next = db->byname[h];
+	db->byname[h] = e;
+}
+
+static void xt_netdb_add_num(struct xt_netdb *db, int number,
+			     const char *proto, const char *name)
+{
+	struct xt_netdb_entry *e;
+	unsigned int h;
+
+	if (xt_netdb_bynum(db, number, proto) != NULL)
+		return;
+
+	h = xt_netdb_hash(NULL, proto, number);
+	e = xtables_malloc(sizeof(*e));
+	e->name = xt_netdb_strdup(name);
+	e->proto = xt_netdb_strdup(proto);
+	e->number = number;
+	e->next = db->bynum[h];
+	db->bynum[h] = e;
+}
+
+static void xt_services_add(const struct servent *se)
+{
+	int port = ntohs((uint16_t)se->s_port);
+	char **alias;
+
+	xt_netdb_add_name(&xt_services, se->s_name, se->s_proto, port);
+	xt_netdb_add_name(&xt_services, se->s_name, "", port);
+	for (alias = se->s_aliases; *alias != NULL; alias++) {
+		xt_netdb_add_name(&xt_services, *alias, se->s_proto, port);
+		xt_netdb_add_name(&xt_services, *alias, "", port);
+	}
+	xt_netdb_add_num(&xt_services, port, se->s_proto, se->s_name);
+	xt_netdb_add_num(&xt_services, port, "", se->s_name);
+}
+
+static void xt_services_load(void)
+{
+	const struct servent *se;
+
+	if (xt_services.loaded)
+		return;
+
+	setservent(1);
+	while ((se = getservent()) != NULL)
+		xt_services_add(se);
+	endservent();
+	xt_services.loaded = true;
+}
+
+/**
+ * xtables_service_port - look up a service by name
+ * @name:	service name or alias
+ * @proto:	protocol of the service, or NULL for any
+ *
+ * Returns the port number in host byte order, or -1 if not found.
+ */
+int xtables_service_port(const char *name, const char *proto)
+{
+	const struct xt_netdb_entry *e;
+	const struct servent *se;
+
+	xt_services_load();
+	e = xt_netdb_byname(&xt_services, name, proto ? proto : "");
+	if (e == NULL) {
+		se = getservbyname(name, proto);
+		if (se != NULL)
+			xt_services_add(se);
+		else
+			xt_netdb_add_name(&xt_services, name,
+					  proto ? proto : "", -1);
+		e = xt_netdb_byname(&xt_services, name, proto ? proto : "");
+	}
+	return e != NULL ? e->number : -1;
+}
+
+/**
+ * xtables_service_name - look up the name of a service
+ * @port:	port number in host byte order
+ * @proto:	protocol of the service, or NULL for any
+ *
+ * Returns the official service name, or NULL if not found.
+ */
+const char *xtables_service_name(unsigned int port, const char *proto)
+{
+	const struct xt_netdb_entry *e;
+	const struct servent *se;
+
+	xt_services_load();
+	e = xt_netdb_bynum(&xt_services, port, proto ? proto : "");
+	if (e == NULL) {
+		se = getservbyport(htons(port), proto);
+		if (se != NULL)
+			xt_services_add(se);
+		else
+			xt_netdb_add_num(&xt_services, port,
+					 proto ? proto : "", NULL);
+		e = xt_netdb_bynum(&xt_services, port, proto ? proto : "");
+	}
+	return e != NULL ? e->name : NULL;
+}
+
+static void xt_protocols_add(const struct protoent *pe)
+{
+	char **alias;
+
+	xt_netdb_add_name(&xt_protocols, pe->p_name, "", pe->p_proto);
+	for (alias = pe->p_aliases; *alias != NULL; alias++)
+		xt_netdb_add_name(&xt_protocols, *alias, "", pe->p_proto);
+	xt_netdb_add_num(&xt_protocols, pe->p_proto, "", pe->p_name);
+}
+
+static void xt_protocols_load(void)
+{
+	const struct protoent *pe;
+
+	if (xt_protocols.loaded)
+		return;
+
+	setprotoent(1);
+	while ((pe = getprotoent()) != NULL)
+		xt_protocols_add(pe);
+	endprotoent();
+	xt_protocols.loaded = true;
+}
+
+/**
+ * xtables_protocol_number - look up a protocol by name
+ * @name:	protocol name or alias
+ *
+ * Returns the protocol number, or -1 if not found.
+ */
+int xtables_protocol_number(const char *name)
+{
+	const struct xt_netdb_entry *e;
+	const struct protoent *pe;
+
+	xt_protocols_load();
+	e = xt_netdb_byname(&xt_protocols, name, "");
+	if (e == NULL) {
+		pe = getprotobyname(name);
+		if (pe != NULL)
+			xt_protocols_add(pe);
+		else
+			xt_netdb_add_name(&xt_protocols, name, "", -1);
+		e = xt_netdb_byname(&xt_protocols, name, "");
+	}
+	return e != NULL ? e->number : -1;
+}
+
+/**
+ * xtables_protocol_name - look up the name of a protocol
+ * @proto:	protocol number
+ *
+ * Returns the official protocol name, or NULL if not found.
+ */
+const char *xtables_protocol_name(unsigned int proto)
+{
+	const struct xt_netdb_entry *e;
+	const struct protoent *pe;
+
+	xt_protocols_load();
+	e = xt_netdb_bynum(&xt_protocols, proto, "");
+	if (e == NULL) {
+		pe = getprotobynumber(proto);
+		if (pe != NULL)
+			xt_protocols_add(pe);
+		else
+			xt_netdb_add_num(&xt_protocols, proto, "", NULL);
+		e = xt_netdb_bynum(&xt_protocols, proto, "");
+	}
+	return e != NULL ? e->name : NULL;
+}
+
+int xtables_service_to_port(const char *name, const char *proto)
+{
+	return xtables_service_port(name, proto);
 }
 
 uint16_t xtables_parse_port(const char *port, const char *proto)
@@ -612,6 +978,55 @@ static bool extension_cmp(const char *name1, const char *name2, uint32_t family)
 	return false;
 }
 
+/*
+ * Lookups of registered extensions by name, valid while xt_ext_gen is
+ * unchanged.
+ */
+#define XT_EXT_CACHE_SIZE	64
+
+struct xt_ext_cache_entry {
+	unsigned int	gen;
+	void		*ext;
+	char		name[XT_EXTENSION_MAXNAMELEN];
+};
+
+static struct xt_ext_cache_entry xt_match_cache[XT_EXT_CACHE_SIZE];
+static struct xt_ext_cache_entry xt_target_cache[XT_EXT_CACHE_SIZE];
+
+static struct xt_ext_cache_entry *
+xt_ext_cache_slot(struct xt_ext_cache_entry *cache, const char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	for (; *name != '\0'; name++)
+		hash = (hash ^ (unsigned char)*name) * 16777619U;
+	return &cache[hash % XT_EXT_CACHE_SIZE];
+}
+
+static void *xt_ext_cache_get(struct xt_ext_cache_entry *cache,
+			      const char *name)
+{
+	struct xt_ext_cache_entry *e = xt_ext_cache_slot(cache, name);
+
+	if (e->gen != xt_ext_gen || strcmp(e->name, name) != 0)
+		return NULL;
+	return e->ext;
+}
+
+static void xt_ext_cache_put(struct xt_ext_cache_entry *cache,
+			     const char *name, void *ext)
+{
+	struct xt_ext_cache_entry *e;
+
+	if (strlen(name) >= sizeof(e->name))
+		return;
+
+	e = xt_ext_cache_slot(cache, name);
+	strcpy(e->name, name);
+	e->ext = ext;
+	e->gen = xt_ext_gen;
+}
+
 struct xtables_match *
 xtables_find_match(const char *name, enum xtables_tryload tryload,
 		   struct xtables_rule_match **matches)
@@ -619,6 +1034,7 @@ xtables_find_match(const char *name, enum xtables_tryload tryload,
 	struct xtables_match **dptr;
 	struct xtables_match *ptr;
 	const char *icmp6 = "icmp6";
+	bool registered;
 
 	if (strlen(name) >= XT_EXTENSION_MAXNAMELEN)
 		xtables_error(PARAMETER_PROBLEM,
@@ -632,37 +1048,44 @@ xtables_find_match(const char *name, enum xtables_tryload tryload,
 	     (strcmp(name,"icmp6") == 0) )
 		name = icmp6;
 
-	/* Trigger delayed initialization */
-	for (dptr = &xtables_pending_matches; *dptr; ) {
-		if (extension_cmp(name, (*dptr)->name, (*dptr)->family)) {
-			ptr = *dptr;
-			*dptr = (*dptr)->next;
-			if (xtables_fully_register_pending_match(ptr))
-				continue;
-			*dptr = ptr;
+	ptr = xt_ext_cache_get(xt_match_cache, name);
+	if (ptr == NULL) {
+		/* Trigger delayed initialization */
+		for (dptr = &xtables_pending_matches; *dptr; ) {
+			if (extension_cmp(name, (*dptr)->name,
+					  (*dptr)->family)) {
+				ptr = *dptr;
+				*dptr = (*dptr)->next;
+				registered =
+				    xtables_fully_register_pending_match(ptr);
+				xt_ext_gen++;
+				if (registered)
+					continue;
+				*dptr = ptr;
+			}
+			dptr = &((*dptr)->next);
 		}
-		dptr = &((*dptr)->next);
-	}
-
-	for (ptr = xtables_matches; ptr; ptr = ptr->next) {
-		if (extension_cmp(name, ptr->name, ptr->family)) {
-			struct xtables_match *clone;
 
-			/* First match of this type: */
-			if (ptr->m == NULL)
+		for (ptr = xtables_matches; ptr; ptr = ptr->next)
+			if (extension_cmp(name, ptr->name, ptr->family))
 				break;
 
-			/* Second and subsequent clones */
-			clone = xtables_malloc(sizeof(struct xtables_match));
-			memcpy(clone, ptr, sizeof(struct xtables_match));
-			clone->udata = NULL;
-			clone->mflags = 0;
-			/* This is a clone: */
-			clone->next = clone;
+		if (ptr != NULL)
+			xt_ext_cache_put(xt_match_cache, name, ptr);
+	}
 
-			ptr = clone;
-			break;
-		}
+	/* Second and subsequent matches of this type get a clone */
+	if (ptr != NULL && ptr->m != NULL) {
+		struct xtables_match *clone;
+
+		clone = xtables_malloc(sizeof(struct xtables_match));
+		memcpy(clone, ptr, sizeof(struct xtables_match));
+		clone->udata = NULL;
+		clone->mflags = 0;
+		/* This is a clone: */
+		clone->next = clone;
+
+		ptr = clone;
 	}
 
 #ifndef NO_SHARED_LIBS
@@ -734,6 +1157,7 @@ xtables_find_target(const char *name, enum xtables_tryload tryload)
 {
 	struct xtables_target **dptr;
 	struct xtables_target *ptr;
+	bool registered;
 
 	/* Standard target? */
 	if (strcmp(name, "") == 0
@@ -743,37 +1167,44 @@ xtables_find_target(const char *name, enum xtables_tryload tryload)
 	    || strcmp(name, XTC_LABEL_RETURN) == 0)
 		name = "standard";
 
-	/* Trigger delayed initialization */
-	for (dptr = &xtables_pending_targets; *dptr; ) {
-		if (extension_cmp(name, (*dptr)->name, (*dptr)->family)) {
-			ptr = *dptr;
-			*dptr = (*dptr)->next;
-			if (xtables_fully_register_pending_target(ptr))
-				continue;
-			*dptr = ptr;
+	ptr = xt_ext_cache_get(xt_target_cache, name);
+	if (ptr == NULL) {
+		/* Trigger delayed initialization */
+		for (dptr = &xtables_pending_targets; *dptr; ) {
+			if (extension_cmp(name, (*dptr)->name,
+					  (*dptr)->family)) {
+				ptr = *dptr;
+				*dptr = (*dptr)->next;
+				registered =
+				    xtables_fully_register_pending_target(ptr);
+				xt_ext_gen++;
+				if (registered)
+					continue;
+				*dptr = ptr;
+			}
+			dptr = &((*dptr)->next);
 		}
-		dptr = &((*dptr)->next);
-	}
-
-	for (ptr = xtables_targets; ptr; ptr = ptr->next) {
-		if (extension_cmp(name, ptr->name, ptr->family)) {
-			struct xtables_target *clone;
 
-			/* First target of this type: */
-			if (ptr->t == NULL)
+		for (ptr = xtables_targets; ptr; ptr = ptr->next)
+			if (extension_cmp(name, ptr->name, ptr->family))
 				break;
 
-			/* Second and subsequent clones */
-			clone = xtables_malloc(sizeof(struct xtables_target));
-			memcpy(clone, ptr, sizeof(struct xtables_target));
-			clone->udata = NULL;
-			clone->tflags = 0;
-			/* This is a clone: */
-			clone->next = clone;
+		if (ptr != NULL)
+			xt_ext_cache_put(xt_target_cache, name, ptr);
+	}
+
+	/* Second and subsequent targets of this type get a clone */
+	if (ptr != NULL && ptr->t != NULL) {
+		struct xtables_target *clone;
 
-			ptr = clone;
-			break;
-		}
+		clone = xtables_malloc(sizeof(struct xtables_target));
+		memcpy(clone, ptr, sizeof(struct xtables_target));
+		clone->udata = NULL;
+		clone->tflags = 0;
+		/* This is a clone: */
+		clone->next = clone;
+
+		ptr = clone;
 	}
 
 #ifndef NO_SHARED_LIBS
@@ -958,6 +1389,7 @@ void xtables_register_match(struct xtables_match *me)
 	/* place on linked list of matches pending full registration */
 	me->next = xtables_pending_matches;
 	xtables_pending_matches = me;
+	xt_ext_gen++;
 }
 
 /**
@@ -1147,13 +1579,10 @@ void xtables_register_target(struct xtables_target *me)
 	if (me->extra_opts != NULL)
 		xtables_check_options(me->name, me->extra_opts);
 
-	/* ignore not interested target */
-	if (me->family != afinfo->family && me->family != AF_UNSPEC)
-		return;
-
 	/* place on linked list of targets pending full registration */
 	me->next = xtables_pending_targets;
 	xtables_pending_targets = me;
+	xt_ext_gen++;
 }
 
 static bool xtables_fully_register_pending_target(struct xtables_target *me)
@@ -1332,12 +1761,149 @@ void xtables_param_act(unsigned int status, const char *p1, ...)
 	va_end(args);
 }
 
+/*
+ * Formatters for the save and list paths. Each writes a NUL-terminated
+ * string to @buf and returns a pointer to the terminating NUL, so calls
+ * can be chained into one buffer.
+ */
+char *xtables_fmt_u64(char *buf, uint64_t num)
+{
+	char tmp[20], *p = tmp + sizeof(tmp);
+
+	do {
+		*--p = '0' + num % 10;
+		num /= 10;
+	} while (num != 0);
+
+	memcpy(buf, p, tmp + sizeof(tmp) - p);
+	buf += tmp + sizeof(tmp) - p;
+	*buf = '\0';
+	return buf;
+}
+
+static char *xt_fmt_u8(char *buf, unsigned int num)
+{
+	if (num >= 100) {
+		*buf++ = '0' + num / 100;
+		num %= 100;
+		*buf++ = '0' + num / 10;
+	} else if (num >= 10) {
+		*buf++ = '0' + num / 10;
+	}
+	*buf++ = '0' + num % 10;
+	return buf;
+}
+
+char *xtables_fmt_ipaddr(char *buf, const struct in_addr *addr)
+{
+	const unsigned char *bytep = (const void *)&addr->s_addr;
+
+	buf = xt_fmt_u8(buf, bytep[0]);
+	*buf++ = '.';
+	buf = xt_fmt_u8(buf, bytep[1]);
+	*buf++ = '.';
+	buf = xt_fmt_u8(buf, bytep[2]);
+	*buf++ = '.';
+	buf = xt_fmt_u8(buf, bytep[3]);
+	*buf = '\0';
+	return buf;
+}
+
+/* Like xtables_ipmask_to_numeric(), including the leading slash. */
+char *xtables_fmt_ipmask(char *buf, const struct in_addr *mask)
+{
+	int cidr = xtables_ipmask_to_cidr(mask);
+
+	if (cidr == 32) {
+		*buf = '\0';
+		return buf;
+	}
+	*buf++ = '/';
+	if (cidr < 0)
+		return xtables_fmt_ipaddr(buf, mask);
+	return xtables_fmt_u64(buf, cidr);
+}
+
+static char *xt_fmt_hex16(char *buf, unsigned int num)
+{
+	static const char digits[] = "0123456789abcdef";
+	int shift = 12;
+
+	while (shift > 0 && (num >> shift) == 0)
+		shift -= 4;
+	for (; shift >= 0; shift -= 4)
+		*buf++ = digits[(num >> shift) & 0xf];
+	return buf;
+}
+
+/* Same output as inet_ntop(AF_INET6, ...), see RFC 5952. */
+char *xtables_fmt_ip6addr(char *buf, const struct in6_addr *addr)
+{
+	int best = -1, bestlen = 0, cur = -1, curlen = 0;
+	unsigned int words[8];
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		words[i] = addr->s6_addr[2 * i] << 8 | addr->s6_addr[2 * i + 1];
+		if (words[i] == 0) {
+			if (cur < 0) {
+				cur = i;
+				curlen = 0;
+			}
+			if (++curlen > bestlen) {
+				best = cur;
+				bestlen = curlen;
+			}
+		} else {
+			cur = -1;
+		}
+	}
+	/* a single zero word is not compressed */
+	if (bestlen < 2)
+		best = -1;
+
+	for (i = 0; i < 8; i++) {
+		if (i == best) {
+			*buf++ = ':';
+			i += bestlen - 1;
+			if (i == 7)
+				*buf++ = ':';
+			continue;
+		}
+		if (i != 0)
+			*buf++ = ':';
+		/* IPv4-compatible and IPv4-mapped addresses */
+		if (i == 6 && best == 0 &&
+		    (bestlen == 6 || (bestlen == 5 && words[5] == 0xffff))) {
+			return xtables_fmt_ipaddr(buf,
+				(const void *)&addr->s6_addr[12]);
+		}
+		buf = xt_fmt_hex16(buf, words[i]);
+	}
+	*buf = '\0';
+	return buf;
+}
+
+/* Like xtables_ip6mask_to_numeric(), including the leading slash. */
+char *xtables_fmt_ip6mask(char *buf, const struct in6_addr *mask)
+{
+	int cidr = xtables_ip6mask_to_cidr(mask);
+
+	if (cidr == 128) {
+		*buf = '\0';
+		return buf;
+	}
+	*buf++ = '/';
+	if (cidr < 0)
+		return xtables_fmt_ip6addr(buf, mask);
+	return xtables_fmt_u64(buf, cidr);
+}
+
 const char *xtables_ipaddr_to_numeric(const struct in_addr *addrp)
 {
 	static char buf[20];
-	const unsigned char *bytep = (const void *)&addrp->s_addr;
 
-	sprintf(buf, "%u.%u.%u.%u", bytep[0], bytep[1], bytep[2], bytep[3]);
+	xtables_fmt_ipaddr(buf, addrp);
 	return buf;
 }
 
@@ -1382,41 +1948,21 @@ const char *xtables_ipaddr_to_anyname(const struct in_addr *addr)
 
 int xtables_ipmask_to_cidr(const struct in_addr *mask)
 {
-	uint32_t maskaddr, bits;
-	int i;
-
-	maskaddr = ntohl(mask->s_addr);
-	/* shortcut for /32 networks */
-	if (maskaddr == 0xFFFFFFFFL)
-		return 32;
-
-	i = 32;
-	bits = 0xFFFFFFFEL;
-	while (--i >= 0 && maskaddr != bits)
-		bits <<= 1;
-	if (i >= 0)
-		return i;
+	uint32_t hostbits = ~ntohl(mask->s_addr);
 
 	/* this mask cannot be converted to CIDR notation */
-	return -1;
+	if (hostbits & (hostbits + 1))
+		return -1;
+
+	return 32 - __builtin_popcount(hostbits);
 }
 
 const char *xtables_ipmask_to_numeric(const struct in_addr *mask)
 {
 	static char buf[20];
-	uint32_t cidr;
-
-	cidr = xtables_ipmask_to_cidr(mask);
-	if (cidr == (unsigned int)-1) {
-		/* mask was not a decent combination of 1's and 0's */
-		sprintf(buf, "/%s", xtables_ipaddr_to_numeric(mask));
-		return buf;
-	} else if (cidr == 32) {
-		/* we don't want to see "/32" */
-		return "";
-	}
 
-	sprintf(buf, "/%d", cidr);
+	/* we don't want to see "/32" */
+	xtables_fmt_ipmask(buf, mask);
 	return buf;
 }
 
@@ -1476,6 +2022,258 @@ struct in_addr *xtables_numeric_to_ipmask(const char *dotted)
 	return __numeric_to_ipaddr(dotted, true);
 }
 
+/*
+ * Host name resolution cache. Every (family, name) is resolved only once
+ * per XT_RESOLVE_TTL, so all rules of a command or restore naming a host see
+ * the same addresses in the same order, and xtables_resolve_prefetch() can
+ * resolve names concurrently ahead of parsing. getaddrinfo() does not tell
+ * the TTL of the records, the entries simply expire so that long-lived
+ * processes like xtables-daemon see address changes. Failed lookups are not
+ * cached, the next command tries again.
+ */
+#define XT_RESOLVE_HSIZE	1024
+#define XT_RESOLVE_THREADS	16
+#define XT_RESOLVE_TTL		60	/* seconds */
+
+struct xt_resolve_entry {
+	struct xt_resolve_entry	*next;
+	time_t			expires;
+	int			family;
+	int			err;
+	unsigned int		naddrs;
+	void			*addrs;
+	char			name[];
+};
+
+static struct xt_resolve_entry *xt_resolve_cache[XT_RESOLVE_HSIZE];
+
+static unsigned int xt_resolve_hash(int family, const char *name)
+{
+	uint32_t hash = 2166136261U ^ family;
+
+	for (; *name != '\0'; name++) {
+		hash ^= (unsigned char)*name;
+		hash *= 16777619U;
+	}
+	return hash % XT_RESOLVE_HSIZE;
+}
+
+static time_t xt_resolve_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void xt_resolve_free(struct xt_resolve_entry *e)
+{
+	free(e->addrs);
+	free(e);
+}
+
+/* Expired entries met on the way are dropped. */
+static struct xt_resolve_entry *xt_resolve_find(int family, const char *name)
+{
+	struct xt_resolve_entry **pe, *e;
+	time_t now = xt_resolve_now();
+
+	pe = &xt_resolve_cache[xt_resolve_hash(family, name)];
+	while ((e = *pe) != NULL) {
+		if (now >= e->expires) {
+			*pe = e->next;
+			xt_resolve_free(e);
+			continue;
+		}
+		if (e->family == family && strcmp(e->name, name) == 0)
+			return e;
+		pe = &e->next;
+	}
+
+	return NULL;
+}
+
+/* Takes over @e, which is freed rather than cached if the lookup failed. */
+static void xt_resolve_insert(struct xt_resolve_entry *e)
+{
+	unsigned int h = xt_resolve_hash(e->family, e->name);
+
+	if (e->err != 0) {
+		xt_resolve_free(e);
+		return;
+	}
+
+	e->expires = xt_resolve_now() + XT_RESOLVE_TTL;
+	e->next = xt_resolve_cache[h];
+	xt_resolve_cache[h] = e;
+}
+
+static size_t xt_resolve_addrlen(int family)
+{
+	return family == AF_INET6 ? sizeof(struct in6_addr) :
+				    sizeof(struct in_addr);
+}
+
+static const void *xt_resolve_sa_addr(const struct sockaddr *sa)
+{
+	if (sa->sa_family == AF_INET6)
+		return &((const struct sockaddr_in6 *)sa)->sin6_addr;
+	return &((const struct sockaddr_in *)sa)->sin_addr;
+}
+
+/* May run in a prefetch thread: no exit_err(), no cache access. */
+static void xt_resolve_query(struct xt_resolve_entry *e)
+{
+	struct addrinfo hints = {
+		.ai_family	= e->family,
+		.ai_socktype	= SOCK_RAW,
+	};
+	struct addrinfo *res, *p;
+	size_t len = xt_resolve_addrlen(e->family);
+	unsigned int i;
+
+	e->err = getaddrinfo(e->name, NULL, &hints, &res);
+	if (e->err != 0)
+		return;
+
+	for (p = res; p != NULL; p = p->ai_next)
+		++e->naddrs;
+	e->addrs = calloc(e->naddrs, len);
+	if (e->addrs == NULL) {
+		e->err = EAI_MEMORY;
+		e->naddrs = 0;
+	}
+	for (i = 0, p = res; e->addrs != NULL && p != NULL; p = p->ai_next)
+		memcpy((char *)e->addrs + len * i++,
+		       xt_resolve_sa_addr(p->ai_addr), len);
+	freeaddrinfo(res);
+}
+
+static struct xt_resolve_entry *xt_resolve_new(int family, const char *name)
+{
+	struct xt_resolve_entry *e;
+
+	e = xtables_calloc(1, sizeof(*e) + strlen(name) + 1);
+	e->family = family;
+	strcpy(e->name, name);
+	return e;
+}
+
+/**
+ * xtables_resolve_host - resolve a host name through the cache
+ * @family:	address family to query
+ * @name:	host name
+ * @addrs:	on success, a freshly allocated array of in_addr or in6_addr
+ * @naddrs:	number of elements in @addrs
+ *
+ * Returns 0 on success or the getaddrinfo() error code.
+ */
+int xtables_resolve_host(int family, const char *name, void **addrs,
+			 unsigned int *naddrs)
+{
+	struct xt_resolve_entry *e = xt_resolve_find(family, name);
+	size_t len;
+	int err;
+
+	*naddrs = 0;
+	*addrs = NULL;
+	if (e == NULL) {
+		e = xt_resolve_new(family, name);
+		xt_resolve_query(e);
+		err = e->err;
+		xt_resolve_insert(e);
+		if (err != 0)
+			return err;
+	}
+
+	len = xt_resolve_addrlen(family);
+	*addrs = xtables_malloc(e->naddrs * len);
+	memcpy(*addrs, e->addrs, e->naddrs * len);
+	*naddrs = e->naddrs;
+	return 0;
+}
+
+struct xt_resolve_batch {
+	pthread_mutex_t		lock;
+	struct xt_resolve_entry	**todo;
+	unsigned int		num, next;
+};
+
+static void *xt_resolve_worker(void *data)
+{
+	struct xt_resolve_batch *b = data;
+	unsigned int i;
+
+	while (1) {
+		pthread_mutex_lock(&b->lock);
+		i = b->next++;
+		pthread_mutex_unlock(&b->lock);
+		if (i >= b->num)
+			break;
+		xt_resolve_query(b->todo[i]);
+	}
+	return NULL;
+}
+
+static bool xt_resolve_numeric(int family, const char *name)
+{
+	switch (family) {
+	case AF_INET:
+		return xtables_numeric_to_ipaddr(name) != NULL;
+	case AF_INET6:
+		return xtables_numeric_to_ip6addr(name) != NULL;
+	}
+	return true;
+}
+
+/**
+ * xtables_resolve_prefetch - resolve host names concurrently
+ * @family:	address family to query
+ * @names:	host names, numeric addresses are skipped
+ * @num:	number of elements in @names
+ *
+ * Resolves all names not cached yet in parallel and adds the results to
+ * the cache, as if they had been resolved one after another in the given
+ * order. Names that fail to resolve are left to be looked up again.
+ */
+void xtables_resolve_prefetch(int family, const char *const *names,
+			      unsigned int num)
+{
+	struct xt_resolve_batch b = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	pthread_t threads[XT_RESOLVE_THREADS];
+	unsigned int i, j, nthreads = 0;
+
+	if (family != AF_INET && family != AF_INET6)
+		return;
+
+	b.todo = xtables_calloc(num ? num : 1, sizeof(*b.todo));
+	for (i = 0; i < num; i++) {
+		if (xt_resolve_numeric(family, names[i]) ||
+		    xt_resolve_find(family, names[i]) != NULL)
+			continue;
+		for (j = 0; j < b.num; j++)
+			if (strcmp(b.todo[j]->name, names[i]) == 0)
+				break;
+		if (j == b.num)
+			b.todo[b.num++] = xt_resolve_new(family, names[i]);
+	}
+
+	while (nthreads < XT_RESOLVE_THREADS && nthreads < b.num &&
+	       pthread_create(&threads[nthreads], NULL,
+			      xt_resolve_worker, &b) == 0)
+		nthreads++;
+	/* whatever the threads did not pick up is done here */
+	xt_resolve_worker(&b);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < b.num; i++)
+		xt_resolve_insert(b.todo[i]);
+	free(b.todo);
+}
+
 static struct in_addr *network_to_ipaddr(const char *name)
 {
 	static struct in_addr addr;
@@ -1493,28 +2291,10 @@ static struct in_addr *network_to_ipaddr(const char *name)
 
 static struct in_addr *host_to_ipaddr(const char *name, unsigned int *naddr)
 {
-	struct in_addr *addr;
-	struct addrinfo hints;
-	struct addrinfo *res, *p;
-	int err;
-	unsigned int i;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family   = AF_INET;
-	hints.ai_socktype = SOCK_RAW;
+	void *addr;
 
-	*naddr = 0;
-	err = getaddrinfo(name, NULL, &hints, &res);
-	if (err != 0)
+	if (xtables_resolve_host(AF_INET, name, &addr, naddr) != 0)
 		return NULL;
-	for (p = res; p != NULL; p = p->ai_next)
-		++*naddr;
-	addr = xtables_calloc(*naddr, sizeof(struct in_addr));
-	for (i = 0, p = res; p != NULL; p = p->ai_next)
-		memcpy(&addr[i++],
-		       &((const struct sockaddr_in *)p->ai_addr)->sin_addr,
-		       sizeof(struct in_addr));
-	freeaddrinfo(res);
 	return addr;
 }
 
@@ -1692,7 +2472,9 @@ const char *xtables_ip6addr_to_numeric(const struct in6_addr *addrp)
 	/* 0000:0000:0000:0000:0000:0000:000.000.000.000
 	 * 0000:0000:0000:0000:0000:0000:0000:0000 */
 	static char buf[50+1];
-	return inet_ntop(AF_INET6, addrp, buf, sizeof(buf));
+
+	xtables_fmt_ip6addr(buf, addrp);
+	return buf;
 }
 
 static const char *ip6addr_to_host(const struct in6_addr *addr)
@@ -1750,18 +2532,9 @@ int xtables_ip6mask_to_cidr(const struct in6_addr *k)
 const char *xtables_ip6mask_to_numeric(const struct in6_addr *addrp)
 {
 	static char buf[50+2];
-	int l = xtables_ip6mask_to_cidr(addrp);
 
-	if (l == -1) {
-		strcpy(buf, "/");
-		strcat(buf, xtables_ip6addr_to_numeric(addrp));
-		return buf;
-	}
 	/* we don't want to see "/128" */
-	if (l == 128)
-		return "";
-	else
-		sprintf(buf, "/%d", l);
+	xtables_fmt_ip6mask(buf, addrp);
 	return buf;
 }
 
@@ -1779,30 +2552,10 @@ struct in6_addr *xtables_numeric_to_ip6addr(const char *num)
 static struct in6_addr *
 host_to_ip6addr(const char *name, unsigned int *naddr)
 {
-	struct in6_addr *addr;
-	struct addrinfo hints;
-	struct addrinfo *res, *p;
-	int err;
-	unsigned int i;
+	void *addr;
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family   = AF_INET6;
-	hints.ai_socktype = SOCK_RAW;
-
-	*naddr = 0;
-	err = getaddrinfo(name, NULL, &hints, &res);
-	if (err != 0)
+	if (xtables_resolve_host(AF_INET6, name, &addr, naddr) != 0)
 		return NULL;
-	/* Find length of address chain */
-	for (p = res; p != NULL; p = p->ai_next)
-		++*naddr;
-	/* Copy each element of the address chain */
-	addr = xtables_calloc(*naddr, sizeof(struct in6_addr));
-	for (i = 0, p = res; p != NULL; p = p->ai_next)
-		memcpy(&addr[i++],
-		       &((const struct sockaddr_in6 *)p->ai_addr)->sin6_addr,
-		       sizeof(struct in6_addr));
-	freeaddrinfo(res);
 	return addr;
 }
 
@@ -2036,8 +2789,8 @@ const struct xtables_pprot xtables_chain_protos[] = {
 uint16_t
 xtables_parse_protocol(const char *s)
 {
-	const struct protoent *pent;
 	unsigned int proto, i;
+	int ret;
 
 	if (xtables_strtoui(s, NULL, &proto, 0, UINT8_MAX))
 		return proto;
@@ -2049,9 +2802,9 @@ xtables_parse_protocol(const char *s)
 	if (strcmp(s, "all") == 0)
 		return 0;
 
-	pent = getprotobyname(s);
-	if (pent != NULL)
-		return pent->p_proto;
+	ret = xtables_protocol_number(s);
+	if (ret >= 0)
+		return ret;
 
 	for (i = 0; i < ARRAY_SIZE(xtables_chain_protos); ++i) {
 		if (xtables_chain_protos[i].name == NULL)
@@ -2064,33 +2817,66 @@ xtables_parse_protocol(const char *s)
 	return -1;
 }
 
+/**
+ * xtables_output_init - prepare @fp for dumping rules
+ *
+ * Unless @fp is a terminal, it gets a large buffer. Locking is left to the
+ * caller, which is a no-op for the single-threaded programs, so the many
+ * small writes from the save and print hooks no longer each take the
+ * stream lock.
+ */
+void xtables_output_init(FILE *fp)
+{
+	static char *buf;
+
+	if (!isatty(fileno(fp))) {
+		if (buf == NULL)
+			buf = malloc(XTABLES_OUTPUT_BUFSIZ);
+		if (buf != NULL)
+			setvbuf(fp, buf, _IOFBF, XTABLES_OUTPUT_BUFSIZ);
+	}
+	__fsetlocking(fp, FSETLOCKING_BYCALLER);
+}
+
+static void xt_print_num(uint64_t number, char unit, unsigned int width,
+			 unsigned int format)
+{
+	char digits[24], buf[32], *p = buf;
+	unsigned int len = xtables_fmt_u64(digits, number) - digits;
+
+	if (!(format & FMT_NOTABLE))
+		for (; len < width; width--)
+			*p++ = ' ';
+	memcpy(p, digits, len);
+	p += len;
+	if (unit)
+		*p++ = unit;
+	*p++ = ' ';
+	fwrite(buf, 1, p - buf, stdout);
+}
+
 void xtables_print_num(uint64_t number, unsigned int format)
 {
+	static const char units[] = "KMGT";
+	unsigned int i;
+
 	if (!(format & FMT_KILOMEGAGIGA)) {
-		printf(FMT("%8llu ","%llu "), (unsigned long long)number);
+		xt_print_num(number, 0, 8, format);
 		return;
 	}
 	if (number <= 99999) {
-		printf(FMT("%5llu ","%llu "), (unsigned long long)number);
-		return;
-	}
-	number = (number + 500) / 1000;
-	if (number <= 9999) {
-		printf(FMT("%4lluK ","%lluK "), (unsigned long long)number);
+		xt_print_num(number, 0, 5, format);
 		return;
 	}
-	number = (number + 500) / 1000;
-	if (number <= 9999) {
-		printf(FMT("%4lluM ","%lluM "), (unsigned long long)number);
-		return;
-	}
-	number = (number + 500) / 1000;
-	if (number <= 9999) {
-		printf(FMT("%4lluG ","%lluG "), (unsigned long long)number);
-		return;
+	for (i = 0; i < sizeof(units) - 2; i++) {
+		number = (number + 500) / 1000;
+		if (number <= 9999) {
+			xt_print_num(number, units[i], 4, format);
+			return;
+		}
 	}
 	number = (number + 500) / 1000;
-	printf(FMT("%4lluT ","%lluT "), (unsigned long long)number);
+	xt_print_num(number, units[i], 4, format);
 }
 
 void xtables_print_mac(const unsigned char *macaddress)
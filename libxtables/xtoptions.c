@@ -75,10 +75,18 @@ xtables_options_xfrm(struct option *orig_opts, struct option *oldopts,
 		     const struct xt_option_entry *entry, unsigned int *offset)
 {
 	unsigned int num_orig, num_old = 0, num_new, i;
-	struct option *merge, *mp;
+	struct option *merge, *mp, *parent;
 
 	if (entry == NULL)
 		return oldopts;
+
+	parent = oldopts != NULL ? oldopts : orig_opts;
+	merge = xtables_opts_lookup(parent, offset);
+	if (merge != NULL) {
+		xtables_free_opts(0);
+		return merge;
+	}
+
 	for (num_orig = 0; orig_opts[num_orig].name != NULL; ++num_orig)
 		;
 	if (oldopts != NULL)
@@ -105,9 +113,6 @@ xtables_options_xfrm(struct option *orig_opts, struct option *oldopts,
 	mp = merge + num_orig;
 
 	/* Second, the new options */
-	xt_params->option_offset += XT_OPTION_OFFSET_SCALE;
-	*offset = xt_params->option_offset;
-
 	for (i = 0; i < num_new; ++i, ++mp, ++entry) {
 		mp->name         = entry->name;
 		mp->has_arg      = entry->type != XTTYPE_NONE;
@@ -120,10 +125,10 @@ xtables_options_xfrm(struct option *orig_opts, struct option *oldopts,
 		memcpy(mp, oldopts, sizeof(*mp) * num_old);
 		mp += num_old;
 	}
-	xtables_free_opts(0);
 
 	/* Clear trailing entry */
 	memset(mp, 0, sizeof(*mp));
+	xtables_opts_store(parent, *offset, merge);
 	return merge;
 }
 
@@ -497,37 +502,34 @@ static socklen_t xtables_sa_hostlen(unsigned int afproto)
  */
 static void xtopt_parse_host(struct xt_option_call *cb)
 {
-	struct addrinfo hints = {.ai_family = afinfo->family};
-	unsigned int adcount = 0;
-	struct addrinfo *res, *p;
+	socklen_t len = xtables_sa_hostlen(afinfo->family);
+	unsigned int i, naddrs;
+	void *addrs;
 	int ret;
 
-	ret = getaddrinfo(cb->arg, NULL, &hints, &res);
-	if (ret != 0)
-		xt_params->exit_err(PARAMETER_PROBLEM,
-			"getaddrinfo: %s\n", gai_strerror(ret));
-
 	memset(&cb->val.hmask, 0xFF, sizeof(cb->val.hmask));
 	cb->val.hlen = (afinfo->family == NFPROTO_IPV4) ? 32 : 128;
-
-	for (p = res; p != NULL; p = p->ai_next) {
-		if (adcount == 0) {
-			memset(&cb->val.haddr, 0, sizeof(cb->val.haddr));
-			memcpy(&cb->val.haddr,
-			       xtables_sa_host(p->ai_addr, p->ai_family),
-			       xtables_sa_hostlen(p->ai_family));
-			++adcount;
-			continue;
-		}
-		if (memcmp(&cb->val.haddr,
-		    xtables_sa_host(p->ai_addr, p->ai_family),
-		    xtables_sa_hostlen(p->ai_family)) != 0)
+	memset(&cb->val.haddr, 0, sizeof(cb->val.haddr));
+
+	/* numeric addresses never go through the resolver */
+	if (len == 0 ||
+	    inet_pton(afinfo->family, cb->arg, &cb->val.haddr) != 1) {
+		ret = xtables_resolve_host(afinfo->family, cb->arg,
+					   &addrs, &naddrs);
+		if (ret != 0)
 			xt_params->exit_err(PARAMETER_PROBLEM,
-				"%s resolves to more than one address\n",
-				cb->arg);
+				"getaddrinfo: %s\n", gai_strerror(ret));
+
+		for (i = 1; i < naddrs; i++)
+			if (memcmp(addrs, (char *)addrs + i * len, len) != 0)
+				xt_params->exit_err(PARAMETER_PROBLEM,
+					"%s resolves to more than one address\n",
+					cb->arg);
+		if (naddrs > 0)
+			memcpy(&cb->val.haddr, addrs, len);
+		free(addrs);
 	}
 
-	freeaddrinfo(res);
 	if (cb->entry->flags & XTOPT_PUT)
 		/* Validation in xtables_option_metavalidate */
 		memcpy(XTOPT_MKPTR(cb), &cb->val.haddr,
@@ -542,26 +544,21 @@ static void xtopt_parse_host(struct xt_option_call *cb)
  */
 static int xtables_getportbyname(const char *name)
 {
-	struct addrinfo *res = NULL, *p;
+	unsigned long port;
+	char *end;
 	int ret;
 
-	ret = getaddrinfo(NULL, name, NULL, &res);
-	if (ret != 0)
-		return -1;
-	ret = -1;
-	for (p = res; p != NULL; p = p->ai_next) {
-		if (p->ai_family == AF_INET6) {
-			ret = ((struct sockaddr_in6 *)p->ai_addr)->sin6_port;
-			break;
-		} else if (p->ai_family == AF_INET) {
-			ret = ((struct sockaddr_in *)p->ai_addr)->sin_port;
-			break;
-		}
+	/* numeric ports, truncated the way getaddrinfo() does */
+	if (isdigit((unsigned char)*name)) {
+		port = strtoul(name, &end, 10);
+		if (*end == '\0')
+			return (uint16_t)port;
 	}
-	freeaddrinfo(res);
+
+	ret = xtables_service_port(name, "tcp");
 	if (ret < 0)
-		return ret;
-	return ntohs(ret);
+		ret = xtables_service_port(name, "udp");
+	return ret;
 }
 
 /**